@@ -39,6 +39,8 @@
 #include <gst/video/video.h>
 #include <string.h>
 #include "shared/bebo_shmem.h"
+#include "shared/bebo_shmem_ring.h"
+#include "shared/bebo_shmem_channel.h"
 #include "gstdxgidevice.h"
 
 #ifdef NDEBUG
@@ -53,6 +55,7 @@ enum
 {
   SIGNAL_CLIENT_CONNECTED,
   SIGNAL_CLIENT_DISCONNECTED,
+  SIGNAL_SNAPSHOT,
   LAST_SIGNAL
 };
 
@@ -61,17 +64,71 @@ enum
 {
   PROP_0,
   PROP_BUFFER_TIME,
-  PROP_LATENCY
+  PROP_LATENCY,
+  PROP_PAYLOAD,
+  PROP_READER_TIMEOUT,
+  PROP_POLICY,
+  PROP_STATS,
+  PROP_STATS_INTERVAL,
+  PROP_SLOT_COUNT,
+  PROP_SLOT_SIZE,
+  PROP_HUGE_PAGES,
+  PROP_AUDIO_CHUNKS,
+  PROP_CHANNEL,
+  PROP_THUMBNAIL_WIDTH,
+  PROP_THUMBNAIL_HEIGHT,
+  PROP_THUMBNAIL_INTERVAL
 };
 
 
 #define SUPPORTED_GL_APIS (GST_GL_API_OPENGL3)
 
-// frame count, if the right side doesn't consume it in 10 frames time,
-// we're going to unref it and drop that frame.
-#define FRAME_UNREF_THRESHOLD 10
-#define BUFFER_COUNT      6
-#define BUFFER_POOL_SIZE  BUFFER_COUNT
+#define DEFAULT_SLOT_COUNT 6
+// payload mode: every slot may hold a block, keep two for upstream / render
+#define PAYLOAD_SPARE_BLOCKS 2
+#define PAYLOAD_BLOCK_COUNT(self) ((self)->slot_count + PAYLOAD_SPARE_BLOCKS)
+// GstShmemAllocator tracks its blocks in a 64 bit mask
+#define MAX_SLOT_COUNT (64 - PAYLOAD_SPARE_BLOCKS)
+// encoded mode: arena bytes per slot unless slot-size says otherwise
+#define DEFAULT_ENCODED_SLOT_SIZE (1024 * 1024)
+#define DEFAULT_READER_TIMEOUT 2000
+// audio ring: 8 KiB hold ~20ms of 48kHz stereo F32
+#define AUDIO_CHUNK_SIZE (8 * 1024)
+#define MAX_AUDIO_CHUNKS 4096
+// thumbnails of every 15th frame, 4 a second at 60 fps
+#define DEFAULT_THUMBNAIL_INTERVAL 15
+// how often render looks for dead readers, in ns
+#define REAP_INTERVAL (100 * GST_MSECOND)
+/* how long we keep publishing without readers after an observer's snapshot */
+#define OBSERVER_TIMEOUT (30 * GST_SECOND)
+// how often render publishes a clock sample, in ns
+#define CLOCK_SAMPLE_INTERVAL (100 * GST_MSECOND)
+#define DEFAULT_POLICY GST_SHM_SINK_POLICY_DROP_OLDEST
+// block policy: readers can't wake us across processes, poll this often (us)
+#define BLOCK_POLL_INTERVAL (2 * G_TIME_SPAN_MILLISECOND)
+// offered frames a QoS proportion is measured over
+#define QOS_WINDOW 8
+
+#define GST_TYPE_SHM_SINK_POLICY (gst_shm_sink_policy_get_type())
+static GType
+gst_shm_sink_policy_get_type (void)
+{
+  static GType policy_type = 0;
+
+  static const GEnumValue policies[] = {
+    {GST_SHM_SINK_POLICY_DROP_NEWEST, "Drop the incoming frame", "drop-newest"},
+    {GST_SHM_SINK_POLICY_DROP_OLDEST, "Overwrite the oldest unread frame",
+        "drop-oldest"},
+    {GST_SHM_SINK_POLICY_BLOCK, "Wait up to buffer-time for the readers",
+        "block"},
+    {0, NULL, NULL},
+  };
+
+  if (!policy_type) {
+    policy_type = g_enum_register_static ("GstShmSinkPolicy", policies);
+  }
+  return policy_type;
+}
 
 GST_DEBUG_CATEGORY_STATIC (shmsink_debug);
 #define GST_CAT_DEFAULT shmsink_debug
@@ -84,10 +141,35 @@ GST_DEBUG_CATEGORY_STATIC (shmsink_debug);
     "framerate = " GST_VIDEO_FPS_RANGE ", "                             \
     "texture-target = (string) { 2D }"
 
+#define GST_PAYLOAD_SINK_CAPS \
+    "video/x-raw, "                                                     \
+    "format = (string) { RGBA, BGRA, I420, NV12 }, "                    \
+    "width = " GST_VIDEO_SIZE_RANGE ", "                                \
+    "height = " GST_VIDEO_SIZE_RANGE ", "                               \
+    "framerate = " GST_VIDEO_FPS_RANGE
+
+// payload mode only, see BEBO_SHMEM_CODEC_H264
+#define GST_ENCODED_SINK_CAPS \
+    "video/x-h264, "                                                    \
+    "stream-format = (string) byte-stream, "                            \
+    "alignment = (string) au, "                                         \
+    "width = " GST_VIDEO_SIZE_RANGE ", "                                \
+    "height = " GST_VIDEO_SIZE_RANGE
+
 static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
     GST_PAD_SINK,
     GST_PAD_ALWAYS,
-    GST_STATIC_CAPS (GST_GL_SINK_CAPS));
+    GST_STATIC_CAPS (GST_GL_SINK_CAPS "; " GST_PAYLOAD_SINK_CAPS "; "
+        GST_ENCODED_SINK_CAPS));
+
+static GstStaticPadTemplate audiotemplate = GST_STATIC_PAD_TEMPLATE ("audio",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("audio/x-raw, "
+        "format = (string) { S16LE, F32LE }, "
+        "layout = (string) interleaved, "
+        "rate = " GST_AUDIO_RATE_RANGE ", "
+        "channels = " GST_AUDIO_CHANNELS_RANGE));
 
 #define parent_class gst_shm_sink_parent_class
 G_DEFINE_TYPE (GstDirectShowSink, gst_shm_sink, GST_TYPE_BASE_SINK);
@@ -108,8 +190,13 @@ static gboolean gst_shm_sink_unlock (GstBaseSink * bsink);
 static gboolean gst_shm_sink_unlock_stop (GstBaseSink * bsink);
 static gboolean gst_shm_sink_propose_allocation (GstBaseSink * sink,
     GstQuery * query);
+static GstFlowReturn gst_shm_sink_audio_chain (GstPad * pad,
+    GstObject * parent, GstBuffer * buf);
+static gboolean gst_shm_sink_audio_event (GstPad * pad, GstObject * parent,
+    GstEvent * event);
 static gboolean gst_shm_sink_set_caps (GstBaseSink * bsink,
     GstCaps * caps);
+static GstCaps *gst_shm_sink_get_caps (GstBaseSink * bsink, GstCaps * filter);
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
@@ -134,96 +221,597 @@ gst_dshowfiltersink_set_context(GstElement *element,
  ***************/
 
 #define ALIGN(nr, align) \
- (nr % align == 0) ? nr : align * (nr / align +1)
+ (((nr) % (align) == 0) ? (nr) : (align) * ((nr) / (align) + 1))
 
 #define ALIGNMENT 64
 
+/* Caller holds the object lock */
+static void
+gst_shm_sink_reset_stats (GstDirectShowSink * self, guint n_occupancy)
+{
+  g_free (self->stats.occupancy);
+  memset (&self->stats, 0, sizeof (self->stats));
+  self->stats.occupancy = g_new0 (guint64, n_occupancy);
+  self->stats.n_occupancy = n_occupancy;
+}
+
+static guint64
+gst_shm_sink_stats_dropped (GstShmSinkStats * stats)
+{
+  return stats->dropped_early + stats->dropped_no_readers +
+      stats->dropped_no_block + stats->dropped_ring_full +
+      stats->dropped_buffer_time + stats->dropped_no_keyframe;
+}
 
-static gboolean 
-initialize_shared_memory(GstDirectShowSink * self, GstVideoInfo * info)
+/* Take the read timestamps of the readers off a slot before we reuse it.
+ * Nobody has it pinned, so nobody writes read_ns right now. */
+static void
+gst_shm_sink_collect_latency (GstDirectShowSink * self, struct frame *frame)
 {
-  GST_OBJECT_LOCK (self);
-  if (self->shmem_init) {
-    GST_OBJECT_UNLOCK (self);
-    GST_INFO("shmem already initialized");
+  GstShmSinkStats *stats = &self->stats;
+
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    uint64_t read_ns = frame->read_ns[i];
+    if (read_ns == 0)
+      continue;
+    frame->read_ns[i] = 0;
+    if (frame->publish_ns == 0 || read_ns < frame->publish_ns)
+      continue;
+
+    stats->latency[stats->latency_pos] = read_ns - frame->publish_ns;
+    stats->latency_pos = (stats->latency_pos + 1) % GST_SHM_SINK_LATENCY_SAMPLES;
+    if (stats->n_latency < GST_SHM_SINK_LATENCY_SAMPLES)
+      stats->n_latency++;
   }
-  //FIXME This should live somewhere else.
+}
+
+static gint
+compare_guint64 (gconstpointer a, gconstpointer b)
+{
+  guint64 x = *(const guint64 *) a;
+  guint64 y = *(const guint64 *) b;
+  return x < y ? -1 : x > y;
+}
 
+/* Caller holds the object lock */
+static GstStructure *
+gst_shm_sink_create_stats (GstDirectShowSink * self)
+{
+  GstShmSinkStats *stats = &self->stats;
+  guint64 sorted[GST_SHM_SINK_LATENCY_SAMPLES];
+  guint n = stats->n_latency;
+  GValue occupancy = G_VALUE_INIT;
+
+  memcpy (sorted, stats->latency, n * sizeof (guint64));
+  qsort (sorted, n, sizeof (guint64), compare_guint64);
+#define PERCENTILE(p) (n ? sorted[(n - 1) * (p) / 100] : 0)
+
+  GstStructure *s = gst_structure_new ("application/x-bebo-shm-sink-stats",
+      "rendered", G_TYPE_UINT64, stats->rendered,
+      "dropped", G_TYPE_UINT64, gst_shm_sink_stats_dropped (stats),
+      "dropped-early", G_TYPE_UINT64, stats->dropped_early,
+      "dropped-no-readers", G_TYPE_UINT64, stats->dropped_no_readers,
+      "dropped-no-block", G_TYPE_UINT64, stats->dropped_no_block,
+      "dropped-ring-full", G_TYPE_UINT64, stats->dropped_ring_full,
+      "dropped-buffer-time", G_TYPE_UINT64, stats->dropped_buffer_time,
+      "dropped-no-keyframe", G_TYPE_UINT64, stats->dropped_no_keyframe,
+      "overwritten", G_TYPE_UINT64, stats->overwritten,
+      "evicted-readers", G_TYPE_UINT64, stats->evicted,
+      "latency-samples", G_TYPE_UINT, n,
+      "latency-p50", G_TYPE_UINT64, PERCENTILE (50),
+      "latency-p90", G_TYPE_UINT64, PERCENTILE (90),
+      "latency-p99", G_TYPE_UINT64, PERCENTILE (99),
+      "latency-max", G_TYPE_UINT64, PERCENTILE (100),
+      NULL);
+#undef PERCENTILE
+
+  g_value_init (&occupancy, GST_TYPE_ARRAY);
+  for (guint i = 0; i < stats->n_occupancy; i++) {
+    GValue v = G_VALUE_INIT;
+    g_value_init (&v, G_TYPE_UINT64);
+    g_value_set_uint64 (&v, stats->occupancy[i]);
+    gst_value_array_append_value (&occupancy, &v);
+    g_value_unset (&v);
+  }
+  gst_structure_take_value (s, "occupancy", &occupancy);
+  return s;
+}
+
+/* Periodic stats message if one is due, caller holds the object lock and
+ * posts the result after letting go of it. */
+static GstStructure *
+gst_shm_sink_stats_due (GstDirectShowSink * self, uint64_t now)
+{
+  if (self->stats_interval == 0 ||
+      now - self->last_stats < (uint64_t) self->stats_interval * GST_MSECOND)
+    return NULL;
+  self->last_stats = now;
+  return gst_shm_sink_create_stats (self);
+}
+
+static void
+gst_shm_sink_post_stats (GstDirectShowSink * self, GstStructure * s)
+{
+  if (s == NULL)
+    return;
+  gst_element_post_message (GST_ELEMENT_CAST (self),
+      gst_message_new_element (GST_OBJECT_CAST (self), s));
+}
+
+/* Describe info in the header, readers opening from now on start with it */
+static void
+gst_shm_sink_set_shmem_video_info (GstDirectShowSink * self, GstVideoInfo * info)
+{
   guint width = GST_VIDEO_INFO_WIDTH(info);
   guint height = GST_VIDEO_INFO_HEIGHT(info);
   guint fps = GST_VIDEO_INFO_FPS_N(info)/GST_VIDEO_INFO_FPS_D(info);
 
-  GST_INFO("Initializating shared mem info to %d x %d at %d fps", width, height, fps);
-  DWORD size = 0;
-  DWORD header_size = ALIGN(sizeof(struct shmem), ALIGNMENT);
-  self->shmem_mutex = CreateMutexW(NULL, true, BEBO_SHMEM_MUTEX);
-  if (self->shmem_mutex == 0) {
-    GST_ERROR_OBJECT(self, "could not create shmem mutex %d", GetLastError());
-    GST_OBJECT_UNLOCK (self);
+  GST_INFO("Setting shared mem info to %d x %d at %d fps", width, height, fps);
+  if (self->payload || self->encoded) {
+    self->shmem->video_info = *info;
+  } else {
+    gst_video_info_set_format(&self->shmem->video_info, GST_VIDEO_FORMAT_RGBA, width, height);
+    GstVideoInfo * sh_info = &self->shmem->video_info;
+    sh_info->fps_n = fps;
+  }
+  self->shmem->format = GST_VIDEO_INFO_FORMAT(&self->shmem->video_info);
+}
+
+/* Describe the audio in the header, caller holds the object lock. */
+static void
+gst_shm_sink_set_shmem_audio_info (GstDirectShowSink * self)
+{
+  if (self->shmem == NULL || self->shmem->audio_count == 0 ||
+      self->audio_info.finfo == NULL)
+    return;
+
+  if (bebo_shmem_mutex_lock(&self->shmem_mutex, BEBO_SHMEM_INFINITE) != BEBO_SHMEM_WAIT_OK) {
+    GST_ERROR_OBJECT(self, "could not lock shmem mutex %d", bebo_shmem_last_error());
+    return;
+  }
+  self->shmem->audio_format = GST_AUDIO_INFO_FORMAT(&self->audio_info);
+  self->shmem->audio_rate = GST_AUDIO_INFO_RATE(&self->audio_info);
+  self->shmem->audio_channels = GST_AUDIO_INFO_CHANNELS(&self->audio_info);
+  bebo_atomic_add_u32(&self->shmem->audio_generation, 1);
+  bebo_shmem_mutex_unlock(&self->shmem_mutex);
+}
+
+/* Caps changed while running. Nothing is remapped: frames carry their own
+ * size and info_generation, readers switch on the first new frame. Caller
+ * holds the object lock. */
+static gboolean
+gst_shm_sink_update_video_info (GstDirectShowSink * self, GstVideoInfo * info)
+{
+  gboolean encoded = GST_VIDEO_INFO_FORMAT(info) == GST_VIDEO_FORMAT_ENCODED;
+  if (encoded != self->encoded) {
+    GST_ERROR_OBJECT(self, "can't switch between raw and encoded video");
+    return FALSE;
+  }
+  if (self->payload && !encoded &&
+      GST_VIDEO_INFO_SIZE(info) > self->shmem->payload_size) {
+    GST_ERROR_OBJECT(self, "frames of %d bytes don't fit into the %llu byte "
+        "blocks, set slot-size to leave room", GST_VIDEO_INFO_SIZE(info),
+        self->shmem->payload_size);
     return FALSE;
   }
 
-  size_t frame_size = ALIGN(sizeof(struct frame), ALIGNMENT);
-  size = ((DWORD)frame_size * BUFFER_COUNT) + header_size;
+  // readers copy the header while attaching
+  if (bebo_shmem_mutex_lock(&self->shmem_mutex, BEBO_SHMEM_INFINITE) != BEBO_SHMEM_WAIT_OK) {
+    GST_ERROR_OBJECT(self, "could not lock shmem mutex %d", bebo_shmem_last_error());
+    return FALSE;
+  }
+  gst_shm_sink_set_shmem_video_info(self, info);
+  bebo_atomic_add_u32(&self->shmem->info_generation, 1);
+  // snapshots take self->info for it
+  gst_buffer_replace(&self->unpublished, NULL);
+  bebo_shmem_mutex_unlock(&self->shmem_mutex);
+  bebo_shmem_channel_describe(&self->channel_registration, self->shmem);
+  if (self->thumbnail && !gst_shm_thumbnail_set_info(self->thumbnail, info)) {
+    gst_shm_thumbnail_free(self->thumbnail);
+    self->thumbnail = NULL;
+  }
+  return TRUE;
+}
 
-  self->shmem_handle = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
-    0, size, BEBO_SHMEM_NAME);
-  if (!self->shmem_handle) {
-    GST_ERROR_OBJECT(self, "could not create mapping %d", GetLastError());
+static gboolean 
+initialize_shared_memory(GstDirectShowSink * self, GstVideoInfo * info)
+{
+  GST_OBJECT_LOCK (self);
+  if (self->shmem_init) {
+    GST_INFO("shmem already initialized, updating video info");
+    gboolean ret = gst_shm_sink_update_video_info(self, info);
+    GST_OBJECT_UNLOCK (self);
+    return ret;
+  }
+  //FIXME This should live somewhere else.
+
+  if (self->payload && !self->encoded && self->slot_size != 0 &&
+      self->slot_size < GST_VIDEO_INFO_SIZE(info)) {
+    GST_ERROR_OBJECT(self, "slot-size %llu is too small for %d byte frames",
+        self->slot_size, GST_VIDEO_INFO_SIZE(info));
     GST_OBJECT_UNLOCK (self);
     return FALSE;
   }
 
-  self->shmem = MapViewOfFile(self->shmem_handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
-  if (!self->shmem) {
-    GST_ERROR_OBJECT(self, "could not map shmem %d", GetLastError());
+  enum bebo_shmem_channel_result registered = bebo_shmem_channel_register(
+      &self->channel_registration, self->channel);
+  if (registered == BEBO_SHMEM_CHANNEL_IN_USE) {
+    GST_ERROR_OBJECT(self, "channel \"%s\" is taken by another producer",
+        self->channel ? self->channel : "");
     GST_OBJECT_UNLOCK (self);
     return FALSE;
+  } else if (registered != BEBO_SHMEM_CHANNEL_OK) {
+    // readers can still attach by name
+    GST_WARNING_OBJECT(self, "could not register the channel: %d", registered);
   }
 
-  memset(self->shmem, 0, size);
+  char name[BEBO_SHMEM_MAX_NAME];
+  // before the region, readers open them as soon as they find it
+  int n_semaphores;
+  for (n_semaphores = 0; n_semaphores < BEBO_SHMEM_MAX_READERS; n_semaphores++) {
+    bebo_shmem_data_sem_name(name, self->channel, n_semaphores);
+    if (!bebo_shmem_semaphore_create(&self->shmem_new_data_semaphore[n_semaphores], name)) {
+      GST_ERROR_OBJECT(self, "could not create semaphore %s %d", name,
+          bebo_shmem_last_error());
+      goto fail_semaphores;
+    }
+  }
+
+  // the v2 header with the readers' own cache lines follows the v1 one,
+  // then the ring readers push freed slots to, laid out like every producer
+  struct bebo_shmem_layout layout;
+  bebo_shmem_layout_headers(&layout);
+  size_t header_size = layout.frame_offset;
+  // slot 0 must not land on the v2 header or the release ring
+  g_assert (layout.release_offset >= layout.v2_offset + sizeof(struct bebo_shmem_v2));
+  g_assert (header_size >= layout.release_offset + sizeof(struct bebo_shmem_release_ring));
+  bebo_shmem_object_name(name, BEBO_SHMEM_MUTEX, self->channel);
+  if (!bebo_shmem_mutex_create(&self->shmem_mutex, name, true)) {
+    GST_ERROR_OBJECT(self, "could not create shmem mutex %d", bebo_shmem_last_error());
+    goto fail_semaphores;
+  }
+
+  size_t frame_size = layout.frame_size;
+  size_t size = (frame_size * self->slot_count) + header_size;
+
+  size_t payload_offset = 0;
+  size_t payload_size = 0;
+  size_t arena_size = 0;
+  uint32_t region_flags = 0;
+  if (self->encoded) {
+    // access units are packed back to back, slot-size is a budget per slot
+    payload_offset = size;
+    arena_size = self->slot_size ? self->slot_size : DEFAULT_ENCODED_SLOT_SIZE;
+    arena_size *= self->slot_count;
+    arena_size = ALIGN(arena_size, ALIGNMENT);
+    size += arena_size;
+    GST_INFO("encoded mode: %d slots, %d byte arena", self->slot_count, arena_size);
+  } else if (self->payload) {
+    // blocks follow the frame headers, both sizes are already aligned
+    payload_offset = size;
+    payload_size = self->slot_size ? self->slot_size : GST_VIDEO_INFO_SIZE(info);
+    payload_size = ALIGN(payload_size, ALIGNMENT);
+    size += payload_size * PAYLOAD_BLOCK_COUNT(self);
+    GST_INFO("payload mode: %d blocks of %d bytes", PAYLOAD_BLOCK_COUNT(self), payload_size);
+    // a 4K RGBA frame spans ~8000 4K pages, 16 2M ones
+    if (self->huge_pages)
+      region_flags |= BEBO_SHMEM_REGION_HUGE_PAGES;
+  }
 
-  gst_video_info_set_format(&self->shmem->video_info, GST_VIDEO_FORMAT_RGBA, width, height);
-  GstVideoInfo * sh_info = &self->shmem->video_info;
-  sh_info->fps_n = fps;
+  size_t audio_offset = 0;
+  size_t audio_data_offset = 0;
+  if (self->audio_chunks) {
+    size_t table_size = sizeof(struct bebo_shmem_audio_chunk) * self->audio_chunks;
+    audio_offset = size;
+    size += ALIGN(table_size, ALIGNMENT);
+    audio_data_offset = size;
+    size += (size_t) AUDIO_CHUNK_SIZE * self->audio_chunks;
+    GST_INFO("audio ring: %d chunks of %d bytes", self->audio_chunks, AUDIO_CHUNK_SIZE);
+  }
 
+  bebo_shmem_object_name(name, BEBO_SHMEM_NAME, self->channel);
+  if (!bebo_shmem_region_create(&self->shmem_region, name, size,
+      region_flags)) {
+    GST_ERROR_OBJECT(self, "could not create mapping %d", bebo_shmem_last_error());
+    goto fail_mutex;
+  }
+  self->shmem = self->shmem_region.data;
+  GST_INFO_OBJECT(self, "mapped %llu bytes, huge pages: %d",
+      (guint64) self->shmem_region.size, self->shmem_region.huge_pages);
+
+  memset(self->shmem, 0, size);
+
+  gst_shm_sink_set_shmem_video_info(self, info);
+  self->shmem->info_generation = 1;
   self->shmem->version = SHM_INTERFACE_VERSION;
+  self->shmem->owner_pid = bebo_shmem_pid();
+  self->shmem->owner_heartbeat = bebo_shmem_now_ns();
   self->shmem->frame_offset = header_size;
+  bebo_shmem_v2_init(self->shmem, layout.v2_offset, BEBO_SHMEM_FEATURE_READER_LINES |
+      BEBO_SHMEM_FEATURE_RELEASE_RING | BEBO_SHMEM_FEATURE_OBSERVERS, 0);
+  bebo_shmem_release_ring_init(self->shmem, layout.release_offset);
+  // a stale release_late from the last region must not skip an entry
+  self->release_late = G_MAXUINT64;
+  self->last_full_clean = 0;
+  self->last_publish = 0;
   self->shmem->frame_size = frame_size;
-  self->shmem->count = BUFFER_COUNT;
+  self->shmem->count = self->slot_count;
   self->shmem->write_ptr = 0;
-  self->shmem->read_ptr = 0;
+  self->shmem->readers = 0;
   self->shmem->shmem_size = size;
+  self->shmem->payload_offset = payload_offset;
+  self->shmem->payload_size = payload_size;
+  self->shmem->codec = self->encoded ? BEBO_SHMEM_CODEC_H264 : BEBO_SHMEM_CODEC_RAW;
+  self->shmem->arena_size = arena_size;
+  self->shmem->audio_offset = audio_offset;
+  self->shmem->audio_data_offset = audio_data_offset;
+  self->shmem->audio_count = self->audio_chunks;
+  self->shmem->audio_chunk_size = AUDIO_CHUNK_SIZE;
+  self->audio_nr = 0;
+  self->arena_head = 0;
+  self->need_keyframe = self->encoded;
+
+  if (self->payload && !self->encoded) {
+    self->shmem_allocator = gst_shmem_allocator_new(self->shmem,
+        payload_offset, payload_size, PAYLOAD_BLOCK_COUNT(self));
+  }
+
+  gst_shm_sink_reset_stats(self, self->slot_count + 1);
+
+  bebo_shmem_mutex_unlock(&self->shmem_mutex);
+  bebo_shmem_channel_describe(&self->channel_registration, self->shmem);
+
+  // the full frames go out without them
+  if (self->thumbnail_width != 0) {
+    if (self->payload && !self->encoded) {
+      self->thumbnail = gst_shm_thumbnail_new(self->channel, info,
+          self->thumbnail_width, self->thumbnail_height, self->thumbnail_interval);
+    }
+    if (self->thumbnail == NULL)
+      GST_WARNING_OBJECT(self, "no thumbnails, they need raw video in payload mode");
+  }
 
-  ReleaseMutex(self->shmem_mutex);
   self->shmem_init = true;
+  // audio caps may have come first
+  gst_shm_sink_set_shmem_audio_info(self);
   GST_OBJECT_UNLOCK (self);
   return TRUE;
+
+  // named objects outlive us on Windows, a retry must not find ours
+fail_mutex:
+  bebo_shmem_mutex_unlock(&self->shmem_mutex);
+  bebo_shmem_mutex_close(&self->shmem_mutex);
+fail_semaphores:
+  while (n_semaphores-- > 0)
+    bebo_shmem_semaphore_close(&self->shmem_new_data_semaphore[n_semaphores]);
+  bebo_shmem_channel_unregister(&self->channel_registration);
+  GST_OBJECT_UNLOCK (self);
+  return FALSE;
+}
+
+/* Empty a slot we claimed with bebo_shmem_slot_begin_write(), the caller
+ * ends the write. */
+static void
+gst_shm_sink_clear_slot (GstDirectShowSink * self, struct frame *frame)
+{
+  if (frame->_gst_buf_ref != NULL)
+    gst_buffer_unref(frame->_gst_buf_ref);
+  // no memset, readers may be touching seq and reader_mask concurrently
+  frame->nr = 0;
+  frame->dts = 0;
+  frame->pts = 0;
+  frame->latency = 0;
+  frame->duration = 0;
+  frame->size = 0;
+  frame->dxgi_handle = NULL;
+  frame->payload_offset = 0;
+  frame->n_planes = 0;
+  frame->discontinuity = 0;
+  frame->flags = 0;
+  frame->meta_size = 0;
+  frame->publish_ns = 0;
+  frame->_gst_buf_ref = NULL;
+}
+
+static void
+clean_shmem_frame(GstDirectShowSink * self, uint64_t i, gboolean include_unread)
+{
+  // Caller expected to hold the object lock, only the producer writes slots.
+  uint64_t frame_offset =  self->shmem->frame_offset +  i * self->shmem->frame_size;
+  struct frame *frame = bebo_shmem_frame(self->shmem, i);
+  // observers snapshot the newest frame, it stays until the next one
+  // takes its place. Encoded frames have no snapshots.
+  if (!include_unread && !self->encoded && frame->nr != 0 &&
+      frame->nr == self->shmem->write_ptr)
+    return;
+  // encoded frames hold no buffer, their bytes live in the arena
+  gboolean used = frame->_gst_buf_ref != NULL ||
+      (self->encoded && frame->nr != 0);
+  if (used && bebo_shmem_slot_begin_write(frame, include_unread)) {
+    gst_shm_sink_collect_latency(self, frame);
+    GST_LOG_OBJECT(self,
+        "UNREF STOP nr: %llu dxgi_handle: %llu pts: %lld frame_offset: %d size: %d latency: %d reader_mask: %#010x",
+        frame->nr,
+        frame->dxgi_handle,
+        frame->pts / 1000000,
+        frame_offset,
+        frame->size,
+        frame->latency / 1000000,
+        frame->reader_mask
+        );
+
+    gst_shm_sink_clear_slot(self, frame);
+    bebo_shmem_slot_end_write(frame, 0);
+  }
 }
 
 static void
-clean_shmem_frame_with_max_ref_count(GstDirectShowSink * self, int max_ref_cnt)
-{
-  // Caller expected to be responsible of holding locks!
-  for (int i = 0; i < self->shmem->count; i++) {
-    uint64_t frame_offset =  self->shmem->frame_offset +  i * self->shmem->frame_size;
-    struct frame *frame = ((struct frame*) (((unsigned char*)self->shmem) + frame_offset));
-    if (frame->_gst_buf_ref != NULL && frame->ref_cnt <= max_ref_cnt) {
-      GST_LOG_OBJECT(self,
-          "UNREF STOP nr: %llu dxgi_handle: %llu pts: %lld frame_offset: %d size: %d latency: %d refcnt: %lu",
-          frame->nr,
-          frame->dxgi_handle,
-          frame->pts / 1000000,
-          frame_offset,
-          frame->size,
-          frame->latency / 1000000,
-          frame->ref_cnt
-          );
-
-      gst_buffer_unref(frame->_gst_buf_ref);
-      memset(frame, 0, sizeof(struct frame));
+clean_shmem_frames(GstDirectShowSink * self, gboolean include_unread)
+{
+  for (uint64_t i = 0; i < self->shmem->count; i++) {
+    clean_shmem_frame(self, i, include_unread);
+  }
+}
+
+/* Undo initialize_shared_memory(), the next caps create everything again
+ * with the properties they have by then. Caller holds the object lock. */
+static void
+close_shared_memory(GstDirectShowSink * self)
+{
+  if (self->shmem) {
+    bebo_shmem_mutex_lock(&self->shmem_mutex, BEBO_SHMEM_INFINITE);
+    clean_shmem_frames(self, TRUE);
+    // slots readers still pin keep their buffer, the region goes away
+    // under them anyway
+    for (uint64_t i = 0; i < self->shmem->count; i++) {
+      struct frame *frame = bebo_shmem_frame(self->shmem, i);
+      if (frame->_gst_buf_ref != NULL) {
+        gst_buffer_unref(frame->_gst_buf_ref);
+        frame->_gst_buf_ref = NULL;
+      }
     }
-  };
+    bebo_shmem_mutex_unlock(&self->shmem_mutex);
+  }
+  gst_buffer_replace(&self->unpublished, NULL);
+
+  gst_shm_thumbnail_free (self->thumbnail);
+  self->thumbnail = NULL;
+
+  bebo_shmem_channel_unregister (&self->channel_registration);
+  // upstream may still hold buffers of the pool, the mapping goes away
+  // with the last of them
+  if (self->shmem_allocator) {
+    gst_shmem_allocator_take_region (self->shmem_allocator, &self->shmem_region);
+    gst_object_unref (self->shmem_allocator);
+  }
+  self->shmem_allocator = NULL;
+  bebo_shmem_region_close (&self->shmem_region);
+  self->shmem = NULL;
+  bebo_shmem_mutex_close (&self->shmem_mutex);
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    bebo_shmem_semaphore_close (&self->shmem_new_data_semaphore[i]);
+  }
+  self->shmem_init = FALSE;
+}
+
+/* TRUE if every reader in readers pushes the slots it frees. */
+static gboolean
+gst_shm_sink_readers_push (GstDirectShowSink * self, uint32_t readers)
+{
+  struct bebo_shmem_v2 *v2 = bebo_shmem_v2(self->shmem);
+
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    // set on attach before the reader shows up in the table
+    if ((readers & (1u << i)) &&
+        !(bebo_atomic_load_u64(&v2->reader[i].features) &
+            BEBO_SHMEM_FEATURE_RELEASE_RING))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* TRUE if an observer took a snapshot lately, see
+ * BEBO_SHMEM_FEATURE_OBSERVERS. */
+static gboolean
+gst_shm_sink_observed (GstDirectShowSink * self, uint64_t now)
+{
+  uint64_t *heartbeat = bebo_shmem_observer_heartbeat(self->shmem);
+  uint64_t last = heartbeat ? bebo_atomic_load_u64(heartbeat) : 0;
+
+  // a stamp from after our now still counts
+  return last != 0 && last + OBSERVER_TIMEOUT > now;
+}
+
+/* Unref the buffers readers are done with. Normally only the slots they
+ * pushed to the release ring since the last frame are looked at. All of
+ * them are when that can miss one: a reader does not push (v1 or older
+ * readers), the reader table changed (detaching drops marks without
+ * pushing), and every REAP_INTERVAL for pushes that did not fit. Caller
+ * holds the object lock. */
+static void
+gst_shm_sink_collect_released (GstDirectShowSink * self, uint64_t now)
+{
+  struct bebo_shmem_release_ring *ring = bebo_shmem_release_ring(self->shmem);
+  uint32_t readers = bebo_shmem_readers(self->shmem);
+  uint32_t slot;
+
+  if (ring && readers == self->release_readers && self->release_all &&
+      now - self->last_full_clean < REAP_INTERVAL) {
+    while (bebo_shmem_release_pop(ring, &slot)) {
+      // a hint, clean_shmem_frame checks the marks again
+      if (slot < self->shmem->count)
+        clean_shmem_frame(self, slot, FALSE);
+    }
+    return;
+  }
+
+  if (ring) {
+    // the scan below covers whatever is in there
+    while (bebo_shmem_release_pop(ring, &slot))
+      ;
+    // a reader died between claiming an entry and writing it
+    if (ring->tail == self->release_late && bebo_shmem_release_skip(ring)) {
+      GST_DEBUG_OBJECT(self, "skipping release entry %llu", ring->tail - 1);
+    }
+    self->release_late = ring->tail;
+  }
+  clean_shmem_frames(self, FALSE);
+  self->release_readers = readers;
+  self->release_all = ring && gst_shm_sink_readers_push(self, readers);
+  self->last_full_clean = now;
+}
+
+/* "snapshot" action: the newest frame as a sample, NULL if there is none
+ * yet. Takes no reader entry and no pin, readers and the drop policy don't
+ * notice. Payload frames are copied, the shmem block goes back to the ring
+ * right away. DXGI frames are handed out by reference, the texture is not
+ * reused until the sample is gone. Without readers that is the last frame
+ * we did not publish. */
+static GstSample *
+gst_shm_sink_snapshot (GstDirectShowSink * self)
+{
+  GstBuffer *buf = NULL;
+  GstCaps *caps = NULL;
+  gboolean block = FALSE;
+
+  GST_OBJECT_LOCK (self);
+  if (self->unpublished != NULL) {
+    // newer than anything in the ring, and not one of our blocks
+    buf = gst_buffer_ref(self->unpublished);
+    caps = gst_video_info_to_caps(&self->info);
+  } else if (self->shmem && !self->encoded && self->shmem->write_ptr != 0) {
+    // encoded frames live in the arena and need the ones before them
+    uint64_t nr = self->shmem->write_ptr;
+    struct frame *frame = bebo_shmem_frame(self->shmem, nr % self->shmem->count);
+    // we are the only writer and hold the lock, the slot can't change
+    if (frame->nr == nr && frame->_gst_buf_ref != NULL) {
+      GstVideoInfo info = self->info;
+      // a frame from before the last caps change
+      if (frame->info_generation != self->shmem->info_generation) {
+        gst_video_info_set_format(&info, (GstVideoFormat) frame->format,
+            frame->width, frame->height);
+      }
+      buf = gst_buffer_ref((GstBuffer *) frame->_gst_buf_ref);
+      caps = gst_video_info_to_caps(&info);
+      block = self->payload;
+    }
+  }
+  GST_OBJECT_UNLOCK (self);
+
+  if (buf == NULL)
+    return NULL;
+
+  if (block) {
+    // the block stays taken only while we copy
+    GstBuffer *copy = gst_buffer_copy_deep(buf);
+    gst_buffer_unref(buf);
+    buf = copy;
+  }
+
+  GstSample *sample = gst_sample_new(buf, caps, NULL, NULL);
+  gst_buffer_unref(buf);
+  gst_caps_unref(caps);
+  return sample;
 }
 
 static void
@@ -233,12 +821,51 @@ gst_shm_sink_init (GstDirectShowSink * self)
   self->latency = -1;
   self->pool = NULL;
   self->shmem_init = FALSE;
+  self->payload = FALSE;
+  self->shmem_allocator = NULL;
+  self->reader_timeout = DEFAULT_READER_TIMEOUT;
+  self->last_reap = 0;
+  self->last_publish = 0;
+  self->release_readers = 0;
+  self->release_all = FALSE;
+  self->last_full_clean = 0;
+  self->release_late = G_MAXUINT64;
+  self->unpublished = NULL;
+  self->policy = DEFAULT_POLICY;
+  self->qos_rendered = 0;
+  self->qos_dropped = 0;
+  self->stats_interval = 0;
+  self->last_stats = 0;
+  self->slot_count = DEFAULT_SLOT_COUNT;
+  self->slot_size = 0;
+  self->huge_pages = TRUE;
+  self->encoded = FALSE;
+  self->arena_head = 0;
+  self->need_keyframe = FALSE;
+  self->n_clock_samples = 0;
+  self->clock_sample_pos = 0;
+  self->last_clock_sample = 0;
+  self->audio_chunks = 0;
+  self->audio_nr = 0;
+  self->audio_discont = TRUE;
+  self->channel = NULL;
+  self->thumbnail = NULL;
+  self->thumbnail_width = 0;
+  self->thumbnail_height = 0;
+  self->thumbnail_interval = DEFAULT_THUMBNAIL_INTERVAL;
+  gst_audio_info_init (&self->audio_info);
+  gst_video_info_init (&self->info);
+  gst_base_sink_set_qos_enabled (GST_BASE_SINK (self), TRUE);
 
   g_cond_init (&self->cond);
   //self->size = DEFAULT_SIZE;
 
-  // FIXME handle creation error
-  self->shmem_new_data_semaphore = CreateSemaphoreW(NULL, 0, 1, BEBO_SHMEM_DATA_SEM);
+  self->audio_pad = gst_pad_new_from_static_template (&audiotemplate, "audio");
+  gst_pad_set_chain_function (self->audio_pad,
+      GST_DEBUG_FUNCPTR (gst_shm_sink_audio_chain));
+  gst_pad_set_event_function (self->audio_pad,
+      GST_DEBUG_FUNCPTR (gst_shm_sink_audio_event));
+  gst_element_add_pad (GST_ELEMENT (self), self->audio_pad);
 
   /* gst_allocation_params_init (&self->params); */
 }
@@ -268,6 +895,8 @@ gst_shm_sink_class_init (GstDirectShowSinkClass * klass)
       GST_DEBUG_FUNCPTR (gst_shm_sink_propose_allocation);
   gstbasesink_class->set_caps=
       GST_DEBUG_FUNCPTR (gst_shm_sink_set_caps);
+  gstbasesink_class->get_caps =
+      GST_DEBUG_FUNCPTR (gst_shm_sink_get_caps);
 
   gstelement_class->set_context = GST_DEBUG_FUNCPTR (gst_dshowfiltersink_set_context);
   // FIXME: should we implement gst_element_change_state();
@@ -283,6 +912,86 @@ gst_shm_sink_class_init (GstDirectShowSinkClass * klass)
     g_param_spec_int64("latency", "latency", "The pipeline's measured latency",
       0, G_MAXINT64, 3, G_PARAM_READWRITE));
 
+  g_object_class_install_property(gobject_class, PROP_PAYLOAD,
+    g_param_spec_boolean("payload", "Payload",
+      "Write raw pixels or H.264 access units into the shared memory instead "
+      "of sharing DXGI textures",
+      FALSE, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_READER_TIMEOUT,
+    g_param_spec_uint("reader-timeout", "Reader Timeout",
+      "Milliseconds a reader may stop reading before its frames are taken back "
+      "(0 = only when its process is gone)",
+      0, G_MAXUINT, DEFAULT_READER_TIMEOUT,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_POLICY,
+    g_param_spec_enum("policy", "Policy",
+      "What to do when the readers fall behind by a full ring or more than buffer-time",
+      GST_TYPE_SHM_SINK_POLICY, DEFAULT_POLICY,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_STATS,
+    g_param_spec_boxed("stats", "Statistics",
+      "Drops per reason, ring occupancy histogram and publish to read latency (ns) percentiles",
+      GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_STATS_INTERVAL,
+    g_param_spec_uint("stats-interval", "Stats Interval",
+      "Milliseconds between element messages carrying the stats (0 = none)",
+      0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_SLOT_COUNT,
+    g_param_spec_uint("slot-count", "Slot Count",
+      "Number of frames in the shared memory ring",
+      2, MAX_SLOT_COUNT, DEFAULT_SLOT_COUNT,
+      G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_SLOT_SIZE,
+    g_param_spec_uint64("slot-size", "Slot Size",
+      "Bytes of pixels per slot in payload mode, leaves room for larger caps "
+      "later (0 = fit the first caps). Arena bytes per slot for H.264 "
+      "(0 = 1 MiB)",
+      0, G_MAXUINT64, 0,
+      G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_HUGE_PAGES,
+    g_param_spec_boolean("huge-pages", "Huge Pages",
+      "Back the shared memory with huge pages in payload mode when the system allows it",
+      TRUE, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_AUDIO_CHUNKS,
+    g_param_spec_uint("audio-chunks", "Audio Chunks",
+      "Number of 8 KiB PCM chunks in the audio ring fed by the audio pad "
+      "(0 = no audio ring)",
+      0, MAX_AUDIO_CHUNKS, 0,
+      G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_CHANNEL,
+    g_param_spec_string("channel", "Channel",
+      "Name of the shared memory channel, so several sinks can run side by "
+      "side (letters, digits, '-' and '_'; NULL = the default channel)",
+      NULL, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_THUMBNAIL_WIDTH,
+    g_param_spec_uint("thumbnail-width", "Thumbnail Width",
+      "Payload mode: also publish box filtered thumbnails this wide on the "
+      "channel's \"-thumbnail\" channel (0 = no thumbnails)",
+      0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_THUMBNAIL_HEIGHT,
+    g_param_spec_uint("thumbnail-height", "Thumbnail Height",
+      "Height of the thumbnails (0 = keep the aspect ratio)",
+      0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_THUMBNAIL_INTERVAL,
+    g_param_spec_uint("thumbnail-interval", "Thumbnail Interval",
+      "Publish a thumbnail of every n-th frame",
+      1, G_MAXUINT, DEFAULT_THUMBNAIL_INTERVAL,
+      G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
   signals[SIGNAL_CLIENT_CONNECTED] = g_signal_new ("client-connected",
       GST_TYPE_SHM_SINK, G_SIGNAL_RUN_LAST, 0, NULL, NULL,
       g_cclosure_marshal_VOID__INT, G_TYPE_NONE, 1, G_TYPE_INT);
@@ -291,7 +1000,16 @@ gst_shm_sink_class_init (GstDirectShowSinkClass * klass)
       GST_TYPE_SHM_SINK, G_SIGNAL_RUN_LAST, 0, NULL, NULL,
       g_cclosure_marshal_VOID__INT, G_TYPE_NONE, 1, G_TYPE_INT);
 
+  // the newest frame as a GstSample, see gst_shm_sink_snapshot()
+  signals[SIGNAL_SNAPSHOT] = g_signal_new ("snapshot",
+      GST_TYPE_SHM_SINK, G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+      G_STRUCT_OFFSET (GstDirectShowSinkClass, snapshot), NULL, NULL, NULL,
+      GST_TYPE_SAMPLE, 0, G_TYPE_NONE);
+
+  klass->snapshot = gst_shm_sink_snapshot;
+
   gst_element_class_add_static_pad_template (gstelement_class, &sinktemplate);
+  gst_element_class_add_static_pad_template (gstelement_class, &audiotemplate);
 
   gst_element_class_set_static_metadata (gstelement_class,
       "Direct Show Filter Sink",
@@ -309,6 +1027,12 @@ gst_shm_sink_finalize (GObject * object)
   GstDirectShowSink *self = GST_SHM_SINK (object);
 
   g_cond_clear (&self->cond);
+  g_free (self->stats.occupancy);
+
+  GST_OBJECT_LOCK (self);
+  close_shared_memory (self);
+  GST_OBJECT_UNLOCK (self);
+  g_free (self->channel);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -333,6 +1057,79 @@ gst_shm_sink_set_property (GObject * object, guint prop_id,
     case PROP_LATENCY:
       self->latency = g_value_get_int64 (value);
       break;
+    case PROP_PAYLOAD:
+      GST_OBJECT_LOCK (object);
+      self->payload = g_value_get_boolean (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_READER_TIMEOUT:
+      GST_OBJECT_LOCK (object);
+      self->reader_timeout = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_POLICY:
+      GST_OBJECT_LOCK (object);
+      self->policy = g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (object);
+      g_cond_broadcast (&self->cond);
+      break;
+    case PROP_STATS_INTERVAL:
+      GST_OBJECT_LOCK (object);
+      self->stats_interval = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_SLOT_COUNT:
+      GST_OBJECT_LOCK (object);
+      self->slot_count = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_SLOT_SIZE:
+      GST_OBJECT_LOCK (object);
+      self->slot_size = g_value_get_uint64 (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_HUGE_PAGES:
+      GST_OBJECT_LOCK (object);
+      self->huge_pages = g_value_get_boolean (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_AUDIO_CHUNKS:
+      GST_OBJECT_LOCK (object);
+      self->audio_chunks = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_CHANNEL:
+    {
+      const gchar *channel = g_value_get_string (value);
+      if (!bebo_shmem_channel_name_valid (channel)) {
+        GST_WARNING_OBJECT (self, "invalid channel name \"%s\"", channel);
+        break;
+      }
+      GST_OBJECT_LOCK (object);
+      if (self->shmem_init) {
+        GST_WARNING_OBJECT (self, "the shared memory exists, can't change the channel");
+      } else {
+        g_free (self->channel);
+        self->channel = g_strdup (channel);
+      }
+      GST_OBJECT_UNLOCK (object);
+      break;
+    }
+    case PROP_THUMBNAIL_WIDTH:
+      GST_OBJECT_LOCK (object);
+      self->thumbnail_width = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_THUMBNAIL_HEIGHT:
+      GST_OBJECT_LOCK (object);
+      self->thumbnail_height = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_THUMBNAIL_INTERVAL:
+      GST_OBJECT_LOCK (object);
+      self->thumbnail_interval = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
     default:
       break;
   }
@@ -353,6 +1150,45 @@ gst_shm_sink_get_property (GObject * object, guint prop_id,
     case PROP_LATENCY:
       g_value_set_int64(value, self->latency / 1000000);
       break;
+    case PROP_PAYLOAD:
+      g_value_set_boolean (value, self->payload);
+      break;
+    case PROP_READER_TIMEOUT:
+      g_value_set_uint (value, self->reader_timeout);
+      break;
+    case PROP_POLICY:
+      g_value_set_enum (value, self->policy);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_shm_sink_create_stats (self));
+      break;
+    case PROP_STATS_INTERVAL:
+      g_value_set_uint (value, self->stats_interval);
+      break;
+    case PROP_SLOT_COUNT:
+      g_value_set_uint (value, self->slot_count);
+      break;
+    case PROP_SLOT_SIZE:
+      g_value_set_uint64 (value, self->slot_size);
+      break;
+    case PROP_HUGE_PAGES:
+      g_value_set_boolean (value, self->huge_pages);
+      break;
+    case PROP_AUDIO_CHUNKS:
+      g_value_set_uint (value, self->audio_chunks);
+      break;
+    case PROP_CHANNEL:
+      g_value_set_string (value, self->channel);
+      break;
+    case PROP_THUMBNAIL_WIDTH:
+      g_value_set_uint (value, self->thumbnail_width);
+      break;
+    case PROP_THUMBNAIL_HEIGHT:
+      g_value_set_uint (value, self->thumbnail_height);
+      break;
+    case PROP_THUMBNAIL_INTERVAL:
+      g_value_set_uint (value, self->thumbnail_interval);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -370,6 +1206,11 @@ gst_shm_sink_start (GstBaseSink * bsink)
 
   self->stop = FALSE;
 
+  // no GL / D3D interop needed, pixels go through shmem
+  if (self->payload) {
+    return TRUE;
+  }
+
   gst_gl_ensure_element_data (GST_ELEMENT (self),
         (GstGLDisplay **) & self->display,
         (GstGLContext **) & self->other_context);
@@ -394,18 +1235,21 @@ gst_shm_sink_stop (GstBaseSink * bsink)
 
   self->stop = TRUE;
 
-  GST_OBJECT_LOCK (self);
-  if (self->shmem_mutex) {
-    WaitForSingleObject(self->shmem_mutex, INFINITE);
-    clean_shmem_frame_with_max_ref_count(self, 1);
-    ReleaseMutex(self->shmem_mutex);
-  }
-  GST_OBJECT_UNLOCK (self);
-
-  if (self->pool)
+  // before the region, buffers that come back to it are freed right away
+  if (self->pool) {
+    gst_buffer_pool_set_active (self->pool, FALSE);
     gst_object_unref (self->pool);
+  }
   self->pool = NULL;
 
+  GST_OBJECT_LOCK (self);
+  close_shared_memory(self);
+  // the next run may have another clock
+  self->n_clock_samples = 0;
+  self->clock_sample_pos = 0;
+  self->last_clock_sample = 0;
+  GST_OBJECT_UNLOCK (self);
+
   if (self->allocator)
     gst_object_unref (self->allocator);
     self->allocator = NULL;
@@ -413,13 +1257,121 @@ gst_shm_sink_stop (GstBaseSink * bsink)
   return TRUE;
 }
 
+/* Number of slots some reader did not read yet and the pts of the oldest
+ * of them. Caller holds the object lock. */
+static guint
+gst_shm_sink_ring_fill (GstDirectShowSink * self, GstClockTime * oldest_pts)
+{
+  uint64_t oldest_nr = G_MAXUINT64;
+  guint fill = 0;
+
+  *oldest_pts = GST_CLOCK_TIME_NONE;
+  for (uint64_t i = 0; i < self->shmem->count; i++) {
+    struct frame *frame = bebo_shmem_frame(self->shmem, i);
+    // nr and pts are only written by us, reader_mask changes under our feet
+    if (frame->nr == 0 ||
+        !(bebo_atomic_load_u32(&frame->reader_mask) & BEBO_SHMEM_REF_UNREAD))
+      continue;
+    fill++;
+    if (frame->nr < oldest_nr) {
+      oldest_nr = frame->nr;
+      *oldest_pts = frame->pts;
+    }
+  }
+  return fill;
+}
+
+/* FALSE if the readers sit on frames older than buffer-time */
 static gboolean
 gst_shm_sink_can_render (GstDirectShowSink * self, GstClockTime time)
 {
-  if (time == GST_CLOCK_TIME_NONE || self->buffer_time == GST_CLOCK_TIME_NONE)
+  GstClockTime oldest;
+
+  if (time == GST_CLOCK_TIME_NONE || self->buffer_time < 0)
     return TRUE;
 
-  return TRUE;
+  if (gst_shm_sink_ring_fill(self, &oldest) == 0 ||
+      !GST_CLOCK_TIME_IS_VALID(oldest) || oldest >= time)
+    return TRUE;
+
+  return time - oldest <= (GstClockTime) self->buffer_time;
+}
+
+/* Claim frame for the incoming buffer according to the policy. The block
+ * policy waits with the object lock released, caller holds it. */
+static gboolean
+gst_shm_sink_claim_slot (GstDirectShowSink * self, struct frame *frame,
+    GstClockTime time)
+{
+  gboolean drop_oldest = self->policy == GST_SHM_SINK_POLICY_DROP_OLDEST;
+  gint64 deadline = 0;
+
+  for (;;) {
+    uint32_t unread = bebo_atomic_load_u32(&frame->reader_mask) & BEBO_SHMEM_REF_UNREAD;
+    if ((drop_oldest || gst_shm_sink_can_render(self, time)) &&
+        bebo_shmem_slot_begin_write(frame, drop_oldest)) {
+      if (unread)
+        self->stats.overwritten++;
+      return TRUE;
+    }
+
+    if (self->policy != GST_SHM_SINK_POLICY_BLOCK || self->buffer_time <= 0 ||
+        self->unlock)
+      return FALSE;
+
+    gint64 now = g_get_monotonic_time();
+    if (deadline == 0)
+      deadline = now + self->buffer_time / GST_USECOND;
+    else if (now >= deadline)
+      return FALSE;
+    g_cond_wait_until(&self->cond, GST_OBJECT_GET_LOCK(self),
+        MIN(deadline, now + BLOCK_POLL_INTERVAL));
+  }
+}
+
+/* Tell upstream that we throw frames away so the compositor and encoder
+ * can produce less. Sent once per QOS_WINDOW offered frames at most. */
+static void
+gst_shm_sink_send_qos (GstDirectShowSink * self, GstBuffer * buf)
+{
+  GstBaseSink *bsink = GST_BASE_SINK (self);
+  GstClockTime timestamp = GST_BUFFER_PTS (buf);
+  GstClockTime duration = GST_BUFFER_DURATION (buf);
+  guint64 rendered, dropped, total_rendered, total_dropped;
+
+  if (!gst_base_sink_is_qos_enabled (bsink) || !GST_CLOCK_TIME_IS_VALID (timestamp))
+    return;
+
+  GST_OBJECT_LOCK (self);
+  rendered = self->qos_rendered;
+  dropped = self->qos_dropped;
+  if (rendered + dropped < QOS_WINDOW) {
+    GST_OBJECT_UNLOCK (self);
+    return;
+  }
+  self->qos_rendered = 0;
+  self->qos_dropped = 0;
+  total_rendered = self->stats.rendered;
+  total_dropped = gst_shm_sink_stats_dropped (&self->stats);
+  GST_OBJECT_UNLOCK (self);
+
+  // frames offered per frame the readers took
+  gdouble proportion = (gdouble) (rendered + dropped) / MAX (rendered, 1);
+  GstClockTimeDiff diff = GST_CLOCK_TIME_IS_VALID (duration) ? duration : 0;
+
+  GST_DEBUG_OBJECT (self, "QoS overflow proportion: %f rendered: %"
+      G_GUINT64_FORMAT " dropped: %" G_GUINT64_FORMAT, proportion, rendered,
+      dropped);
+
+  gst_pad_push_event (GST_BASE_SINK_PAD (bsink),
+      gst_event_new_qos (GST_QOS_TYPE_OVERFLOW, proportion, diff, timestamp));
+
+  GstMessage *msg = gst_message_new_qos (GST_OBJECT_CAST (self), TRUE,
+      timestamp, GST_CLOCK_TIME_NONE, timestamp, duration);
+  gst_message_set_qos_values (msg, diff, proportion, 1000000);
+  gst_message_set_qos_stats (msg, GST_FORMAT_BUFFERS, total_rendered,
+      total_dropped);
+  gst_element_post_message (GST_ELEMENT_CAST (self), msg);
 }
 
 static void gl_run_dxgi_map_d3d(GstGLContext *context, GstGLDXGIMemory * gl_mem)
@@ -427,6 +1379,382 @@ static void gl_run_dxgi_map_d3d(GstGLContext *context, GstGLDXGIMemory * gl_mem)
   gl_dxgi_map_d3d(gl_mem);
 }
 
+/* Returns a new reference to a buffer whose pixels live in a shmem block,
+ * copying into a free block if upstream did not use our pool. */
+static GstBuffer *
+gst_shm_sink_get_payload_buffer (GstDirectShowSink * self, GstBuffer * buf)
+{
+  GstMemory *memory = gst_buffer_peek_memory(buf, 0);
+  if (gst_buffer_n_memory(buf) == 1 &&
+      memory->allocator == GST_ALLOCATOR(self->shmem_allocator)) {
+    return gst_buffer_ref(buf);
+  }
+
+  GST_LOG_OBJECT(self, "Memory in buffer %p was not allocated by us: "
+    "%" GST_PTR_FORMAT ", will memcpy", buf, memory->allocator);
+
+  GstMemory *shm_mem = gst_allocator_alloc(GST_ALLOCATOR(self->shmem_allocator),
+      GST_VIDEO_INFO_SIZE(&self->info), NULL);
+  if (shm_mem == NULL) {
+    return NULL;
+  }
+
+  GstBuffer *copy = gst_buffer_new();
+  gst_buffer_append_memory(copy, shm_mem);
+  gst_buffer_copy_into(copy, buf,
+      GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+
+  GstVideoFrame src, dest;
+  if (!gst_video_frame_map(&src, &self->info, buf, GST_MAP_READ)) {
+    GST_WARNING_OBJECT(self, "could not map incoming buffer %p", buf);
+    gst_buffer_unref(copy);
+    return NULL;
+  }
+  if (!gst_video_frame_map(&dest, &self->info, copy, GST_MAP_WRITE)) {
+    gst_video_frame_unmap(&src);
+    gst_buffer_unref(copy);
+    return NULL;
+  }
+  gst_video_frame_copy(&dest, &src);
+  gst_video_frame_unmap(&dest);
+  gst_video_frame_unmap(&src);
+
+  return copy;
+}
+
+/* Point the slot at the block holding buf and record the plane layout. */
+static void
+gst_shm_sink_fill_payload (GstDirectShowSink * self, struct frame *frame,
+    GstBuffer * buf)
+{
+  GstShmemMemory *mem = (GstShmemMemory *) gst_buffer_peek_memory(buf, 0);
+  GstVideoMeta *meta = gst_buffer_get_video_meta(buf);
+
+  frame->dxgi_handle = NULL;
+  frame->payload_offset = mem->region_offset + mem->mem.offset;
+  frame->n_planes = GST_VIDEO_INFO_N_PLANES(&self->info);
+  for (guint i = 0; i < GST_VIDEO_MAX_PLANES; i++) {
+    if (i >= frame->n_planes) {
+      frame->plane_offset[i] = 0;
+      frame->plane_stride[i] = 0;
+    } else if (meta) {
+      frame->plane_offset[i] = (uint32_t) meta->offset[i];
+      frame->plane_stride[i] = meta->stride[i];
+    } else {
+      frame->plane_offset[i] = (uint32_t) GST_VIDEO_INFO_PLANE_OFFSET(&self->info, i);
+      frame->plane_stride[i] = GST_VIDEO_INFO_PLANE_STRIDE(&self->info, i);
+    }
+  }
+}
+
+/* GstMeta that crosses the process boundary. The serializers write
+ * straight into the claimed slot on the render path and must not allocate,
+ * they return FALSE if frame.meta is full. beboshmsrc has the matching
+ * deserializers. */
+typedef gboolean (*GstShmSinkMetaSerializeFunc) (GstMeta * meta,
+    struct frame * frame);
+
+static gboolean
+gst_shm_sink_serialize_timecode (GstMeta * meta, struct frame *frame)
+{
+  GstVideoTimeCode *tc = &((GstVideoTimeCodeMeta *) meta)->tc;
+  struct bebo_shmem_meta_timecode *out = bebo_shmem_meta_add(frame,
+      BEBO_SHMEM_META_TIMECODE, sizeof(*out));
+  if (out == NULL)
+    return FALSE;
+
+  out->fps_n = tc->config.fps_n;
+  out->fps_d = tc->config.fps_d;
+  out->flags = tc->config.flags;
+  out->hours = tc->hours;
+  out->minutes = tc->minutes;
+  out->seconds = tc->seconds;
+  out->frames = tc->frames;
+  out->field_count = tc->field_count;
+  return TRUE;
+}
+
+static gboolean
+gst_shm_sink_serialize_roi (GstMeta * meta, struct frame *frame)
+{
+  GstVideoRegionOfInterestMeta *roi = (GstVideoRegionOfInterestMeta *) meta;
+  struct bebo_shmem_meta_roi *out = bebo_shmem_meta_add(frame,
+      BEBO_SHMEM_META_ROI, sizeof(*out));
+  if (out == NULL)
+    return FALSE;
+
+  out->x = roi->x;
+  out->y = roi->y;
+  out->w = roi->w;
+  out->h = roi->h;
+  out->id = roi->id;
+  out->parent_id = roi->parent_id;
+  // quark strings are interned, nothing is allocated
+  g_strlcpy(out->roi_type, g_quark_to_string(roi->roi_type),
+      sizeof(out->roi_type));
+  return TRUE;
+}
+
+#if GST_CHECK_VERSION(1, 16, 0)
+static gboolean
+gst_shm_sink_serialize_caption (GstMeta * meta, struct frame *frame)
+{
+  GstVideoCaptionMeta *cc = (GstVideoCaptionMeta *) meta;
+  struct bebo_shmem_meta_caption *out = bebo_shmem_meta_add(frame,
+      BEBO_SHMEM_META_CAPTION, sizeof(*out) + cc->size);
+  if (out == NULL)
+    return FALSE;
+
+  out->caption_type = cc->caption_type;
+  out->size = (uint32_t) cc->size;
+  memcpy(out + 1, cc->data, cc->size);
+  return TRUE;
+}
+#endif
+
+static const struct {
+  GType (*api) (void);
+  GstShmSinkMetaSerializeFunc serialize;
+} meta_serializers[] = {
+  {gst_video_time_code_meta_api_get_type, gst_shm_sink_serialize_timecode},
+  {gst_video_region_of_interest_meta_api_get_type, gst_shm_sink_serialize_roi},
+#if GST_CHECK_VERSION(1, 16, 0)
+  {gst_video_caption_meta_api_get_type, gst_shm_sink_serialize_caption},
+#endif
+};
+
+/* Fill frame.meta from the metas on buf that we know how to serialize. */
+static void
+gst_shm_sink_serialize_meta (GstDirectShowSink * self, struct frame *frame,
+    GstBuffer * buf)
+{
+  gpointer state = NULL;
+  GstMeta *meta;
+
+  frame->meta_size = 0;
+  while ((meta = gst_buffer_iterate_meta(buf, &state)) != NULL) {
+    for (guint i = 0; i < G_N_ELEMENTS(meta_serializers); i++) {
+      if (meta->info->api != meta_serializers[i].api())
+        continue;
+      if (!meta_serializers[i].serialize(meta, frame))
+        GST_LOG_OBJECT(self, "no room left for %s in frame meta",
+            g_type_name(meta->info->api));
+      break;
+    }
+  }
+}
+
+/* Find size contiguous arena bytes for the frame going into slot index.
+ * Access units are laid out in frame order, so everything between the end
+ * of the newest frame and the start of the oldest one still in a slot is
+ * free. Retires the oldest frames if that is not enough, gives up if a
+ * reader holds one of them. Caller holds the object lock. */
+static gboolean
+gst_shm_sink_arena_alloc (GstDirectShowSink * self, uint64_t index,
+    uint64_t size, uint64_t * offset)
+{
+  struct shmem *shmem = self->shmem;
+  uint64_t arena = shmem->arena_size;
+  gboolean drop_oldest = self->policy == GST_SHM_SINK_POLICY_DROP_OLDEST;
+
+  if (size > arena)
+    return FALSE;
+
+  for (;;) {
+    struct frame *oldest = NULL;
+    for (uint64_t i = 0; i < shmem->count; i++) {
+      struct frame *frame = bebo_shmem_frame(shmem, i);
+      if (i == index || frame->nr == 0 || frame->payload_offset == 0)
+        continue;
+      if (oldest == NULL || frame->nr < oldest->nr)
+        oldest = frame;
+    }
+
+    uint64_t head = self->arena_head;
+    int64_t start = -1;
+    if (oldest == NULL) {
+      start = 0;
+    } else {
+      uint64_t tail = oldest->payload_offset - shmem->payload_offset;
+      if (head > tail) {
+        // in use: [tail, head)
+        if (arena - head >= size)
+          start = head;
+        else if (tail >= size)
+          start = 0;
+      } else if (head < tail && tail - head >= size) {
+        // in use: [tail, end) and [0, head), head == tail is full
+        start = head;
+      }
+    }
+
+    if (start >= 0) {
+      *offset = shmem->payload_offset + start;
+      uint64_t end = start + size;
+      self->arena_head = MIN(ALIGN(end, ALIGNMENT), arena);
+      return TRUE;
+    }
+
+    uint32_t unread = bebo_atomic_load_u32(&oldest->reader_mask) & BEBO_SHMEM_REF_UNREAD;
+    if (!bebo_shmem_slot_begin_write(oldest, drop_oldest))
+      return FALSE;
+    if (unread)
+      self->stats.overwritten++;
+    GST_LOG_OBJECT(self, "retiring nr: %llu to make room for %llu bytes",
+        oldest->nr, size);
+    gst_shm_sink_collect_latency(self, oldest);
+    gst_shm_sink_clear_slot(self, oldest);
+    bebo_shmem_slot_end_write(oldest, 0);
+  }
+}
+
+/* Copy the access unit in buf into the arena, the one copy on its way to
+ * every reader. FALSE if the readers still hold too much of the arena. */
+static gboolean
+gst_shm_sink_fill_encoded (GstDirectShowSink * self, uint64_t index,
+    struct frame *frame, GstBuffer * buf)
+{
+  gsize size = gst_buffer_get_size(buf);
+  uint64_t offset;
+
+  if (!gst_shm_sink_arena_alloc(self, index, size, &offset))
+    return FALSE;
+
+  gst_buffer_extract(buf, 0, (guint8 *) self->shmem + offset, size);
+  frame->dxgi_handle = NULL;
+  frame->payload_offset = offset;
+  frame->n_planes = 0;
+  for (guint i = 0; i < GST_VIDEO_MAX_PLANES; i++) {
+    frame->plane_offset[i] = 0;
+    frame->plane_stride[i] = 0;
+  }
+  return TRUE;
+}
+
+/* Delta units are useless after a drop, ask the encoder to start over. */
+static void
+gst_shm_sink_request_keyframe (GstDirectShowSink * self)
+{
+  GST_DEBUG_OBJECT(self, "requesting a keyframe");
+  gst_pad_push_event(GST_BASE_SINK_PAD(self),
+      gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+}
+
+/* Fit a line through the last clock observations and publish it in the
+ * header, readers extrapolate from it. Caller holds the object lock. */
+static void
+gst_shm_sink_sample_clock (GstDirectShowSink * self, uint64_t now,
+    GstClockTime clock_time, GstClockTime base_time, GstClockTime latency)
+{
+  GstClockTime temp[2 * GST_SHM_SINK_CLOCK_SAMPLES];
+  GstClockTime m_num, m_denom, b, xbase;
+  gdouble r_squared;
+  struct bebo_shmem_clock sample;
+
+  if (self->last_clock_sample != 0 &&
+      now - self->last_clock_sample < CLOCK_SAMPLE_INTERVAL)
+    return;
+  self->last_clock_sample = now;
+
+  self->clock_samples[2 * self->clock_sample_pos] = now;
+  self->clock_samples[2 * self->clock_sample_pos + 1] = clock_time;
+  self->clock_sample_pos = (self->clock_sample_pos + 1) % GST_SHM_SINK_CLOCK_SAMPLES;
+  if (self->n_clock_samples < GST_SHM_SINK_CLOCK_SAMPLES)
+    self->n_clock_samples++;
+
+  sample.base_time = base_time;
+  sample.latency = latency;
+  sample.internal = now;
+  sample.external = clock_time;
+  sample.rate_num = BEBO_SHMEM_CLOCK_RATE_DENOM;
+  sample.rate_denom = BEBO_SHMEM_CLOCK_RATE_DENOM;
+
+  // same fit GstClock uses for slaving, order of the samples doesn't matter
+  if (self->n_clock_samples >= 4 &&
+      gst_calculate_linear_regression (self->clock_samples, temp,
+          self->n_clock_samples, &m_num, &m_denom, &b, &xbase, &r_squared) &&
+      m_denom != 0) {
+    sample.internal = xbase;
+    sample.external = b;
+    sample.rate_num = gst_util_uint64_scale (BEBO_SHMEM_CLOCK_RATE_DENOM,
+        m_num, m_denom);
+  }
+
+  bebo_shmem_clock_publish(self->shmem, &sample);
+  GST_LOG_OBJECT(self, "clock %" GST_TIME_FORMAT " at %" G_GUINT64_FORMAT
+      " rate %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT,
+      GST_TIME_ARGS(sample.external), sample.internal, sample.rate_num,
+      sample.rate_denom);
+}
+
+/* Staleness counts from our last publish, not the clock: while we stall
+ * there is nothing to read and waiting readers are not late. */
+static gboolean
+gst_shm_sink_reader_is_dead (GstDirectShowSink * self, int i)
+{
+  struct bebo_shmem_reader *reader = &self->shmem->reader[i];
+  uint64_t timeout = (uint64_t) self->reader_timeout * GST_MSECOND;
+  uint64_t heartbeat =
+      bebo_atomic_load_u64(bebo_shmem_heartbeat_field(self->shmem, i));
+
+  if (!bebo_shmem_process_alive(reader->pid))
+    return TRUE;
+  return timeout != 0 && self->last_publish > heartbeat &&
+      self->last_publish - heartbeat > timeout;
+}
+
+/* Evict readers that died or stopped reading so their pins and unread marks
+ * don't block slots forever. Never waits for the shmem mutex, if a reader is
+ * attaching right now we look again next time. Caller holds the object lock,
+ * returns the evicted readers. */
+static uint32_t
+gst_shm_sink_reap_readers (GstDirectShowSink * self, uint64_t now)
+{
+  uint32_t readers = bebo_shmem_readers(self->shmem);
+  uint32_t dead = 0;
+
+  if (readers == 0 || now - self->last_reap < REAP_INTERVAL)
+    return 0;
+  self->last_reap = now;
+
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    if ((readers & (1u << i)) && gst_shm_sink_reader_is_dead(self, i))
+      dead |= 1u << i;
+  }
+  if (dead == 0 ||
+      bebo_shmem_mutex_lock(&self->shmem_mutex, 0) != BEBO_SHMEM_WAIT_OK)
+    return 0;
+
+  // the table may have changed before we got the mutex
+  readers = bebo_shmem_readers(self->shmem);
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    if (!(dead & readers & (1u << i)) || !gst_shm_sink_reader_is_dead(self, i)) {
+      dead &= ~(1u << i);
+      continue;
+    }
+    // it is letting go of a frame this very moment, so it is alive after all
+    if (!bebo_shmem_reader_evict(self->shmem, i)) {
+      dead &= ~(1u << i);
+      continue;
+    }
+    GST_WARNING_OBJECT(self, "evicted reader %d pid: %u heartbeat: %llu ms ago",
+        i, self->shmem->reader[i].pid,
+        (now - *bebo_shmem_heartbeat_field(self->shmem, i)) / GST_MSECOND);
+    self->stats.evicted++;
+  }
+  bebo_shmem_mutex_unlock(&self->shmem_mutex);
+  return dead;
+}
+
+static void
+gst_shm_sink_emit_evicted (GstDirectShowSink * self, uint32_t evicted)
+{
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    if (evicted & (1u << i))
+      g_signal_emit (self, signals[SIGNAL_CLIENT_DISCONNECTED], 0, i);
+  }
+}
+
 static GstFlowReturn
 gst_shm_sink_render (GstBaseSink * bsink, GstBuffer * buf)
 {
@@ -437,6 +1765,8 @@ gst_shm_sink_render (GstBaseSink * bsink, GstBuffer * buf)
     GST_ERROR_OBJECT(self, "NOT A BUFFER???");
     return GST_FLOW_ERROR;
   }
+  // takes the object lock
+  GstClockTime pipeline_latency = gst_base_sink_get_latency(bsink);
   GST_OBJECT_LOCK (self);
 
   GstClock *clock = GST_ELEMENT_CLOCK (self);
@@ -450,8 +1780,12 @@ gst_shm_sink_render (GstBaseSink * bsink, GstBuffer * buf)
   if (clock != NULL) {
     /* The time according to the current clock */
     GstClockTime base_time = GST_ELEMENT_CAST (bsink)->base_time;
-    running_time = gst_clock_get_time(clock) - base_time;
-    self->latency = running_time - buf->pts;
+    uint64_t now = bebo_shmem_now_ns();
+    GstClockTime clock_time = gst_clock_get_time(clock);
+    running_time = clock_time - base_time;
+    gst_shm_sink_sample_clock(self, now, clock_time, base_time, pipeline_latency);
+    latency = running_time - buf->pts;
+    self->latency = latency;
 
     GST_LOG_OBJECT(self, "Measured plugin latency to %d", self->latency / 1000000);
     gst_object_unref (clock);
@@ -465,6 +1799,7 @@ gst_shm_sink_render (GstBaseSink * bsink, GstBuffer * buf)
   }
 
   if (GST_BUFFER_DTS_OR_PTS(buf) < self->first_render_time) {
+    self->stats.dropped_early++;
     GST_OBJECT_UNLOCK (self);
     GST_DEBUG_OBJECT(self, "dropping early frame");
     return GST_FLOW_OK;
@@ -472,64 +1807,142 @@ gst_shm_sink_render (GstBaseSink * bsink, GstBuffer * buf)
 
   self->last_render_time = GST_BUFFER_DTS_OR_PTS(buf);
 
-  GstMemory *memory = gst_buffer_peek_memory(buf, 0);
-#ifndef _NDEBUG
-  if (memory->allocator != GST_ALLOCATOR(self->allocator)) {
-    GST_LOG_OBJECT(self, "Memory in buffer %p was not allocated by us: "
-      "%" GST_PTR_FORMAT ", will memcpy", buf, memory->allocator);
+  // thumbnail readers don't attach to the full frames, feed them first.
+  // Downscaling every n-th frame keeps the lock for a moment.
+  if (self->thumbnail) {
+    gst_shm_thumbnail_push(self->thumbnail, buf, &self->info,
+        (guint64) self->reader_timeout * GST_MSECOND);
   }
-#endif
-  gst_buffer_ref(buf);
 
-  // TOGO: GST_VIDEO_INFO_FPS_N(self->video_info);
-  DWORD rc = WaitForSingleObject(self->shmem_mutex, 16);
-
-  if (rc == WAIT_FAILED) {
-    GST_WARNING_OBJECT(self, "MUTEX ERROR %#010x", GetLastError());
-  } else if (rc == WAIT_TIMEOUT) {
-    // FIXME: TODO log dropped frames
-    GST_DEBUG_OBJECT(self, "MUTEX TIMED OUT dropping frame");
-    GST_OBJECT_UNLOCK (self);
-    return GST_FLOW_OK;
-  } else if (rc != WAIT_OBJECT_0) {
-    GST_WARNING_OBJECT(self, "WTF MUTEX %#010x", rc);
+  // nobody is attached, don't hold on to frames nobody will read. Observers
+  // don't attach, they let us know with their heartbeat.
+  uint64_t now = bebo_shmem_now_ns();
+  if (bebo_shmem_readers(self->shmem) == 0 && !gst_shm_sink_observed(self, now)) {
+    self->stats.dropped_no_readers++;
+    // whoever attaches next can't decode from the middle of a GOP
+    if (self->encoded)
+      self->need_keyframe = TRUE;
+    else
+      gst_buffer_replace(&self->unpublished, buf);
+    gst_shm_sink_collect_released(self, now);
+    GstStructure *stats = gst_shm_sink_stats_due(self, now);
     GST_OBJECT_UNLOCK (self);
+    gst_shm_sink_post_stats(self, stats);
+    GST_LOG_OBJECT(self, "no readers, skipping frame");
     return GST_FLOW_OK;
   }
 
-  self->shmem->write_ptr++;
+  gboolean request_keyframe = FALSE;
+  if (self->encoded) {
+    request_keyframe = bebo_atomic_cas_u32(&self->shmem->keyframe_request, 1, 0);
+    if (self->need_keyframe &&
+        GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT)) {
+      self->stats.dropped_no_keyframe++;
+      GST_OBJECT_UNLOCK (self);
+      GST_LOG_OBJECT(self, "waiting for a keyframe, dropping delta unit");
+      if (request_keyframe)
+        gst_shm_sink_request_keyframe(self);
+      return GST_FLOW_OK;
+    }
+    self->need_keyframe = FALSE;
+  }
+
+  // the payload copy below does not carry the metas over
+  GstBuffer *meta_buf = buf;
+  GstMemory *memory = gst_buffer_peek_memory(buf, 0);
+  if (self->encoded) {
+    gst_buffer_ref(buf);
+  } else if (self->payload) {
+    buf = gst_shm_sink_get_payload_buffer(self, buf);
+    if (buf == NULL) {
+      self->stats.dropped_no_block++;
+      GST_OBJECT_UNLOCK (self);
+      GST_DEBUG_OBJECT(self, "no free shmem block, dropping frame");
+      return GST_FLOW_OK;
+    }
+  } else {
+#ifndef _NDEBUG
+    if (memory->allocator != GST_ALLOCATOR(self->allocator)) {
+      GST_LOG_OBJECT(self, "Memory in buffer %p was not allocated by us: "
+        "%" GST_PTR_FORMAT ", will memcpy", buf, memory->allocator);
+    }
+#endif
+    gst_buffer_ref(buf);
+  }
+
+  // no shmem mutex here, see bebo_shmem_ring.h
+  now = bebo_shmem_now_ns();
+  bebo_atomic_store_release_u64(&self->shmem->owner_heartbeat, now);
+  uint32_t evicted = gst_shm_sink_reap_readers(self, now);
+  GstStructure *stats = gst_shm_sink_stats_due(self, now);
 
-  uint64_t index = self->shmem->write_ptr % self->shmem->count;
+  uint64_t nr = self->shmem->write_ptr + 1;
+  uint64_t index = nr % self->shmem->count;
   uint64_t frame_offset =  self->shmem->frame_offset +  index * self->shmem->frame_size;
-  struct frame *frame = ((struct frame*) (((unsigned char*)self->shmem) + frame_offset));
+  struct frame *frame = bebo_shmem_frame(self->shmem, index);
 
-  if (frame->_gst_buf_ref != NULL) {
-    if (frame->ref_cnt > 0) {
-      GST_LOG_OBJECT(self,
-          "buffer is still being referenced, dropping incoming frame. nr: %llu dxgi_handle: %llu ref_cnt: %d",
-          frame->nr,
-          frame->dxgi_handle,
-          frame->ref_cnt);
-
-      self->shmem->write_ptr--;
-
-      static uint64_t last_frame_nr = 0;
-      last_frame_nr = frame->nr;
-      if (last_frame_nr > FRAME_UNREF_THRESHOLD) {
-        gst_buffer_unref(frame->_gst_buf_ref);
-        frame->ref_cnt = 0;
-        frame->_gst_buf_ref = NULL;
-      }
+  GstClockTime oldest;
+  guint fill = gst_shm_sink_ring_fill(self, &oldest);
+  if (fill < self->stats.n_occupancy)
+    self->stats.occupancy[fill]++;
 
-      ReleaseMutex(self->shmem_mutex);
-      GST_OBJECT_UNLOCK(self);
-      // we shouldn't notify the other side that we dropped a frame?
-      // ReleaseSemaphore(self->shmem_new_data_semaphore, 1, NULL);
-      // TODO: ADD DROPPED FRAMES STATS
-      gst_buffer_unref (buf);
-      return GST_FLOW_OK;
+  if (!gst_shm_sink_claim_slot(self, frame, GST_BUFFER_PTS(buf))) {
+    gboolean flushing = self->unlock;
+    GST_LOG_OBJECT(self,
+        "readers are behind, dropping incoming frame. nr: %llu dxgi_handle: %llu reader_mask: %#010x",
+        frame->nr,
+        frame->dxgi_handle,
+        frame->reader_mask);
+
+    if (!flushing) {
+      if (gst_shm_sink_can_render(self, GST_BUFFER_PTS(buf)))
+        self->stats.dropped_ring_full++;
+      else
+        self->stats.dropped_buffer_time++;
+      self->qos_dropped++;
+      if (self->encoded) {
+        self->need_keyframe = TRUE;
+        request_keyframe = TRUE;
+      }
     }
+    GST_OBJECT_UNLOCK(self);
+    gst_shm_sink_emit_evicted(self, evicted);
+    gst_shm_sink_post_stats(self, stats);
+    // we shouldn't notify the other side that we dropped a frame?
+    // bebo_shmem_semaphore_signal(&self->shmem_new_data_semaphore[i]);
+    if (!flushing)
+      gst_shm_sink_send_qos(self, buf);
+    if (request_keyframe)
+      gst_shm_sink_request_keyframe(self);
+    gst_buffer_unref (buf);
+    return flushing ? GST_FLOW_FLUSHING : GST_FLOW_OK;
+  }
+
+  gst_shm_sink_collect_latency(self, frame);
+
+  if (self->encoded && !gst_shm_sink_fill_encoded(self, index, frame, buf)) {
+    GST_DEBUG_OBJECT(self, "no room in the arena for %" G_GSIZE_FORMAT
+        " bytes, dropping frame", gst_buffer_get_size(buf));
+    gst_shm_sink_clear_slot(self, frame);
+    bebo_shmem_slot_end_write(frame, 0);
+    self->stats.dropped_ring_full++;
+    self->qos_dropped++;
+    self->need_keyframe = TRUE;
+    GST_OBJECT_UNLOCK(self);
+    gst_shm_sink_emit_evicted(self, evicted);
+    gst_shm_sink_post_stats(self, stats);
+    gst_shm_sink_send_qos(self, buf);
+    gst_shm_sink_request_keyframe(self);
+    gst_buffer_unref (buf);
+    return GST_FLOW_OK;
+  }
 
+  self->stats.rendered++;
+  self->qos_rendered++;
+  if (self->qos_dropped == 0 && self->qos_rendered >= QOS_WINDOW)
+    self->qos_rendered = 0;
+
+  if (frame->_gst_buf_ref != NULL) {
     GST_LOG_OBJECT(self, "UNREF(1) nr: %llu dxgi_handle: %llu pts: %lld frame_offset: %d size: %d buf: %p latency: %d",
         frame->nr,
         frame->dxgi_handle,
@@ -542,27 +1955,47 @@ gst_shm_sink_render (GstBaseSink * bsink, GstBuffer * buf)
         );
 
     gst_buffer_unref(frame->_gst_buf_ref);
-    frame->ref_cnt = 0;
     frame->_gst_buf_ref = NULL;
   }
 
-  GstGLDXGIMemory * gl_dxgi_mem = (GstGLDXGIMemory *)memory;
+  GstGLDXGIMemory * gl_dxgi_mem = NULL;
+  if (self->encoded) {
+    // gst_shm_sink_fill_encoded copied it into the arena already
+  } else if (self->payload) {
+    gst_shm_sink_fill_payload(self, frame, buf);
+  } else {
+    gl_dxgi_mem = (GstGLDXGIMemory *)memory;
+    frame->dxgi_handle = gl_dxgi_mem->dxgi_handle;
+  }
 
+  frame->width = self->shmem->video_info.width;
+  frame->height = self->shmem->video_info.height;
+  frame->format = self->shmem->format;
+  frame->info_generation = self->shmem->info_generation;
   frame->latency = latency;
   frame->dts = buf->dts;
   frame->pts = buf->pts;
   frame->duration = buf->duration;
   frame->discontinuity = GST_BUFFER_IS_DISCONT(buf);
   frame->size = gst_buffer_get_size(buf);
-  frame->dxgi_handle = gl_dxgi_mem->dxgi_handle;
-  frame->nr = self->shmem->write_ptr;
-  frame->_gst_buf_ref = buf;
-  frame->ref_cnt = 1;
-
-  GST_LOG_OBJECT(self, "nr: %llu dxgi_handle: %llu tex_id: %#010x pts: %" GST_TIME_FORMAT " frame_offset: %d size: %d buf: %p latency: %d",
+  frame->flags = GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT) ?
+      0 : BEBO_SHMEM_FRAME_KEYFRAME;
+  gst_shm_sink_serialize_meta(self, frame, meta_buf);
+  frame->nr = nr;
+  // the arena holds a copy, nothing to keep alive
+  frame->_gst_buf_ref = self->encoded ? NULL : buf;
+  frame->publish_ns = bebo_shmem_now_ns();
+  self->last_publish = frame->publish_ns;
+  uint32_t readers = bebo_shmem_readers(self->shmem);
+  bebo_shmem_slot_end_write(frame, readers);
+  bebo_shmem_publish(self->shmem, nr);
+  gst_buffer_replace(&self->unpublished, NULL);
+
+  GST_LOG_OBJECT(self, "nr: %llu dxgi_handle: %llu tex_id: %#010x payload_offset: %llu pts: %" GST_TIME_FORMAT " frame_offset: %d size: %d buf: %p latency: %d",
       frame->nr,
       frame->dxgi_handle,
-      gl_dxgi_mem->mem.tex_id,
+      gl_dxgi_mem ? gl_dxgi_mem->mem.tex_id : 0,
+      frame->payload_offset,
       //frame->dts / 1000000,
       GST_TIME_ARGS(frame->pts),
       frame_offset,
@@ -572,12 +2005,119 @@ gst_shm_sink_render (GstBaseSink * bsink, GstBuffer * buf)
       );
 
   // unref buffers that are not being referenced anymore.
-  clean_shmem_frame_with_max_ref_count(self, 0);
+  gst_shm_sink_collect_released(self, now);
+
+  GST_OBJECT_UNLOCK (self);
+  gst_shm_sink_emit_evicted(self, evicted);
+  gst_shm_sink_post_stats(self, stats);
+  if (self->encoded)
+    gst_buffer_unref(buf);
+  if (request_keyframe)
+    gst_shm_sink_request_keyframe(self);
+
+  // only readers that sleep until this frame, see bebo_shmem_client_wait()
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    if ((readers & (1u << i)) &&
+        bebo_shmem_reader_take_wakeup(self->shmem, i, nr)) {
+      bebo_shmem_semaphore_signal(&self->shmem_new_data_semaphore[i]);
+    }
+  }
+  return GST_FLOW_OK;
+}
+
+static gboolean
+gst_shm_sink_audio_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+  GstDirectShowSink *self = GST_SHM_SINK (parent);
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_CAPS:{
+      GstCaps *caps;
+      GstAudioInfo info;
+
+      gst_event_parse_caps (event, &caps);
+      if (!gst_audio_info_from_caps (&info, caps)) {
+        GST_ERROR_OBJECT (self, "could not parse audio caps %" GST_PTR_FORMAT, caps);
+        gst_event_unref (event);
+        return FALSE;
+      }
+      GST_OBJECT_LOCK (self);
+      self->audio_info = info;
+      gst_shm_sink_set_shmem_audio_info (self);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    }
+    case GST_EVENT_FLUSH_STOP:
+      GST_OBJECT_LOCK (self);
+      self->audio_discont = TRUE;
+      GST_OBJECT_UNLOCK (self);
+      break;
+    default:
+      break;
+  }
+
+  // nothing downstream of us, the video pad handles EOS and the like
+  gst_event_unref (event);
+  return TRUE;
+}
 
-  ReleaseMutex(self->shmem_mutex);
+/* Cut buf into chunks of whole audio frames and publish them. Readers pick
+ * them up with the next video frame, so nobody is woken up here. */
+static GstFlowReturn
+gst_shm_sink_audio_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+  GstDirectShowSink *self = GST_SHM_SINK (parent);
+  GstMapInfo map;
+
+  GST_OBJECT_LOCK (self);
+  if (self->shmem == NULL || self->shmem->audio_count == 0 ||
+      self->audio_info.finfo == NULL || bebo_shmem_readers(self->shmem) == 0) {
+    GST_OBJECT_UNLOCK (self);
+    gst_buffer_unref (buf);
+    return GST_FLOW_OK;
+  }
+
+  if (!gst_buffer_map (buf, &map, GST_MAP_READ)) {
+    GST_OBJECT_UNLOCK (self);
+    gst_buffer_unref (buf);
+    return GST_FLOW_ERROR;
+  }
+
+  gint bpf = GST_AUDIO_INFO_BPF (&self->audio_info);
+  gint rate = GST_AUDIO_INFO_RATE (&self->audio_info);
+  gsize max = AUDIO_CHUNK_SIZE - AUDIO_CHUNK_SIZE % bpf;
+  GstClockTime pts = GST_BUFFER_PTS (buf);
+  gboolean discont = self->audio_discont || GST_BUFFER_IS_DISCONT (buf);
+
+  for (gsize done = 0; done < map.size;) {
+    gsize size = MIN (max, map.size - done);
+    uint64_t nr = ++self->audio_nr;
+    struct bebo_shmem_audio_chunk *chunk =
+        bebo_shmem_audio_begin_write (self->shmem, nr);
+
+    memcpy (bebo_shmem_audio_data (self->shmem, nr % self->shmem->audio_count),
+        map.data + done, size);
+    chunk->nr = nr;
+    chunk->pts = GST_CLOCK_TIME_IS_VALID (pts) ?
+        pts + gst_util_uint64_scale_int (done / bpf, GST_SECOND, rate) :
+        GST_CLOCK_TIME_NONE;
+    chunk->duration = gst_util_uint64_scale_int (size / bpf, GST_SECOND, rate);
+    chunk->size = (uint32_t) size;
+    chunk->flags = discont ? BEBO_SHMEM_AUDIO_DISCONT : 0;
+    bebo_shmem_audio_end_write (self->shmem, chunk);
+
+    discont = FALSE;
+    done += size;
+  }
+  self->audio_discont = FALSE;
+  uint64_t last_nr = self->audio_nr;
   GST_OBJECT_UNLOCK (self);
 
-  ReleaseSemaphore(self->shmem_new_data_semaphore, 1, NULL);
+  GST_LOG_OBJECT (self, "audio pts: %" GST_TIME_FORMAT " size: %" G_GSIZE_FORMAT
+      " chunks up to %" G_GUINT64_FORMAT, GST_TIME_ARGS (pts), map.size, last_nr);
+
+  gst_buffer_unmap (buf, &map);
+  gst_buffer_unref (buf);
   return GST_FLOW_OK;
 }
 
@@ -630,6 +2170,81 @@ gst_dshow_filter_sink_ensure_gl_context(GstDirectShowSink * self) {
       &self->context, &self->other_context, &self->display);
 }
 
+/* Payload mode: offer a video pool whose memories are shmem blocks, so
+ * upstream renders straight into shared memory. After a resolution change
+ * the slots, and readers pinning them, still hold blocks of the last pool,
+ * so the new one preallocates nothing and grows as blocks come back. */
+static gboolean
+gst_shm_sink_propose_payload_allocation (GstDirectShowSink * self,
+    GstQuery * query, GstCaps * caps, guint vi_size)
+{
+  if (self->shmem_allocator == NULL) {
+    GST_WARNING_OBJECT(self, "shared memory not initialized, no pool to offer");
+    return FALSE;
+  }
+
+  if (vi_size > self->shmem->payload_size) {
+    GST_WARNING_OBJECT(self, "frames of %d bytes don't fit into %llu byte blocks",
+        vi_size, self->shmem->payload_size);
+    return FALSE;
+  }
+
+  GstAllocationParams params;
+  gst_allocation_params_init(&params);
+  gst_query_add_allocation_param(query, GST_ALLOCATOR(self->shmem_allocator), &params);
+  gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
+
+  if (self->pool) {
+    GstStructure *cur_pool_config = gst_buffer_pool_get_config(self->pool);
+    guint size;
+    gst_buffer_pool_config_get_params(cur_pool_config, NULL, &size, NULL, NULL);
+    gst_structure_free(cur_pool_config);
+    if (size == vi_size) {
+      GST_DEBUG_OBJECT(self, "Reusing buffer pool.");
+      gst_query_add_allocation_pool(query, self->pool, vi_size,
+          0, PAYLOAD_BLOCK_COUNT(self));
+      return TRUE;
+    }
+    gst_object_unref(self->pool);
+    self->pool = NULL;
+
+    // hand back the old frames readers are done with, the newest one stays
+    // for snapshots until the next frame replaces it
+    GST_OBJECT_LOCK (self);
+    if (bebo_shmem_mutex_lock(&self->shmem_mutex, BEBO_SHMEM_INFINITE) == BEBO_SHMEM_WAIT_OK) {
+      clean_shmem_frames(self, FALSE);
+      bebo_shmem_mutex_unlock(&self->shmem_mutex);
+    }
+    GST_OBJECT_UNLOCK (self);
+  }
+
+  self->pool = gst_video_buffer_pool_new();
+  GstStructure *config = gst_buffer_pool_get_config(self->pool);
+  gst_buffer_pool_config_set_params(config, caps, vi_size,
+      0, PAYLOAD_BLOCK_COUNT(self));
+  gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+  gst_buffer_pool_config_set_allocator(config,
+      GST_ALLOCATOR(self->shmem_allocator), &params);
+
+  if (!gst_buffer_pool_set_config(self->pool, config)) {
+    GST_WARNING_OBJECT(self, "failed setting config");
+    gst_object_unref(self->pool);
+    self->pool = NULL;
+    return FALSE;
+  }
+
+  gst_query_add_allocation_pool(query, self->pool, vi_size,
+      0, PAYLOAD_BLOCK_COUNT(self));
+  GST_DEBUG_OBJECT(self, "Added %" GST_PTR_FORMAT " shmem pool to query", self->pool);
+  return TRUE;
+}
+
+static gboolean
+gst_shm_sink_is_encoded_caps (GstCaps * caps)
+{
+  return gst_structure_has_name(gst_caps_get_structure(caps, 0), "video/x-h264");
+}
+
 static gboolean
 gst_shm_sink_propose_allocation (GstBaseSink * sink, GstQuery * query)
 {
@@ -642,16 +2257,26 @@ gst_shm_sink_propose_allocation (GstBaseSink * sink, GstQuery * query)
   GstCapsFeatures *features;
   features = gst_caps_get_features (caps, 0);
 
-  if (!gst_caps_features_contains (features, GST_CAPS_FEATURE_MEMORY_GL_MEMORY)) {
+  if (!self->payload &&
+      !gst_caps_features_contains (features, GST_CAPS_FEATURE_MEMORY_GL_MEMORY)) {
       GST_ERROR_OBJECT(self, "shouldn't GL MEMORY be negotiated?");
   }
 
+  // access units are copied into the arena, no pool to offer
+  if (gst_shm_sink_is_encoded_caps (caps)) {
+    return TRUE;
+  }
+
   GstVideoInfo info;
   if (!gst_video_info_from_caps (&info, caps))
     goto invalid_caps;
 
   guint vi_size = (guint) info.size;
 
+  if (self->payload) {
+    return gst_shm_sink_propose_payload_allocation(self, query, caps, vi_size);
+  }
+
   if (!gst_dshow_filter_sink_ensure_gl_context(self)) {
     return FALSE;
   }
@@ -664,7 +2289,7 @@ gst_shm_sink_propose_allocation (GstBaseSink * sink, GstQuery * query)
     GST_DEBUG_OBJECT(self, "Old pool size: %d New allocation size: info.size: %d", size, vi_size);
     if (size == vi_size) {
       GST_DEBUG_OBJECT(self, "Reusing buffer pool.");
-      gst_query_add_allocation_pool(query, self->pool, vi_size, BUFFER_POOL_SIZE, BUFFER_POOL_SIZE);
+      gst_query_add_allocation_pool(query, self->pool, vi_size, self->slot_count, self->slot_count);
       return true;
     } else {
       GST_DEBUG_OBJECT(self, "The pool buffer size doesn't match (old: %d new: %d). Creating a new one.",
@@ -686,7 +2311,7 @@ gst_shm_sink_propose_allocation (GstBaseSink * sink, GstQuery * query)
   self->pool = gst_gl_buffer_pool_new(self->context);
   GstStructure *config;
   config = gst_buffer_pool_get_config (self->pool);
-  gst_buffer_pool_config_set_params (config, caps, vi_size, BUFFER_POOL_SIZE, BUFFER_POOL_SIZE);
+  gst_buffer_pool_config_set_params (config, caps, vi_size, self->slot_count, self->slot_count);
   gst_buffer_pool_config_add_option (config, GST_BUFFER_POOL_OPTION_GL_SYNC_META);
   gst_buffer_pool_config_set_allocator (config, GST_ALLOCATOR (self->allocator), &params);
 
@@ -696,7 +2321,7 @@ gst_shm_sink_propose_allocation (GstBaseSink * sink, GstQuery * query)
   }
 
   /* we need at least 2 buffer because we hold on to the last one */
-  gst_query_add_allocation_pool (query, self->pool, vi_size, BUFFER_POOL_SIZE, BUFFER_POOL_SIZE);
+  gst_query_add_allocation_pool (query, self->pool, vi_size, self->slot_count, self->slot_count);
   GST_DEBUG_OBJECT(self, "Added %" GST_PTR_FORMAT " pool to query", self->pool);
 
   return true;
@@ -713,6 +2338,38 @@ config_failed:
   }
 }
 
+/* GstVideoInfo can't parse encoded caps, keep the size and rate for the
+ * header. Decides on encoded mode before the region is made. */
+static gboolean
+gst_shm_sink_encoded_info_from_caps (GstDirectShowSink * self, GstCaps * caps,
+    GstVideoInfo * info)
+{
+  GstStructure *s = gst_caps_get_structure(caps, 0);
+  gint width, height, fps_n = 0, fps_d = 1;
+
+  if (!self->payload) {
+    GST_ERROR_OBJECT(self, "encoded video needs payload=true");
+    return FALSE;
+  }
+  if (!gst_structure_get_int(s, "width", &width) ||
+      !gst_structure_get_int(s, "height", &height)) {
+    GST_ERROR_OBJECT(self, "no size in %" GST_PTR_FORMAT, caps);
+    return FALSE;
+  }
+  gst_structure_get_fraction(s, "framerate", &fps_n, &fps_d);
+
+  gst_video_info_init(info);
+  gst_video_info_set_format(info, GST_VIDEO_FORMAT_ENCODED, width, height);
+  info->fps_n = fps_n;
+  info->fps_d = fps_d > 0 ? fps_d : 1;
+
+  GST_OBJECT_LOCK (self);
+  if (!self->shmem_init)
+    self->encoded = TRUE;
+  GST_OBJECT_UNLOCK (self);
+  return TRUE;
+}
+
 static gboolean
 gst_shm_sink_set_caps (GstBaseSink * sink, GstCaps * caps)
 {
@@ -720,9 +2377,38 @@ gst_shm_sink_set_caps (GstBaseSink * sink, GstCaps * caps)
   GST_DEBUG_OBJECT(self, "gst_shm_sink_set_caps with %" GST_PTR_FORMAT, caps);
 
   GstVideoInfo info;
-  if (!gst_video_info_from_caps(&info, caps)) {
+  if (gst_shm_sink_is_encoded_caps(caps)) {
+    if (!gst_shm_sink_encoded_info_from_caps(self, caps, &info))
+      return FALSE;
+  } else if (!gst_video_info_from_caps(&info, caps)) {
     GST_ERROR("Could not get info from caps");
     return FALSE;
   }
-  return initialize_shared_memory(self, &info);
+  if (!initialize_shared_memory(self, &info)) {
+    return FALSE;
+  }
+  GST_OBJECT_LOCK (self);
+  self->info = info;
+  GST_OBJECT_UNLOCK (self);
+  return TRUE;
+}
+
+static GstCaps *
+gst_shm_sink_get_caps (GstBaseSink * sink, GstCaps * filter)
+{
+  GstDirectShowSink *self = GST_SHM_SINK (sink);
+  GstCaps *caps;
+
+  GST_OBJECT_LOCK (self);
+  caps = gst_caps_from_string (self->payload ?
+      GST_PAYLOAD_SINK_CAPS "; " GST_ENCODED_SINK_CAPS : GST_GL_SINK_CAPS);
+  GST_OBJECT_UNLOCK (self);
+
+  if (filter) {
+    GstCaps *intersection =
+        gst_caps_intersect_full (filter, caps, GST_CAPS_INTERSECT_FIRST);
+    gst_caps_unref (caps);
+    caps = intersection;
+  }
+  return caps;
 }
@@ -30,7 +30,13 @@
 
 #include <gst/gst.h>
 #include <gst/base/gstbasesink.h>
+#include <gst/video/video.h>
+#include <gst/audio/audio.h>
 #include "gstdxgimemory.h"
+#include "gstshmemallocator.h"
+#include "gstshmthumbnail.h"
+#include "bebo_shmem.h"
+#include "bebo_shmem_channel.h"
 
 //#include "shmpipe.h"
 
@@ -48,6 +54,40 @@ G_BEGIN_DECLS
 typedef struct _GstDirectShowSink GstDirectShowSink;
 typedef struct _GstDirectShowSinkClass GstDirectShowSinkClass;
 
+#define GST_SHM_SINK_LATENCY_SAMPLES 512
+/* clock observations shmem.clock is fitted through */
+#define GST_SHM_SINK_CLOCK_SAMPLES 32
+
+/* behind the stats property, protected by the object lock */
+typedef struct {
+  guint64 rendered;
+  guint64 dropped_early;        /* before the first render time */
+  guint64 dropped_no_readers;
+  guint64 dropped_no_block;     /* payload mode, every shmem block in use */
+  guint64 dropped_ring_full;
+  guint64 dropped_buffer_time;
+  guint64 dropped_no_keyframe;  /* encoded, delta units after a drop */
+  guint64 overwritten;          /* unread frames taken back by drop-oldest */
+  guint64 evicted;              /* readers */
+
+  /* occupancy[n]: renders that found n unread slots, count + 1 entries */
+  guint64 *occupancy;
+  guint n_occupancy;
+
+  /* publish to read in ns, the last GST_SHM_SINK_LATENCY_SAMPLES reads */
+  guint64 latency[GST_SHM_SINK_LATENCY_SAMPLES];
+  guint n_latency;
+  guint latency_pos;
+} GstShmSinkStats;
+
+/* what to do when the ring is full or its unread frames are older than
+ * buffer-time */
+typedef enum {
+  GST_SHM_SINK_POLICY_DROP_NEWEST,
+  GST_SHM_SINK_POLICY_DROP_OLDEST,
+  GST_SHM_SINK_POLICY_BLOCK,
+} GstShmSinkPolicy;
+
 struct _GstDirectShowSink
 {
   GstBaseSink element;
@@ -55,10 +95,14 @@ struct _GstDirectShowSink
   GstGLContext *other_context;
   GstGLDisplay *display;
 
-  HANDLE shmem_handle;
+  struct bebo_shmem_region shmem_region;
   struct shmem *shmem;
-  HANDLE shmem_mutex;
-  HANDLE shmem_new_data_semaphore;
+  struct bebo_shmem_mutex shmem_mutex;
+  /* one per reader slot, see bebo_shmem_data_sem_name() */
+  struct bebo_shmem_semaphore shmem_new_data_semaphore[BEBO_SHMEM_MAX_READERS];
+  /* names the objects above, fixed once the shmem exists */
+  gchar *channel;
+  struct bebo_shmem_channel_registration channel_registration;
 
   gboolean wait_for_connection;
   gboolean stop;
@@ -74,13 +118,79 @@ struct _GstDirectShowSink
 
 
   GstGLDXGIMemoryAllocator *allocator;
+
+  /* payload mode: pixels are written into the shmem blocks */
+  gboolean payload;
+  /* payload mode with video/x-h264 caps: access units are copied into the
+   * shmem arena, arena_head is where the next one goes */
+  gboolean encoded;
+  guint64 arena_head;
+  gboolean need_keyframe; /* we dropped, hold delta units back */
+  GstVideoInfo info;
+  GstShmemAllocator *shmem_allocator;
   /* GstAllocationParams params; */
   gint64 latency;
+
+  /* ms without a heartbeat before a reader is evicted, 0 to only evict
+   * readers whose process is gone */
+  guint reader_timeout;
+  uint64_t last_reap; /* bebo_shmem_now_ns() */
+  uint64_t last_publish; /* bebo_shmem_now_ns(), 0 before the first frame */
+
+  /* what readers let go of comes through the release ring, see
+   * gst_shm_sink_collect_released() */
+  uint32_t release_readers; /* reader table at the last full scan */
+  gboolean release_all; /* all of them push to the ring */
+  uint64_t last_full_clean; /* bebo_shmem_now_ns() */
+  uint64_t release_late; /* ring tail that was not written at the last full scan */
+
+  /* raw video: the newest frame that was not published for lack of
+   * readers, for the "snapshot" action */
+  GstBuffer *unpublished;
+
+  GstShmSinkPolicy policy;
+  /* since the last QoS event */
+  guint64 qos_rendered;
+  guint64 qos_dropped;
+
+  GstShmSinkStats stats;
+  guint stats_interval; /* ms between stats messages, 0 for none */
+  uint64_t last_stats; /* bebo_shmem_now_ns() */
+
+  /* ring geometry, fixed once the region is created */
+  guint slot_count;
+  guint64 slot_size; /* payload block size, 0 to fit the first caps */
+  gboolean huge_pages;
+
+  /* (bebo_shmem_now_ns(), clock time) pairs behind shmem.clock, protected
+   * by the object lock */
+  GstClockTime clock_samples[2 * GST_SHM_SINK_CLOCK_SAMPLES];
+  guint n_clock_samples;
+  guint clock_sample_pos;
+  uint64_t last_clock_sample; /* bebo_shmem_now_ns() */
+
+  /* PCM ring next to the frames, fed through the "audio" pad. Protected
+   * by the object lock. */
+  GstPad *audio_pad;
+  guint audio_chunks; /* 0 for no audio ring */
+  GstAudioInfo audio_info; /* finfo is NULL until we have caps */
+  uint64_t audio_nr; /* of the last chunk written */
+  gboolean audio_discont;
+
+  /* payload mode: downscaled frames for monitoring readers, NULL while
+   * thumbnail-width is 0. Settings fixed once the shmem exists. */
+  GstShmThumbnail *thumbnail;
+  guint thumbnail_width;
+  guint thumbnail_height;
+  guint thumbnail_interval;
 };
 
 struct _GstDirectShowSinkClass
 {
   GstBaseSinkClass parent_class;
+
+  /* actions */
+  GstSample * (*snapshot) (GstDirectShowSink * sink);
 };
 
 GType gst_shm_sink_get_type(void);
@@ -0,0 +1,249 @@
+/* GStreamer
+ * Copyright (C) 2019 Pigs in Flight, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ * vim: ts=2:sw=2
+ */
+
+#include <string.h>
+#include "gstshmemallocator.h"
+
+#ifdef NDEBUG
+#undef GST_LOG_OBJECT
+#define GST_LOG_OBJECT(...)
+#endif
+
+#define GST_SHMEM_ALLOCATOR_NAME "BeboShmemMemory"
+
+GST_DEBUG_CATEGORY_STATIC (GST_CAT_SHMEM_ALLOCATOR);
+#define GST_CAT_DEFAULT GST_CAT_SHMEM_ALLOCATOR
+
+G_DEFINE_TYPE (GstShmemAllocator, gst_shmem_allocator, GST_TYPE_ALLOCATOR);
+
+#define parent_class gst_shmem_allocator_parent_class
+
+static GstShmemMemory *
+shmem_memory_new (GstShmemAllocator * self, GstMemory * parent, guint block,
+    GstMemoryFlags flags, gsize align, gsize offset, gsize size)
+{
+  GstShmemMemory *mem = g_slice_new0 (GstShmemMemory);
+
+  mem->block = block;
+  mem->region_offset = self->payload_offset + block * self->payload_size;
+  gst_memory_init (GST_MEMORY_CAST (mem), flags, GST_ALLOCATOR_CAST (self),
+      parent, (gsize) self->payload_size, align, offset, size);
+  return mem;
+}
+
+static GstMemory *
+gst_shmem_allocator_alloc (GstAllocator * allocator, gsize size,
+    GstAllocationParams * params)
+{
+  GstShmemAllocator *self = GST_SHMEM_ALLOCATOR (allocator);
+  gsize maxsize = size + params->prefix + params->padding;
+  guint block;
+
+  if (maxsize > self->payload_size) {
+    GST_WARNING_OBJECT (self, "requested %" G_GSIZE_FORMAT " bytes, blocks "
+        "only hold %" G_GUINT64_FORMAT, maxsize, self->payload_size);
+    return NULL;
+  }
+
+  GST_OBJECT_LOCK (self);
+  for (block = 0; block < self->count; block++) {
+    if (!(self->used & (G_GUINT64_CONSTANT (1) << block))) {
+      break;
+    }
+  }
+  if (block == self->count) {
+    GST_OBJECT_UNLOCK (self);
+    GST_LOG_OBJECT (self, "all %u blocks are in use", self->count);
+    return NULL;
+  }
+
+  /* a misaligned block would break whoever asked, let them fall back */
+  if ((((guintptr) self->base + self->payload_offset +
+          block * self->payload_size) & params->align) != 0) {
+    GST_OBJECT_UNLOCK (self);
+    GST_WARNING_OBJECT (self, "block %u does not satisfy alignment %"
+        G_GSIZE_FORMAT, block, params->align);
+    return NULL;
+  }
+  self->used |= G_GUINT64_CONSTANT (1) << block;
+  GST_OBJECT_UNLOCK (self);
+
+  GST_LOG_OBJECT (self, "alloc block %u size %" G_GSIZE_FORMAT, block, size);
+  return GST_MEMORY_CAST (shmem_memory_new (self, NULL, block, params->flags,
+          params->align, params->prefix, size));
+}
+
+static void
+gst_shmem_allocator_free (GstAllocator * allocator, GstMemory * memory)
+{
+  GstShmemAllocator *self = GST_SHMEM_ALLOCATOR (allocator);
+  GstShmemMemory *mem = (GstShmemMemory *) memory;
+
+  /* shared sub memories don't own the block */
+  if (memory->parent == NULL) {
+    GST_LOG_OBJECT (self, "free block %u", mem->block);
+    GST_OBJECT_LOCK (self);
+    self->used &= ~(G_GUINT64_CONSTANT (1) << mem->block);
+    GST_OBJECT_UNLOCK (self);
+  }
+
+  g_slice_free (GstShmemMemory, mem);
+}
+
+static gpointer
+gst_shmem_mem_map (GstMemory * memory, gsize maxsize, GstMapFlags flags)
+{
+  GstShmemAllocator *self = GST_SHMEM_ALLOCATOR (memory->allocator);
+  GstShmemMemory *mem = (GstShmemMemory *) memory;
+
+  return self->base + mem->region_offset;
+}
+
+static void
+gst_shmem_mem_unmap (GstMemory * memory)
+{
+}
+
+static GstMemory *
+gst_shmem_mem_share (GstMemory * memory, gssize offset, gssize size)
+{
+  GstShmemAllocator *self = GST_SHMEM_ALLOCATOR (memory->allocator);
+  GstShmemMemory *mem = (GstShmemMemory *) memory;
+  GstMemory *parent;
+
+  if ((parent = memory->parent) == NULL)
+    parent = memory;
+
+  if (size == -1)
+    size = memory->size - offset;
+
+  return GST_MEMORY_CAST (shmem_memory_new (self, parent, mem->block,
+          GST_MINI_OBJECT_FLAGS (parent) | GST_MINI_OBJECT_FLAG_LOCK_READONLY,
+          memory->align, memory->offset + offset, size));
+}
+
+static GstMemory *
+gst_shmem_mem_copy (GstMemory * memory, gssize offset, gssize size)
+{
+  GstMemory *copy;
+  GstMapInfo src, dest;
+
+  if (size == -1)
+    size = memory->size > offset ? memory->size - offset : 0;
+
+  /* copies go to system memory, the blocks are reserved for the pool */
+  copy = gst_allocator_alloc (NULL, size, NULL);
+  if (!gst_memory_map (memory, &src, GST_MAP_READ)) {
+    gst_memory_unref (copy);
+    return NULL;
+  }
+  gst_memory_map (copy, &dest, GST_MAP_WRITE);
+  memcpy (dest.data, src.data + offset, size);
+  gst_memory_unmap (copy, &dest);
+  gst_memory_unmap (memory, &src);
+  return copy;
+}
+
+static gboolean
+gst_shmem_mem_is_span (GstMemory * mem1, GstMemory * mem2, gsize * offset)
+{
+  if (offset) {
+    GstMemory *parent;
+
+    if ((parent = mem1->parent) == NULL)
+      parent = mem1;
+    *offset = mem1->offset - parent->offset;
+  }
+
+  return mem1->offset + mem1->size == mem2->offset;
+}
+
+static void
+gst_shmem_allocator_finalize (GObject * object)
+{
+  GstShmemAllocator *self = GST_SHMEM_ALLOCATOR (object);
+
+  /* every memory holds a reference, none of them is left */
+  bebo_shmem_region_close (&self->region);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+gst_shmem_allocator_class_init (GstShmemAllocatorClass * klass)
+{
+  GObjectClass *gobject_class = (GObjectClass *) klass;
+  GstAllocatorClass *allocator_class = (GstAllocatorClass *) klass;
+
+  gobject_class->finalize = gst_shmem_allocator_finalize;
+  allocator_class->alloc = gst_shmem_allocator_alloc;
+  allocator_class->free = gst_shmem_allocator_free;
+
+  GST_DEBUG_CATEGORY_INIT (GST_CAT_SHMEM_ALLOCATOR, "shmemallocator", 0,
+      "Shmem Slot Allocator");
+}
+
+static void
+gst_shmem_allocator_init (GstShmemAllocator * self)
+{
+  GstAllocator *allocator = GST_ALLOCATOR_CAST (self);
+
+  allocator->mem_type = GST_SHMEM_ALLOCATOR_NAME;
+  allocator->mem_map = gst_shmem_mem_map;
+  allocator->mem_unmap = gst_shmem_mem_unmap;
+  allocator->mem_share = gst_shmem_mem_share;
+  allocator->mem_copy = gst_shmem_mem_copy;
+  allocator->mem_is_span = gst_shmem_mem_is_span;
+}
+
+GstShmemAllocator *
+gst_shmem_allocator_new (gpointer base, guint64 payload_offset,
+    guint64 payload_size, guint count)
+{
+  GstShmemAllocator *self;
+
+  g_return_val_if_fail (count <= 64, NULL);
+
+  self = g_object_new (GST_TYPE_SHMEM_ALLOCATOR, NULL);
+  gst_object_ref_sink (self);
+
+  self->base = base;
+  self->payload_offset = payload_offset;
+  self->payload_size = payload_size;
+  self->count = count;
+  self->used = 0;
+
+  GST_DEBUG_OBJECT (self, "%u blocks of %" G_GUINT64_FORMAT " bytes at %"
+      G_GUINT64_FORMAT, count, payload_size, payload_offset);
+  return self;
+}
+
+void
+gst_shmem_allocator_take_region (GstShmemAllocator * self,
+    struct bebo_shmem_region *region)
+{
+  g_return_if_fail (self->region.data == NULL);
+
+  GST_DEBUG_OBJECT (self, "keeping the region mapped, %" G_GUINT64_FORMAT
+      " blocks in use", self->used);
+  self->region = *region;
+  memset (region, 0, sizeof (*region));
+}
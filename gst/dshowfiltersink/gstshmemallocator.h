@@ -0,0 +1,76 @@
+/* GStreamer
+ * Copyright (C) 2019 Pigs in Flight, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ * vim: ts=2:sw=2
+ */
+#pragma once
+
+#include <gst/gst.h>
+#include "bebo_shmem_platform.h"
+
+G_BEGIN_DECLS
+#define GST_TYPE_SHMEM_ALLOCATOR \
+  (gst_shmem_allocator_get_type())
+#define GST_SHMEM_ALLOCATOR(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_SHMEM_ALLOCATOR,GstShmemAllocator))
+#define GST_IS_SHMEM_ALLOCATOR(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_SHMEM_ALLOCATOR))
+
+/*
+ * Hands out the payload blocks of the shmem region as GstMemory, so upstream
+ * renders straight into shared memory. Each block is payload_size bytes,
+ * blocks are not shared between memories and alloc fails once all of them
+ * are in use.
+ */
+typedef struct _GstShmemMemory
+{
+  GstMemory mem;
+  guint block;
+  /* from the start of the shmem region */
+  guint64 region_offset;
+} GstShmemMemory;
+
+typedef struct _GstShmemAllocator
+{
+  GstAllocator parent;
+
+  guint8 *base;
+  guint64 payload_offset;
+  guint64 payload_size;
+  guint count;
+  guint64 used; /* bitmask of blocks in use, protected by the object lock */
+  /* set by gst_shmem_allocator_take_region(), closed with the allocator */
+  struct bebo_shmem_region region;
+} GstShmemAllocator;
+
+typedef struct _GstShmemAllocatorClass
+{
+  GstAllocatorClass parent_class;
+} GstShmemAllocatorClass;
+
+GType gst_shmem_allocator_get_type(void);
+/* count <= 64 blocks of payload_size bytes at base + payload_offset */
+GstShmemAllocator * gst_shmem_allocator_new(gpointer base,
+    guint64 payload_offset, guint64 payload_size, guint count);
+/* Keep the mapping of base alive until the last memory is gone, upstream
+ * may still hold buffers when the sink lets go of the region. Takes over
+ * region and leaves it empty. */
+void gst_shmem_allocator_take_region(GstShmemAllocator * self,
+    struct bebo_shmem_region * region);
+
+G_END_DECLS
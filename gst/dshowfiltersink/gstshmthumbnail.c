@@ -0,0 +1,385 @@
+/* GStreamer
+ * Copyright (C) 2019 Pigs in Flight, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ * vim: ts=2:sw=2
+ */
+
+#include <string.h>
+#include "gstshmthumbnail.h"
+#include "bebo_shmem_ring.h"
+
+#ifdef NDEBUG
+#undef GST_LOG
+#define GST_LOG(...)
+#endif
+
+GST_DEBUG_CATEGORY_STATIC (GST_CAT_SHM_THUMBNAIL);
+#define GST_CAT_DEFAULT GST_CAT_SHM_THUMBNAIL
+
+// readers only ever want the newest one
+#define THUMBNAIL_SLOT_COUNT 4
+// like the sink, look for dead readers this often (ns)
+#define REAP_INTERVAL (100 * GST_MSECOND)
+
+gchar *
+gst_shm_thumbnail_channel (const gchar * channel)
+{
+  if (channel == NULL || channel[0] == '\0')
+    return g_strdup ("thumbnail");
+  return g_strdup_printf ("%s-thumbnail", channel);
+}
+
+/* Same size, format of info */
+static void
+thumbnail_set_format (GstShmThumbnail * self, GstVideoInfo * info)
+{
+  GstVideoInfo out;
+
+  gst_video_info_set_format (&out, GST_VIDEO_INFO_FORMAT (info),
+      GST_VIDEO_INFO_WIDTH (&self->info), GST_VIDEO_INFO_HEIGHT (&self->info));
+  out.fps_n = GST_VIDEO_INFO_FPS_N (info);
+  out.fps_d = GST_VIDEO_INFO_FPS_D (info) * self->interval;
+  self->info = out;
+}
+
+GstShmThumbnail *
+gst_shm_thumbnail_new (const gchar * channel, GstVideoInfo * info,
+    guint width, guint height, guint interval)
+{
+  static gsize debug_init = 0;
+  GstShmThumbnail *self;
+  GstVideoInfo largest;
+  char name[BEBO_SHMEM_MAX_NAME];
+
+  if (g_once_init_enter (&debug_init)) {
+    GST_DEBUG_CATEGORY_INIT (GST_CAT_SHM_THUMBNAIL, "shmthumbnail", 0,
+        "shmem thumbnail ring");
+    g_once_init_leave (&debug_init, 1);
+  }
+
+  if (GST_VIDEO_FORMAT_INFO_BITS (info->finfo) != 8) {
+    GST_WARNING ("no thumbnails of %s frames",
+        gst_video_format_to_string (GST_VIDEO_INFO_FORMAT (info)));
+    return NULL;
+  }
+
+  // box filtering only ever shrinks
+  width = MIN (width, GST_VIDEO_INFO_WIDTH (info));
+  if (height == 0)
+    height = (guint) gst_util_uint64_scale_round (width,
+        GST_VIDEO_INFO_HEIGHT (info), GST_VIDEO_INFO_WIDTH (info));
+  height = CLAMP (height, 1, GST_VIDEO_INFO_HEIGHT (info));
+
+  self = g_new0 (GstShmThumbnail, 1);
+  self->channel = gst_shm_thumbnail_channel (channel);
+  if (!bebo_shmem_channel_name_valid (self->channel)) {
+    GST_ERROR ("channel name %s is too long", self->channel);
+    gst_shm_thumbnail_free (self);
+    return NULL;
+  }
+  self->interval = MAX (interval, 1);
+  self->skipped = self->interval;
+  self->kernels = gst_shm_thumbnail_kernels_get ();
+  GST_DEBUG ("box filtering with the %s kernels", self->kernels->name);
+  gst_video_info_set_format (&self->info, GST_VIDEO_INFO_FORMAT (info),
+      width, height);
+  thumbnail_set_format (self, info);
+  // later caps may switch to a format with more bytes per pixel
+  gst_video_info_set_format (&largest, GST_VIDEO_FORMAT_RGBA, width, height);
+  self->block_size = BEBO_SHMEM_ALIGN (GST_VIDEO_INFO_SIZE (&largest));
+
+  if (bebo_shmem_channel_register (&self->registration, self->channel) ==
+      BEBO_SHMEM_CHANNEL_IN_USE) {
+    GST_ERROR ("another producer runs channel %s", self->channel);
+    gst_shm_thumbnail_free (self);
+    return NULL;
+  }
+
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    bebo_shmem_data_sem_name (name, self->channel, i);
+    if (!bebo_shmem_semaphore_create (&self->new_data[i], name)) {
+      GST_ERROR ("could not create thumbnail semaphore %s %d", name,
+          bebo_shmem_last_error ());
+      gst_shm_thumbnail_free (self);
+      return NULL;
+    }
+  }
+
+  // like the sink's, the release ring stays unused, readers that want
+  // every thumbnail are not what this is for
+  struct bebo_shmem_layout layout;
+  bebo_shmem_layout_headers (&layout);
+  guint64 frame_offset = layout.frame_offset;
+  guint64 frame_size = layout.frame_size;
+  guint64 payload_offset = frame_offset + frame_size * THUMBNAIL_SLOT_COUNT;
+  guint64 size = payload_offset + self->block_size * THUMBNAIL_SLOT_COUNT;
+
+  bebo_shmem_object_name (name, BEBO_SHMEM_MUTEX, self->channel);
+  if (!bebo_shmem_mutex_create (&self->mutex, name, true)) {
+    GST_ERROR ("could not create thumbnail mutex %d", bebo_shmem_last_error ());
+    gst_shm_thumbnail_free (self);
+    return NULL;
+  }
+  bebo_shmem_object_name (name, BEBO_SHMEM_NAME, self->channel);
+  if (!bebo_shmem_region_create (&self->region, name, (size_t) size, 0)) {
+    GST_ERROR ("could not create thumbnail mapping %d", bebo_shmem_last_error ());
+    bebo_shmem_mutex_unlock (&self->mutex);
+    gst_shm_thumbnail_free (self);
+    return NULL;
+  }
+
+  struct shmem *shmem = self->shmem = self->region.data;
+  memset (shmem, 0, (size_t) size);
+  shmem->video_info = self->info;
+  shmem->format = GST_VIDEO_INFO_FORMAT (&self->info);
+  shmem->info_generation = 1;
+  shmem->version = SHM_INTERFACE_VERSION;
+  shmem->owner_pid = bebo_shmem_pid ();
+  shmem->owner_heartbeat = bebo_shmem_now_ns ();
+  shmem->frame_offset = frame_offset;
+  bebo_shmem_v2_init (shmem, layout.v2_offset, BEBO_SHMEM_FEATURE_READER_LINES, 0);
+  shmem->frame_size = frame_size;
+  shmem->count = THUMBNAIL_SLOT_COUNT;
+  shmem->shmem_size = size;
+  shmem->payload_offset = payload_offset;
+  shmem->payload_size = self->block_size;
+  shmem->codec = BEBO_SHMEM_CODEC_RAW;
+  bebo_shmem_mutex_unlock (&self->mutex);
+  bebo_shmem_channel_describe (&self->registration, shmem);
+
+  GST_INFO ("%ux%u thumbnails of every %u. frame on channel %s", width,
+      height, self->interval, self->channel);
+  return self;
+}
+
+gboolean
+gst_shm_thumbnail_set_info (GstShmThumbnail * self, GstVideoInfo * info)
+{
+  if (GST_VIDEO_FORMAT_INFO_BITS (info->finfo) != 8) {
+    GST_ERROR ("no thumbnails of %s frames",
+        gst_video_format_to_string (GST_VIDEO_INFO_FORMAT (info)));
+    return FALSE;
+  }
+
+  thumbnail_set_format (self, info);
+  if (bebo_shmem_mutex_lock (&self->mutex, BEBO_SHMEM_INFINITE) != BEBO_SHMEM_WAIT_OK) {
+    GST_ERROR ("could not lock thumbnail mutex %d", bebo_shmem_last_error ());
+    return FALSE;
+  }
+  self->shmem->video_info = self->info;
+  self->shmem->format = GST_VIDEO_INFO_FORMAT (&self->info);
+  bebo_atomic_add_u32 (&self->shmem->info_generation, 1);
+  bebo_shmem_mutex_unlock (&self->mutex);
+  bebo_shmem_channel_describe (&self->registration, self->shmem);
+  return TRUE;
+}
+
+/*
+ * Box filter one plane of bpp byte pixels: every thumbnail pixel is the
+ * mean of the source pixels it covers. The source rows of one thumbnail row
+ * are summed up column wise first with the SIMD kernels, a flat loop over
+ * every source byte, which is where nearly all the time goes. The
+ * horizontal pass then only touches sums.
+ */
+static void
+box_filter_plane (const struct gst_shm_thumbnail_kernels *kernels,
+    const guint8 * src, gint src_stride, guint src_w,
+    guint src_h, guint8 * dst, gint dst_stride, guint dst_w, guint dst_h,
+    guint bpp, guint32 * sums)
+{
+  gsize row_bytes = (gsize) src_w * bpp;
+
+  for (guint y = 0; y < dst_h; y++) {
+    guint y0 = (guint) ((guint64) y * src_h / dst_h);
+    guint y1 = MAX ((guint) ((guint64) (y + 1) * src_h / dst_h), y0 + 1);
+    guint8 *out = dst + (gsize) y * dst_stride;
+
+    memset (sums, 0, row_bytes * sizeof (guint32));
+    for (guint sy = y0; sy < y1; sy++)
+      kernels->accumulate (sums, src + (gsize) sy * src_stride, row_bytes);
+
+    for (guint x = 0; x < dst_w; x++) {
+      guint x0 = (guint) ((guint64) x * src_w / dst_w);
+      guint x1 = MAX ((guint) ((guint64) (x + 1) * src_w / dst_w), x0 + 1);
+      guint32 n = (y1 - y0) * (x1 - x0);
+      for (guint c = 0; c < bpp; c++) {
+        guint32 sum = 0;
+        for (guint sx = x0; sx < x1; sx++)
+          sum += sums[sx * bpp + c];
+        out[x * bpp + c] = (guint8) ((sum + n / 2) / n);
+      }
+    }
+  }
+}
+
+/* Downscale every plane of src into the block at dst. */
+static gboolean
+thumbnail_scale (GstShmThumbnail * self, GstVideoFrame * src, guint8 * dst)
+{
+  GstVideoInfo *out = &self->info;
+  gsize n_sums = (gsize) GST_VIDEO_FRAME_WIDTH (src) * 4;
+
+  if (GST_VIDEO_FRAME_FORMAT (src) != GST_VIDEO_INFO_FORMAT (out))
+    return FALSE;
+
+  if (n_sums > self->n_sums) {
+    g_free (self->sums);
+    self->sums = g_new (guint32, n_sums);
+    self->n_sums = n_sums;
+  }
+
+  for (guint p = 0; p < GST_VIDEO_FRAME_N_PLANES (src); p++) {
+    // the first component of the plane tells its size, packed components
+    // (RGBA, NV12 UV) are box filtered byte by byte
+    guint c = 0;
+    while (GST_VIDEO_FRAME_COMP_PLANE (src, c) != p)
+      c++;
+    guint bpp = GST_VIDEO_FRAME_COMP_PSTRIDE (src, c);
+    box_filter_plane (self->kernels, GST_VIDEO_FRAME_PLANE_DATA (src, p),
+        GST_VIDEO_FRAME_PLANE_STRIDE (src, p),
+        GST_VIDEO_FRAME_COMP_WIDTH (src, c), GST_VIDEO_FRAME_COMP_HEIGHT (src, c),
+        dst + GST_VIDEO_INFO_PLANE_OFFSET (out, p),
+        GST_VIDEO_INFO_PLANE_STRIDE (out, p),
+        GST_VIDEO_INFO_COMP_WIDTH (out, c), GST_VIDEO_INFO_COMP_HEIGHT (out, c),
+        bpp, self->sums);
+  }
+  return TRUE;
+}
+
+/* Evict readers whose process is gone or that stopped reading, like
+ * gst_shm_sink_reap_readers(), counting from our last thumbnail. Never
+ * waits for the mutex. */
+static void
+thumbnail_reap_readers (GstShmThumbnail * self, uint64_t now,
+    guint64 reader_timeout)
+{
+  struct shmem *shmem = self->shmem;
+  uint32_t readers = bebo_shmem_readers (shmem);
+
+  if (readers == 0 || now - self->last_reap < REAP_INTERVAL ||
+      bebo_shmem_mutex_lock (&self->mutex, 0) != BEBO_SHMEM_WAIT_OK)
+    return;
+  self->last_reap = now;
+
+  readers = bebo_shmem_readers (shmem);
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    uint64_t heartbeat;
+    if (!(readers & (1u << i)))
+      continue;
+    heartbeat = bebo_atomic_load_u64 (bebo_shmem_heartbeat_field (shmem, i));
+    if (bebo_shmem_process_alive (shmem->reader[i].pid) &&
+        (reader_timeout == 0 || self->last_publish <= heartbeat ||
+            self->last_publish - heartbeat <= reader_timeout))
+      continue;
+    // a reader in the middle of a release is looked at again next time
+    if (bebo_shmem_reader_evict (shmem, i))
+      GST_WARNING ("evicted thumbnail reader %d pid: %u", i,
+          shmem->reader[i].pid);
+  }
+  bebo_shmem_mutex_unlock (&self->mutex);
+}
+
+void
+gst_shm_thumbnail_push (GstShmThumbnail * self, GstBuffer * buf,
+    GstVideoInfo * info, guint64 reader_timeout)
+{
+  struct shmem *shmem = self->shmem;
+  GstVideoFrame src;
+  uint64_t now = bebo_shmem_now_ns ();
+
+  bebo_atomic_store_release_u64 (&shmem->owner_heartbeat, now);
+  if (++self->skipped < self->interval)
+    return;
+  thumbnail_reap_readers (self, now, reader_timeout);
+  uint32_t readers = bebo_shmem_readers (shmem);
+  if (readers == 0)
+    return;
+  self->skipped = 0;
+
+  uint64_t nr = shmem->write_ptr + 1;
+  uint64_t index = nr % shmem->count;
+  struct frame *frame = bebo_shmem_frame (shmem, index);
+  guint8 *block = (guint8 *) shmem + shmem->payload_offset +
+      index * self->block_size;
+
+  // readers that want every thumbnail are not what this is for
+  if (!bebo_shmem_slot_begin_write (frame, true)) {
+    GST_LOG ("thumbnail slot %llu is pinned, skipping frame", index);
+    return;
+  }
+  if (!gst_video_frame_map (&src, info, buf, GST_MAP_READ)) {
+    GST_WARNING ("could not map buffer %p for a thumbnail", buf);
+    bebo_shmem_slot_end_write (frame, 0);
+    return;
+  }
+  gboolean scaled = thumbnail_scale (self, &src, block);
+  gst_video_frame_unmap (&src);
+  if (!scaled) {
+    bebo_shmem_slot_end_write (frame, 0);
+    return;
+  }
+
+  frame->dxgi_handle = NULL;
+  frame->payload_offset = block - (guint8 *) shmem;
+  frame->n_planes = GST_VIDEO_INFO_N_PLANES (&self->info);
+  for (guint i = 0; i < GST_VIDEO_MAX_PLANES; i++) {
+    gboolean used = i < frame->n_planes;
+    frame->plane_offset[i] =
+        used ? (uint32_t) GST_VIDEO_INFO_PLANE_OFFSET (&self->info, i) : 0;
+    frame->plane_stride[i] =
+        used ? GST_VIDEO_INFO_PLANE_STRIDE (&self->info, i) : 0;
+  }
+  frame->width = GST_VIDEO_INFO_WIDTH (&self->info);
+  frame->height = GST_VIDEO_INFO_HEIGHT (&self->info);
+  frame->format = GST_VIDEO_INFO_FORMAT (&self->info);
+  frame->info_generation = shmem->info_generation;
+  frame->latency = 0;
+  frame->dts = GST_BUFFER_DTS (buf);
+  frame->pts = GST_BUFFER_PTS (buf);
+  frame->duration = GST_BUFFER_DURATION (buf);
+  frame->discontinuity = GST_BUFFER_IS_DISCONT (buf);
+  frame->size = GST_VIDEO_INFO_SIZE (&self->info);
+  frame->flags = BEBO_SHMEM_FRAME_KEYFRAME;
+  frame->meta_size = 0;
+  frame->_gst_buf_ref = NULL;
+  frame->nr = nr;
+  frame->publish_ns = bebo_shmem_now_ns ();
+  self->last_publish = frame->publish_ns;
+  bebo_shmem_slot_end_write (frame, readers);
+  bebo_shmem_publish (shmem, nr);
+
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    if ((readers & (1u << i)) && bebo_shmem_reader_take_wakeup (shmem, i, nr))
+      bebo_shmem_semaphore_signal (&self->new_data[i]);
+  }
+}
+
+void
+gst_shm_thumbnail_free (GstShmThumbnail * self)
+{
+  if (self == NULL)
+    return;
+  bebo_shmem_channel_unregister (&self->registration);
+  bebo_shmem_region_close (&self->region);
+  bebo_shmem_mutex_close (&self->mutex);
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++)
+    bebo_shmem_semaphore_close (&self->new_data[i]);
+  g_free (self->sums);
+  g_free (self->channel);
+  g_free (self);
+}
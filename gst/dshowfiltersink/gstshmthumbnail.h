@@ -0,0 +1,79 @@
+/* GStreamer
+ * Copyright (C) 2019 Pigs in Flight, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ * vim: ts=2:sw=2
+ */
+#pragma once
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include "bebo_shmem.h"
+#include "bebo_shmem_platform.h"
+#include "bebo_shmem_channel.h"
+#include "gstshmthumbnailkernels.h"
+
+G_BEGIN_DECLS
+
+/*
+ * A second, small payload ring next to the sink's own, holding box filtered
+ * copies of every interval-th frame. Dashboards and health monitors attach
+ * to it like to any other channel, named by gst_shm_thumbnail_channel(),
+ * and never touch the full frames.
+ *
+ * Only the render thread uses it, no locking. Thumbnails keep the size they
+ * got for the first caps, later caps only change their format.
+ */
+typedef struct _GstShmThumbnail
+{
+  struct bebo_shmem_region region;
+  struct shmem *shmem;
+  struct bebo_shmem_mutex mutex;
+  struct bebo_shmem_semaphore new_data[BEBO_SHMEM_MAX_READERS];
+  gchar *channel;
+  struct bebo_shmem_channel_registration registration;
+
+  GstVideoInfo info; /* of the thumbnails */
+  guint64 block_size;
+  guint interval;
+  guint skipped; /* frames since the last thumbnail */
+  uint64_t last_reap; /* bebo_shmem_now_ns() */
+  uint64_t last_publish; /* bebo_shmem_now_ns(), 0 before the first one */
+
+  /* column sums of the source rows that make up one thumbnail row */
+  guint32 *sums;
+  gsize n_sums;
+  const struct gst_shm_thumbnail_kernels *kernels;
+} GstShmThumbnail;
+
+/* "thumbnail" for the default channel, "<channel>-thumbnail" otherwise */
+gchar * gst_shm_thumbnail_channel(const gchar * channel);
+
+/* width x height thumbnails of frames described by info, height 0 keeps
+ * the aspect ratio. NULL if the ring could not be created. */
+GstShmThumbnail * gst_shm_thumbnail_new(const gchar * channel,
+    GstVideoInfo * info, guint width, guint height, guint interval);
+/* Caps changed, thumbnails of later frames have the new format. */
+gboolean gst_shm_thumbnail_set_info(GstShmThumbnail * thumbnail,
+    GstVideoInfo * info);
+/* Count buf and publish a thumbnail of it if it is due. reader_timeout in
+ * ns, like the sink's reader-timeout. */
+void gst_shm_thumbnail_push(GstShmThumbnail * thumbnail, GstBuffer * buf,
+    GstVideoInfo * info, guint64 reader_timeout);
+void gst_shm_thumbnail_free(GstShmThumbnail * thumbnail);
+
+G_END_DECLS
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Thumbnail kernels, see gstshmthumbnailkernels.h.
+ *
+ * MSVC does not vectorize the widening u8 to u32 loop on its own, so the
+ * SSE2 version spells it out: 16 bytes unpacked to 16 u32 lanes per step,
+ * the bytes left over at the end of the row go to the scalar one.
+ *
+ * x86: SSE2 is compiled in with GCC's target attribute (MSVC takes the
+ * intrinsics as they are) and only used if cpuid says so, like the noise
+ * gate kernels.
+ */
+
+#include "gstshmthumbnailkernels.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define THUMBNAIL_X86 1
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KERNEL_TARGET(isa)
+#endif
+
+/*
+ * scalar, the reference
+ */
+
+static void
+accumulate_scalar(uint32_t *sums, const uint8_t *row, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    sums[i] += row[i];
+  }
+}
+
+static const struct gst_shm_thumbnail_kernels scalar_kernels = {
+  "scalar", accumulate_scalar
+};
+
+#ifdef THUMBNAIL_X86
+
+/*
+ * SSE2, 16 bytes
+ */
+
+KERNEL_TARGET("sse2") static void
+accumulate_sse2(uint32_t *sums, const uint8_t *row, size_t n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *) (row + i));
+    __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+    __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+    __m128i *s = (__m128i *) (sums + i);
+
+    _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s),
+        _mm_unpacklo_epi16(lo, zero)));
+    _mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1),
+        _mm_unpackhi_epi16(lo, zero)));
+    _mm_storeu_si128(s + 2, _mm_add_epi32(_mm_loadu_si128(s + 2),
+        _mm_unpacklo_epi16(hi, zero)));
+    _mm_storeu_si128(s + 3, _mm_add_epi32(_mm_loadu_si128(s + 3),
+        _mm_unpackhi_epi16(hi, zero)));
+  }
+  accumulate_scalar(sums + i, row + i, n - i);
+}
+
+static const struct gst_shm_thumbnail_kernels sse2_kernels = {
+  "sse2", accumulate_sse2
+};
+
+static int
+have_sse2(void)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+  return 1;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] >> 26) & 1;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+#endif
+}
+
+#endif /* THUMBNAIL_X86 */
+
+int
+gst_shm_thumbnail_kernels_available(
+    const struct gst_shm_thumbnail_kernels **out, int max)
+{
+  const struct gst_shm_thumbnail_kernels *all[2];
+  int count = 0;
+
+  all[count++] = &scalar_kernels;
+#ifdef THUMBNAIL_X86
+  if (have_sse2()) {
+    all[count++] = &sse2_kernels;
+  }
+#endif
+
+  for (int i = 0; i < count && i < max; i++) {
+    out[i] = all[i];
+  }
+  return count;
+}
+
+const struct gst_shm_thumbnail_kernels *
+gst_shm_thumbnail_kernels_get(void)
+{
+  // racing first callers find the same ones
+  static const struct gst_shm_thumbnail_kernels *best;
+
+  if (best == NULL) {
+    const struct gst_shm_thumbnail_kernels *all[2];
+    int count = gst_shm_thumbnail_kernels_available(all, 2);
+    best = all[count - 1];
+  }
+  return best;
+}
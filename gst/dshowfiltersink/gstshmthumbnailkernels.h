@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+#pragma once
+
+/*
+ * The inner loop of the thumbnail box filter: adding a source row to the
+ * column sums of the thumbnail row it belongs to. Every source byte goes
+ * through it once, the rest of the filter only touches the sums.
+ *
+ * Integer sums, so every version returns the very same ones as the scalar
+ * reference, tools/thumbbench checks that.
+ *
+ * Plain C without GLib, so the benchmark builds without GStreamer.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+  extern "C" {
+#endif
+
+  /* sums[i] += row[i] for i < n */
+  typedef void (*gst_shm_thumbnail_accumulate_func)(uint32_t *sums,
+      const uint8_t *row, size_t n);
+
+  struct gst_shm_thumbnail_kernels {
+    const char *name; /* "scalar", "sse2" */
+    gst_shm_thumbnail_accumulate_func accumulate;
+  };
+
+  /* The kernels this CPU can run, scalar first and the fastest last.
+   * Returns how many, at most max are stored in out. */
+  int gst_shm_thumbnail_kernels_available(
+      const struct gst_shm_thumbnail_kernels **out, int max);
+  /* The fastest kernels this CPU can run, detected once. */
+  const struct gst_shm_thumbnail_kernels *gst_shm_thumbnail_kernels_get(void);
+
+#ifdef __cplusplus
+    }
+#endif
@@ -24,6 +24,7 @@
 
 #include <gst/gst.h>
 #include "dshowfiltersink/gstdshowsink.h"
+#include "shmsrc/gstbeboshmsrc.h"
 #include "nvenc/gstnvh264enc.h"
 #include "nvenc/gstnvenc.h"
 #include "gl2dxgi/gstgl2dxgi.h"
@@ -48,6 +49,10 @@ plugin_init (GstPlugin * plugin)
     GST_RANK_NONE, GST_TYPE_SHM_SINK)) {
     return FALSE;
   }
+  if (!gst_element_register(plugin, "beboshmsrc",
+    GST_RANK_NONE, GST_TYPE_BEBO_SHM_SRC)) {
+    return FALSE;
+  }
   if (!gst_element_register(plugin, "gl2dxgi",
     GST_RANK_NONE, GST_TYPE_GL_2_DXGI)) {
     return FALSE;
@@ -48,6 +48,7 @@
 #endif
 
 #include "gstaudionoisegate.h"
+#include "gstnoisegatekernels.h"
 #include <gst/gst.h>
 #include <gst/audio/audio.h>
 #include <gst/audio/gstaudiofilter.h>
@@ -57,6 +58,9 @@
 GST_DEBUG_CATEGORY_STATIC (gst_audio_noise_gate_debug);
 #define GST_CAT_DEFAULT gst_audio_noise_gate_debug
 
+/* frames per pass of the kernels */
+#define GATE_BLOCK 256
+
 G_DEFINE_TYPE (GstAudioNoiseGate, gst_audio_noise_gate,
     GST_TYPE_AUDIO_FILTER);
 
@@ -330,7 +334,9 @@ gst_audio_noise_gate_setup (GstAudioFilter * base,
   reconfigure_values(filter);
 
   // only support F32 now
+  filter->kernels = gst_noise_gate_kernels_get();
   filter->process = (GstAudioNoiseGateProcessFunc) gate_float;
+  GST_INFO_OBJECT (filter, "using %s kernels", filter->kernels->name);
 
   return TRUE;
 }
@@ -396,48 +402,53 @@ static void gate_float(GstAudioNoiseGate *s,
   const gfloat attack_hold_time = ms_to_s(s->attack_hold_time);
   const gfloat release_hold_time = ms_to_s(s->release_hold_time);
   const gfloat period = 1.0f / rate;
-  int n, c;
+  const struct gst_noise_gate_kernels *kernels = s->kernels;
+  gfloat peak[GATE_BLOCK], gains[GATE_BLOCK];
+  int n, block;
   int in_channels, out_channels;
 
   in_channels = out_channels = GST_AUDIO_INFO_CHANNELS(info);
 
-  for (n = 0; n < nb_samples; n++, src += in_channels, dst += in_channels, scsrc += out_channels) {
-    gfloat abs_sample = fabsf(scsrc[0]), gain = 1.0f;
-
-    // find the peak
-    for (c = 1; c < out_channels; c++) {
-      abs_sample = MAX(fabsf(scsrc[c]), abs_sample);
-    }
-
-    gboolean gate_open = (abs_sample > open_threshold);
-    gboolean gate_close = (abs_sample < close_threshold);
-    gfloat gc = (gate_open) ? 1.0f : 0.0f;
-    if (gate_open) {
-      s->hold_attack_counter += period;
-      s->hold_release_counter = 0.0;
-      if (s->hold_attack_counter > attack_hold_time && gc > s->previous_gain) {
-        gain = MAX((attack_coeff * s->previous_gain) + (1.0f - attack_coeff) * gc, 0.0f);
-      } else if (s->hold_attack_counter <= attack_hold_time) {
+  // the peaks and the multiplications go through the kernels a block at a
+  // time, the gain depends on the previous one and stays a plain loop
+  for (; nb_samples > 0; nb_samples -= block, src += block * in_channels,
+      dst += block * in_channels, scsrc += block * out_channels) {
+    block = MIN(nb_samples, GATE_BLOCK);
+
+    kernels->peak(scsrc, peak, block, out_channels);
+
+    for (n = 0; n < block; n++) {
+      gfloat abs_sample = peak[n], gain = 1.0f;
+
+      gboolean gate_open = (abs_sample > open_threshold);
+      gboolean gate_close = (abs_sample < close_threshold);
+      gfloat gc = (gate_open) ? 1.0f : 0.0f;
+      if (gate_open) {
+        s->hold_attack_counter += period;
+        s->hold_release_counter = 0.0;
+        if (s->hold_attack_counter > attack_hold_time && gc > s->previous_gain) {
+          gain = MAX((attack_coeff * s->previous_gain) + (1.0f - attack_coeff) * gc, 0.0f);
+        } else if (s->hold_attack_counter <= attack_hold_time) {
+          gain = s->previous_gain;
+        }
+      } else if (gate_close) {
+        s->hold_attack_counter = 0.0;
+        s->hold_release_counter += period;
+        if (s->hold_release_counter > release_hold_time && gc <= s->previous_gain) {
+          gain = MIN((release_coeff * s->previous_gain) + (1.0f - release_coeff) * gc, 1.0f);
+        } else if (s->hold_release_counter <= release_hold_time) {
+          gain = s->previous_gain;
+        }
+      } else {
+        s->hold_attack_counter = 0.0;
+        s->hold_release_counter = 0.0;
         gain = s->previous_gain;
       }
-    } else if (gate_close) {
-      s->hold_attack_counter = 0.0;
-      s->hold_release_counter += period;
-      if (s->hold_release_counter > release_hold_time && gc <= s->previous_gain) {
-        gain = MIN((release_coeff * s->previous_gain) + (1.0f - release_coeff) * gc, 1.0f);
-      } else if (s->hold_release_counter <= release_hold_time) {
-        gain = s->previous_gain;
-      }
-    } else {
-      s->hold_attack_counter = 0.0;
-      s->hold_release_counter = 0.0;
-      gain = s->previous_gain;
-    }
 
-    s->previous_gain = gain;
-
-    for (c = 0; c < in_channels; c++) {
-      dst[c] = src[c] * gain * makeup;
+      s->previous_gain = gain;
+      gains[n] = gain;
     }
+
+    kernels->apply(src, dst, gains, makeup, block, in_channels);
   }
 }
@@ -90,6 +90,8 @@ struct _GstAudioNoiseGate
 
   gfloat previous_gain;
 
+  /* SIMD ones if the CPU has them, see gstnoisegatekernels.h */
+  const struct gst_noise_gate_kernels *kernels;
   GstAudioNoiseGateProcessFunc process;
 };
 
@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Noise gate kernels, see gstnoisegatekernels.h.
+ *
+ * Every SIMD version handles mono, stereo and channel counts that fill its
+ * registers (4 or 8) and hands anything else, and the frames left over at
+ * the end, to the next smaller version down to the scalar one.
+ *
+ * x86: SSE2 and AVX2 are compiled in with GCC's target attribute (MSVC
+ * takes the intrinsics as they are) and only used if cpuid says so.
+ * ARM: NEON on aarch64 only, 32-bit NEON flushes denormals to zero and
+ * would not match the scalar output.
+ */
+
+#include <math.h>
+#include <stddef.h>
+
+#include "gstnoisegatekernels.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define NOISE_GATE_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define NOISE_GATE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KERNEL_TARGET(isa)
+#endif
+
+/* like GLib's MAX, which the element used */
+#define PEAK_MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+/*
+ * scalar, the reference
+ */
+
+static void
+peak_scalar(const float *src, float *peak, int frames, int channels)
+{
+  for (int n = 0; n < frames; n++, src += channels) {
+    float p = fabsf(src[0]);
+    for (int c = 1; c < channels; c++) {
+      p = PEAK_MAX(fabsf(src[c]), p);
+    }
+    peak[n] = p;
+  }
+}
+
+static void
+apply_scalar(const float *src, float *dst, const float *gain, float makeup,
+    int frames, int channels)
+{
+  for (int n = 0; n < frames; n++, src += channels, dst += channels) {
+    for (int c = 0; c < channels; c++) {
+      dst[c] = src[c] * gain[n] * makeup;
+    }
+  }
+}
+
+static const struct gst_noise_gate_kernels scalar_kernels = {
+  "scalar", peak_scalar, apply_scalar
+};
+
+#ifdef NOISE_GATE_X86
+
+/*
+ * SSE2, 4 floats
+ */
+
+KERNEL_TARGET("sse2") static inline __m128
+abs_sse2(__m128 v)
+{
+  return _mm_and_ps(v, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+}
+
+KERNEL_TARGET("sse2") static inline float
+hmax_sse2(__m128 v)
+{
+  v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)));
+  return _mm_cvtss_f32(v);
+}
+
+KERNEL_TARGET("sse2") static void
+peak_sse2(const float *src, float *peak, int frames, int channels)
+{
+  int n = 0;
+
+  if (channels == 1) {
+    for (; n + 4 <= frames; n += 4) {
+      _mm_storeu_ps(peak + n, abs_sse2(_mm_loadu_ps(src + n)));
+    }
+  } else if (channels == 2) {
+    // 4 frames, split into the left and the right samples
+    for (; n + 4 <= frames; n += 4) {
+      __m128 a = abs_sse2(_mm_loadu_ps(src + 2 * n));
+      __m128 b = abs_sse2(_mm_loadu_ps(src + 2 * n + 4));
+      __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+      __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+      _mm_storeu_ps(peak + n, _mm_max_ps(r, l));
+    }
+  } else if (channels % 4 == 0) {
+    for (; n < frames; n++) {
+      const float *frame = src + (size_t) n * channels;
+      __m128 m = abs_sse2(_mm_loadu_ps(frame));
+      for (int c = 4; c < channels; c += 4) {
+        m = _mm_max_ps(abs_sse2(_mm_loadu_ps(frame + c)), m);
+      }
+      peak[n] = hmax_sse2(m);
+    }
+  }
+  peak_scalar(src + (size_t) n * channels, peak + n, frames - n, channels);
+}
+
+KERNEL_TARGET("sse2") static void
+apply_sse2(const float *src, float *dst, const float *gain, float makeup,
+    int frames, int channels)
+{
+  __m128 mk = _mm_set1_ps(makeup);
+  int n = 0;
+
+  if (channels == 1) {
+    for (; n + 4 <= frames; n += 4) {
+      __m128 s = _mm_loadu_ps(src + n);
+      _mm_storeu_ps(dst + n, _mm_mul_ps(_mm_mul_ps(s, _mm_loadu_ps(gain + n)), mk));
+    }
+  } else if (channels == 2) {
+    for (; n + 4 <= frames; n += 4) {
+      __m128 g = _mm_loadu_ps(gain + n);
+      __m128 g01 = _mm_unpacklo_ps(g, g);
+      __m128 g23 = _mm_unpackhi_ps(g, g);
+      __m128 s0 = _mm_loadu_ps(src + 2 * n);
+      __m128 s1 = _mm_loadu_ps(src + 2 * n + 4);
+      _mm_storeu_ps(dst + 2 * n, _mm_mul_ps(_mm_mul_ps(s0, g01), mk));
+      _mm_storeu_ps(dst + 2 * n + 4, _mm_mul_ps(_mm_mul_ps(s1, g23), mk));
+    }
+  } else if (channels % 4 == 0) {
+    for (; n < frames; n++) {
+      size_t at = (size_t) n * channels;
+      __m128 g = _mm_set1_ps(gain[n]);
+      for (int c = 0; c < channels; c += 4) {
+        __m128 s = _mm_loadu_ps(src + at + c);
+        _mm_storeu_ps(dst + at + c, _mm_mul_ps(_mm_mul_ps(s, g), mk));
+      }
+    }
+  }
+  apply_scalar(src + (size_t) n * channels, dst + (size_t) n * channels,
+      gain + n, makeup, frames - n, channels);
+}
+
+static const struct gst_noise_gate_kernels sse2_kernels = {
+  "sse2", peak_sse2, apply_sse2
+};
+
+/*
+ * AVX2, 8 floats
+ */
+
+KERNEL_TARGET("avx2") static inline __m256
+abs_avx2(__m256 v)
+{
+  return _mm256_and_ps(v, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+}
+
+KERNEL_TARGET("avx2") static void
+peak_avx2(const float *src, float *peak, int frames, int channels)
+{
+  int n = 0;
+
+  if (channels == 1) {
+    for (; n + 8 <= frames; n += 8) {
+      _mm256_storeu_ps(peak + n, abs_avx2(_mm256_loadu_ps(src + n)));
+    }
+  } else if (channels == 2) {
+    for (; n + 8 <= frames; n += 8) {
+      __m256 a = abs_avx2(_mm256_loadu_ps(src + 2 * n));
+      __m256 b = abs_avx2(_mm256_loadu_ps(src + 2 * n + 8));
+      // shuffles stay within 128 bit lanes: frames 0 1 4 5 | 2 3 6 7
+      __m256 l = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+      __m256 r = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+      __m256d m = _mm256_castps_pd(_mm256_max_ps(r, l));
+      m = _mm256_permute4x64_pd(m, _MM_SHUFFLE(3, 1, 2, 0));
+      _mm256_storeu_ps(peak + n, _mm256_castpd_ps(m));
+    }
+  } else if (channels % 8 == 0) {
+    for (; n < frames; n++) {
+      const float *frame = src + (size_t) n * channels;
+      __m256 m = abs_avx2(_mm256_loadu_ps(frame));
+      for (int c = 8; c < channels; c += 8) {
+        m = _mm256_max_ps(abs_avx2(_mm256_loadu_ps(frame + c)), m);
+      }
+      __m128 h = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+      h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+      h = _mm_max_ps(h, _mm_shuffle_ps(h, h, _MM_SHUFFLE(1, 1, 1, 1)));
+      peak[n] = _mm_cvtss_f32(h);
+    }
+  }
+  // the SSE2 code is not VEX encoded, it would pay for the upper halves
+  _mm256_zeroupper();
+  peak_sse2(src + (size_t) n * channels, peak + n, frames - n, channels);
+}
+
+KERNEL_TARGET("avx2") static void
+apply_avx2(const float *src, float *dst, const float *gain, float makeup,
+    int frames, int channels)
+{
+  __m256 mk = _mm256_set1_ps(makeup);
+  int n = 0;
+
+  if (channels == 1) {
+    for (; n + 8 <= frames; n += 8) {
+      __m256 s = _mm256_loadu_ps(src + n);
+      _mm256_storeu_ps(dst + n,
+          _mm256_mul_ps(_mm256_mul_ps(s, _mm256_loadu_ps(gain + n)), mk));
+    }
+  } else if (channels == 2) {
+    const __m256i pairs = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    for (; n + 4 <= frames; n += 4) {
+      __m256 g = _mm256_permutevar8x32_ps(
+          _mm256_castps128_ps256(_mm_loadu_ps(gain + n)), pairs);
+      __m256 s = _mm256_loadu_ps(src + 2 * n);
+      _mm256_storeu_ps(dst + 2 * n, _mm256_mul_ps(_mm256_mul_ps(s, g), mk));
+    }
+  } else if (channels % 8 == 0) {
+    for (; n < frames; n++) {
+      size_t at = (size_t) n * channels;
+      __m256 g = _mm256_set1_ps(gain[n]);
+      for (int c = 0; c < channels; c += 8) {
+        __m256 s = _mm256_loadu_ps(src + at + c);
+        _mm256_storeu_ps(dst + at + c, _mm256_mul_ps(_mm256_mul_ps(s, g), mk));
+      }
+    }
+  }
+  _mm256_zeroupper();
+  apply_sse2(src + (size_t) n * channels, dst + (size_t) n * channels,
+      gain + n, makeup, frames - n, channels);
+}
+
+static const struct gst_noise_gate_kernels avx2_kernels = {
+  "avx2", peak_avx2, apply_avx2
+};
+
+static int
+have_sse2(void)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+  return 1;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] >> 26) & 1;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static int
+have_avx2(void)
+{
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return 0;
+  }
+  // the OS must save the ymm registers too
+  __cpuid(info, 1);
+  if (!((info[2] >> 27) & 1) || !((info[2] >> 28) & 1) ||
+      (_xgetbv(0) & 6) != 6) {
+    return 0;
+  }
+  __cpuidex(info, 7, 0);
+  return (info[1] >> 5) & 1;
+#else
+  // checks the OS support as well
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif /* NOISE_GATE_X86 */
+
+#ifdef NOISE_GATE_NEON
+
+/*
+ * NEON, 4 floats
+ */
+
+static void
+peak_neon(const float *src, float *peak, int frames, int channels)
+{
+  int n = 0;
+
+  if (channels == 1) {
+    for (; n + 4 <= frames; n += 4) {
+      vst1q_f32(peak + n, vabsq_f32(vld1q_f32(src + n)));
+    }
+  } else if (channels == 2) {
+    for (; n + 4 <= frames; n += 4) {
+      // de-interleaves into the left and the right samples
+      float32x4x2_t v = vld2q_f32(src + 2 * n);
+      vst1q_f32(peak + n, vmaxq_f32(vabsq_f32(v.val[1]), vabsq_f32(v.val[0])));
+    }
+  } else if (channels % 4 == 0) {
+    for (; n < frames; n++) {
+      const float *frame = src + (size_t) n * channels;
+      float32x4_t m = vabsq_f32(vld1q_f32(frame));
+      for (int c = 4; c < channels; c += 4) {
+        m = vmaxq_f32(vabsq_f32(vld1q_f32(frame + c)), m);
+      }
+      peak[n] = vmaxvq_f32(m);
+    }
+  }
+  peak_scalar(src + (size_t) n * channels, peak + n, frames - n, channels);
+}
+
+static void
+apply_neon(const float *src, float *dst, const float *gain, float makeup,
+    int frames, int channels)
+{
+  float32x4_t mk = vdupq_n_f32(makeup);
+  int n = 0;
+
+  if (channels == 1) {
+    for (; n + 4 <= frames; n += 4) {
+      float32x4_t s = vld1q_f32(src + n);
+      vst1q_f32(dst + n, vmulq_f32(vmulq_f32(s, vld1q_f32(gain + n)), mk));
+    }
+  } else if (channels == 2) {
+    for (; n + 4 <= frames; n += 4) {
+      float32x4_t g = vld1q_f32(gain + n);
+      float32x4x2_t v = vld2q_f32(src + 2 * n);
+      v.val[0] = vmulq_f32(vmulq_f32(v.val[0], g), mk);
+      v.val[1] = vmulq_f32(vmulq_f32(v.val[1], g), mk);
+      vst2q_f32(dst + 2 * n, v);
+    }
+  } else if (channels % 4 == 0) {
+    for (; n < frames; n++) {
+      size_t at = (size_t) n * channels;
+      float32x4_t g = vdupq_n_f32(gain[n]);
+      for (int c = 0; c < channels; c += 4) {
+        float32x4_t s = vld1q_f32(src + at + c);
+        vst1q_f32(dst + at + c, vmulq_f32(vmulq_f32(s, g), mk));
+      }
+    }
+  }
+  apply_scalar(src + (size_t) n * channels, dst + (size_t) n * channels,
+      gain + n, makeup, frames - n, channels);
+}
+
+static const struct gst_noise_gate_kernels neon_kernels = {
+  "neon", peak_neon, apply_neon
+};
+
+#endif /* NOISE_GATE_NEON */
+
+int
+gst_noise_gate_kernels_available(const struct gst_noise_gate_kernels **out,
+    int max)
+{
+  const struct gst_noise_gate_kernels *all[4];
+  int count = 0;
+
+  all[count++] = &scalar_kernels;
+#ifdef NOISE_GATE_X86
+  if (have_sse2()) {
+    all[count++] = &sse2_kernels;
+    // falls back to SSE2 for what it does not handle itself
+    if (have_avx2()) {
+      all[count++] = &avx2_kernels;
+    }
+  }
+#endif
+#ifdef NOISE_GATE_NEON
+  all[count++] = &neon_kernels;
+#endif
+
+  for (int i = 0; i < count && i < max; i++) {
+    out[i] = all[i];
+  }
+  return count;
+}
+
+const struct gst_noise_gate_kernels *
+gst_noise_gate_kernels_get(void)
+{
+  // racing first callers find the same ones
+  static const struct gst_noise_gate_kernels *best;
+
+  if (best == NULL) {
+    const struct gst_noise_gate_kernels *all[4];
+    int count = gst_noise_gate_kernels_available(all, 4);
+    best = all[count - 1];
+  }
+  return best;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+#pragma once
+
+/*
+ * The per sample loops of the noise gate, on interleaved F32 frames.
+ *
+ * The gain follows the peaks frame by frame and stays scalar in the
+ * element, these two are what is left: the peak of each frame across its
+ * channels, and multiplying every sample by its frame's gain and the
+ * makeup gain. The scalar versions are the reference, the SIMD ones return
+ * the very same floats (max and abs are exact, the multiplications happen
+ * in the same order), tools/gatebench checks that.
+ *
+ * Plain C without GLib, so the benchmark builds without GStreamer.
+ */
+
+#ifdef __cplusplus
+  extern "C" {
+#endif
+
+  /* peak[n] = max over c of |src[n * channels + c]| */
+  typedef void (*gst_noise_gate_peak_func)(const float *src, float *peak,
+      int frames, int channels);
+  /* dst[n * channels + c] = src[n * channels + c] * gain[n] * makeup,
+   * dst may be src */
+  typedef void (*gst_noise_gate_apply_func)(const float *src, float *dst,
+      const float *gain, float makeup, int frames, int channels);
+
+  struct gst_noise_gate_kernels {
+    const char *name; /* "scalar", "sse2", "avx2", "neon" */
+    gst_noise_gate_peak_func peak;
+    gst_noise_gate_apply_func apply;
+  };
+
+  /* The kernels this CPU can run, scalar first and the fastest last.
+   * Returns how many, at most max are stored in out. */
+  int gst_noise_gate_kernels_available(const struct gst_noise_gate_kernels **out,
+      int max);
+  /* The fastest kernels this CPU can run, detected once. */
+  const struct gst_noise_gate_kernels *gst_noise_gate_kernels_get(void);
+
+#ifdef __cplusplus
+    }
+#endif
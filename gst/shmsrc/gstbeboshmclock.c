@@ -0,0 +1,109 @@
+/* GStreamer
+ * Copyright (C) 2019 Pigs in Flight, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ * vim: ts=2:sw=2
+ */
+
+/*
+ * GstBeboShmClock reads the producer's clock out of the shmem header, no
+ * round trip to the producer and no syscall besides bebo_shmem_now_ns().
+ * It derives from GstSystemClock, waits are timed on the local clock,
+ * which runs at the producer's rate up to the published rate estimate.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstbeboshmclock.h"
+#include "bebo_shmem_ring.h"
+
+GST_DEBUG_CATEGORY_STATIC (beboshmclock_debug);
+#define GST_CAT_DEFAULT beboshmclock_debug
+
+#define parent_class gst_bebo_shm_clock_parent_class
+G_DEFINE_TYPE (GstBeboShmClock, gst_bebo_shm_clock, GST_TYPE_SYSTEM_CLOCK);
+
+static GstClockTime gst_bebo_shm_clock_get_internal_time (GstClock * clock);
+
+static void
+gst_bebo_shm_clock_init (GstBeboShmClock * self)
+{
+  self->shmem = NULL;
+  self->last_time = 0;
+  self->last_now = 0;
+}
+
+static void
+gst_bebo_shm_clock_class_init (GstBeboShmClockClass * klass)
+{
+  GstClockClass *gstclock_class = (GstClockClass *) klass;
+
+  gstclock_class->get_internal_time =
+      GST_DEBUG_FUNCPTR (gst_bebo_shm_clock_get_internal_time);
+
+  GST_DEBUG_CATEGORY_INIT (beboshmclock_debug, "beboshmclock", 0,
+      "Bebo Shared Memory Clock");
+}
+
+GstClock *
+gst_bebo_shm_clock_new (const gchar * name)
+{
+  GstClock *clock = g_object_new (GST_TYPE_BEBO_SHM_CLOCK, "name", name, NULL);
+
+  // drop the floating ref, like gst_system_clock_obtain()
+  gst_object_ref_sink (clock);
+  return clock;
+}
+
+void
+gst_bebo_shm_clock_set_shmem (GstBeboShmClock * self, struct shmem *shmem)
+{
+  GST_OBJECT_LOCK (self);
+  self->shmem = shmem;
+  GST_OBJECT_UNLOCK (self);
+  GST_DEBUG_OBJECT (self, "%s the producer clock",
+      shmem ? "following" : "no longer following");
+}
+
+static GstClockTime
+gst_bebo_shm_clock_get_internal_time (GstClock * clock)
+{
+  GstBeboShmClock *self = GST_BEBO_SHM_CLOCK (clock);
+  struct bebo_shmem_clock sample;
+  uint64_t now = bebo_shmem_now_ns ();
+  GstClockTime time;
+
+  GST_OBJECT_LOCK (self);
+  if (self->shmem && bebo_shmem_clock_read (self->shmem, &sample)) {
+    time = bebo_shmem_clock_time (&sample, now);
+  } else if (self->last_now != 0) {
+    time = self->last_time + (now - self->last_now);
+  } else {
+    time = now;
+  }
+
+  // a new sample may put the line a bit behind what we returned before
+  if (time < self->last_time)
+    time = self->last_time;
+  self->last_time = time;
+  self->last_now = now;
+  GST_OBJECT_UNLOCK (self);
+
+  return time;
+}
@@ -0,0 +1,64 @@
+/* GStreamer
+ * Copyright (C) 2019 Pigs in Flight, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ * vim: ts=2:sw=2
+ */
+
+#ifndef __GST_BEBO_SHM_CLOCK_H__
+#define __GST_BEBO_SHM_CLOCK_H__
+
+#include <gst/gst.h>
+#include "bebo_shmem.h"
+
+G_BEGIN_DECLS
+#define GST_TYPE_BEBO_SHM_CLOCK \
+  (gst_bebo_shm_clock_get_type())
+#define GST_BEBO_SHM_CLOCK(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_BEBO_SHM_CLOCK,GstBeboShmClock))
+#define GST_BEBO_SHM_CLOCK_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_BEBO_SHM_CLOCK,GstBeboShmClockClass))
+#define GST_IS_BEBO_SHM_CLOCK(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_BEBO_SHM_CLOCK))
+typedef struct _GstBeboShmClock GstBeboShmClock;
+typedef struct _GstBeboShmClockClass GstBeboShmClockClass;
+
+/* The producer's pipeline clock as published in shmem.clock. Free runs on
+ * the local monotonic clock while no producer is attached. */
+struct _GstBeboShmClock
+{
+  GstSystemClock parent;
+
+  /* all protected by the object lock */
+  struct shmem *shmem;
+  GstClockTime last_time; /* we never go back */
+  uint64_t last_now; /* bebo_shmem_now_ns() of last_time */
+};
+
+struct _GstBeboShmClockClass
+{
+  GstSystemClockClass parent_class;
+};
+
+GType gst_bebo_shm_clock_get_type(void);
+
+GstClock *gst_bebo_shm_clock_new(const gchar * name);
+/* The header to read the clock from, NULL before the mapping goes away. */
+void gst_bebo_shm_clock_set_shmem(GstBeboShmClock * clock, struct shmem * shmem);
+
+G_END_DECLS
+#endif /* __GST_BEBO_SHM_CLOCK_H__ */
@@ -0,0 +1,783 @@
+/* GStreamer
+ * Copyright (C) 2019 Pigs in Flight, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ * vim: ts=2:sw=2
+ */
+
+/*
+ * beboshmsrc attaches as a reader to the frame ring of dshowfiltersink
+ * (payload=true) and pushes buffers that wrap the shmem blocks directly.
+ * The slot stays pinned until the buffer is freed. When the producer
+ * shares H.264 the buffers wrap access units in its arena, we start at a
+ * keyframe and ask for one whenever we had to skip.
+ *
+ * Timecode, ROI and caption metas the producer serialized into the slot
+ * are put back on the buffers.
+ *
+ * channel picks the dshowfiltersink to attach to when several run side by
+ * side, see bebo_shmem_channel.h.
+ *
+ * catch-up, max-lag and max-latency decide how we catch up when frames come
+ * in later than we want them, see bebo_shmem_client_set_catch_up().
+ *
+ * It provides a GstBeboShmClock. When the pipeline runs on it, buffers are
+ * timestamped with the producer's pts mapped onto our running time, so
+ * they are presented in step with the producer. Otherwise they are
+ * timestamped when they arrive.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstbeboshmsrc.h"
+
+#ifdef NDEBUG
+#undef GST_LOG_OBJECT
+#define GST_LOG_OBJECT(...)
+#endif
+
+// wake up this often to check for flushing
+#define WAIT_TIMEOUT_MS 100
+
+GST_DEBUG_CATEGORY_STATIC (beboshmsrc_debug);
+#define GST_CAT_DEFAULT beboshmsrc_debug
+
+enum
+{
+  PROP_0,
+  PROP_CHANNEL,
+  PROP_CATCH_UP,
+  PROP_MAX_LAG,
+  PROP_MAX_LATENCY
+};
+
+#define DEFAULT_CATCH_UP GST_BEBO_SHM_SRC_CATCH_UP_RENDER_ALL
+
+#define GST_TYPE_BEBO_SHM_SRC_CATCH_UP (gst_bebo_shm_src_catch_up_get_type())
+static GType
+gst_bebo_shm_src_catch_up_get_type (void)
+{
+  static GType catch_up_type = 0;
+
+  static const GEnumValue modes[] = {
+    {GST_BEBO_SHM_SRC_CATCH_UP_RENDER_ALL, "Push every frame, however late",
+        "render-all"},
+    {GST_BEBO_SHM_SRC_CATCH_UP_DROP_ALTERNATE,
+        "Push every other frame while late", "drop-alternate"},
+    {GST_BEBO_SHM_SRC_CATCH_UP_SKIP_TO_NEWEST,
+        "Skip to the newest frame when late", "skip-to-newest"},
+    {0, NULL, NULL},
+  };
+
+  if (!catch_up_type) {
+    catch_up_type = g_enum_register_static ("GstBeboShmSrcCatchUp", modes);
+  }
+  return catch_up_type;
+}
+
+#define GST_SHM_SRC_CAPS \
+    "video/x-raw, "                                                     \
+    "format = (string) { RGBA, BGRA, I420, NV12 }, "                    \
+    "width = " GST_VIDEO_SIZE_RANGE ", "                                \
+    "height = " GST_VIDEO_SIZE_RANGE ", "                               \
+    "framerate = " GST_VIDEO_FPS_RANGE "; "                             \
+    "video/x-h264, "                                                    \
+    "stream-format = (string) byte-stream, "                            \
+    "alignment = (string) au, "                                         \
+    "width = " GST_VIDEO_SIZE_RANGE ", "                                \
+    "height = " GST_VIDEO_SIZE_RANGE ", "                               \
+    "framerate = " GST_VIDEO_FPS_RANGE
+
+static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS (GST_SHM_SRC_CAPS));
+
+#define parent_class gst_bebo_shm_src_parent_class
+G_DEFINE_TYPE (GstBeboShmSrc, gst_bebo_shm_src, GST_TYPE_PUSH_SRC);
+
+typedef struct
+{
+  GstBeboShmSrc *self;
+  uint64_t ticket;
+} SlotRelease;
+
+static void gst_bebo_shm_src_finalize (GObject * object);
+static void gst_bebo_shm_src_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec);
+static void gst_bebo_shm_src_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec);
+static gboolean gst_bebo_shm_src_start (GstBaseSrc * bsrc);
+static gboolean gst_bebo_shm_src_stop (GstBaseSrc * bsrc);
+static GstCaps *gst_bebo_shm_src_get_caps (GstBaseSrc * bsrc, GstCaps * filter);
+static gboolean gst_bebo_shm_src_unlock (GstBaseSrc * bsrc);
+static gboolean gst_bebo_shm_src_unlock_stop (GstBaseSrc * bsrc);
+static GstFlowReturn gst_bebo_shm_src_create (GstPushSrc * psrc,
+    GstBuffer ** outbuf);
+static gboolean gst_bebo_shm_src_query (GstBaseSrc * bsrc, GstQuery * query);
+static GstClock *gst_bebo_shm_src_provide_clock (GstElement * element);
+
+static void
+gst_bebo_shm_src_log (void *user_data, enum bebo_shmem_log_level level,
+    const char *message)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (user_data);
+
+  if (level == BEBO_SHMEM_LOG_ERROR) {
+    GST_WARNING_OBJECT (self, "%s", message);
+  } else {
+    GST_INFO_OBJECT (self, "%s", message);
+  }
+}
+
+static void
+gst_bebo_shm_src_init (GstBeboShmSrc * self)
+{
+  bebo_shmem_client_init (&self->client, gst_bebo_shm_src_log, self);
+  gst_video_info_init (&self->info);
+  self->encoded = FALSE;
+  self->need_keyframe = FALSE;
+  self->last_nr = 0;
+  self->catch_up = DEFAULT_CATCH_UP;
+  self->max_lag = 0;
+  self->max_latency = 0;
+  self->outstanding = 0;
+  self->closing = FALSE;
+  self->unlock = FALSE;
+  self->clock = gst_bebo_shm_clock_new ("GstBeboShmClock");
+  GST_OBJECT_FLAG_SET (self, GST_ELEMENT_FLAG_PROVIDE_CLOCK);
+
+  gst_base_src_set_live (GST_BASE_SRC (self), TRUE);
+  gst_base_src_set_format (GST_BASE_SRC (self), GST_FORMAT_TIME);
+  gst_base_src_set_do_timestamp (GST_BASE_SRC (self), TRUE);
+}
+
+static void
+gst_bebo_shm_src_class_init (GstBeboShmSrcClass * klass)
+{
+  GObjectClass *gobject_class = (GObjectClass *) klass;
+  GstElementClass *gstelement_class = (GstElementClass *) klass;
+  GstBaseSrcClass *gstbasesrc_class = (GstBaseSrcClass *) klass;
+  GstPushSrcClass *gstpushsrc_class = (GstPushSrcClass *) klass;
+
+  gobject_class->finalize = gst_bebo_shm_src_finalize;
+  gobject_class->set_property = gst_bebo_shm_src_set_property;
+  gobject_class->get_property = gst_bebo_shm_src_get_property;
+
+  gstelement_class->provide_clock =
+      GST_DEBUG_FUNCPTR (gst_bebo_shm_src_provide_clock);
+
+  gstbasesrc_class->start = GST_DEBUG_FUNCPTR (gst_bebo_shm_src_start);
+  gstbasesrc_class->stop = GST_DEBUG_FUNCPTR (gst_bebo_shm_src_stop);
+  gstbasesrc_class->get_caps = GST_DEBUG_FUNCPTR (gst_bebo_shm_src_get_caps);
+  gstbasesrc_class->unlock = GST_DEBUG_FUNCPTR (gst_bebo_shm_src_unlock);
+  gstbasesrc_class->unlock_stop =
+      GST_DEBUG_FUNCPTR (gst_bebo_shm_src_unlock_stop);
+  gstbasesrc_class->query = GST_DEBUG_FUNCPTR (gst_bebo_shm_src_query);
+  gstpushsrc_class->create = GST_DEBUG_FUNCPTR (gst_bebo_shm_src_create);
+
+  g_object_class_install_property (gobject_class, PROP_CHANNEL,
+      g_param_spec_string ("channel", "Channel",
+          "Shared memory channel of the dshowfiltersink to attach to "
+          "(NULL = the default channel)",
+          NULL, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY |
+          G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CATCH_UP,
+      g_param_spec_enum ("catch-up", "Catch Up",
+          "What to do when frames are later than max-lag or max-latency, "
+          "H.264 always pushes every frame",
+          GST_TYPE_BEBO_SHM_SRC_CATCH_UP, DEFAULT_CATCH_UP,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY |
+          G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_LAG,
+      g_param_spec_uint ("max-lag", "Max Lag",
+          "Frames behind the newest one before we are late (0 = no limit)",
+          0, G_MAXUINT, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY |
+          G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_LATENCY,
+      g_param_spec_uint ("max-latency", "Max Latency",
+          "Milliseconds since the producer published a frame before we are "
+          "late (0 = no limit)",
+          0, G_MAXUINT, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY |
+          G_PARAM_STATIC_STRINGS));
+
+  gst_element_class_add_static_pad_template (gstelement_class, &srctemplate);
+
+  gst_element_class_set_static_metadata (gstelement_class,
+      "Bebo Shared Memory Source",
+      "Source/Video",
+      "Receive raw video from dshowfiltersink over shared memory",
+      "Pigs in Flight, Inc");
+
+  GST_DEBUG_CATEGORY_INIT (beboshmsrc_debug, "beboshmsrc", 0,
+      "Bebo Shared Memory Source");
+}
+
+static void
+gst_bebo_shm_src_finalize (GObject * object)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (object);
+
+  // every buffer holds a ref on us, nothing can be outstanding here
+  gst_bebo_shm_clock_set_shmem (GST_BEBO_SHM_CLOCK (self->clock), NULL);
+  bebo_shmem_client_close (&self->client);
+  gst_object_unref (self->clock);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+gst_bebo_shm_src_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (object);
+
+  switch (prop_id) {
+    case PROP_CHANNEL:
+      GST_OBJECT_LOCK (self);
+      // taken on the next start
+      if (!bebo_shmem_client_set_channel (&self->client,
+              g_value_get_string (value))) {
+        GST_WARNING_OBJECT (self, "invalid channel name \"%s\"",
+            g_value_get_string (value));
+      }
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_CATCH_UP:
+      GST_OBJECT_LOCK (self);
+      self->catch_up = g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_MAX_LAG:
+      GST_OBJECT_LOCK (self);
+      self->max_lag = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_MAX_LATENCY:
+      GST_OBJECT_LOCK (self);
+      self->max_latency = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_bebo_shm_src_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (object);
+
+  switch (prop_id) {
+    case PROP_CHANNEL:
+      GST_OBJECT_LOCK (self);
+      g_value_set_string (value,
+          self->client.channel[0] ? self->client.channel : NULL);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_CATCH_UP:
+      GST_OBJECT_LOCK (self);
+      g_value_set_enum (value, self->catch_up);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_MAX_LAG:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint (value, self->max_lag);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_MAX_LATENCY:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint (value, self->max_latency);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static gboolean
+gst_bebo_shm_src_start (GstBaseSrc * bsrc)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (bsrc);
+  enum bebo_shmem_open_result res;
+  struct bebo_shmem_catch_up_policy policy;
+
+  GST_OBJECT_LOCK (self);
+  // nothing acquires while we start
+  policy.mode = (enum bebo_shmem_catch_up) self->catch_up;
+  policy.max_frames = self->max_lag;
+  policy.max_ms = self->max_latency;
+  bebo_shmem_client_set_catch_up (&self->client, &policy);
+  if (self->closing) {
+    // buffers of the last run are still around, keep using the client
+    self->closing = FALSE;
+    GST_OBJECT_UNLOCK (self);
+    gst_bebo_shm_clock_set_shmem (GST_BEBO_SHM_CLOCK (self->clock),
+        self->client.shmem);
+    return TRUE;
+  }
+  GST_OBJECT_UNLOCK (self);
+
+  res = bebo_shmem_client_open (&self->client);
+  if (res != BEBO_SHMEM_OPEN_OK) {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ,
+        ("Could not attach to the shared memory frame ring"),
+        ("bebo_shmem_client_open failed: %d", res));
+    return FALSE;
+  }
+
+  struct shmem *shmem = self->client.shmem;
+  gboolean encoded = shmem->codec == BEBO_SHMEM_CODEC_H264;
+  if (shmem->payload_size == 0 && !encoded) {
+    GST_ELEMENT_ERROR (self, RESOURCE, OPEN_READ,
+        ("The producer does not share pixels"),
+        ("dshowfiltersink needs payload=true"));
+    bebo_shmem_client_close (&self->client);
+    return FALSE;
+  }
+
+  GST_OBJECT_LOCK (self);
+  self->encoded = encoded;
+  self->need_keyframe = encoded;
+  self->last_nr = 0;
+  gst_video_info_set_format (&self->info, (GstVideoFormat) shmem->format,
+      shmem->video_info.width, shmem->video_info.height);
+  if (shmem->video_info.fps_d > 0) {
+    self->info.fps_n = shmem->video_info.fps_n;
+    self->info.fps_d = shmem->video_info.fps_d;
+  }
+  self->info_generation = shmem->info_generation;
+  GST_OBJECT_UNLOCK (self);
+
+  gst_bebo_shm_clock_set_shmem (GST_BEBO_SHM_CLOCK (self->clock), shmem);
+  // we joined somewhere in a GOP
+  if (encoded)
+    bebo_atomic_store_release_u32 (&shmem->keyframe_request, 1);
+
+  GST_DEBUG_OBJECT (self, "attached as reader %d, %s %dx%d",
+      self->client.reader,
+      gst_video_format_to_string (GST_VIDEO_INFO_FORMAT (&self->info)),
+      GST_VIDEO_INFO_WIDTH (&self->info), GST_VIDEO_INFO_HEIGHT (&self->info));
+  return TRUE;
+}
+
+static gboolean
+gst_bebo_shm_src_stop (GstBaseSrc * bsrc)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (bsrc);
+  gboolean close;
+
+  // the clock stays usable, it free runs from here
+  gst_bebo_shm_clock_set_shmem (GST_BEBO_SHM_CLOCK (self->clock), NULL);
+
+  GST_OBJECT_LOCK (self);
+  close = self->outstanding == 0;
+  self->closing = !close;
+  GST_OBJECT_UNLOCK (self);
+
+  if (close) {
+    bebo_shmem_client_close (&self->client);
+  } else {
+    GST_DEBUG_OBJECT (self, "%u buffers outstanding, closing later",
+        self->outstanding);
+  }
+  return TRUE;
+}
+
+/* Caller holds the object lock */
+static GstCaps *
+gst_bebo_shm_src_info_to_caps (GstBeboShmSrc * self, GstVideoInfo * info)
+{
+  if (!self->encoded)
+    return gst_video_info_to_caps (info);
+
+  return gst_caps_new_simple ("video/x-h264",
+      "stream-format", G_TYPE_STRING, "byte-stream",
+      "alignment", G_TYPE_STRING, "au",
+      "width", G_TYPE_INT, GST_VIDEO_INFO_WIDTH (info),
+      "height", G_TYPE_INT, GST_VIDEO_INFO_HEIGHT (info),
+      "framerate", GST_TYPE_FRACTION, GST_VIDEO_INFO_FPS_N (info),
+      GST_VIDEO_INFO_FPS_D (info), NULL);
+}
+
+static GstCaps *
+gst_bebo_shm_src_get_caps (GstBaseSrc * bsrc, GstCaps * filter)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (bsrc);
+  GstCaps *caps;
+
+  GST_OBJECT_LOCK (self);
+  if (self->client.shmem) {
+    caps = gst_bebo_shm_src_info_to_caps (self, &self->info);
+    GST_OBJECT_UNLOCK (self);
+  } else {
+    GST_OBJECT_UNLOCK (self);
+    caps = gst_pad_get_pad_template_caps (GST_BASE_SRC_PAD (bsrc));
+  }
+
+  if (filter) {
+    GstCaps *intersection =
+        gst_caps_intersect_full (filter, caps, GST_CAPS_INTERSECT_FIRST);
+    gst_caps_unref (caps);
+    caps = intersection;
+  }
+  return caps;
+}
+
+static GstClock *
+gst_bebo_shm_src_provide_clock (GstElement * element)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (element);
+
+  return gst_object_ref (self->clock);
+}
+
+/* Whether the pipeline runs on the producer's clock, fills in its current
+ * sample if so. */
+static gboolean
+gst_bebo_shm_src_on_producer_clock (GstBeboShmSrc * self,
+    struct bebo_shmem_clock *sample)
+{
+  gboolean ours;
+
+  GST_OBJECT_LOCK (self);
+  ours = GST_ELEMENT_CLOCK (self) == self->clock;
+  GST_OBJECT_UNLOCK (self);
+
+  return ours && self->client.shmem &&
+      bebo_shmem_clock_read (self->client.shmem, sample);
+}
+
+static gboolean
+gst_bebo_shm_src_query (GstBaseSrc * bsrc, GstQuery * query)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (bsrc);
+  struct bebo_shmem_clock sample;
+
+  // frames come out as late as the producer pipeline shows them
+  if (GST_QUERY_TYPE (query) == GST_QUERY_LATENCY &&
+      gst_bebo_shm_src_on_producer_clock (self, &sample)) {
+    GST_DEBUG_OBJECT (self, "producer latency %" GST_TIME_FORMAT,
+        GST_TIME_ARGS (sample.latency));
+    gst_query_set_latency (query, TRUE, sample.latency, GST_CLOCK_TIME_NONE);
+    return TRUE;
+  }
+
+  return GST_BASE_SRC_CLASS (parent_class)->query (bsrc, query);
+}
+
+static gboolean
+gst_bebo_shm_src_unlock (GstBaseSrc * bsrc)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (bsrc);
+
+  GST_OBJECT_LOCK (self);
+  self->unlock = TRUE;
+  GST_OBJECT_UNLOCK (self);
+  return TRUE;
+}
+
+static gboolean
+gst_bebo_shm_src_unlock_stop (GstBaseSrc * bsrc)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (bsrc);
+
+  GST_OBJECT_LOCK (self);
+  self->unlock = FALSE;
+  GST_OBJECT_UNLOCK (self);
+  return TRUE;
+}
+
+static void
+gst_bebo_shm_src_release_slot (gpointer data)
+{
+  SlotRelease *release = data;
+  GstBeboShmSrc *self = release->self;
+  gboolean close;
+
+  bebo_shmem_client_release (&self->client, release->ticket);
+
+  GST_OBJECT_LOCK (self);
+  self->outstanding--;
+  close = self->closing && self->outstanding == 0;
+  if (close)
+    self->closing = FALSE;
+  GST_OBJECT_UNLOCK (self);
+
+  if (close) {
+    GST_DEBUG_OBJECT (self, "last buffer released, closing");
+    bebo_shmem_client_close (&self->client);
+  }
+
+  gst_object_unref (self);
+  g_slice_free (SlotRelease, release);
+}
+
+/* Encoded streams: a delta unit is only any use if we have everything it
+ * refers to, otherwise wait for the next keyframe. */
+static gboolean
+gst_bebo_shm_src_decodable (GstBeboShmSrc * self, struct frame *frame)
+{
+  gboolean skipped = self->last_nr != 0 && frame->nr != self->last_nr + 1;
+
+  self->last_nr = frame->nr;
+  if (frame->flags & BEBO_SHMEM_FRAME_KEYFRAME) {
+    self->need_keyframe = FALSE;
+    return TRUE;
+  }
+  if (skipped && !self->need_keyframe) {
+    GST_DEBUG_OBJECT (self, "skipped to nr %" G_GUINT64_FORMAT
+        ", waiting for a keyframe", frame->nr);
+    self->need_keyframe = TRUE;
+    bebo_atomic_store_release_u32 (&self->client.shmem->keyframe_request, 1);
+  }
+  return !self->need_keyframe;
+}
+
+/* The producer switched caps, frame is the first one with the new ones */
+static gboolean
+gst_bebo_shm_src_renegotiate (GstBeboShmSrc * self, struct frame *frame)
+{
+  GstVideoInfo info, old;
+  GstCaps *caps;
+  gboolean ret;
+
+  GST_OBJECT_LOCK (self);
+  old = self->info;
+  gst_video_info_set_format (&info, (GstVideoFormat) frame->format,
+      frame->width, frame->height);
+  info.fps_n = old.fps_n;
+  info.fps_d = old.fps_d;
+  // get_caps must answer with the new caps while we negotiate
+  self->info = info;
+  GST_OBJECT_UNLOCK (self);
+
+  GST_INFO_OBJECT (self, "caps changed to %s %dx%d",
+      gst_video_format_to_string (GST_VIDEO_INFO_FORMAT (&info)),
+      GST_VIDEO_INFO_WIDTH (&info), GST_VIDEO_INFO_HEIGHT (&info));
+
+  GST_OBJECT_LOCK (self);
+  caps = gst_bebo_shm_src_info_to_caps (self, &info);
+  GST_OBJECT_UNLOCK (self);
+  ret = gst_base_src_set_caps (GST_BASE_SRC (self), caps);
+  gst_caps_unref (caps);
+
+  GST_OBJECT_LOCK (self);
+  if (ret)
+    self->info_generation = frame->info_generation;
+  else
+    self->info = old;
+  GST_OBJECT_UNLOCK (self);
+  return ret;
+}
+
+/* Put the GstMeta the producer serialized into frame.meta back on
+ * buffer, unknown records are skipped. */
+typedef void (*GstBeboShmSrcMetaDeserializeFunc) (GstBuffer * buffer,
+    const void *value, gsize size);
+
+static void
+gst_bebo_shm_src_deserialize_timecode (GstBuffer * buffer, const void *value,
+    gsize size)
+{
+  const struct bebo_shmem_meta_timecode *tc = value;
+  if (size < sizeof (*tc))
+    return;
+
+  gst_buffer_add_video_time_code_meta_full (buffer, tc->fps_n, tc->fps_d,
+      NULL, (GstVideoTimeCodeFlags) tc->flags, tc->hours, tc->minutes,
+      tc->seconds, tc->frames, tc->field_count);
+}
+
+static void
+gst_bebo_shm_src_deserialize_roi (GstBuffer * buffer, const void *value,
+    gsize size)
+{
+  const struct bebo_shmem_meta_roi *roi = value;
+  if (size < sizeof (*roi))
+    return;
+
+  gchar roi_type[sizeof (roi->roi_type)];
+  g_strlcpy (roi_type, roi->roi_type, sizeof (roi_type));
+  GstVideoRegionOfInterestMeta *meta =
+      gst_buffer_add_video_region_of_interest_meta (buffer, roi_type,
+      roi->x, roi->y, roi->w, roi->h);
+  meta->id = roi->id;
+  meta->parent_id = roi->parent_id;
+}
+
+#if GST_CHECK_VERSION(1, 16, 0)
+static void
+gst_bebo_shm_src_deserialize_caption (GstBuffer * buffer, const void *value,
+    gsize size)
+{
+  const struct bebo_shmem_meta_caption *cc = value;
+  if (size < sizeof (*cc) || size - sizeof (*cc) < cc->size)
+    return;
+
+  gst_buffer_add_video_caption_meta (buffer,
+      (GstVideoCaptionType) cc->caption_type, (const guint8 *) (cc + 1),
+      cc->size);
+}
+#endif
+
+static const struct {
+  uint16_t type;
+  GstBeboShmSrcMetaDeserializeFunc deserialize;
+} meta_deserializers[] = {
+  {BEBO_SHMEM_META_TIMECODE, gst_bebo_shm_src_deserialize_timecode},
+  {BEBO_SHMEM_META_ROI, gst_bebo_shm_src_deserialize_roi},
+#if GST_CHECK_VERSION(1, 16, 0)
+  {BEBO_SHMEM_META_CAPTION, gst_bebo_shm_src_deserialize_caption},
+#endif
+};
+
+static void
+gst_bebo_shm_src_deserialize_meta (GstBeboShmSrc * self, struct frame *frame,
+    GstBuffer * buffer)
+{
+  struct bebo_shmem_meta meta;
+  size_t offset = 0;
+  const void *value;
+
+  while ((value = bebo_shmem_meta_next (frame, &offset, &meta)) != NULL) {
+    for (guint i = 0; i < G_N_ELEMENTS (meta_deserializers); i++) {
+      if (meta_deserializers[i].type == meta.type) {
+        meta_deserializers[i].deserialize (buffer, value, meta.size);
+        break;
+      }
+    }
+  }
+}
+
+static GstFlowReturn
+gst_bebo_shm_src_create (GstPushSrc * psrc, GstBuffer ** outbuf)
+{
+  GstBeboShmSrc *self = GST_BEBO_SHM_SRC (psrc);
+  struct frame *frame;
+  uint64_t ticket;
+
+  for (;;) {
+    gboolean unlock;
+
+    GST_OBJECT_LOCK (self);
+    unlock = self->unlock;
+    GST_OBJECT_UNLOCK (self);
+    if (unlock)
+      return GST_FLOW_FLUSHING;
+
+    enum bebo_shmem_wait_result res = bebo_shmem_client_acquire (&self->client,
+        WAIT_TIMEOUT_MS, &frame, &ticket);
+    if (res == BEBO_SHMEM_WAIT_OK && self->encoded &&
+        !gst_bebo_shm_src_decodable (self, frame)) {
+      bebo_shmem_client_release (&self->client, ticket);
+      continue;
+    }
+    if (res == BEBO_SHMEM_WAIT_OK)
+      break;
+    if (res == BEBO_SHMEM_WAIT_ABANDONED) {
+      GST_ELEMENT_ERROR (self, RESOURCE, READ,
+          ("The producer went away"), (NULL));
+      return GST_FLOW_ERROR;
+    }
+    if (res == BEBO_SHMEM_WAIT_ERROR) {
+      GST_ELEMENT_ERROR (self, RESOURCE, READ,
+          ("Failed waiting for new frames"),
+          ("error %d", bebo_shmem_last_error ()));
+      return GST_FLOW_ERROR;
+    }
+  }
+
+  if (frame->info_generation != self->info_generation &&
+      !gst_bebo_shm_src_renegotiate (self, frame)) {
+    bebo_shmem_client_release (&self->client, ticket);
+    GST_ELEMENT_ERROR (self, CORE, NEGOTIATION,
+        ("Downstream did not accept the new video size"), (NULL));
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+
+  guint8 *data = bebo_shmem_client_payload (&self->client, frame);
+  if (data == NULL) {
+    bebo_shmem_client_release (&self->client, ticket);
+    GST_ELEMENT_ERROR (self, STREAM, FORMAT,
+        ("The producer stopped sharing pixels"), (NULL));
+    return GST_FLOW_ERROR;
+  }
+
+  SlotRelease *release = g_slice_new (SlotRelease);
+  release->self = gst_object_ref (self);
+  release->ticket = ticket;
+
+  GST_OBJECT_LOCK (self);
+  self->outstanding++;
+  GST_OBJECT_UNLOCK (self);
+
+  GstBuffer *buffer;
+  if (self->encoded) {
+    buffer = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, data,
+        (gsize) frame->size, 0, (gsize) frame->size, release,
+        gst_bebo_shm_src_release_slot);
+    if (!(frame->flags & BEBO_SHMEM_FRAME_KEYFRAME))
+      GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  } else {
+    buffer = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+        data, (gsize) self->client.shmem->payload_size, 0, (gsize) frame->size,
+        release, gst_bebo_shm_src_release_slot);
+
+    gsize offset[GST_VIDEO_MAX_PLANES] = { 0, };
+    gint stride[GST_VIDEO_MAX_PLANES] = { 0, };
+    for (guint i = 0; i < frame->n_planes && i < GST_VIDEO_MAX_PLANES; i++) {
+      offset[i] = frame->plane_offset[i];
+      stride[i] = frame->plane_stride[i];
+    }
+    gst_buffer_add_video_meta_full (buffer, GST_VIDEO_FRAME_FLAG_NONE,
+        GST_VIDEO_INFO_FORMAT (&self->info), GST_VIDEO_INFO_WIDTH (&self->info),
+        GST_VIDEO_INFO_HEIGHT (&self->info), frame->n_planes, offset, stride);
+  }
+
+  gst_bebo_shm_src_deserialize_meta (self, frame, buffer);
+
+  struct bebo_shmem_clock sample;
+  if (gst_bebo_shm_src_on_producer_clock (self, &sample)) {
+    GstClockTime base_time = gst_element_get_base_time (GST_ELEMENT (self));
+    GstClockTime time = sample.base_time + frame->pts;
+    // otherwise basesrc stamps it with the arrival time
+    if (time >= base_time) {
+      GST_BUFFER_PTS (buffer) = time - base_time;
+      GST_BUFFER_DTS (buffer) = time - base_time;
+    }
+  }
+
+  GST_BUFFER_OFFSET (buffer) = frame->nr;
+  GST_BUFFER_DURATION (buffer) = frame->duration;
+  if (frame->discontinuity)
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
+
+  GST_LOG_OBJECT (self, "nr: %" G_GUINT64_FORMAT " ticket: %" G_GINT64_MODIFIER
+      "x size: %" G_GUINT64_FORMAT, frame->nr, ticket, frame->size);
+
+  *outbuf = buffer;
+  return GST_FLOW_OK;
+}
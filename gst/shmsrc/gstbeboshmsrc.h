@@ -0,0 +1,87 @@
+/* GStreamer
+ * Copyright (C) 2019 Pigs in Flight, Inc
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ * vim: ts=2:sw=2
+ */
+
+#ifndef __GST_BEBO_SHM_SRC_H__
+#define __GST_BEBO_SHM_SRC_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstpushsrc.h>
+#include <gst/video/video.h>
+#include "bebo_shmem_client.h"
+#include "gstbeboshmclock.h"
+
+G_BEGIN_DECLS
+#define GST_TYPE_BEBO_SHM_SRC \
+  (gst_bebo_shm_src_get_type())
+#define GST_BEBO_SHM_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_BEBO_SHM_SRC,GstBeboShmSrc))
+#define GST_BEBO_SHM_SRC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_BEBO_SHM_SRC,GstBeboShmSrcClass))
+#define GST_IS_BEBO_SHM_SRC(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_BEBO_SHM_SRC))
+/* enum bebo_shmem_catch_up */
+typedef enum {
+  GST_BEBO_SHM_SRC_CATCH_UP_RENDER_ALL = BEBO_SHMEM_CATCH_UP_RENDER_ALL,
+  GST_BEBO_SHM_SRC_CATCH_UP_DROP_ALTERNATE = BEBO_SHMEM_CATCH_UP_DROP_ALTERNATE,
+  GST_BEBO_SHM_SRC_CATCH_UP_SKIP_TO_NEWEST = BEBO_SHMEM_CATCH_UP_SKIP_TO_NEWEST,
+} GstBeboShmSrcCatchUp;
+
+typedef struct _GstBeboShmSrc GstBeboShmSrc;
+typedef struct _GstBeboShmSrcClass GstBeboShmSrcClass;
+
+struct _GstBeboShmSrc
+{
+  GstPushSrc parent;
+
+  struct bebo_shmem_client client;
+  /* of the caps we negotiated, protected by the object lock */
+  GstVideoInfo info;
+  uint32_t info_generation;
+  /* H.264 access units instead of pixels, see BEBO_SHMEM_CODEC_H264 */
+  gboolean encoded;
+  gboolean need_keyframe;
+  uint64_t last_nr;
+
+  /* handed to the client on start, protected by the object lock */
+  GstBeboShmSrcCatchUp catch_up;
+  guint max_lag; /* frames */
+  guint max_latency; /* ms */
+
+  /* buffers still pinning a slot, the client is closed after the last one
+   * is gone. Protected by the object lock. */
+  guint outstanding;
+  gboolean closing;
+
+  gboolean unlock;
+
+  /* the producer's clock, offered to the pipeline */
+  GstClock *clock;
+};
+
+struct _GstBeboShmSrcClass
+{
+  GstPushSrcClass parent_class;
+};
+
+GType gst_bebo_shm_src_get_type(void);
+
+G_END_DECLS
+#endif /* __GST_BEBO_SHM_SRC_H__ */
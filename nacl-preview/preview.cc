@@ -21,7 +21,8 @@
 #include "ppapi/cpp/var_dictionary.h"
 #include "ppapi/lib/gl/gles2/gl2ext_ppapi.h"
 #include "ppapi/utility/completion_callback_factory.h"
-#include "shared/bebo_shmem.h"
+#include "shared/bebo_shmem_client.h"
+#include "shared/bebo_shmem_channel.h"
 #include "lru_cache.h"
 
 #ifdef WIN32
@@ -106,12 +107,18 @@ class GLTextureFrame {
 
 class PreviewFrame {
   public:
-    PreviewFrame(uint64_t nr, uint64_t ptr, uint64_t shared_handle):
-      nr_(nr), ptr_(ptr), shared_handle_(shared_handle), texture_(0) {};
+    PreviewFrame(uint64_t nr, uint64_t ptr, uint64_t shared_handle,
+        GLint width, GLint height, uint64_t due):
+      nr_(nr), ptr_(ptr), shared_handle_(shared_handle), width_(width),
+      height_(height), due_(due), texture_(0) {};
 
     uint64_t nr() const { return nr_; }
     uint64_t ptr() const { return ptr_; }
     uint64_t shared_handle() const { return shared_handle_; }
+    GLint width() const { return width_; }
+    GLint height() const { return height_; }
+    // producer clock time to show the frame at, 0 for right away
+    uint64_t due() const { return due_; }
     GLuint texture() const { return texture_; }
 
     void SetTexture(GLuint texture) {
@@ -122,6 +129,9 @@ class PreviewFrame {
     uint64_t ptr_;
     uint64_t nr_;
     uint64_t shared_handle_;
+    GLint width_;
+    GLint height_;
+    uint64_t due_;
     GLuint texture_;
 };
 
@@ -140,11 +150,11 @@ class PreviewInstance : public pp::Instance {
         texture_loc_(0),
         position_loc_(0),
         color_loc_(0),
-        shmem_(NULL),
-        shmem_handle_(NULL),
-        shmem_mutex_(NULL),
-        shmem_new_data_semaphore_(NULL),
-        texture_cache_(TEXTURE_CACHE_SIZE, 0) {}
+        info_generation_(0),
+        shmem_client_(),
+        texture_cache_(TEXTURE_CACHE_SIZE, 0) {
+    bebo_shmem_client_init(&shmem_client_, &PreviewInstance::ShmemLog, this);
+  }
 
   virtual ~PreviewInstance() {
     texture_cache_.clear();
@@ -152,16 +162,36 @@ class PreviewInstance : public pp::Instance {
   }
 
   virtual bool Init(uint32_t argc, const char* argn[], const char* argv[]) {
-    OpenSharedMemory();
+    struct bebo_shmem_catch_up_policy catch_up = {};
     for (uint32_t i = 0; i < argc; i++) {
       std::string key = std::string(argn[i]);
       std::string value = std::string(argv[i]);
-      if (key.compare("width")) {
+      if (key == "channel") {
+        if (!bebo_shmem_client_set_channel(&shmem_client_, value.c_str())) {
+          error("invalid channel name: %s", value.c_str());
+        }
+      } else if (key == "catch_up") {
+        if (value == "render-all") {
+          catch_up.mode = BEBO_SHMEM_CATCH_UP_RENDER_ALL;
+        } else if (value == "drop-alternate") {
+          catch_up.mode = BEBO_SHMEM_CATCH_UP_DROP_ALTERNATE;
+        } else if (value == "skip-to-newest") {
+          catch_up.mode = BEBO_SHMEM_CATCH_UP_SKIP_TO_NEWEST;
+        } else {
+          error("invalid catch_up: %s", value.c_str());
+        }
+      } else if (key == "max_lag") {
+        catch_up.max_frames = atoi(value.c_str());
+      } else if (key == "max_latency") {
+        catch_up.max_ms = atoi(value.c_str());
+      } else if (key.compare("width")) {
         negotiated_width_ = atoi(value.c_str());
       } else if (key.compare("height")) {
         negotiated_height_ = atoi(value.c_str());
       }
     }
+    bebo_shmem_client_set_catch_up(&shmem_client_, &catch_up);
+    OpenSharedMemory();
     return true;
   }
 
@@ -208,6 +238,9 @@ class PreviewInstance : public pp::Instance {
   }
 
   virtual void HandleMessage(const pp::Var& message) {
+    if (message.is_string() && message.AsString() == "list-channels") {
+      PostChannels();
+    }
   }
 
  private:
@@ -376,16 +409,24 @@ class PreviewInstance : public pp::Instance {
     GLuint        texture = 0;
     GLuint64      surface = 0;
 
-    if (!GetAndWaitForShmemFrame(&preview_frame)) {
+    if (!pending_frame_ && !GetAndWaitForShmemFrame(&pending_frame_)) {
       return false;
     }
 
+    // hold the frame back until the producer's clock says it is due
+    if (!IsDue(*pending_frame_)) {
+      return false;
+    }
+    preview_frame = std::move(pending_frame_);
+
     if (preview_frame->shared_handle() == 0) {
+      UnrefFrame(std::move(preview_frame));
       return false;
     }
 
-    GLint width  = shmem_->video_info.width;
-    GLint height = shmem_->video_info.height;
+    // the size may change from one frame to the next
+    GLint width  = preview_frame->width();
+    GLint height = preview_frame->height();
     std::string cache_key =
       std::to_string(width) + ":" +
       std::to_string(height) + ":" +
@@ -412,171 +453,92 @@ class PreviewInstance : public pp::Instance {
     return preview_frames_.back()->texture();
   }
 
-  void CloseSharedMemory() {
-    if (shmem_) {
-      UnmapViewOfFile(shmem_);
-      shmem_ = NULL;
-    }
-
-    if (shmem_handle_) {
-      CloseHandle(shmem_handle_);
-      shmem_handle_ = NULL;
+  bool IsDue(const PreviewFrame& frame) {
+    struct bebo_shmem_clock clock;
+    if (frame.due() == 0 || !shmem_client_.shmem ||
+        !bebo_shmem_clock_read(shmem_client_.shmem, &clock)) {
+      return true;
     }
+    return bebo_shmem_clock_time(&clock, bebo_shmem_now_ns()) >= frame.due();
+  }
 
-    if (shmem_mutex_) {
-      CloseHandle(shmem_mutex_);
-      shmem_mutex_ = NULL;
-    }
+  void CloseSharedMemory() {
+    // closing drops our pins, the tickets would only match whatever we pin
+    // in the next region
+    pending_frame_.reset();
+    preview_frames_ = std::queue<std::unique_ptr<PreviewFrame>>();
+    bebo_shmem_client_close(&shmem_client_);
+  }
 
-    if (shmem_new_data_semaphore_) {
-      CloseHandle(shmem_new_data_semaphore_);
-      shmem_new_data_semaphore_ = NULL;
-    }
+  static void ShmemLog(void* user_data, enum bebo_shmem_log_level level,
+      const char* message) {
+    PreviewInstance* self = static_cast<PreviewInstance*>(user_data);
+    self->PostLogMessage(level == BEBO_SHMEM_LOG_ERROR ? "ERROR" : "INFO",
+        "%s", message);
   }
 
   bool OpenSharedMemory() {
-    shmem_new_data_semaphore_ = OpenSemaphore(SYNCHRONIZE, false, BEBO_SHMEM_DATA_SEM);
-    if (!shmem_new_data_semaphore_) {
-      DWORD error = GetLastError();
-      if (error == 2) {
-        info("shared semaphore is not created yet, retrying in 500ms");
-      } else {
-        error("failed to open shared memory semaphore, %d", error);
-      }
-      Sleep(500);
-      return false;
-    }
-
-    shmem_handle_ = OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, false, BEBO_SHMEM_NAME);
-    if (!shmem_handle_) {
-      return false;
-    }
-
-    shmem_mutex_ = OpenMutexW(SYNCHRONIZE, false, BEBO_SHMEM_MUTEX);
-
-    DWORD result = WaitForSingleObject(shmem_mutex_, INFINITE);
-    if (result != WAIT_OBJECT_0) {
-      return false;
-    }
-
-    shmem_ = (struct shmem*) MapViewOfFile(shmem_handle_, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(struct shmem));
-    if (!shmem_) {
-      error("could not map shmem %d", GetLastError());
-      ReleaseMutex(shmem_mutex_);
-      return false;
-    }
-
-    uint64_t shmem_size = shmem_->shmem_size;
-    uint64_t version = shmem_->version;
-
-    UnmapViewOfFile(shmem_);
-    shmem_ = nullptr;
-
-    if (version != SHM_INTERFACE_VERSION) {
-      ReleaseMutex(shmem_mutex_);
-      error("SHM_INTERFACE_VERSION mismatch %d != %d", version, SHM_INTERFACE_VERSION);
-      Sleep(3000);
-      return false;
-    }
-
-    shmem_ = (struct shmem*) MapViewOfFile(shmem_handle_, FILE_MAP_ALL_ACCESS, 0, 0, shmem_size);
-    shmem_->read_ptr = 0;
-    video_width_ = shmem_->video_info.width;
-    video_height_ = shmem_->video_info.height;
-
-    ReleaseMutex(shmem_mutex_);
-
-    if (!shmem_) {
-      error("could not map shmem %d", GetLastError());
-      Sleep(300);
-      return false;
+    switch (bebo_shmem_client_open(&shmem_client_)) {
+      case BEBO_SHMEM_OPEN_OK:
+        break;
+      case BEBO_SHMEM_OPEN_NOT_FOUND:
+        info("retrying in 500ms");
+        bebo_shmem_sleep_ms(500);
+        return false;
+      case BEBO_SHMEM_OPEN_VERSION_MISMATCH:
+      case BEBO_SHMEM_OPEN_NO_READER_SLOT:
+        bebo_shmem_sleep_ms(3000);
+        return false;
+      default:
+        bebo_shmem_sleep_ms(300);
+        return false;
     }
 
-    info("successfully opened shared memory buffer");
+    video_width_ = shmem_client_.shmem->video_info.width;
+    video_height_ = shmem_client_.shmem->video_info.height;
+    info_generation_ = shmem_client_.shmem->info_generation;
     return true;
   }
 
   bool GetAndWaitForShmemFrame(std::unique_ptr<PreviewFrame>* out_frame) {
-    if (!shmem_ && !OpenSharedMemory()) {
+    if (!shmem_client_.shmem && !OpenSharedMemory()) {
       return false;
     }
 
-    DWORD result = WaitForSingleObject(shmem_mutex_, INFINITE);
-    if (result != WAIT_OBJECT_0) {
+    // lock free, see bebo_shmem_ring.h
+    uint32_t wait_time_ms = 1000; // TODO: change it to indefinitely but need to support shutdown case
+    struct frame* frame;
+    uint64_t ticket;
+    enum bebo_shmem_wait_result res =
+      bebo_shmem_client_acquire(&shmem_client_, wait_time_ms, &frame, &ticket);
+    if (res == BEBO_SHMEM_WAIT_ABANDONED) {
+      // the producer died, open whatever the next one creates
+      CloseSharedMemory();
       return false;
     }
-
-    DWORD wait_time_ms = 1000; // TODO: change it to indefinitely but need to support shutdown case
-    while (shmem_->write_ptr == 0 || shmem_->read_ptr >= shmem_->write_ptr) {
-      result = SignalObjectAndWait(shmem_mutex_,
-          shmem_new_data_semaphore_,
-          wait_time_ms,
-          false);
-
-      // re-attempt if we fail to acquire the semaphore
-      if (result != WAIT_OBJECT_0) {
-        ReleaseMutex(shmem_mutex_);
-        return false;
-      }
-
-      // acquire the mutex to access shmem_ for later
-      if (WaitForSingleObject(shmem_mutex_, INFINITE) != WAIT_OBJECT_0) {
-        continue;
-      }
+    if (res != BEBO_SHMEM_WAIT_OK) {
+      return false;
     }
 
-    if (shmem_->read_ptr == 0) {
-      if (shmem_->write_ptr - shmem_->read_ptr > 0) {
-        shmem_->read_ptr = shmem_->write_ptr;
-        info("starting stream - resetting read pointer read_ptr: %d write_ptr: %d",
-            shmem_->read_ptr, shmem_->write_ptr);
-        UnrefBefore(shmem_->read_ptr);
-      }
-    } else if (shmem_->write_ptr - shmem_->read_ptr > shmem_->count) {
-      uint64_t read_ptr = shmem_->write_ptr - shmem_->count / 2;
-      info("late - resetting read pointer read_ptr: %d write_ptr: %d behind: %d new read_ptr: %d",
-          shmem_->read_ptr, shmem_->write_ptr, shmem_->write_ptr - shmem_->read_ptr, read_ptr);
-      shmem_->read_ptr = read_ptr;
-      UnrefBefore(shmem_->read_ptr);
+    if (frame->info_generation != info_generation_) {
+      info_generation_ = frame->info_generation;
+      video_width_ = frame->width;
+      video_height_ = frame->height;
     }
 
-    uint64_t i = shmem_->read_ptr % shmem_->count;
-    uint64_t frame_offset = shmem_->frame_offset + i * shmem_->frame_size;
-    struct frame *frame = (struct frame*) (((char*)shmem_) + frame_offset);
-    frame->ref_cnt++;
-    shmem_->read_ptr++;
+    struct bebo_shmem_clock clock;
+    uint64_t due = 0;
+    if (bebo_shmem_clock_read(shmem_client_.shmem, &clock)) {
+      due = bebo_shmem_clock_frame_time(&clock, frame);
+    }
 
-    *out_frame = std::make_unique<PreviewFrame>(frame->nr, i, (uint64_t) frame->dxgi_handle);
-    ReleaseMutex(shmem_mutex_);
+    *out_frame = std::make_unique<PreviewFrame>(frame->nr, ticket,
+        (uint64_t) frame->dxgi_handle, frame->width, frame->height, due);
     return true;
   }
 
-  struct frame* GetShmFrame(uint64_t i) {
-    uint64_t frame_offset = shmem_->frame_offset + i * shmem_->frame_size;
-    return (struct frame*) (((char*)shmem_) + frame_offset);
-  }
-
-  void UnrefBefore(uint64_t before) {
-    // expect to hold mutex!
-    for (int i = 0; i < shmem_->count; i++) {
-      auto shm_frame = GetShmFrame(i);
-      if (shm_frame->ref_cnt < 2 && shm_frame->nr < before) {
-        shm_frame->ref_cnt = 0;
-      }
-    }
-  }
-
   void UnrefFrame(std::unique_ptr<PreviewFrame> frame) {
-    if (WaitForSingleObject(shmem_mutex_, 1000) != WAIT_OBJECT_0) {
-      return;
-    }
-
-    auto shm_frame = GetShmFrame(frame->ptr());
-    if (shm_frame->nr == frame->nr()) {
-      shm_frame->ref_cnt = shm_frame->ref_cnt - 2;
-    }
-
-    ReleaseMutex(shmem_mutex_);
+    bebo_shmem_client_release(&shmem_client_, frame->ptr());
   }
 
   void UnrefOldFrame() {
@@ -588,6 +550,27 @@ class PreviewInstance : public pp::Instance {
     UnrefFrame(std::move(frame));
   }
 
+  // the producers there are, so the page can pick one for the channel attribute
+  void PostChannels() {
+    struct bebo_shmem_channel channels[BEBO_SHMEM_MAX_CHANNELS];
+    int n = bebo_shmem_channel_list(channels, BEBO_SHMEM_MAX_CHANNELS);
+
+    pp::VarArray list;
+    list.SetLength(n);
+    for (int i = 0; i < n; i++) {
+      pp::VarDictionary channel;
+      channel.Set(pp::Var("name"), pp::Var(channels[i].name));
+      channel.Set(pp::Var("width"), pp::Var((int32_t) channels[i].width));
+      channel.Set(pp::Var("height"), pp::Var((int32_t) channels[i].height));
+      channel.Set(pp::Var("fps_n"), pp::Var(channels[i].fps_n));
+      channel.Set(pp::Var("fps_d"), pp::Var(channels[i].fps_d));
+      channel.Set(pp::Var("slots"), pp::Var((int32_t) channels[i].count));
+      channel.Set(pp::Var("payload"), pp::Var(channels[i].payload_size != 0));
+      list.Set(i, channel);
+    }
+    PostTypedMessage("channels", list);
+  }
+
   void PostTypedMessage(std::string type, pp::Var message) {
     pp::VarDictionary dictionary;
     dictionary.Set(pp::Var("type"), pp::Var(type));
@@ -628,6 +611,8 @@ class PreviewInstance : public pp::Instance {
   GLuint index_buffer_;
 
   std::queue<std::unique_ptr<PreviewFrame>> preview_frames_;
+  // acquired but not due yet
+  std::unique_ptr<PreviewFrame> pending_frame_;
   lru::Cache<std::string, std::shared_ptr<GLTextureFrame>> texture_cache_;
 
   GLuint texture_loc_;
@@ -636,11 +621,9 @@ class PreviewInstance : public pp::Instance {
   GLuint color_loc_;
   GLint video_width_;
   GLint video_height_;
+  uint32_t info_generation_;
 
-  struct shmem* shmem_;
-  HANDLE shmem_handle_;
-  HANDLE shmem_mutex_;
-  HANDLE shmem_new_data_semaphore_;
+  struct bebo_shmem_client shmem_client_;
 };
 
 class Graphics3DModule : public pp::Module {
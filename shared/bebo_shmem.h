@@ -6,17 +6,152 @@
 #include <gst/video/video.h>
 #include <gst/video/video-format.h>
 
-#define BEBO_SHMEM_NAME       L"BEBO_SHARED_MEMORY_BUFFER"
-#define BEBO_SHMEM_MUTEX      L"BEBO_SHARED_MEMORY_BUFFER_MUTEX"
-#define BEBO_SHMEM_DATA_SEM   L"BEBO_SHARE_MEMORY_NEW_DATA_SEMAPHORE"
+#include "bebo_shmem_platform.h"
+
+#ifndef _WIN32
+/* dxgi_handle is only meaningful on Windows, keep the field pointer sized */
+typedef void *HANDLE;
+#endif
+
+/* object names, see bebo_shmem_platform.h. A producer on a channel other
+ * than the default one appends "@<channel>", see bebo_shmem_object_name() */
+#define BEBO_SHMEM_NAME       "BEBO_SHARED_MEMORY_BUFFER"
+#define BEBO_SHMEM_MUTEX      "BEBO_SHARED_MEMORY_BUFFER_MUTEX"
+#define BEBO_SHMEM_DATA_SEM   "BEBO_SHARE_MEMORY_NEW_DATA_SEMAPHORE" // + "_<reader>"
+/* Linux, Unix socket in the abstract namespace, see bebo_shmem_pool.h */
+#define BEBO_SHMEM_POOL_SOCKET "BEBO_SHARED_MEMORY_POOL"
+/* struct bebo_shmem_registry, shared by all producers. Has its own
+ * version, bump the suffix when the registry structs change. */
+#define BEBO_SHMEM_REGISTRY   "BEBO_SHARED_MEMORY_CHANNELS_1"
+
+#define BEBO_SHMEM_MAX_CHANNELS 32
+/* including the terminating 0, letters, digits, '-' and '_' only */
+#define BEBO_SHMEM_MAX_CHANNEL_NAME 48
+
+#define BEBO_SHMEM_MAX_READERS 8
+
+/* shmem.codec */
+#define BEBO_SHMEM_CODEC_RAW   0
+#define BEBO_SHMEM_CODEC_H264  1 // byte-stream, one access unit per frame
+
+/* frame.flags */
+#define BEBO_SHMEM_FRAME_KEYFRAME (1u << 0)
+
+/* bytes of serialized GstMeta a frame can carry, see struct frame.meta */
+#define BEBO_SHMEM_FRAME_META_SIZE 512
+
+/* bebo_shmem_meta.type */
+#define BEBO_SHMEM_META_TIMECODE 1 // struct bebo_shmem_meta_timecode
+#define BEBO_SHMEM_META_ROI      2 // struct bebo_shmem_meta_roi
+#define BEBO_SHMEM_META_CAPTION  3 // struct bebo_shmem_meta_caption + the caption bytes
+
+/* bebo_shmem_audio_chunk.flags */
+#define BEBO_SHMEM_AUDIO_DISCONT (1u << 0)
 
 /*
- * ATTENTION - MAKE SURE YOU INCREASE THE SHM_INTERFACE_VERSION WHEN YOU CHANGE THE SHM STRUCTS BELOW !
+ * ATTENTION - struct shmem, struct frame and what they embed are the v1 view
+ * every reader knows. Readers refuse to attach when SHM_INTERFACE_VERSION
+ * changes, so don't change these structs. New features go into struct
+ * bebo_shmem_v2 behind a BEBO_SHMEM_FEATURE_* bit instead, readers that
+ * don't know the bit keep working.
  */
-#define SHM_INTERFACE_VERSION 1521597836
+#define SHM_INTERFACE_VERSION 1793181600
+
+/* bebo_shmem_v2.magic, "BEBOSHM2" */
+#define BEBO_SHMEM_V2_MAGIC 0x324d48534f424542ull
+#define BEBO_SHMEM_CACHE_LINE 64
+
+/* bebo_shmem_v2.features, .required and bebo_shmem_reader_line.features */
+#define BEBO_SHMEM_FEATURE_READER_LINES (1ull << 0) // read_ptr, heartbeat and wake_at in bebo_shmem_v2.reader
+#define BEBO_SHMEM_FEATURE_FD_POOL      (1ull << 1) // pixels in buffers passed over BEBO_SHMEM_POOL_SOCKET, see bebo_shmem_v2.slot_offset
+#define BEBO_SHMEM_FEATURE_RELEASE_RING (1ull << 2) // readers push the slots they free to bebo_shmem_v2.release_offset
+#define BEBO_SHMEM_FEATURE_OBSERVERS    (1ull << 3) // observers stamp bebo_shmem_v2.observer_heartbeat
+/* all features this build knows */
+#ifdef _WIN32
+#define BEBO_SHMEM_FEATURES_KNOWN (BEBO_SHMEM_FEATURE_READER_LINES | \
+    BEBO_SHMEM_FEATURE_RELEASE_RING | BEBO_SHMEM_FEATURE_OBSERVERS)
+#else
+#define BEBO_SHMEM_FEATURES_KNOWN (BEBO_SHMEM_FEATURE_READER_LINES | \
+    BEBO_SHMEM_FEATURE_FD_POOL | BEBO_SHMEM_FEATURE_RELEASE_RING | \
+    BEBO_SHMEM_FEATURE_OBSERVERS)
+#endif
+
+/* entries of struct bebo_shmem_release_ring */
+#define BEBO_SHMEM_RELEASE_RING_SIZE 256
+
+/* bebo_shmem_slot.pool_index of a frame without a pool buffer */
+#define BEBO_SHMEM_POOL_NONE UINT32_MAX
 
 /*
  * Will use a ring buffer for frames, and will trigger semaphore when new items are in the buffer
+ *
+ * The mutex is only taken to attach / detach. Frames are handed over without
+ * locking, see bebo_shmem_ring.h for the protocol on write_ptr, the reader
+ * table, frame.seq and frame.reader_mask.
+ *
+ * Each reader has its own counting semaphore. A reader that wants to sleep
+ * stores the frame nr it wants to be woken at in reader.wake_at, the
+ * producer signals once when it publishes that frame and clears the
+ * request. Readers can wait for several frames at a time this way.
+ *
+ * In payload mode (shmem.payload_size != 0) the pixels travel in the region
+ * itself: count blocks of payload_size bytes start at shmem.payload_offset.
+ * A frame points to its block with payload_offset, planes are found at
+ * payload_offset + plane_offset[i] with plane_stride[i] bytes per line, the
+ * layout of shmem.video_info does not have to be known.
+ *
+ * With an encoded stream (shmem.codec != BEBO_SHMEM_CODEC_RAW) the slots are
+ * an index into a circular byte arena of arena_size bytes at payload_offset.
+ * A frame's access unit is the size bytes at frame.payload_offset, frames
+ * without BEBO_SHMEM_FRAME_KEYFRAME need the ones before them. A reader
+ * that has to start over sets shmem.keyframe_request.
+ *
+ * If audio_count != 0 an audio ring follows: audio_count chunk headers at
+ * audio_offset, then audio_count blocks of audio_chunk_size bytes of
+ * interleaved PCM at audio_data_offset. Chunks are never pinned, the
+ * producer overwrites the oldest one and readers copy them out under
+ * chunk.seq. chunk.pts is a buffer pts like frame.pts. Audio does not wake
+ * readers, they pick it up with the frames, see
+ * bebo_shmem_client_read_audio().
+ *
+ * frame.meta carries meta_size bytes of GstMeta the producer knows how to
+ * serialize, as records of a struct bebo_shmem_meta followed by size
+ * bytes of value, each record starting 8 byte aligned. Unknown types are
+ * skipped, see bebo_shmem_meta_next().
+ *
+ * Producers since v2 put a struct bebo_shmem_v2 at shmem.v2_offset,
+ * cache line aligned. It lists the features the producer offers and the
+ * ones a reader must know to attach at all, readers say which ones they
+ * use in their reader line when they attach. Where v1 has the readers'
+ * read_ptr, heartbeat and wake_at next to write_ptr, so every read bounces
+ * the producer's cache line, v2 gives each reader a line of its own. v1
+ * readers keep using the v1 reader table. See bebo_shmem_v2().
+ *
+ * With BEBO_SHMEM_FEATURE_FD_POOL (Linux) the pixels don't live in the
+ * region but in a pool of memfd or dmabuf buffers the producer hands to
+ * every reader once over BEBO_SHMEM_POOL_SOCKET. A frame's
+ * bebo_shmem_slot at v2.slot_offset names its buffer by pool index, the
+ * reader maps each buffer a single time. See bebo_shmem_pool.h.
+ *
+ * With BEBO_SHMEM_FEATURE_RELEASE_RING a reader that takes the last mark
+ * off a slot pushes the slot index to the struct bebo_shmem_release_ring
+ * at v2.release_offset. The producer unrefs exactly those slots instead of
+ * looking at every slot after every frame. Entries are only hints: the
+ * producer still checks reader_mask, and falls back to looking at every
+ * slot now and then, when the ring was full or a reader does not push.
+ * See bebo_shmem_release_push().
+ *
+ * Observers never attach, so the producer can't see them in the reader
+ * table. With BEBO_SHMEM_FEATURE_OBSERVERS they stamp
+ * v2.observer_heartbeat on every snapshot, and the producer keeps
+ * publishing frames for a while after that even when no reader is
+ * attached. It never takes the newest published frame back on its own, so
+ * a snapshot always finds one, if possibly an old one (see frame.pts).
+ *
+ * shmem.clock publishes the producer pipeline clock as a line through
+ * samples of (bebo_shmem_now_ns(), clock time), so readers can tell the
+ * producer's clock time without asking it. A frame is due at
+ * clock.base_time + frame.pts + clock.latency, see bebo_shmem_clock_time().
  */
 #ifdef __cplusplus
   extern "C" {
@@ -33,21 +168,190 @@
     uint64_t duration;
     uint64_t size;
     HANDLE dxgi_handle;
+    uint64_t payload_offset; // from the start of struct shmem, 0 if there are no pixels
+    uint32_t n_planes;
+    uint32_t plane_offset[GST_VIDEO_MAX_PLANES];
+    int32_t plane_stride[GST_VIDEO_MAX_PLANES];
     uint8_t discontinuity;
-    uint8_t ref_cnt;
+    uint32_t reader_mask; // atomic, pin and unread bit per reader
     void *_gst_buf_ref;
     //GstBuffer *_gst_buf_ref;
+    uint64_t seq; // atomic, odd while the producer rewrites the slot
+    uint64_t publish_ns; // bebo_shmem_now_ns() when the producer published it
+    // what this frame holds, may differ from the header after a caps change
+    uint32_t width;
+    uint32_t height;
+    int32_t format; // GstVideoFormat
+    uint32_t info_generation; // shmem.info_generation the frame was made with
+    uint64_t read_ns[BEBO_SHMEM_MAX_READERS]; // written by reader i while pinned, 0 if not read
+    uint32_t flags; // BEBO_SHMEM_FRAME_*
+    uint32_t meta_size; // bytes used in meta
+    uint8_t meta[BEBO_SHMEM_FRAME_META_SIZE];
+  };
+
+  struct bebo_shmem_meta {
+    uint16_t type; // BEBO_SHMEM_META_*
+    uint16_t size; // of the value that follows
+  };
+
+  /* GstVideoTimeCodeMeta */
+  struct bebo_shmem_meta_timecode {
+    uint32_t fps_n;
+    uint32_t fps_d;
+    uint32_t flags; // GstVideoTimeCodeFlags
+    uint32_t hours;
+    uint32_t minutes;
+    uint32_t seconds;
+    uint32_t frames;
+    uint32_t field_count;
+  };
+
+  /* GstVideoRegionOfInterestMeta, one record per region */
+  struct bebo_shmem_meta_roi {
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+    int32_t id;
+    int32_t parent_id;
+    char roi_type[32]; // NUL terminated, truncated
+  };
+
+  /* GstVideoCaptionMeta, the caption bytes follow */
+  struct bebo_shmem_meta_caption {
+    uint32_t caption_type; // GstVideoCaptionType
+    uint32_t size;
+  };
+
+  struct bebo_shmem_audio_chunk {
+    uint64_t seq; // atomic, odd while the producer rewrites the chunk
+    uint64_t nr; // 0 if empty
+    uint64_t pts;
+    uint64_t duration;
+    uint32_t size; // bytes of PCM
+    uint32_t flags; // BEBO_SHMEM_AUDIO_*
+  };
+
+  struct bebo_shmem_reader {
+    uint64_t read_ptr; // atomic, next frame nr this reader wants
+    uint64_t heartbeat; // atomic, bebo_shmem_now_ns() of the last read or wait
+    uint32_t pid;
+    uint32_t generation; // atomic, bumped on attach and when the producer evicts the reader, top bit is BEBO_SHMEM_GENERATION_RELEASING
+    uint64_t wake_at; // atomic, signal the reader once this frame nr is published, 0 if it is not waiting
+  };
+
+  struct bebo_shmem_clock {
+    uint64_t seq; // atomic, odd while the producer updates the clock
+    uint64_t base_time; // of the producer pipeline
+    uint64_t latency; // of the producer pipeline, frames are shown this late
+    uint64_t internal; // bebo_shmem_now_ns() of the sample
+    uint64_t external; // producer clock time at internal
+    uint64_t rate_num; // external advances rate_num ns per rate_denom ns
+    uint64_t rate_denom; // 0 until the producer has a clock
   };
 
   struct shmem {
     uint64_t version;
-    GstVideoInfo video_info;
+    uint32_t owner_pid; // producer
+    uint64_t owner_heartbeat; // atomic, bebo_shmem_now_ns() of the last render
+    GstVideoInfo video_info; // finfo is a pointer into the producer, use format
+    int32_t format; // GstVideoFormat
+    uint32_t info_generation; // atomic, bumped with every caps change, under BEBO_SHMEM_MUTEX
     uint64_t shmem_size;
     uint64_t frame_offset;
     uint64_t frame_size;
     uint64_t count;
-    uint64_t write_ptr; // TODO better name - not really a ptr more like frame count
-    uint64_t read_ptr;
+    uint64_t write_ptr; // atomic - TODO better name - not really a ptr more like frame count
+    uint32_t readers; // atomic, bit per attached reader
+    struct bebo_shmem_reader reader[BEBO_SHMEM_MAX_READERS];
+    uint64_t payload_offset;
+    uint64_t payload_size; // per block, 0 unless the sink runs in payload mode
+    struct bebo_shmem_clock clock;
+    uint32_t codec; // BEBO_SHMEM_CODEC_*
+    uint32_t keyframe_request; // atomic, set by readers, cleared by the producer
+    uint64_t arena_size; // encoded streams, bytes at payload_offset
+    uint64_t audio_offset;
+    uint64_t audio_data_offset;
+    uint32_t audio_count; // 0 without an audio ring
+    uint32_t audio_chunk_size;
+    uint64_t audio_write_ptr; // atomic, nr of the newest chunk
+    // under BEBO_SHMEM_MUTEX, audio_generation is bumped when they change
+    int32_t audio_format; // GstAudioFormat, 0 until the producer has caps
+    uint32_t audio_rate;
+    uint32_t audio_channels;
+    uint32_t audio_generation; // atomic
+    // struct bebo_shmem_v2, 0 if there is none. The last v1 field, read it
+    // with bebo_shmem_v2(), older producers have frames here.
+    uint64_t v2_offset;
+  };
+
+  /* One cache line, only written by its reader (and the producer taking
+   * wake_at). */
+  struct bebo_shmem_reader_line {
+    uint64_t features; // atomic, BEBO_SHMEM_FEATURE_* the reader uses, set on attach, 0 for v1 readers
+    uint64_t read_ptr; // atomic, like bebo_shmem_reader
+    uint64_t heartbeat; // atomic
+    uint64_t wake_at; // atomic
+    uint8_t _pad[BEBO_SHMEM_CACHE_LINE - 4 * sizeof(uint64_t)];
+  };
+
+  struct bebo_shmem_v2 {
+    // written before the first reader can attach, read only after that
+    uint64_t magic; // BEBO_SHMEM_V2_MAGIC
+    uint64_t size; // sizeof(struct bebo_shmem_v2) of the producer, later versions append
+    uint64_t features; // BEBO_SHMEM_FEATURE_* the producer offers
+    uint64_t required; // features a reader must know to attach
+    uint8_t _pad[BEBO_SHMEM_CACHE_LINE - 4 * sizeof(uint64_t)];
+    struct bebo_shmem_reader_line reader[BEBO_SHMEM_MAX_READERS];
+    uint64_t slot_offset; // struct bebo_shmem_slot[shmem.count] from the start of the region, 0 without BEBO_SHMEM_FEATURE_FD_POOL
+    uint64_t release_offset; // struct bebo_shmem_release_ring from the start of the region, 0 without BEBO_SHMEM_FEATURE_RELEASE_RING
+    uint64_t observer_heartbeat; // atomic, bebo_shmem_now_ns() of the last snapshot, see BEBO_SHMEM_FEATURE_OBSERVERS
+  };
+
+  /* Many readers push, the producer takes. head and tail sit in lines of
+   * their own, the producer only looks at head when an entry is late. */
+  struct bebo_shmem_release_ring {
+    uint64_t head; // atomic, position the next reader writes to
+    uint8_t _pad0[BEBO_SHMEM_CACHE_LINE - sizeof(uint64_t)];
+    uint64_t tail; // atomic, position the producer takes next
+    uint8_t _pad1[BEBO_SHMEM_CACHE_LINE - sizeof(uint64_t)];
+    // atomic, lap << 32 | slot index, lap is position / size + 1 so a stale
+    // entry is never taken for a new one
+    uint64_t entry[BEBO_SHMEM_RELEASE_RING_SIZE];
+  };
+
+  /* What struct frame has no room for, written with the frame under its
+   * seq. */
+  struct bebo_shmem_slot {
+    uint32_t pool_index; // BEBO_SHMEM_POOL_NONE if the frame has no pool buffer
+    uint32_t pool_generation; // of the buffer, it was sent again when this changed
+    uint64_t pool_offset; // of the pixels in the buffer
+  };
+
+  /*
+   * Every running producer has an entry in the registry, so readers can
+   * find the channels there are without knowing their names. An entry is
+   * claimed with a CAS of owner_pid from 0 (or a dead process) to the
+   * producer's pid and written under seq like a frame slot, readers copy it
+   * out optimistically. See bebo_shmem_channel.h.
+   */
+  struct bebo_shmem_channel {
+    uint64_t seq; // atomic, odd while the producer updates the entry
+    uint32_t owner_pid; // atomic, 0 if the entry is free
+    uint32_t codec; // BEBO_SHMEM_CODEC_*
+    char name[BEBO_SHMEM_MAX_CHANNEL_NAME]; // "" is the default channel
+    // what shmem.video_info says, updated with every caps change
+    uint32_t width;
+    uint32_t height;
+    int32_t format; // GstVideoFormat
+    int32_t fps_n;
+    int32_t fps_d;
+    uint32_t count; // slots
+    uint64_t payload_size; // per block, 0 if only DXGI handles travel
+  };
+
+  struct bebo_shmem_registry {
+    struct bebo_shmem_channel channel[BEBO_SHMEM_MAX_CHANNELS];
   };
 
 #pragma pack(pop)
@@ -0,0 +1,156 @@
+#pragma once
+
+/*
+ * Minimal atomics for fields of the shared memory ring that are accessed
+ * from several processes without holding BEBO_SHMEM_MUTEX.
+ *
+ * MSVC does not ship C11 <stdatomic.h> for C, so map onto the Interlocked
+ * intrinsics there and onto the __atomic builtins everywhere else. All
+ * fields passed in must be naturally aligned.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef __cplusplus
+  extern "C" {
+#endif
+
+#ifdef _MSC_VER
+
+  /* x86/x64: aligned loads and stores are atomic, loads have acquire and
+   * stores release semantics, the compiler barrier keeps them in order. */
+  static inline uint64_t bebo_atomic_load_u64(uint64_t *p) {
+    uint64_t v = *(volatile uint64_t *) p;
+    _ReadWriteBarrier();
+    return v;
+  }
+
+  static inline uint32_t bebo_atomic_load_u32(uint32_t *p) {
+    uint32_t v = *(volatile uint32_t *) p;
+    _ReadWriteBarrier();
+    return v;
+  }
+
+  static inline void bebo_atomic_store_release_u64(uint64_t *p, uint64_t v) {
+    _ReadWriteBarrier();
+    *(volatile uint64_t *) p = v;
+  }
+
+  static inline void bebo_atomic_store_release_u32(uint32_t *p, uint32_t v) {
+    _ReadWriteBarrier();
+    *(volatile uint32_t *) p = v;
+  }
+
+  /* sequentially consistent store */
+  static inline void bebo_atomic_store_u64(uint64_t *p, uint64_t v) {
+    _InterlockedExchange64((volatile __int64 *) p, (__int64) v);
+  }
+
+  /* returns the new value */
+  static inline uint32_t bebo_atomic_add_u32(uint32_t *p, int32_t v) {
+    return (uint32_t) _InterlockedExchangeAdd((volatile long *) p, v) + v;
+  }
+
+  static inline uint64_t bebo_atomic_add_u64(uint64_t *p, int64_t v) {
+    return (uint64_t) _InterlockedExchangeAdd64((volatile __int64 *) p, v) + v;
+  }
+
+  static inline bool bebo_atomic_cas_u32(uint32_t *p, uint32_t expected,
+      uint32_t desired) {
+    return (uint32_t) _InterlockedCompareExchange((volatile long *) p,
+        (long) desired, (long) expected) == expected;
+  }
+
+  static inline bool bebo_atomic_cas_u64(uint64_t *p, uint64_t expected,
+      uint64_t desired) {
+    return (uint64_t) _InterlockedCompareExchange64((volatile __int64 *) p,
+        (__int64) desired, (__int64) expected) == expected;
+  }
+
+  /* return the new value */
+  static inline uint32_t bebo_atomic_or_u32(uint32_t *p, uint32_t v) {
+    return (uint32_t) _InterlockedOr((volatile long *) p, (long) v) | v;
+  }
+
+  static inline uint32_t bebo_atomic_and_u32(uint32_t *p, uint32_t v) {
+    return (uint32_t) _InterlockedAnd((volatile long *) p, (long) v) & v;
+  }
+
+  /* orders the loads before the fence with the loads after it */
+  static inline void bebo_atomic_fence_acquire(void) {
+    _ReadWriteBarrier();
+  }
+
+  /* orders the stores before the fence with the stores after it */
+  static inline void bebo_atomic_fence_release(void) {
+    _ReadWriteBarrier();
+  }
+
+#else
+
+  static inline uint64_t bebo_atomic_load_u64(uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+  }
+
+  static inline uint32_t bebo_atomic_load_u32(uint32_t *p) {
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+  }
+
+  static inline void bebo_atomic_store_release_u64(uint64_t *p, uint64_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+  }
+
+  static inline void bebo_atomic_store_release_u32(uint32_t *p, uint32_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+  }
+
+  static inline void bebo_atomic_store_u64(uint64_t *p, uint64_t v) {
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+  }
+
+  static inline uint32_t bebo_atomic_add_u32(uint32_t *p, int32_t v) {
+    return __atomic_add_fetch(p, (uint32_t) v, __ATOMIC_SEQ_CST);
+  }
+
+  static inline uint64_t bebo_atomic_add_u64(uint64_t *p, int64_t v) {
+    return __atomic_add_fetch(p, (uint64_t) v, __ATOMIC_SEQ_CST);
+  }
+
+  static inline bool bebo_atomic_cas_u32(uint32_t *p, uint32_t expected,
+      uint32_t desired) {
+    return __atomic_compare_exchange_n(p, &expected, desired, false,
+        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  }
+
+  static inline bool bebo_atomic_cas_u64(uint64_t *p, uint64_t expected,
+      uint64_t desired) {
+    return __atomic_compare_exchange_n(p, &expected, desired, false,
+        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  }
+
+  static inline uint32_t bebo_atomic_or_u32(uint32_t *p, uint32_t v) {
+    return __atomic_or_fetch(p, v, __ATOMIC_SEQ_CST);
+  }
+
+  static inline uint32_t bebo_atomic_and_u32(uint32_t *p, uint32_t v) {
+    return __atomic_and_fetch(p, v, __ATOMIC_SEQ_CST);
+  }
+
+  static inline void bebo_atomic_fence_acquire(void) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  }
+
+  static inline void bebo_atomic_fence_release(void) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+
+#endif
+
+#ifdef __cplusplus
+    }
+#endif
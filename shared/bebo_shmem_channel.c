@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * Channel registry, see bebo_shmem_channel.h.
+ */
+
+#include <string.h>
+
+#include "bebo_shmem_channel.h"
+
+#define READ_ATTEMPTS 4
+
+bool
+bebo_shmem_channel_name_valid(const char *channel)
+{
+  size_t len;
+
+  if (channel == NULL) {
+    return true;
+  }
+
+  // the name ends up in kernel object and /dev/shm names
+  for (len = 0; channel[len] != '\0'; len++) {
+    char c = channel[len];
+    if (len + 1 >= BEBO_SHMEM_MAX_CHANNEL_NAME ||
+        !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') || c == '-' || c == '_')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Copy entry out under its seq. False if the producer kept rewriting it. */
+static bool
+read_entry(struct bebo_shmem_channel *entry, struct bebo_shmem_channel *out)
+{
+  for (int attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+    uint64_t seq = bebo_atomic_load_u64(&entry->seq);
+    if (seq & 1) {
+      continue;
+    }
+    memcpy(out, entry, sizeof(*out));
+    bebo_atomic_fence_acquire();
+    if (bebo_atomic_load_u64(&entry->seq) == seq) {
+      out->name[BEBO_SHMEM_MAX_CHANNEL_NAME - 1] = '\0';
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool
+entry_live(const struct bebo_shmem_channel *entry)
+{
+  return entry->owner_pid != 0 && bebo_shmem_process_alive(entry->owner_pid);
+}
+
+/* Only the owner writes its entry, seq tells readers to look again. */
+static void
+begin_update(struct bebo_shmem_channel *entry)
+{
+  bebo_atomic_store_u64(&entry->seq, entry->seq | 1);
+}
+
+static void
+end_update(struct bebo_shmem_channel *entry)
+{
+  bebo_atomic_store_release_u64(&entry->seq, (entry->seq | 1) + 1);
+}
+
+enum bebo_shmem_channel_result
+bebo_shmem_channel_register(struct bebo_shmem_channel_registration *reg,
+    const char *channel)
+{
+  struct bebo_shmem_registry *registry;
+  struct bebo_shmem_channel copy;
+  uint32_t pid = bebo_shmem_pid();
+
+  memset(reg, 0, sizeof(*reg));
+  if (channel == NULL) {
+    channel = "";
+  }
+  if (!bebo_shmem_channel_name_valid(channel)) {
+    return BEBO_SHMEM_CHANNEL_ERROR;
+  }
+
+  // the first producer creates it zeroed, all entries free
+  if (!bebo_shmem_region_create(&reg->region, BEBO_SHMEM_REGISTRY,
+      sizeof(struct bebo_shmem_registry), BEBO_SHMEM_REGION_SHARED)) {
+    return BEBO_SHMEM_CHANNEL_ERROR;
+  }
+  registry = (struct bebo_shmem_registry *) reg->region.data;
+
+  // two producers racing for one name may both get through, their objects
+  // collide then like they did before there were channels
+  for (int i = 0; i < BEBO_SHMEM_MAX_CHANNELS; i++) {
+    if (read_entry(&registry->channel[i], &copy) && entry_live(&copy) &&
+        strcmp(copy.name, channel) == 0) {
+      bebo_shmem_region_close(&reg->region);
+      return BEBO_SHMEM_CHANNEL_IN_USE;
+    }
+  }
+
+  for (int i = 0; i < BEBO_SHMEM_MAX_CHANNELS; i++) {
+    struct bebo_shmem_channel *entry = &registry->channel[i];
+    uint32_t owner = bebo_atomic_load_u32(&entry->owner_pid);
+    if (owner != 0 && bebo_shmem_process_alive(owner)) {
+      continue;
+    }
+    if (!bebo_atomic_cas_u32(&entry->owner_pid, owner, pid)) {
+      continue;
+    }
+
+    begin_update(entry);
+    memset(entry->name, 0, sizeof(entry->name));
+    strcpy(entry->name, channel);
+    entry->codec = BEBO_SHMEM_CODEC_RAW;
+    entry->width = 0;
+    entry->height = 0;
+    entry->format = 0;
+    entry->fps_n = 0;
+    entry->fps_d = 1;
+    entry->count = 0;
+    entry->payload_size = 0;
+    end_update(entry);
+
+    reg->entry = entry;
+    return BEBO_SHMEM_CHANNEL_OK;
+  }
+
+  bebo_shmem_region_close(&reg->region);
+  return BEBO_SHMEM_CHANNEL_FULL;
+}
+
+void
+bebo_shmem_channel_describe(struct bebo_shmem_channel_registration *reg,
+    struct shmem *shmem)
+{
+  struct bebo_shmem_channel *entry = reg->entry;
+
+  if (entry == NULL) {
+    return;
+  }
+
+  begin_update(entry);
+  entry->codec = shmem->codec;
+  entry->width = shmem->video_info.width;
+  entry->height = shmem->video_info.height;
+  entry->format = shmem->format;
+  entry->fps_n = shmem->video_info.fps_n;
+  entry->fps_d = shmem->video_info.fps_d;
+  entry->count = (uint32_t) shmem->count;
+  entry->payload_size = shmem->payload_size;
+  end_update(entry);
+}
+
+void
+bebo_shmem_channel_unregister(struct bebo_shmem_channel_registration *reg)
+{
+  if (reg->entry) {
+    bebo_atomic_store_release_u32(&reg->entry->owner_pid, 0);
+    reg->entry = NULL;
+  }
+  bebo_shmem_region_close(&reg->region);
+}
+
+int
+bebo_shmem_channel_list(struct bebo_shmem_channel *channels, int max)
+{
+  struct bebo_shmem_region region;
+  struct bebo_shmem_registry *registry;
+  int n = 0;
+
+  if (!bebo_shmem_region_open(&region, BEBO_SHMEM_REGISTRY,
+      sizeof(struct bebo_shmem_registry))) {
+    return 0;
+  }
+  registry = (struct bebo_shmem_registry *) region.data;
+
+  for (int i = 0; i < BEBO_SHMEM_MAX_CHANNELS && n < max; i++) {
+    if (read_entry(&registry->channel[i], &channels[n]) &&
+        entry_live(&channels[n])) {
+      n++;
+    }
+  }
+
+  bebo_shmem_region_close(&region);
+  return n;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+/*
+ * Channels let several producers run side by side, e.g. the main scene and
+ * a picture in picture feed. Each channel has its own ring, mutex and
+ * semaphores, named with bebo_shmem_object_name(). The default channel ""
+ * keeps the old names, so readers that know nothing about channels still
+ * find it.
+ *
+ * Producers list themselves in the registry region BEBO_SHMEM_REGISTRY
+ * with the geometry of their ring. Readers enumerate it with
+ * bebo_shmem_channel_list() and open the channel they want with
+ * bebo_shmem_client_set_channel(). The registry is for discovery only,
+ * readers don't need it to attach.
+ */
+
+#include "bebo_shmem.h"
+#include "bebo_shmem_ring.h"
+
+#ifdef __cplusplus
+  extern "C" {
+#endif
+
+  enum bebo_shmem_channel_result {
+    BEBO_SHMEM_CHANNEL_OK = 0,
+    BEBO_SHMEM_CHANNEL_IN_USE,   /* another live producer has the name */
+    BEBO_SHMEM_CHANNEL_FULL,     /* all BEBO_SHMEM_MAX_CHANNELS entries are taken */
+    BEBO_SHMEM_CHANNEL_ERROR,    /* the registry could not be mapped */
+  };
+
+  struct bebo_shmem_channel_registration {
+    struct bebo_shmem_region region;
+    struct bebo_shmem_channel *entry; /* NULL while not registered */
+  };
+
+  /* Letters, digits, '-' and '_', shorter than BEBO_SHMEM_MAX_CHANNEL_NAME.
+   * NULL and "" are the default channel. */
+  bool bebo_shmem_channel_name_valid(const char *channel);
+
+  /* Producer: claim a registry entry for channel. Only IN_USE is a reason
+   * not to run, without a registry readers can still attach by name. */
+  enum bebo_shmem_channel_result bebo_shmem_channel_register(
+      struct bebo_shmem_channel_registration *reg, const char *channel);
+  /* Producer: publish the geometry of shmem, after creating the ring and
+   * after every caps change. */
+  void bebo_shmem_channel_describe(struct bebo_shmem_channel_registration *reg,
+      struct shmem *shmem);
+  void bebo_shmem_channel_unregister(struct bebo_shmem_channel_registration *reg);
+
+  /* Reader: copy the entries of the running producers into channels, at
+   * most max. Returns how many there are, 0 if there is no registry. */
+  int bebo_shmem_channel_list(struct bebo_shmem_channel *channels, int max);
+
+#ifdef __cplusplus
+    }
+#endif
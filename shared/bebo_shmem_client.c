@@ -0,0 +1,684 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * Reader side of the shmem frame ring, see bebo_shmem_client.h.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bebo_shmem_client.h"
+#include "bebo_shmem_channel.h"
+
+#define PIN_ATTEMPTS 3
+// a snapshot races the producer for the newest slot, frames come every ms or more
+#define SNAPSHOT_ATTEMPTS 4
+// a reader that just connected gets the pool with the producer's next frame
+#define POOL_MAP_TIMEOUT_MS 100
+// waiting readers wake up this often to show the producer they are alive
+#define HEARTBEAT_INTERVAL_MS 500
+
+/* ticket = generation << 32 | reader << 24 | slot */
+#define TICKET(generation, reader, slot) \
+  (((uint64_t) (generation) << 32) | ((uint64_t) (reader) << 24) | (slot))
+#define TICKET_GENERATION(ticket) ((uint32_t) ((ticket) >> 32))
+#define TICKET_READER(ticket) ((int) (((ticket) >> 24) & 0xff))
+#define TICKET_SLOT(ticket) ((ticket) & 0xffffff)
+
+static void
+client_log(struct bebo_shmem_client *client, enum bebo_shmem_log_level level,
+    const char *format, ...)
+{
+  char message[512];
+  va_list args;
+
+  if (!client->log) {
+    return;
+  }
+
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  client->log(client->log_user_data, level, message);
+}
+
+void
+bebo_shmem_client_init(struct bebo_shmem_client *client,
+    bebo_shmem_log_func log, void *log_user_data)
+{
+  memset(client, 0, sizeof(*client));
+  client->reader = -1;
+#ifndef _WIN32
+  bebo_shmem_pool_client_init(&client->pool);
+#endif
+  client->log = log;
+  client->log_user_data = log_user_data;
+}
+
+bool
+bebo_shmem_client_set_channel(struct bebo_shmem_client *client,
+    const char *channel)
+{
+  if (!bebo_shmem_channel_name_valid(channel)) {
+    return false;
+  }
+  memset(client->channel, 0, sizeof(client->channel));
+  if (channel) {
+    strcpy(client->channel, channel);
+  }
+  return true;
+}
+
+void
+bebo_shmem_client_set_observer(struct bebo_shmem_client *client,
+    bool observer)
+{
+  client->observer = observer;
+}
+
+void
+bebo_shmem_client_set_catch_up(struct bebo_shmem_client *client,
+    const struct bebo_shmem_catch_up_policy *policy)
+{
+  if (policy) {
+    client->catch_up = *policy;
+  } else {
+    memset(&client->catch_up, 0, sizeof(client->catch_up));
+  }
+}
+
+enum bebo_shmem_open_result
+bebo_shmem_client_open(struct bebo_shmem_client *client)
+{
+  struct shmem *shmem;
+  struct bebo_shmem_v2 *v2;
+  char name[BEBO_SHMEM_MAX_NAME];
+  char sem_name[BEBO_SHMEM_MAX_NAME];
+  int reader;
+
+  bebo_shmem_object_name(name, BEBO_SHMEM_MUTEX, client->channel);
+  if (!bebo_shmem_mutex_open(&client->mutex, name)) {
+    int error = bebo_shmem_last_error();
+    if (error == BEBO_SHMEM_ERROR_NOT_FOUND) {
+      client_log(client, BEBO_SHMEM_LOG_INFO, "shared memory is not created yet");
+      return BEBO_SHMEM_OPEN_NOT_FOUND;
+    }
+    client_log(client, BEBO_SHMEM_LOG_ERROR,
+        "failed to open shared memory mutex, %d", error);
+    return BEBO_SHMEM_OPEN_ERROR;
+  }
+
+  if (bebo_shmem_mutex_lock(&client->mutex, BEBO_SHMEM_INFINITE) != BEBO_SHMEM_WAIT_OK) {
+    bebo_shmem_client_close(client);
+    return BEBO_SHMEM_OPEN_ERROR;
+  }
+
+  // map the whole region, the header tells us whether we understand it
+  bebo_shmem_object_name(name, BEBO_SHMEM_NAME, client->channel);
+  if (!bebo_shmem_region_open(&client->region, name, 0)) {
+    client_log(client, BEBO_SHMEM_LOG_ERROR, "could not map shmem %d",
+        bebo_shmem_last_error());
+    bebo_shmem_mutex_unlock(&client->mutex);
+    bebo_shmem_client_close(client);
+    return BEBO_SHMEM_OPEN_ERROR;
+  }
+
+  shmem = (struct shmem *) client->region.data;
+  if (shmem->version != SHM_INTERFACE_VERSION) {
+    bebo_shmem_mutex_unlock(&client->mutex);
+    client_log(client, BEBO_SHMEM_LOG_ERROR,
+        "SHM_INTERFACE_VERSION mismatch %llu != %llu",
+        (unsigned long long) shmem->version,
+        (unsigned long long) SHM_INTERFACE_VERSION);
+    bebo_shmem_client_close(client);
+    return BEBO_SHMEM_OPEN_VERSION_MISMATCH;
+  }
+
+  // the v1 view is enough unless the producer says otherwise
+  v2 = bebo_shmem_v2(shmem);
+  if (v2 && (v2->required & ~BEBO_SHMEM_FEATURES_KNOWN)) {
+    bebo_shmem_mutex_unlock(&client->mutex);
+    client_log(client, BEBO_SHMEM_LOG_ERROR,
+        "producer requires unknown features 0x%llx",
+        (unsigned long long) (v2->required & ~BEBO_SHMEM_FEATURES_KNOWN));
+    bebo_shmem_client_close(client);
+    return BEBO_SHMEM_OPEN_VERSION_MISMATCH;
+  }
+  client->features = v2 ? v2->features & BEBO_SHMEM_FEATURES_KNOWN : 0;
+#ifndef _WIN32
+  if ((client->features & BEBO_SHMEM_FEATURE_FD_POOL) &&
+      !bebo_shmem_pool_client_connect(&client->pool, client->channel)) {
+    bebo_shmem_mutex_unlock(&client->mutex);
+    client_log(client, BEBO_SHMEM_LOG_ERROR,
+        "could not connect to the buffer pool %d", bebo_shmem_last_error());
+    bebo_shmem_client_close(client);
+    return BEBO_SHMEM_OPEN_ERROR;
+  }
+#endif
+
+  if (client->observer) {
+    client->shmem = shmem;
+    client->audio_read_ptr = bebo_atomic_load_u64(&shmem->audio_write_ptr) + 1;
+    bebo_shmem_mutex_unlock(&client->mutex);
+    client_log(client, BEBO_SHMEM_LOG_INFO,
+        "successfully opened shared memory buffer as observer");
+    return BEBO_SHMEM_OPEN_OK;
+  }
+
+  reader = bebo_shmem_reader_attach(shmem, client->features);
+  if (reader < 0) {
+    bebo_shmem_mutex_unlock(&client->mutex);
+    client_log(client, BEBO_SHMEM_LOG_ERROR, "all %d reader slots are taken",
+        BEBO_SHMEM_MAX_READERS);
+    bebo_shmem_client_close(client);
+    return BEBO_SHMEM_OPEN_NO_READER_SLOT;
+  }
+
+  bebo_shmem_data_sem_name(sem_name, client->channel, reader);
+  if (!bebo_shmem_semaphore_open(&client->new_data, sem_name)) {
+    client_log(client, BEBO_SHMEM_LOG_ERROR,
+        "failed to open shared memory semaphore %s, %d", sem_name,
+        bebo_shmem_last_error());
+    bebo_shmem_reader_detach(shmem, reader);
+    bebo_shmem_mutex_unlock(&client->mutex);
+    bebo_shmem_client_close(client);
+    return BEBO_SHMEM_OPEN_ERROR;
+  }
+
+  client->shmem = shmem;
+  client->reader = reader;
+  client->generation = bebo_shmem_reader_generation(shmem, reader);
+  // audio from before we came is of no use
+  client->audio_read_ptr = bebo_atomic_load_u64(&shmem->audio_write_ptr) + 1;
+  bebo_shmem_mutex_unlock(&client->mutex);
+
+  client_log(client, BEBO_SHMEM_LOG_INFO,
+      "successfully opened shared memory buffer as reader %d", reader);
+  return BEBO_SHMEM_OPEN_OK;
+}
+
+void
+bebo_shmem_client_close(struct bebo_shmem_client *client)
+{
+  if (client->shmem && client->reader >= 0 &&
+      bebo_shmem_mutex_lock(&client->mutex, BEBO_SHMEM_INFINITE) == BEBO_SHMEM_WAIT_OK) {
+    bebo_shmem_reader_detach(client->shmem, client->reader);
+    bebo_shmem_mutex_unlock(&client->mutex);
+  }
+
+  client->reader = -1;
+  client->shmem = NULL;
+  bebo_shmem_region_close(&client->region);
+  bebo_shmem_mutex_close(&client->mutex);
+  bebo_shmem_semaphore_close(&client->new_data);
+#ifndef _WIN32
+  bebo_shmem_pool_client_close(&client->pool);
+#endif
+}
+
+static bool
+evicted(struct bebo_shmem_client *client)
+{
+  struct shmem *shmem = client->shmem;
+  return !(bebo_shmem_readers(shmem) & (1u << client->reader)) ||
+      bebo_shmem_reader_generation(shmem, client->reader) != client->generation;
+}
+
+/* the producer threw us out while we were not reading, take a new entry */
+static enum bebo_shmem_wait_result
+reattach(struct bebo_shmem_client *client)
+{
+  struct shmem *shmem = client->shmem;
+  char sem_name[BEBO_SHMEM_MAX_NAME];
+  int reader;
+
+  if (bebo_shmem_mutex_lock(&client->mutex, BEBO_SHMEM_INFINITE) != BEBO_SHMEM_WAIT_OK) {
+    return BEBO_SHMEM_WAIT_ERROR;
+  }
+
+  reader = bebo_shmem_reader_attach(shmem, client->features);
+  if (reader < 0) {
+    bebo_shmem_mutex_unlock(&client->mutex);
+    client_log(client, BEBO_SHMEM_LOG_ERROR,
+        "evicted and all %d reader slots are taken", BEBO_SHMEM_MAX_READERS);
+    return BEBO_SHMEM_WAIT_ERROR;
+  }
+
+  if (reader != client->reader) {
+    bebo_shmem_semaphore_close(&client->new_data);
+    bebo_shmem_data_sem_name(sem_name, client->channel, reader);
+    if (!bebo_shmem_semaphore_open(&client->new_data, sem_name)) {
+      client_log(client, BEBO_SHMEM_LOG_ERROR,
+          "failed to open shared memory semaphore %s, %d", sem_name,
+          bebo_shmem_last_error());
+      bebo_shmem_reader_detach(shmem, reader);
+      bebo_shmem_mutex_unlock(&client->mutex);
+      client->reader = -1;
+      return BEBO_SHMEM_WAIT_ERROR;
+    }
+  }
+
+  client_log(client, BEBO_SHMEM_LOG_INFO,
+      "evicted by the producer as reader %d, attached again as reader %d",
+      client->reader, reader);
+  client->reader = reader;
+  client->generation = bebo_shmem_reader_generation(shmem, reader);
+  bebo_shmem_mutex_unlock(&client->mutex);
+  return BEBO_SHMEM_WAIT_OK;
+}
+
+/* We took the last mark off slot i, hand it to the producer. */
+static void
+push_release(struct bebo_shmem_client *client, uint64_t i)
+{
+  struct bebo_shmem_release_ring *ring;
+
+  if (!(client->features & BEBO_SHMEM_FEATURE_RELEASE_RING)) {
+    return;
+  }
+  ring = bebo_shmem_release_ring(client->shmem);
+  // if it is full the producer finds the slot when it looks at all of them
+  if (ring) {
+    bebo_shmem_release_push(ring, (uint32_t) i);
+  }
+}
+
+/* Only when starting or after falling more than a ring behind, every slot
+ * may hold a frame we did not read then. */
+static void
+skip_before(struct bebo_shmem_client *client, uint64_t before)
+{
+  for (uint64_t i = 0; i < client->shmem->count; i++) {
+    if (bebo_shmem_slot_skip(bebo_shmem_frame(client->shmem, i), before,
+        client->reader)) {
+      push_release(client, i);
+    }
+  }
+}
+
+static bool
+pin_frame(struct bebo_shmem_client *client, struct frame *frame, uint64_t nr)
+{
+  // the producer may hold the slot for a moment while it cleans up
+  for (int attempt = 0; attempt < PIN_ATTEMPTS; attempt++) {
+    if (bebo_shmem_slot_pin(frame, nr, client->reader)) {
+      return true;
+    }
+    if (frame->nr != nr) {
+      return false;
+    }
+  }
+  return false;
+}
+
+/* Frames acquire can hand out now, *first is the nr of the first one. A
+ * reader that did not read yet starts at the newest frame. */
+static uint64_t
+ready_frames(struct bebo_shmem_client *client, uint64_t *first)
+{
+  struct shmem *shmem = client->shmem;
+  uint64_t write_ptr = bebo_shmem_write_ptr(shmem);
+  uint64_t read_ptr = bebo_atomic_load_u64(
+      bebo_shmem_read_ptr_field(shmem, client->reader));
+
+  if (read_ptr == 0) {
+    read_ptr = write_ptr ? write_ptr : 1;
+  }
+  *first = read_ptr;
+  if (write_ptr < read_ptr) {
+    return 0;
+  }
+  // we skip ahead to the newest frames when we are late
+  return write_ptr - read_ptr + 1 < shmem->count ?
+      write_ptr - read_ptr + 1 : shmem->count;
+}
+
+enum bebo_shmem_wait_result
+bebo_shmem_client_wait(struct bebo_shmem_client *client, uint32_t frames,
+    uint32_t timeout_ms, uint64_t *available)
+{
+  struct shmem *shmem = client->shmem;
+  uint64_t deadline = 0;
+  uint64_t first;
+  uint64_t ready;
+  enum bebo_shmem_wait_result res;
+
+  if (client->reader < 0) {
+    return BEBO_SHMEM_WAIT_ERROR;
+  }
+  if (evicted(client)) {
+    res = reattach(client);
+    if (res != BEBO_SHMEM_WAIT_OK) {
+      return res;
+    }
+  }
+
+  if (frames == 0) {
+    frames = 1;
+  }
+  if (frames > shmem->count) {
+    frames = (uint32_t) shmem->count;
+  }
+  if (timeout_ms != BEBO_SHMEM_INFINITE) {
+    deadline = bebo_shmem_now_ns() + (uint64_t) timeout_ms * 1000000;
+  }
+
+  for (;;) {
+    uint32_t wait_ms = HEARTBEAT_INTERVAL_MS;
+
+    // waiting is reading too, the producer must not take us for dead
+    bebo_shmem_reader_heartbeat(shmem, client->reader);
+    ready = ready_frames(client, &first);
+    if (ready >= frames) {
+      break;
+    }
+
+    if (timeout_ms != BEBO_SHMEM_INFINITE) {
+      uint64_t now = bebo_shmem_now_ns();
+      if (now >= deadline) {
+        break;
+      }
+      if (deadline - now < (uint64_t) wait_ms * 1000000) {
+        wait_ms = (uint32_t) ((deadline - now + 999999) / 1000000);
+      }
+    }
+
+    bebo_shmem_reader_wake_at(shmem, client->reader, first + frames - 1);
+    // the frame we asked for may have been published before we asked
+    if (ready_frames(client, &first) >= frames) {
+      continue;
+    }
+
+    res = bebo_shmem_semaphore_wait(&client->new_data, wait_ms);
+    if (res != BEBO_SHMEM_WAIT_OK && res != BEBO_SHMEM_WAIT_TIMEOUT) {
+      bebo_shmem_reader_wake_at(shmem, client->reader, 0);
+      return res;
+    }
+  }
+
+  // a signal may still come in for this request, the next wait eats it
+  bebo_shmem_reader_wake_at(shmem, client->reader, 0);
+  if (available) {
+    *available = ready;
+  }
+  if (ready > 0) {
+    return BEBO_SHMEM_WAIT_OK;
+  }
+  if (!bebo_shmem_process_alive(shmem->owner_pid)) {
+    client_log(client, BEBO_SHMEM_LOG_ERROR, "producer %u is gone",
+        shmem->owner_pid);
+    return BEBO_SHMEM_WAIT_ABANDONED;
+  }
+  return BEBO_SHMEM_WAIT_TIMEOUT;
+}
+
+/* Whether the pinned frame is later than the catch-up policy allows. */
+static bool
+late(struct bebo_shmem_client *client, struct frame *frame, uint64_t write_ptr)
+{
+  struct bebo_shmem_catch_up_policy *policy = &client->catch_up;
+
+  if (policy->mode == BEBO_SHMEM_CATCH_UP_RENDER_ALL ||
+      client->shmem->codec != BEBO_SHMEM_CODEC_RAW || frame->nr >= write_ptr) {
+    return false;
+  }
+  if (policy->max_frames && write_ptr - frame->nr > policy->max_frames) {
+    return true;
+  }
+  return policy->max_ms &&
+      bebo_shmem_now_ns() - frame->publish_ns > (uint64_t) policy->max_ms * 1000000;
+}
+
+/* Let go of a pinned frame we decided not to hand out. */
+static void
+drop_pinned(struct bebo_shmem_client *client, struct frame *frame, uint64_t i)
+{
+  bebo_shmem_slot_consume(frame, client->reader);
+  if (bebo_shmem_slot_unpin(frame, client->reader)) {
+    push_release(client, i);
+  }
+}
+
+enum bebo_shmem_wait_result
+bebo_shmem_client_acquire(struct bebo_shmem_client *client,
+    uint32_t timeout_ms, struct frame **out_frame, uint64_t *out_ticket)
+{
+  struct shmem *shmem = client->shmem;
+  uint64_t *my_read_ptr;
+  uint64_t write_ptr;
+  uint64_t read_ptr;
+  enum bebo_shmem_wait_result res;
+  struct frame *frame;
+  uint64_t i;
+
+  res = bebo_shmem_client_wait(client, 1, timeout_ms, NULL);
+  if (res != BEBO_SHMEM_WAIT_OK) {
+    return res;
+  }
+
+  my_read_ptr = bebo_shmem_read_ptr_field(shmem, client->reader);
+  write_ptr = bebo_shmem_write_ptr(shmem);
+  read_ptr = bebo_atomic_load_u64(my_read_ptr);
+  bebo_shmem_reader_heartbeat(shmem, client->reader);
+
+  if (read_ptr == 0) {
+    read_ptr = write_ptr;
+    client_log(client, BEBO_SHMEM_LOG_INFO,
+        "starting stream - resetting read pointer read_ptr: %llu write_ptr: %llu",
+        (unsigned long long) read_ptr, (unsigned long long) write_ptr);
+    skip_before(client, read_ptr);
+  } else if (write_ptr - read_ptr > shmem->count) {
+    uint64_t new_read_ptr = client->catch_up.mode == BEBO_SHMEM_CATCH_UP_SKIP_TO_NEWEST ?
+        write_ptr : write_ptr - shmem->count / 2;
+    client_log(client, BEBO_SHMEM_LOG_INFO,
+        "late - resetting read pointer read_ptr: %llu write_ptr: %llu behind: %llu new read_ptr: %llu",
+        (unsigned long long) read_ptr, (unsigned long long) write_ptr,
+        (unsigned long long) (write_ptr - read_ptr),
+        (unsigned long long) new_read_ptr);
+    read_ptr = new_read_ptr;
+    skip_before(client, read_ptr);
+  }
+
+  i = read_ptr % shmem->count;
+  frame = bebo_shmem_frame(shmem, i);
+  if (!pin_frame(client, frame, read_ptr)) {
+    // the producer already reused the slot, continue with the newest frame
+    uint64_t newest = bebo_shmem_write_ptr(shmem);
+    client_log(client, BEBO_SHMEM_LOG_INFO,
+        "late - slot reused read_ptr: %llu write_ptr: %llu",
+        (unsigned long long) read_ptr, (unsigned long long) newest);
+    read_ptr = newest;
+    i = read_ptr % shmem->count;
+    frame = bebo_shmem_frame(shmem, i);
+    skip_before(client, read_ptr);
+    if (!pin_frame(client, frame, read_ptr)) {
+      bebo_atomic_store_release_u64(my_read_ptr, read_ptr);
+      return BEBO_SHMEM_WAIT_TIMEOUT;
+    }
+  }
+
+  // trade the frames in between for latency, if we may and can
+  write_ptr = bebo_shmem_write_ptr(shmem);
+  if (late(client, frame, write_ptr)) {
+    uint64_t next = client->catch_up.mode == BEBO_SHMEM_CATCH_UP_SKIP_TO_NEWEST ?
+        write_ptr : read_ptr + 1;
+    struct frame *next_frame = bebo_shmem_frame(shmem, next % shmem->count);
+    if (pin_frame(client, next_frame, next)) {
+      drop_pinned(client, frame, i);
+      if (next > read_ptr + 1) {
+        skip_before(client, next);
+      }
+      read_ptr = next;
+      i = next % shmem->count;
+      frame = next_frame;
+    }
+  }
+
+  // the producer collects this when it reuses the slot, see stats in the sink
+  bebo_atomic_store_release_u64(&frame->read_ns[client->reader], bebo_shmem_now_ns());
+  bebo_shmem_slot_consume(frame, client->reader);
+  bebo_atomic_store_release_u64(my_read_ptr, read_ptr + 1);
+
+  *out_frame = frame;
+  *out_ticket = TICKET(client->generation, client->reader, i);
+  return BEBO_SHMEM_WAIT_OK;
+}
+
+void
+bebo_shmem_client_release(struct bebo_shmem_client *client, uint64_t ticket)
+{
+  struct shmem *shmem = client->shmem;
+  int reader = TICKET_READER(ticket);
+  bool freed;
+
+  if (!shmem) {
+    return;
+  }
+  // the producer already dropped our pins when it evicted us, and the pin
+  // bit may be someone else's now. It can't evict us while we unpin.
+  if (!bebo_shmem_reader_begin_release(shmem, reader, TICKET_GENERATION(ticket))) {
+    return;
+  }
+  // pinned in bebo_shmem_client_acquire, the slot still holds the frame
+  freed = bebo_shmem_slot_unpin(bebo_shmem_frame(shmem, TICKET_SLOT(ticket)), reader);
+  bebo_shmem_reader_end_release(shmem, reader);
+  if (freed) {
+    push_release(client, TICKET_SLOT(ticket));
+  }
+}
+
+uint8_t *
+bebo_shmem_client_payload(struct bebo_shmem_client *client, struct frame *frame)
+{
+  struct shmem *shmem = client->shmem;
+
+#ifndef _WIN32
+  if (client->features & BEBO_SHMEM_FEATURE_FD_POOL) {
+    uint64_t i = ((uint8_t *) frame - (uint8_t *) shmem - shmem->frame_offset) /
+        shmem->frame_size;
+    // pinned, the producer leaves the slot alone
+    struct bebo_shmem_slot *slot = bebo_shmem_pool_slot(shmem, i);
+    if (slot && slot->pool_index != BEBO_SHMEM_POOL_NONE) {
+      uint8_t *data = bebo_shmem_pool_client_map(&client->pool,
+          slot->pool_index, slot->pool_generation, POOL_MAP_TIMEOUT_MS);
+      if (data == NULL) {
+        client_log(client, BEBO_SHMEM_LOG_ERROR,
+            "pool buffer %u generation %u did not come",
+            slot->pool_index, slot->pool_generation);
+        return NULL;
+      }
+      return data + slot->pool_offset;
+    }
+  }
+#endif
+
+  if (frame->payload_offset == 0) {
+    return NULL;
+  }
+  return (uint8_t *) shmem + frame->payload_offset;
+}
+
+enum bebo_shmem_wait_result
+bebo_shmem_client_snapshot(struct bebo_shmem_client *client,
+    struct frame *out, uint8_t *data, size_t max)
+{
+  struct shmem *shmem = client->shmem;
+  uint64_t *observed;
+
+  if (!shmem || shmem->codec != BEBO_SHMEM_CODEC_RAW) {
+    // a delta unit on its own is of no use
+    return BEBO_SHMEM_WAIT_ERROR;
+  }
+
+  // without readers the producer only publishes while we keep stamping
+  observed = bebo_shmem_observer_heartbeat(shmem);
+  if (observed) {
+    bebo_atomic_store_release_u64(observed, bebo_shmem_now_ns());
+  }
+
+  for (int attempt = 0; attempt < SNAPSHOT_ATTEMPTS; attempt++) {
+    uint64_t nr = bebo_shmem_write_ptr(shmem);
+    struct frame *frame;
+    uint64_t seq;
+    uint8_t *payload;
+
+    if (nr == 0) {
+      break;
+    }
+    frame = bebo_shmem_frame(shmem, nr % shmem->count);
+    seq = bebo_atomic_load_u64(&frame->seq);
+    if (seq & 1) {
+      continue;
+    }
+
+    // like bebo_shmem_slot_read(), the pixels are checked with the same seq
+    memcpy(out, frame, sizeof(*out));
+    if (out->nr != nr) {
+      continue;
+    }
+    payload = bebo_shmem_client_payload(client, frame);
+    if (payload) {
+      // out may be torn, don't trust its size before seq says so
+      if (out->size > shmem->payload_size || out->size > max) {
+        bebo_atomic_fence_acquire();
+        if (bebo_atomic_load_u64(&frame->seq) != seq) {
+          continue;
+        }
+        client_log(client, BEBO_SHMEM_LOG_ERROR,
+            "snapshot of %llu bytes does not fit in %llu",
+            (unsigned long long) out->size, (unsigned long long) max);
+        return BEBO_SHMEM_WAIT_ERROR;
+      }
+      memcpy(data, payload, (size_t) out->size);
+    }
+    bebo_atomic_fence_acquire();
+    if (bebo_atomic_load_u64(&frame->seq) == seq) {
+      // none of it is ours, like a frame from bebo_shmem_slot_read()
+      out->reader_mask = 0;
+      return BEBO_SHMEM_WAIT_OK;
+    }
+  }
+
+  if (!bebo_shmem_process_alive(shmem->owner_pid)) {
+    return BEBO_SHMEM_WAIT_ABANDONED;
+  }
+  return BEBO_SHMEM_WAIT_TIMEOUT;
+}
+
+bool
+bebo_shmem_client_read_audio(struct bebo_shmem_client *client, uint64_t until,
+    struct bebo_shmem_audio_chunk *chunk, uint8_t *data, size_t max)
+{
+  struct shmem *shmem = client->shmem;
+  uint32_t flags = 0;
+
+  if (!shmem || shmem->audio_count == 0) {
+    return false;
+  }
+
+  for (;;) {
+    uint64_t write_ptr = bebo_atomic_load_u64(&shmem->audio_write_ptr);
+    if (client->audio_read_ptr > write_ptr) {
+      return false;
+    }
+    if (write_ptr - client->audio_read_ptr >= shmem->audio_count) {
+      client->audio_read_ptr = write_ptr - shmem->audio_count + 1;
+      flags |= BEBO_SHMEM_AUDIO_DISCONT;
+    }
+
+    if (!bebo_shmem_audio_read(shmem, client->audio_read_ptr, chunk, data, max)) {
+      // the producer got to it first, the next one is still there
+      client->audio_read_ptr++;
+      flags |= BEBO_SHMEM_AUDIO_DISCONT;
+      continue;
+    }
+    if (chunk->pts >= until) {
+      return false;
+    }
+
+    client->audio_read_ptr++;
+    chunk->flags |= flags;
+    return true;
+  }
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+/*
+ * Reader side of the shmem frame ring: attach as one of the readers, wait
+ * for frames and pin them, catching up when we fall behind the producer.
+ *
+ * Used by nacl-preview and beboshmsrc. A client is not thread safe, acquire
+ * and release may be called from different threads as long as they don't
+ * run concurrently with open / close.
+ *
+ * A reader starts at the newest frame. What it does when it falls behind
+ * after that is up to its catch-up policy: a recorder takes every frame
+ * the ring still holds, a preview rather drops frames to stay within a
+ * latency target. See bebo_shmem_client_set_catch_up(). Falling more than
+ * a ring behind always skips, those frames are gone.
+ *
+ * If the producer evicts us because we stopped reading for too long, acquire
+ * attaches again. Frames pinned before that were already taken from us,
+ * releasing them is a no-op. Tickets don't outlive the region though:
+ * close drops every pin, and after open the same reader entry and
+ * generation may come up again, so forget the tickets instead of releasing
+ * them then.
+ *
+ * The header's video_info is what the producer was sending when we opened.
+ * Caps may change at any time after that, every frame carries its size,
+ * format and info_generation.
+ *
+ * Without bebo_shmem_client_set_channel() the client opens the default
+ * channel, see bebo_shmem_channel.h.
+ *
+ * On Linux the pixels may come in buffers passed over a socket instead,
+ * see bebo_shmem_pool.h. The client connects when the producer offers it
+ * and bebo_shmem_client_payload() finds them either way.
+ *
+ * When the producer has an audio ring, bebo_shmem_client_read_audio()
+ * hands out the chunks that go with the frame we just acquired, no second
+ * attach or wakeup needed.
+ *
+ * Thumbnailers and health checks that only want a frame now and then open
+ * as observers, see bebo_shmem_client_set_observer(). An observer takes no
+ * entry of the reader table, so the producer never waits for it and never
+ * evicts it, and grabs frames with bebo_shmem_client_snapshot().
+ */
+
+#include "bebo_shmem.h"
+#include "bebo_shmem_ring.h"
+#include "bebo_shmem_pool.h"
+
+#ifdef __cplusplus
+  extern "C" {
+#endif
+
+  enum bebo_shmem_open_result {
+    BEBO_SHMEM_OPEN_OK = 0,
+    BEBO_SHMEM_OPEN_NOT_FOUND,        /* no producer yet */
+    BEBO_SHMEM_OPEN_VERSION_MISMATCH,
+    BEBO_SHMEM_OPEN_NO_READER_SLOT,
+    BEBO_SHMEM_OPEN_ERROR,
+  };
+
+  enum bebo_shmem_log_level {
+    BEBO_SHMEM_LOG_ERROR,
+    BEBO_SHMEM_LOG_INFO,
+  };
+
+  enum bebo_shmem_catch_up {
+    BEBO_SHMEM_CATCH_UP_RENDER_ALL = 0, /* every frame, however late */
+    BEBO_SHMEM_CATCH_UP_DROP_ALTERNATE, /* every other frame while late */
+    BEBO_SHMEM_CATCH_UP_SKIP_TO_NEWEST, /* straight to the newest frame */
+  };
+
+  /* We are late when the frame acquire would hand out is more than
+   * max_frames behind the newest one or older than max_ms, 0 for no bound
+   * on either. */
+  struct bebo_shmem_catch_up_policy {
+    enum bebo_shmem_catch_up mode;
+    uint32_t max_frames;
+    uint32_t max_ms;
+  };
+
+  typedef void (*bebo_shmem_log_func)(void *user_data,
+      enum bebo_shmem_log_level level, const char *message);
+
+  struct bebo_shmem_client {
+    struct shmem *shmem;
+    int reader;
+    uint32_t generation; /* of our reader table entry when we attached */
+    uint64_t features;   /* BEBO_SHMEM_FEATURE_* we use with this producer */
+    uint64_t audio_read_ptr; /* next audio chunk nr we want */
+    bool observer; /* open without attaching, snapshots only */
+    struct bebo_shmem_catch_up_policy catch_up;
+    char channel[BEBO_SHMEM_MAX_CHANNEL_NAME];
+    struct bebo_shmem_region region;
+    struct bebo_shmem_mutex mutex;
+    struct bebo_shmem_semaphore new_data;
+#ifndef _WIN32
+    struct bebo_shmem_pool_client pool; /* with BEBO_SHMEM_FEATURE_FD_POOL */
+#endif
+
+    bebo_shmem_log_func log;
+    void *log_user_data;
+  };
+
+  void bebo_shmem_client_init(struct bebo_shmem_client *client,
+      bebo_shmem_log_func log, void *log_user_data);
+  /* Open channel instead of the default one from the next open on. False
+   * if the name is not valid, see bebo_shmem_channel_name_valid(). */
+  bool bebo_shmem_client_set_channel(struct bebo_shmem_client *client,
+      const char *channel);
+  /* From the next open on, map the ring without attaching as a reader.
+   * wait and acquire fail on an observer, snapshot and read_audio work. */
+  void bebo_shmem_client_set_observer(struct bebo_shmem_client *client,
+      bool observer);
+  /* How acquire catches up when we are late, NULL for the default: render
+   * all. Encoded streams always render all, a skipped delta unit breaks
+   * the frames after it. Takes effect with the next acquire. */
+  void bebo_shmem_client_set_catch_up(struct bebo_shmem_client *client,
+      const struct bebo_shmem_catch_up_policy *policy);
+  enum bebo_shmem_open_result bebo_shmem_client_open(
+      struct bebo_shmem_client *client);
+  void bebo_shmem_client_close(struct bebo_shmem_client *client);
+
+  /* Wait until frames frames are ready for us or timeout_ms went by,
+   * whichever comes first, so high frame rate readers can take them in one
+   * go. *available (may be NULL) is how many frames acquire will hand out
+   * without waiting, never more than the ring holds. Returns OK if at least
+   * one frame is ready, TIMEOUT if none came and ABANDONED if the producer
+   * is gone. Keeps the reader's heartbeat going while it waits. */
+  enum bebo_shmem_wait_result bebo_shmem_client_wait(
+      struct bebo_shmem_client *client, uint32_t frames, uint32_t timeout_ms,
+      uint64_t *available);
+
+  /* Wait for the next frame and pin it, *ticket is what to release it with.
+   * Late readers skip frames as their catch-up policy says. Returns TIMEOUT
+   * if nothing could be taken in time and ABANDONED if the producer is
+   * gone, close and open again then. */
+  enum bebo_shmem_wait_result bebo_shmem_client_acquire(
+      struct bebo_shmem_client *client, uint32_t timeout_ms,
+      struct frame **frame, uint64_t *ticket);
+  void bebo_shmem_client_release(struct bebo_shmem_client *client,
+      uint64_t ticket);
+
+  /* Copy the next audio chunk with a pts before until into chunk, its PCM
+   * into data (audio_chunk_size bytes). Pass frame.pts + frame.duration of
+   * the frame just acquired to get the audio that plays along with it.
+   * Returns false once we are caught up. If we fell behind by more than the
+   * ring, the oldest chunk left is flagged BEBO_SHMEM_AUDIO_DISCONT. */
+  bool bebo_shmem_client_read_audio(struct bebo_shmem_client *client,
+      uint64_t until, struct bebo_shmem_audio_chunk *chunk, uint8_t *data,
+      size_t max);
+
+  /* Start of the pixels of a pinned frame in payload mode, in the region or
+   * in its pool buffer. NULL if it has none. */
+  uint8_t *bebo_shmem_client_payload(struct bebo_shmem_client *client,
+      struct frame *frame);
+
+  /* Copy the newest frame into *frame and, in payload mode, its pixels into
+   * data (max bytes, plane i at frame->plane_offset[i]) without pinning it:
+   * no cursor moves and the producer may rewrite the slot meanwhile, the
+   * copy is taken again then. With DXGI handles only the frame is copied,
+   * the texture may be reused once the producer moves on. Works on readers
+   * and observers. Keeps the producer publishing while nobody is attached,
+   * the first snapshot after a pause may get an old frame. Returns TIMEOUT if there is no frame yet or it kept
+   * changing under us, ABANDONED if the producer is gone and ERROR for
+   * encoded streams or if max is too small. */
+  enum bebo_shmem_wait_result bebo_shmem_client_snapshot(
+      struct bebo_shmem_client *client, struct frame *frame, uint8_t *data,
+      size_t max);
+
+#ifdef __cplusplus
+    }
+#endif
@@ -0,0 +1,132 @@
+#pragma once
+
+/*
+ * Small platform layer for the bebo_shmem frame ring.
+ *
+ * The producer (dshowfiltersink) and the consumers (nacl-preview, ...) only
+ * need a named shared memory region, a named mutex and a named "new data"
+ * semaphore. Windows implements these with file mappings / kernel objects,
+ * Linux with shm_open and futexes living in their own small shm objects.
+ *
+ * Names are plain ASCII without a leading slash, e.g. BEBO_SHMEM_NAME.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#endif
+
+#ifdef __cplusplus
+  extern "C" {
+#endif
+
+#define BEBO_SHMEM_MAX_NAME   128
+#define BEBO_SHMEM_INFINITE   UINT32_MAX
+#define BEBO_SHMEM_SEMAPHORE_MAX INT32_MAX
+
+#ifdef _WIN32
+#define BEBO_SHMEM_ERROR_NOT_FOUND ERROR_FILE_NOT_FOUND
+#else
+#define BEBO_SHMEM_ERROR_NOT_FOUND ENOENT
+#endif
+
+  enum bebo_shmem_wait_result {
+    BEBO_SHMEM_WAIT_OK = 0,
+    BEBO_SHMEM_WAIT_TIMEOUT,
+    BEBO_SHMEM_WAIT_ERROR,
+    BEBO_SHMEM_WAIT_ABANDONED, /* the other side went away */
+  };
+
+  struct bebo_shmem_region {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    int fd;
+    bool owner;
+    bool hugetlbfs; /* name is a path on BEBO_SHMEM_HUGETLBFS */
+    char name[BEBO_SHMEM_MAX_NAME];
+#endif
+    void *data;
+    size_t size;
+    bool huge_pages; /* backed by 2M (or larger) pages */
+  };
+
+  /* bebo_shmem_region_create() flags */
+  /* Back the region with huge pages if the system lets us, falls back to
+   * normal pages otherwise. Rounds the size up to the huge page size. */
+#define BEBO_SHMEM_REGION_HUGE_PAGES  (1u << 0)
+  /* Several processes create the region and any of them may go first.
+   * Windows keeps the name while one of them has it open, on Linux it is
+   * never removed. */
+#define BEBO_SHMEM_REGION_SHARED      (1u << 1)
+
+#ifndef _WIN32
+#define BEBO_SHMEM_HUGETLBFS "/dev/hugepages"
+#endif
+
+  struct bebo_shmem_mutex {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    struct bebo_shmem_region region;
+#endif
+  };
+
+  struct bebo_shmem_semaphore {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    struct bebo_shmem_region region;
+#endif
+  };
+
+  /* Create (or open if it already exists) and map a region of size bytes. */
+  bool bebo_shmem_region_create(struct bebo_shmem_region *region,
+      const char *name, size_t size, uint32_t flags);
+  /* Open and map an existing region, size 0 maps the whole region. */
+  bool bebo_shmem_region_open(struct bebo_shmem_region *region,
+      const char *name, size_t size);
+  void bebo_shmem_region_close(struct bebo_shmem_region *region);
+
+  bool bebo_shmem_mutex_create(struct bebo_shmem_mutex *mutex,
+      const char *name, bool initial_owner);
+  bool bebo_shmem_mutex_open(struct bebo_shmem_mutex *mutex, const char *name);
+  /* An abandoned mutex (owner died while holding it) is reported as acquired. */
+  enum bebo_shmem_wait_result bebo_shmem_mutex_lock(
+      struct bebo_shmem_mutex *mutex, uint32_t timeout_ms);
+  void bebo_shmem_mutex_unlock(struct bebo_shmem_mutex *mutex);
+  void bebo_shmem_mutex_close(struct bebo_shmem_mutex *mutex);
+
+  /* Counting semaphore: every signal is kept until a wait consumes it, up
+   * to BEBO_SHMEM_SEMAPHORE_MAX pending signals. */
+  bool bebo_shmem_semaphore_create(struct bebo_shmem_semaphore *sem,
+      const char *name);
+  bool bebo_shmem_semaphore_open(struct bebo_shmem_semaphore *sem,
+      const char *name);
+  void bebo_shmem_semaphore_signal(struct bebo_shmem_semaphore *sem);
+  enum bebo_shmem_wait_result bebo_shmem_semaphore_wait(
+      struct bebo_shmem_semaphore *sem, uint32_t timeout_ms);
+  void bebo_shmem_semaphore_close(struct bebo_shmem_semaphore *sem);
+
+  /* Release mutex and wait on sem, like SignalObjectAndWait. */
+  enum bebo_shmem_wait_result bebo_shmem_unlock_and_wait(
+      struct bebo_shmem_mutex *mutex, struct bebo_shmem_semaphore *sem,
+      uint32_t timeout_ms);
+
+  int bebo_shmem_last_error(void);
+  void bebo_shmem_sleep_ms(uint32_t ms);
+  /* monotonic, comparable between processes on the same machine */
+  uint64_t bebo_shmem_now_ns(void);
+
+  uint32_t bebo_shmem_pid(void);
+  /* false only if pid is known to be gone */
+  bool bebo_shmem_process_alive(uint32_t pid);
+
+#ifdef __cplusplus
+    }
+#endif
@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * Linux backend of the bebo_shmem platform layer.
+ *
+ * Regions are POSIX shm objects (/dev/shm/<name>), or files on hugetlbfs
+ * (BEBO_SHMEM_HUGETLBFS/<name>) when asked for huge pages. The mutex is a robust,
+ * process shared pthread mutex and the semaphore a futex word holding its
+ * count, each living in its own small shm object named after the Windows
+ * kernel object so both sides keep using the same BEBO_SHMEM_* names.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+
+#include "bebo_shmem_platform.h"
+
+#define SYNC_MAGIC 0x6265626fu /* "bebo" */
+
+struct posix_mutex {
+  uint32_t ready;
+  pthread_mutex_t mutex;
+};
+
+struct posix_semaphore {
+  uint32_t ready;
+  uint32_t value;
+};
+
+static bool
+shm_path(const char *name, char *out)
+{
+  int len = snprintf(out, BEBO_SHMEM_MAX_NAME, "/%s", name);
+  if (len <= 0 || len >= BEBO_SHMEM_MAX_NAME) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  return true;
+}
+
+static bool
+hugetlbfs_path(const char *name, char *out)
+{
+  int len = snprintf(out, BEBO_SHMEM_MAX_NAME, BEBO_SHMEM_HUGETLBFS "/%s", name);
+  if (len <= 0 || len >= BEBO_SHMEM_MAX_NAME) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  return true;
+}
+
+static void
+abs_timeout(uint32_t timeout_ms, clockid_t clock, struct timespec *ts)
+{
+  clock_gettime(clock, ts);
+  ts->tv_sec += timeout_ms / 1000;
+  ts->tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+static long
+futex(uint32_t *uaddr, int op, uint32_t val, const struct timespec *timeout)
+{
+  /* not FUTEX_PRIVATE_FLAG, the word is shared between processes */
+  return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+static void
+wait_until_ready(uint32_t *ready)
+{
+  /* the creator may still be initializing the object */
+  for (int i = 0; i < 1000; i++) {
+    if (__atomic_load_n(ready, __ATOMIC_ACQUIRE) == SYNC_MAGIC) {
+      return;
+    }
+    usleep(1000);
+  }
+}
+
+static bool
+map_region(struct bebo_shmem_region *region, size_t size)
+{
+  struct stat st;
+
+  if (size == 0) {
+    if (fstat(region->fd, &st) != 0) {
+      return false;
+    }
+    size = (size_t) st.st_size;
+  }
+
+  region->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+      region->fd, 0);
+  if (region->data == MAP_FAILED) {
+    region->data = NULL;
+    return false;
+  }
+
+  region->size = size;
+  return true;
+}
+
+static void
+region_release(struct bebo_shmem_region *region)
+{
+  if (region->data) {
+    munmap(region->data, region->size);
+    region->data = NULL;
+  }
+
+  if (region->fd >= 0) {
+    close(region->fd);
+    region->fd = -1;
+  }
+
+  /* Windows drops the name with the last handle, the best we can do is to
+   * let the creator remove it. Mapped readers are not affected. */
+  if (region->owner) {
+    if (region->hugetlbfs) {
+      unlink(region->name);
+    } else {
+      shm_unlink(region->name);
+    }
+    region->owner = false;
+  }
+  region->hugetlbfs = false;
+  region->huge_pages = false;
+  region->size = 0;
+}
+
+static bool
+region_create(struct bebo_shmem_region *region, const char *name, size_t size,
+    bool *created)
+{
+  memset(region, 0, sizeof(*region));
+  region->fd = -1;
+  if (!shm_path(name, region->name)) {
+    return false;
+  }
+
+  *created = true;
+  region->fd = shm_open(region->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (region->fd < 0 && errno == EEXIST) {
+    *created = false;
+    region->fd = shm_open(region->name, O_RDWR, 0600);
+  }
+  if (region->fd < 0) {
+    return false;
+  }
+
+  region->owner = true;
+  if (ftruncate(region->fd, (off_t) size) != 0 || !map_region(region, size)) {
+    int err = errno;
+    region_release(region);
+    errno = err;
+    return false;
+  }
+  return true;
+}
+
+/* A file on hugetlbfs is mapped with huge pages, like MAP_HUGETLB, but
+ * readers can still find it by name. */
+static bool
+region_create_huge(struct bebo_shmem_region *region, const char *name,
+    size_t size)
+{
+  struct statfs fs;
+  size_t page;
+
+  memset(region, 0, sizeof(*region));
+  region->fd = -1;
+  if (!hugetlbfs_path(name, region->name)) {
+    return false;
+  }
+
+  region->fd = open(region->name, O_RDWR | O_CREAT, 0600);
+  if (region->fd < 0) {
+    return false;
+  }
+  region->owner = true;
+  region->hugetlbfs = true;
+
+  // f_bsize is the huge page size of the mount
+  if (fstatfs(region->fd, &fs) != 0 || fs.f_bsize <= 0) {
+    region_release(region);
+    return false;
+  }
+  page = (size_t) fs.f_bsize;
+  size = (size + page - 1) / page * page;
+
+  // fails with ENOMEM when not enough huge pages are reserved
+  if (ftruncate(region->fd, (off_t) size) != 0 || !map_region(region, size)) {
+    int err = errno;
+    region_release(region);
+    errno = err;
+    return false;
+  }
+  region->huge_pages = true;
+  return true;
+}
+
+bool
+bebo_shmem_region_create(struct bebo_shmem_region *region, const char *name,
+    size_t size, uint32_t flags)
+{
+  char other[BEBO_SHMEM_MAX_NAME];
+  bool created;
+
+  if ((flags & BEBO_SHMEM_REGION_HUGE_PAGES) &&
+      region_create_huge(region, name, size)) {
+    // readers look in /dev/shm first, don't let them find an old region
+    if (shm_path(name, other)) {
+      shm_unlink(other);
+    }
+    return true;
+  }
+
+  if (!region_create(region, name, size, &created)) {
+    return false;
+  }
+  if (flags & BEBO_SHMEM_REGION_SHARED) {
+    // we can't tell when the last one is gone, leave the name be
+    region->owner = false;
+  }
+  if (hugetlbfs_path(name, other)) {
+    unlink(other);
+  }
+  if (flags & BEBO_SHMEM_REGION_HUGE_PAGES) {
+    // transparent huge pages, only honored with shmem_enabled=advise
+    madvise(region->data, region->size, MADV_HUGEPAGE);
+  }
+  return true;
+}
+
+bool
+bebo_shmem_region_open(struct bebo_shmem_region *region, const char *name,
+    size_t size)
+{
+  memset(region, 0, sizeof(*region));
+  region->fd = -1;
+  if (!shm_path(name, region->name)) {
+    return false;
+  }
+
+  region->fd = shm_open(region->name, O_RDWR, 0600);
+  if (region->fd < 0 && errno == ENOENT && hugetlbfs_path(name, region->name)) {
+    region->fd = open(region->name, O_RDWR);
+    region->huge_pages = region->fd >= 0;
+  }
+  if (region->fd < 0) {
+    return false;
+  }
+
+  if (!map_region(region, size)) {
+    int err = errno;
+    region_release(region);
+    errno = err;
+    return false;
+  }
+  return true;
+}
+
+void
+bebo_shmem_region_close(struct bebo_shmem_region *region)
+{
+  /* a zeroed, never opened region has fd 0, don't touch it */
+  if (!region->data) {
+    return;
+  }
+  region_release(region);
+}
+
+bool
+bebo_shmem_mutex_create(struct bebo_shmem_mutex *mutex, const char *name,
+    bool initial_owner)
+{
+  struct posix_mutex *m;
+  pthread_mutexattr_t attr;
+  bool created;
+
+  if (!region_create(&mutex->region, name, sizeof(struct posix_mutex), &created)) {
+    return false;
+  }
+
+  m = mutex->region.data;
+  if (created) {
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&m->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    /* like CreateMutexW, nobody may take it before the initial owner */
+    if (initial_owner) {
+      pthread_mutex_lock(&m->mutex);
+    }
+    __atomic_store_n(&m->ready, SYNC_MAGIC, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  wait_until_ready(&m->ready);
+  if (initial_owner &&
+      bebo_shmem_mutex_lock(mutex, BEBO_SHMEM_INFINITE) != BEBO_SHMEM_WAIT_OK) {
+    bebo_shmem_mutex_close(mutex);
+    return false;
+  }
+  return true;
+}
+
+bool
+bebo_shmem_mutex_open(struct bebo_shmem_mutex *mutex, const char *name)
+{
+  if (!bebo_shmem_region_open(&mutex->region, name, sizeof(struct posix_mutex))) {
+    return false;
+  }
+
+  wait_until_ready(&((struct posix_mutex *) mutex->region.data)->ready);
+  return true;
+}
+
+enum bebo_shmem_wait_result
+bebo_shmem_mutex_lock(struct bebo_shmem_mutex *mutex, uint32_t timeout_ms)
+{
+  struct posix_mutex *m = mutex->region.data;
+  struct timespec ts;
+  int rc;
+
+  if (timeout_ms == BEBO_SHMEM_INFINITE) {
+    rc = pthread_mutex_lock(&m->mutex);
+  } else {
+    abs_timeout(timeout_ms, CLOCK_REALTIME, &ts);
+    rc = pthread_mutex_timedlock(&m->mutex, &ts);
+  }
+
+  switch (rc) {
+    case 0:
+      return BEBO_SHMEM_WAIT_OK;
+    case EOWNERDEAD:
+      /* same as WAIT_ABANDONED, we own it now */
+      pthread_mutex_consistent(&m->mutex);
+      return BEBO_SHMEM_WAIT_OK;
+    case ETIMEDOUT:
+      return BEBO_SHMEM_WAIT_TIMEOUT;
+    default:
+      errno = rc;
+      return BEBO_SHMEM_WAIT_ERROR;
+  }
+}
+
+void
+bebo_shmem_mutex_unlock(struct bebo_shmem_mutex *mutex)
+{
+  struct posix_mutex *m = mutex->region.data;
+  pthread_mutex_unlock(&m->mutex);
+}
+
+void
+bebo_shmem_mutex_close(struct bebo_shmem_mutex *mutex)
+{
+  bebo_shmem_region_close(&mutex->region);
+}
+
+bool
+bebo_shmem_semaphore_create(struct bebo_shmem_semaphore *sem, const char *name)
+{
+  struct posix_semaphore *s;
+  bool created;
+
+  if (!region_create(&sem->region, name, sizeof(struct posix_semaphore), &created)) {
+    return false;
+  }
+
+  s = sem->region.data;
+  if (created) {
+    __atomic_store_n(&s->value, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->ready, SYNC_MAGIC, __ATOMIC_RELEASE);
+  } else {
+    wait_until_ready(&s->ready);
+  }
+  return true;
+}
+
+bool
+bebo_shmem_semaphore_open(struct bebo_shmem_semaphore *sem, const char *name)
+{
+  if (!bebo_shmem_region_open(&sem->region, name, sizeof(struct posix_semaphore))) {
+    return false;
+  }
+
+  wait_until_ready(&((struct posix_semaphore *) sem->region.data)->ready);
+  return true;
+}
+
+void
+bebo_shmem_semaphore_signal(struct bebo_shmem_semaphore *sem)
+{
+  struct posix_semaphore *s = sem->region.data;
+  uint32_t value = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+
+  /* like ReleaseSemaphore, signals past the maximum count are dropped */
+  do {
+    if (value >= BEBO_SHMEM_SEMAPHORE_MAX) {
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&s->value, &value, value + 1, false,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  futex(&s->value, FUTEX_WAKE, 1, NULL);
+}
+
+enum bebo_shmem_wait_result
+bebo_shmem_semaphore_wait(struct bebo_shmem_semaphore *sem, uint32_t timeout_ms)
+{
+  struct posix_semaphore *s = sem->region.data;
+  struct timespec deadline, now, rel;
+
+  if (timeout_ms != BEBO_SHMEM_INFINITE) {
+    abs_timeout(timeout_ms, CLOCK_MONOTONIC, &deadline);
+  }
+
+  for (;;) {
+    uint32_t value = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+    while (value != 0) {
+      if (__atomic_compare_exchange_n(&s->value, &value, value - 1, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return BEBO_SHMEM_WAIT_OK;
+      }
+    }
+
+    if (timeout_ms == BEBO_SHMEM_INFINITE) {
+      if (futex(&s->value, FUTEX_WAIT, 0, NULL) != 0 &&
+          errno != EAGAIN && errno != EINTR) {
+        return BEBO_SHMEM_WAIT_ERROR;
+      }
+      continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rel.tv_sec = deadline.tv_sec - now.tv_sec;
+    rel.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+    if (rel.tv_nsec < 0) {
+      rel.tv_sec--;
+      rel.tv_nsec += 1000000000L;
+    }
+    if (rel.tv_sec < 0) {
+      return BEBO_SHMEM_WAIT_TIMEOUT;
+    }
+
+    if (futex(&s->value, FUTEX_WAIT, 0, &rel) != 0 &&
+        errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+      return BEBO_SHMEM_WAIT_ERROR;
+    }
+  }
+}
+
+void
+bebo_shmem_semaphore_close(struct bebo_shmem_semaphore *sem)
+{
+  bebo_shmem_region_close(&sem->region);
+}
+
+enum bebo_shmem_wait_result
+bebo_shmem_unlock_and_wait(struct bebo_shmem_mutex *mutex,
+    struct bebo_shmem_semaphore *sem, uint32_t timeout_ms)
+{
+  /* Not atomic like SignalObjectAndWait, but a signal that lands in between
+   * is counted by the semaphore so no wakeup is lost. */
+  bebo_shmem_mutex_unlock(mutex);
+  return bebo_shmem_semaphore_wait(sem, timeout_ms);
+}
+
+int
+bebo_shmem_last_error(void)
+{
+  return errno;
+}
+
+void
+bebo_shmem_sleep_ms(uint32_t ms)
+{
+  usleep((useconds_t) ms * 1000);
+}
+
+uint64_t
+bebo_shmem_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+uint32_t
+bebo_shmem_pid(void)
+{
+  return (uint32_t) getpid();
+}
+
+bool
+bebo_shmem_process_alive(uint32_t pid)
+{
+  /* EPERM: exists, but belongs to someone else */
+  return kill((pid_t) pid, 0) == 0 || errno != ESRCH;
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * Windows backend of the bebo_shmem platform layer: named file mappings,
+ * mutexes and semaphores.
+ */
+
+#include <string.h>
+
+#include "bebo_shmem_platform.h"
+
+static bool
+to_wide_name(const char *name, wchar_t *out, int out_len)
+{
+  return MultiByteToWideChar(CP_UTF8, 0, name, -1, out, out_len) > 0;
+}
+
+static enum bebo_shmem_wait_result
+wait_result(DWORD rc)
+{
+  switch (rc) {
+    case WAIT_OBJECT_0:
+    case WAIT_ABANDONED:
+      return BEBO_SHMEM_WAIT_OK;
+    case WAIT_TIMEOUT:
+      return BEBO_SHMEM_WAIT_TIMEOUT;
+    default:
+      return BEBO_SHMEM_WAIT_ERROR;
+  }
+}
+
+static DWORD
+wait_timeout(uint32_t timeout_ms)
+{
+  return timeout_ms == BEBO_SHMEM_INFINITE ? INFINITE : timeout_ms;
+}
+
+#ifndef FILE_MAP_LARGE_PAGES
+#define FILE_MAP_LARGE_PAGES 0x20000000
+#endif
+
+/* Large pages need SeLockMemoryPrivilege, which is granted per account but
+ * still has to be switched on in our token. */
+static bool
+enable_lock_memory_privilege(void)
+{
+  HANDLE token;
+  TOKEN_PRIVILEGES tp;
+  bool ok;
+
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &token)) {
+    return false;
+  }
+  tp.PrivilegeCount = 1;
+  tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+  ok = LookupPrivilegeValueW(NULL, L"SeLockMemoryPrivilege",
+      &tp.Privileges[0].Luid) &&
+      AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) &&
+      GetLastError() == ERROR_SUCCESS;
+  CloseHandle(token);
+  return ok;
+}
+
+static bool
+region_create_large(struct bebo_shmem_region *region, const wchar_t *wname,
+    size_t size)
+{
+  SIZE_T page = GetLargePageMinimum();
+
+  if (page == 0 || !enable_lock_memory_privilege()) {
+    return false;
+  }
+  size = (size + page - 1) / page * page;
+
+  region->handle = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL,
+      PAGE_READWRITE | SEC_COMMIT | SEC_LARGE_PAGES,
+      (DWORD) ((uint64_t) size >> 32), (DWORD) size, wname);
+  if (!region->handle) {
+    return false;
+  }
+
+  region->data = MapViewOfFile(region->handle,
+      FILE_MAP_ALL_ACCESS | FILE_MAP_LARGE_PAGES, 0, 0, size);
+  if (!region->data) {
+    bebo_shmem_region_close(region);
+    return false;
+  }
+
+  region->size = size;
+  region->huge_pages = true;
+  return true;
+}
+
+bool
+bebo_shmem_region_create(struct bebo_shmem_region *region, const char *name,
+    size_t size, uint32_t flags)
+{
+  wchar_t wname[BEBO_SHMEM_MAX_NAME];
+
+  memset(region, 0, sizeof(*region));
+  if (!to_wide_name(name, wname, BEBO_SHMEM_MAX_NAME)) {
+    return false;
+  }
+
+  if ((flags & BEBO_SHMEM_REGION_HUGE_PAGES) &&
+      region_create_large(region, wname, size)) {
+    return true;
+  }
+
+  region->handle = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL,
+      PAGE_READWRITE, (DWORD) ((uint64_t) size >> 32), (DWORD) size, wname);
+  if (!region->handle) {
+    return false;
+  }
+
+  region->data = MapViewOfFile(region->handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+  if (!region->data) {
+    bebo_shmem_region_close(region);
+    return false;
+  }
+
+  region->size = size;
+  return true;
+}
+
+bool
+bebo_shmem_region_open(struct bebo_shmem_region *region, const char *name,
+    size_t size)
+{
+  wchar_t wname[BEBO_SHMEM_MAX_NAME];
+  MEMORY_BASIC_INFORMATION mbi;
+
+  memset(region, 0, sizeof(*region));
+  if (!to_wide_name(name, wname, BEBO_SHMEM_MAX_NAME)) {
+    return false;
+  }
+
+  region->handle = OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, false, wname);
+  if (!region->handle) {
+    return false;
+  }
+
+  region->data = MapViewOfFile(region->handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+  if (!region->data) {
+    bebo_shmem_region_close(region);
+    return false;
+  }
+
+  region->size = size;
+  if (size == 0 && VirtualQuery(region->data, &mbi, sizeof(mbi))) {
+    region->size = mbi.RegionSize;
+  }
+  return true;
+}
+
+void
+bebo_shmem_region_close(struct bebo_shmem_region *region)
+{
+  if (region->data) {
+    UnmapViewOfFile(region->data);
+    region->data = NULL;
+  }
+
+  if (region->handle) {
+    CloseHandle(region->handle);
+    region->handle = NULL;
+  }
+  region->size = 0;
+  region->huge_pages = false;
+}
+
+bool
+bebo_shmem_mutex_create(struct bebo_shmem_mutex *mutex, const char *name,
+    bool initial_owner)
+{
+  wchar_t wname[BEBO_SHMEM_MAX_NAME];
+
+  if (!to_wide_name(name, wname, BEBO_SHMEM_MAX_NAME)) {
+    mutex->handle = NULL;
+    return false;
+  }
+
+  mutex->handle = CreateMutexW(NULL, initial_owner, wname);
+  return mutex->handle != NULL;
+}
+
+bool
+bebo_shmem_mutex_open(struct bebo_shmem_mutex *mutex, const char *name)
+{
+  wchar_t wname[BEBO_SHMEM_MAX_NAME];
+
+  if (!to_wide_name(name, wname, BEBO_SHMEM_MAX_NAME)) {
+    mutex->handle = NULL;
+    return false;
+  }
+
+  mutex->handle = OpenMutexW(SYNCHRONIZE, false, wname);
+  return mutex->handle != NULL;
+}
+
+enum bebo_shmem_wait_result
+bebo_shmem_mutex_lock(struct bebo_shmem_mutex *mutex, uint32_t timeout_ms)
+{
+  return wait_result(WaitForSingleObject(mutex->handle, wait_timeout(timeout_ms)));
+}
+
+void
+bebo_shmem_mutex_unlock(struct bebo_shmem_mutex *mutex)
+{
+  ReleaseMutex(mutex->handle);
+}
+
+void
+bebo_shmem_mutex_close(struct bebo_shmem_mutex *mutex)
+{
+  if (mutex->handle) {
+    CloseHandle(mutex->handle);
+    mutex->handle = NULL;
+  }
+}
+
+bool
+bebo_shmem_semaphore_create(struct bebo_shmem_semaphore *sem, const char *name)
+{
+  wchar_t wname[BEBO_SHMEM_MAX_NAME];
+
+  if (!to_wide_name(name, wname, BEBO_SHMEM_MAX_NAME)) {
+    sem->handle = NULL;
+    return false;
+  }
+
+  sem->handle = CreateSemaphoreW(NULL, 0, BEBO_SHMEM_SEMAPHORE_MAX, wname);
+  return sem->handle != NULL;
+}
+
+bool
+bebo_shmem_semaphore_open(struct bebo_shmem_semaphore *sem, const char *name)
+{
+  wchar_t wname[BEBO_SHMEM_MAX_NAME];
+
+  if (!to_wide_name(name, wname, BEBO_SHMEM_MAX_NAME)) {
+    sem->handle = NULL;
+    return false;
+  }
+
+  sem->handle = OpenSemaphoreW(SYNCHRONIZE, false, wname);
+  return sem->handle != NULL;
+}
+
+void
+bebo_shmem_semaphore_signal(struct bebo_shmem_semaphore *sem)
+{
+  ReleaseSemaphore(sem->handle, 1, NULL);
+}
+
+enum bebo_shmem_wait_result
+bebo_shmem_semaphore_wait(struct bebo_shmem_semaphore *sem, uint32_t timeout_ms)
+{
+  return wait_result(WaitForSingleObject(sem->handle, wait_timeout(timeout_ms)));
+}
+
+void
+bebo_shmem_semaphore_close(struct bebo_shmem_semaphore *sem)
+{
+  if (sem->handle) {
+    CloseHandle(sem->handle);
+    sem->handle = NULL;
+  }
+}
+
+enum bebo_shmem_wait_result
+bebo_shmem_unlock_and_wait(struct bebo_shmem_mutex *mutex,
+    struct bebo_shmem_semaphore *sem, uint32_t timeout_ms)
+{
+  return wait_result(SignalObjectAndWait(mutex->handle, sem->handle,
+        wait_timeout(timeout_ms), false));
+}
+
+int
+bebo_shmem_last_error(void)
+{
+  return (int) GetLastError();
+}
+
+void
+bebo_shmem_sleep_ms(uint32_t ms)
+{
+  Sleep(ms);
+}
+
+uint64_t
+bebo_shmem_now_ns(void)
+{
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0) {
+    QueryPerformanceFrequency(&freq);
+  }
+  QueryPerformanceCounter(&now);
+  return (uint64_t) (now.QuadPart / freq.QuadPart) * 1000000000ull +
+      (uint64_t) (now.QuadPart % freq.QuadPart) * 1000000000ull / freq.QuadPart;
+}
+
+uint32_t
+bebo_shmem_pid(void)
+{
+  return (uint32_t) GetCurrentProcessId();
+}
+
+bool
+bebo_shmem_process_alive(uint32_t pid)
+{
+  HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+  bool alive;
+
+  if (!process) {
+    /* ERROR_ACCESS_DENIED: exists, but we may not look at it */
+    return GetLastError() != ERROR_INVALID_PARAMETER;
+  }
+
+  alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+  CloseHandle(process);
+  return alive;
+}
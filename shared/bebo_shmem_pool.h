@@ -0,0 +1,91 @@
+#pragma once
+
+/*
+ * Pixel buffers passed by fd, Linux only (BEBO_SHMEM_FEATURE_FD_POOL).
+ *
+ * Windows readers open the producer's textures through frame.dxgi_handle.
+ * Linux has no such global handle, so instead the producer listens on the
+ * abstract Unix socket BEBO_SHMEM_POOL_SOCKET (named for the channel like
+ * the other objects) and sends every reader that connects one message per
+ * pool buffer: a struct bebo_shmem_pool_message with the buffer's memfd or
+ * dmabuf attached via SCM_RIGHTS. A buffer that changes (new size after a
+ * caps change) is sent again with the next generation.
+ *
+ * Frames reference their buffer with the bebo_shmem_slot of their slot, see
+ * bebo_shmem_pool_slot(). Readers map each buffer once and reuse the
+ * mapping for every frame in it, nothing is copied after setup.
+ *
+ * Only the socket is new, attaching, pins and wakeups stay on the ring.
+ */
+
+#include "bebo_shmem.h"
+#include "bebo_shmem_platform.h"
+
+#ifdef __cplusplus
+  extern "C" {
+#endif
+
+#ifndef _WIN32
+
+  /* at most, like the sink's GstShmemAllocator */
+#define BEBO_SHMEM_POOL_SIZE 64
+  /* connected readers the producer keeps sending to */
+#define BEBO_SHMEM_POOL_MAX_CLIENTS (2 * BEBO_SHMEM_MAX_READERS)
+
+  struct bebo_shmem_pool_message {
+    uint32_t index;
+    uint32_t generation;
+    uint64_t size;
+  };
+
+  struct bebo_shmem_pool_buffer {
+    int fd; /* -1 if the slot of the pool is empty */
+    uint32_t generation;
+    uint64_t size;
+    uint8_t *data; /* our mapping, NULL if we did not map it */
+  };
+
+  struct bebo_shmem_pool_server {
+    int listen_fd;
+    int clients[BEBO_SHMEM_POOL_MAX_CLIENTS]; /* -1 if free */
+    struct bebo_shmem_pool_buffer buffer[BEBO_SHMEM_POOL_SIZE];
+  };
+
+  struct bebo_shmem_pool_client {
+    int fd;
+    char channel[BEBO_SHMEM_MAX_CHANNEL_NAME];
+    struct bebo_shmem_pool_buffer buffer[BEBO_SHMEM_POOL_SIZE];
+  };
+
+  /* Producer: listen on the socket of channel (NULL for the default one). */
+  bool bebo_shmem_pool_server_open(struct bebo_shmem_pool_server *server,
+      const char *channel);
+  /* Producer: make a new memfd of size bytes buffer index of the pool and
+   * map it for us to write. Replaces what index was before. */
+  uint8_t *bebo_shmem_pool_server_alloc(struct bebo_shmem_pool_server *server,
+      uint32_t index, uint64_t size);
+  /* Producer: make fd (memfd or dmabuf, we keep a dup of it) buffer index
+   * of the pool and send it to the connected readers. */
+  bool bebo_shmem_pool_server_set(struct bebo_shmem_pool_server *server,
+      uint32_t index, int fd, uint64_t size);
+  /* Producer: send the pool to readers that connected since the last call,
+   * never blocks. Call it before publishing a frame. */
+  void bebo_shmem_pool_server_poll(struct bebo_shmem_pool_server *server);
+  void bebo_shmem_pool_server_close(struct bebo_shmem_pool_server *server);
+
+  void bebo_shmem_pool_client_init(struct bebo_shmem_pool_client *client);
+  /* Reader: connect to the producer of channel (NULL for the default one). */
+  bool bebo_shmem_pool_client_connect(struct bebo_shmem_pool_client *client,
+      const char *channel);
+  /* Reader: our mapping of buffer index in generation. Takes in what the
+   * producer sent, waiting up to timeout_ms for it. NULL if it did not
+   * come. */
+  uint8_t *bebo_shmem_pool_client_map(struct bebo_shmem_pool_client *client,
+      uint32_t index, uint32_t generation, uint32_t timeout_ms);
+  void bebo_shmem_pool_client_close(struct bebo_shmem_pool_client *client);
+
+#endif
+
+#ifdef __cplusplus
+    }
+#endif
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * fd pool of the shmem frame ring, see bebo_shmem_pool.h.
+ *
+ * The socket is SOCK_SEQPACKET, so every message arrives whole with the fd
+ * that was sent along with it.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bebo_shmem_pool.h"
+#include "bebo_shmem_ring.h"
+
+#define LISTEN_BACKLOG 16
+
+static socklen_t
+pool_address(struct sockaddr_un *addr, const char *channel)
+{
+  char name[BEBO_SHMEM_MAX_NAME];
+  size_t len;
+
+  bebo_shmem_object_name(name, BEBO_SHMEM_POOL_SOCKET, channel);
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  // abstract, goes away with the producer, nothing to unlink. Names of
+  // valid channels fit.
+  len = strlen(name);
+  if (len > sizeof(addr->sun_path) - 1) {
+    len = sizeof(addr->sun_path) - 1;
+  }
+  memcpy(addr->sun_path + 1, name, len);
+  return (socklen_t) (offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+static void
+buffer_reset(struct bebo_shmem_pool_buffer *buffer)
+{
+  if (buffer->data) {
+    munmap(buffer->data, (size_t) buffer->size);
+  }
+  if (buffer->fd >= 0) {
+    close(buffer->fd);
+  }
+  buffer->fd = -1;
+  buffer->size = 0;
+  buffer->data = NULL;
+}
+
+static bool
+send_buffer(int socket, uint32_t index, struct bebo_shmem_pool_buffer *buffer)
+{
+  struct bebo_shmem_pool_message message = {
+    index, buffer->generation, buffer->size
+  };
+  struct iovec iov = { &message, sizeof(message) };
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.space;
+  msg.msg_controllen = sizeof(control.space);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &buffer->fd, sizeof(int));
+
+  // a reader that lets its socket fill up connects again
+  return sendmsg(socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) ==
+      (ssize_t) sizeof(message);
+}
+
+bool
+bebo_shmem_pool_server_open(struct bebo_shmem_pool_server *server,
+    const char *channel)
+{
+  struct sockaddr_un addr;
+  socklen_t len = pool_address(&addr, channel);
+
+  for (int i = 0; i < BEBO_SHMEM_POOL_MAX_CLIENTS; i++) {
+    server->clients[i] = -1;
+  }
+  for (int i = 0; i < BEBO_SHMEM_POOL_SIZE; i++) {
+    server->buffer[i].fd = -1;
+    server->buffer[i].generation = 0;
+    server->buffer[i].size = 0;
+    server->buffer[i].data = NULL;
+  }
+
+  server->listen_fd = socket(AF_UNIX,
+      SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (server->listen_fd < 0) {
+    return false;
+  }
+  if (bind(server->listen_fd, (struct sockaddr *) &addr, len) != 0 ||
+      listen(server->listen_fd, LISTEN_BACKLOG) != 0) {
+    int error = errno;
+    close(server->listen_fd);
+    server->listen_fd = -1;
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+bool
+bebo_shmem_pool_server_set(struct bebo_shmem_pool_server *server,
+    uint32_t index, int fd, uint64_t size)
+{
+  struct bebo_shmem_pool_buffer *buffer;
+  int copy;
+
+  if (index >= BEBO_SHMEM_POOL_SIZE) {
+    errno = EINVAL;
+    return false;
+  }
+  copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (copy < 0) {
+    return false;
+  }
+
+  buffer = &server->buffer[index];
+  buffer_reset(buffer);
+  buffer->fd = copy;
+  buffer->size = size;
+  buffer->generation++;
+
+  for (int i = 0; i < BEBO_SHMEM_POOL_MAX_CLIENTS; i++) {
+    if (server->clients[i] >= 0 &&
+        !send_buffer(server->clients[i], index, buffer)) {
+      close(server->clients[i]);
+      server->clients[i] = -1;
+    }
+  }
+  return true;
+}
+
+uint8_t *
+bebo_shmem_pool_server_alloc(struct bebo_shmem_pool_server *server,
+    uint32_t index, uint64_t size)
+{
+  struct bebo_shmem_pool_buffer *buffer;
+  void *data;
+  int fd = memfd_create("bebo_shmem_pool", MFD_CLOEXEC);
+
+  if (fd < 0) {
+    return NULL;
+  }
+  if (ftruncate(fd, (off_t) size) != 0 ||
+      !bebo_shmem_pool_server_set(server, index, fd, size)) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return NULL;
+  }
+  close(fd);
+
+  buffer = &server->buffer[index];
+  data = mmap(NULL, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED,
+      buffer->fd, 0);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  buffer->data = data;
+  return data;
+}
+
+/* A free entry in clients, dropping readers that hung up if there is none. */
+static int
+free_client(struct bebo_shmem_pool_server *server)
+{
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < BEBO_SHMEM_POOL_MAX_CLIENTS; i++) {
+      char byte;
+      if (server->clients[i] < 0) {
+        return i;
+      }
+      // readers never write, 0 is a hangup
+      if (pass == 1 && recv(server->clients[i], &byte, 1,
+          MSG_DONTWAIT | MSG_PEEK) == 0) {
+        close(server->clients[i]);
+        server->clients[i] = -1;
+      }
+    }
+  }
+  return -1;
+}
+
+void
+bebo_shmem_pool_server_poll(struct bebo_shmem_pool_server *server)
+{
+  int fd;
+
+  while ((fd = accept4(server->listen_fd, NULL, NULL,
+      SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    int i = free_client(server);
+    bool ok = i >= 0;
+    for (uint32_t j = 0; ok && j < BEBO_SHMEM_POOL_SIZE; j++) {
+      if (server->buffer[j].fd >= 0) {
+        ok = send_buffer(fd, j, &server->buffer[j]);
+      }
+    }
+    if (!ok) {
+      close(fd);
+      continue;
+    }
+    server->clients[i] = fd;
+  }
+}
+
+void
+bebo_shmem_pool_server_close(struct bebo_shmem_pool_server *server)
+{
+  if (server->listen_fd >= 0) {
+    close(server->listen_fd);
+  }
+  server->listen_fd = -1;
+  for (int i = 0; i < BEBO_SHMEM_POOL_MAX_CLIENTS; i++) {
+    if (server->clients[i] >= 0) {
+      close(server->clients[i]);
+    }
+    server->clients[i] = -1;
+  }
+  for (int i = 0; i < BEBO_SHMEM_POOL_SIZE; i++) {
+    buffer_reset(&server->buffer[i]);
+  }
+}
+
+void
+bebo_shmem_pool_client_init(struct bebo_shmem_pool_client *client)
+{
+  memset(client, 0, sizeof(*client));
+  client->fd = -1;
+  for (int i = 0; i < BEBO_SHMEM_POOL_SIZE; i++) {
+    client->buffer[i].fd = -1;
+  }
+}
+
+bool
+bebo_shmem_pool_client_connect(struct bebo_shmem_pool_client *client,
+    const char *channel)
+{
+  struct sockaddr_un addr;
+  socklen_t len = pool_address(&addr, channel);
+
+  // reconnects pass our own copy
+  if (channel != client->channel) {
+    memset(client->channel, 0, sizeof(client->channel));
+    if (channel) {
+      strncpy(client->channel, channel, sizeof(client->channel) - 1);
+    }
+  }
+
+  client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (client->fd < 0) {
+    return false;
+  }
+  if (connect(client->fd, (struct sockaddr *) &addr, len) != 0) {
+    int error = errno;
+    close(client->fd);
+    client->fd = -1;
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+/* Take one message in, false if there was none or the producer hung up. */
+static bool
+receive_buffer(struct bebo_shmem_pool_client *client)
+{
+  struct bebo_shmem_pool_message message;
+  struct iovec iov = { &message, sizeof(message) };
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct bebo_shmem_pool_buffer *buffer;
+  ssize_t n;
+  int fd = -1;
+  void *data;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.space;
+  msg.msg_controllen = sizeof(control.space);
+
+  n = recvmsg(client->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    close(client->fd);
+    client->fd = -1;
+    return false;
+  }
+  if (n < 0) {
+    return false;
+  }
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if (fd < 0) {
+    return true;
+  }
+  if (n != (ssize_t) sizeof(message) || message.index >= BEBO_SHMEM_POOL_SIZE) {
+    close(fd);
+    return true;
+  }
+
+  buffer = &client->buffer[message.index];
+  buffer_reset(buffer);
+  data = mmap(NULL, (size_t) message.size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return true;
+  }
+  buffer->fd = fd;
+  buffer->size = message.size;
+  buffer->generation = message.generation;
+  buffer->data = data;
+  return true;
+}
+
+uint8_t *
+bebo_shmem_pool_client_map(struct bebo_shmem_pool_client *client,
+    uint32_t index, uint32_t generation, uint32_t timeout_ms)
+{
+  struct bebo_shmem_pool_buffer *buffer;
+  uint64_t deadline = bebo_shmem_now_ns() + (uint64_t) timeout_ms * 1000000;
+
+  if (index >= BEBO_SHMEM_POOL_SIZE) {
+    return NULL;
+  }
+  buffer = &client->buffer[index];
+
+  for (;;) {
+    uint64_t now;
+    struct pollfd pfd;
+
+    if (buffer->data && buffer->generation == generation) {
+      return buffer->data;
+    }
+    // the producer restarted or dropped us, its buffers come again
+    if (client->fd < 0 &&
+        !bebo_shmem_pool_client_connect(client, client->channel)) {
+      return NULL;
+    }
+    if (receive_buffer(client)) {
+      continue;
+    }
+
+    // the producer sends a new reader's buffers with its next frame
+    now = bebo_shmem_now_ns();
+    if (now >= deadline) {
+      return NULL;
+    }
+    if (client->fd < 0) {
+      continue;
+    }
+    pfd.fd = client->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, (int) ((deadline - now + 999999) / 1000000));
+  }
+}
+
+void
+bebo_shmem_pool_client_close(struct bebo_shmem_pool_client *client)
+{
+  if (client->fd >= 0) {
+    close(client->fd);
+  }
+  client->fd = -1;
+  for (int i = 0; i < BEBO_SHMEM_POOL_SIZE; i++) {
+    buffer_reset(&client->buffer[i]);
+  }
+}
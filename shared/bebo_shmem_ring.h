@@ -0,0 +1,624 @@
+#pragma once
+
+/*
+ * Lock free hand over of frames through the shmem ring.
+ *
+ * - write_ptr is only written by the producer. It is the nr of the newest
+ *   published frame, which lives in slot write_ptr % count.
+ * - Readers attach to a slot of the reader table (under BEBO_SHMEM_MUTEX)
+ *   and get an index i < BEBO_SHMEM_MAX_READERS. Its read_ptr and
+ *   heartbeat are only written by that reader (in its own cache line with
+ *   BEBO_SHMEM_FEATURE_READER_LINES, see bebo_shmem_reader_line()), each reader waits
+ *   on its own "new data" semaphore. A reader that died or stopped reading
+ *   is evicted by the producer: its bits are dropped and reader[i].generation
+ *   is bumped so the reader notices if it was only slow. A reader that
+ *   unpins marks its generation BEBO_SHMEM_GENERATION_RELEASING first, the
+ *   producer does not evict it meanwhile, see
+ *   bebo_shmem_reader_begin_release().
+ * - frame.seq is a per slot sequence counter. The producer makes it odd
+ *   before it touches a slot and even again once the slot is consistent
+ *   (seqlock). Readers never see a half written frame: they either copy the
+ *   slot optimistically and re-check seq, or pin it first.
+ * - frame.reader_mask holds a pin bit (low 16 bits) and an unread bit
+ *   (high 16 bits) per reader. The producer sets the unread bits of all
+ *   attached readers when it publishes a frame and never rewrites a slot
+ *   while any pin bit is set. It only takes a slot with unread bits left
+ *   when it decides the frame is stale. Otherwise it drops the incoming
+ *   frame, so producer and readers never wait on each other.
+ *
+ * Pinning works like Dekker's algorithm: the producer publishes an odd seq
+ * and then reads reader_mask, the reader sets its pin bit and then re-reads
+ * seq. At least one of them sees the other and backs off.
+ */
+
+#include <stdio.h>
+#include "bebo_shmem.h"
+#include "bebo_shmem_atomic.h"
+
+#ifdef __cplusplus
+  extern "C" {
+#endif
+
+#define BEBO_SHMEM_REF_PINS     0x0000ffffu
+#define BEBO_SHMEM_REF_UNREAD   0xffff0000u
+#define BEBO_SHMEM_REF_PIN(reader)         (1u << (reader))
+#define BEBO_SHMEM_REF_UNREAD_BY(reader)   (1u << (16 + (reader)))
+
+/* reader.generation: the reader is taking pins off under this generation */
+#define BEBO_SHMEM_GENERATION_RELEASING 0x80000000u
+
+/* shmem.clock.rate_denom as written by the producer, keeps the rate math
+ * in bebo_shmem_clock_time() within 64 bits */
+#define BEBO_SHMEM_CLOCK_RATE_DENOM (1ull << 30)
+#define BEBO_SHMEM_CLOCK_READ_ATTEMPTS 8
+
+/* every part of the region starts on its own cache line */
+#define BEBO_SHMEM_ALIGNMENT 64
+#define BEBO_SHMEM_ALIGN(n) \
+    (((n) + BEBO_SHMEM_ALIGNMENT - 1) & ~(uint64_t) (BEBO_SHMEM_ALIGNMENT - 1))
+
+  /* Where a producer puts the headers, see bebo_shmem_layout_headers(). */
+  struct bebo_shmem_layout {
+    uint64_t v2_offset;
+    uint64_t release_offset;
+    uint64_t frame_offset; /* the headers end here, slot 0 starts */
+    uint64_t frame_size;
+  };
+
+  static inline struct frame *bebo_shmem_frame(struct shmem *shmem, uint64_t i) {
+    return (struct frame *) (((unsigned char *) shmem) +
+        shmem->frame_offset + i * shmem->frame_size);
+  }
+
+  static inline uint64_t bebo_shmem_write_ptr(struct shmem *shmem) {
+    return bebo_atomic_load_u64(&shmem->write_ptr);
+  }
+
+  static inline uint32_t bebo_shmem_readers(struct shmem *shmem) {
+    return bebo_atomic_load_u32(&shmem->readers);
+  }
+
+  /* The v2 header, NULL if the producer predates it. */
+  static inline struct bebo_shmem_v2 *bebo_shmem_v2(struct shmem *shmem) {
+    struct bebo_shmem_v2 *v2;
+    /* older producers have their frames (or zeroed padding) where
+     * v2_offset is now */
+    if (shmem->frame_offset < offsetof(struct shmem, v2_offset) + sizeof(uint64_t) ||
+        shmem->v2_offset == 0) {
+      return NULL;
+    }
+    v2 = (struct bebo_shmem_v2 *) (((unsigned char *) shmem) + shmem->v2_offset);
+    return v2->magic == BEBO_SHMEM_V2_MAGIC ? v2 : NULL;
+  }
+
+  /* Producer: set up the v2 header at offset (cache line aligned, from the
+   * start of the region) before the first reader can attach. */
+  static inline void bebo_shmem_v2_init(struct shmem *shmem, uint64_t offset,
+      uint64_t features, uint64_t required) {
+    struct bebo_shmem_v2 *v2 = (struct bebo_shmem_v2 *) (((unsigned char *) shmem) + offset);
+    memset(v2, 0, sizeof(*v2));
+    v2->size = sizeof(*v2);
+    v2->features = features;
+    v2->required = required;
+    v2->magic = BEBO_SHMEM_V2_MAGIC;
+    shmem->v2_offset = offset;
+  }
+
+  /* Where the frame in slot i references its pool buffer, NULL if the
+   * producer has no BEBO_SHMEM_FEATURE_FD_POOL. */
+  static inline struct bebo_shmem_slot *bebo_shmem_pool_slot(
+      struct shmem *shmem, uint64_t i) {
+    struct bebo_shmem_v2 *v2 = bebo_shmem_v2(shmem);
+    if (v2 == NULL || !(v2->features & BEBO_SHMEM_FEATURE_FD_POOL) ||
+        v2->size < offsetof(struct bebo_shmem_v2, slot_offset) + sizeof(uint64_t) ||
+        v2->slot_offset == 0) {
+      return NULL;
+    }
+    return ((struct bebo_shmem_slot *) (((unsigned char *) shmem) +
+        v2->slot_offset)) + i;
+  }
+
+  /* Where readers push the slots they free, NULL if the producer has no
+   * BEBO_SHMEM_FEATURE_RELEASE_RING. */
+  static inline struct bebo_shmem_release_ring *bebo_shmem_release_ring(
+      struct shmem *shmem) {
+    struct bebo_shmem_v2 *v2 = bebo_shmem_v2(shmem);
+    if (v2 == NULL || !(v2->features & BEBO_SHMEM_FEATURE_RELEASE_RING) ||
+        v2->size < offsetof(struct bebo_shmem_v2, release_offset) + sizeof(uint64_t) ||
+        v2->release_offset == 0) {
+      return NULL;
+    }
+    return (struct bebo_shmem_release_ring *) (((unsigned char *) shmem) +
+        v2->release_offset);
+  }
+
+  /* Where observers stamp their snapshots, NULL if the producer has no
+   * BEBO_SHMEM_FEATURE_OBSERVERS. */
+  static inline uint64_t *bebo_shmem_observer_heartbeat(struct shmem *shmem) {
+    struct bebo_shmem_v2 *v2 = bebo_shmem_v2(shmem);
+    if (v2 == NULL || !(v2->features & BEBO_SHMEM_FEATURE_OBSERVERS) ||
+        v2->size < offsetof(struct bebo_shmem_v2, observer_heartbeat) + sizeof(uint64_t)) {
+      return NULL;
+    }
+    return &v2->observer_heartbeat;
+  }
+
+  /* Producer: set up an empty release ring at offset (cache line aligned,
+   * from the start of the region), after bebo_shmem_v2_init(). */
+  static inline void bebo_shmem_release_ring_init(struct shmem *shmem,
+      uint64_t offset) {
+    memset(((unsigned char *) shmem) + offset, 0,
+        sizeof(struct bebo_shmem_release_ring));
+    bebo_shmem_v2(shmem)->release_offset = offset;
+  }
+
+  /* Producer: lay out the v1 header, the v2 header and the release ring
+   * back to back, each cache line aligned. What comes after the frames is
+   * up to the producer. */
+  static inline void bebo_shmem_layout_headers(struct bebo_shmem_layout *layout) {
+    layout->v2_offset = BEBO_SHMEM_ALIGN(sizeof(struct shmem));
+    layout->release_offset = layout->v2_offset +
+        BEBO_SHMEM_ALIGN(sizeof(struct bebo_shmem_v2));
+    layout->frame_offset = layout->release_offset +
+        BEBO_SHMEM_ALIGN(sizeof(struct bebo_shmem_release_ring));
+    layout->frame_size = BEBO_SHMEM_ALIGN(sizeof(struct frame));
+  }
+
+  /* Reader: tell the producer slot is free. Returns false if the ring is
+   * full, the producer finds the slot when it looks at all of them. */
+  static inline bool bebo_shmem_release_push(
+      struct bebo_shmem_release_ring *ring, uint32_t slot) {
+    for (;;) {
+      uint64_t head = bebo_atomic_load_u64(&ring->head);
+      if (head - bebo_atomic_load_u64(&ring->tail) >= BEBO_SHMEM_RELEASE_RING_SIZE) {
+        return false;
+      }
+      if (bebo_atomic_cas_u64(&ring->head, head, head + 1)) {
+        uint64_t lap = (uint32_t) (head / BEBO_SHMEM_RELEASE_RING_SIZE + 1);
+        bebo_atomic_store_release_u64(
+            &ring->entry[head % BEBO_SHMEM_RELEASE_RING_SIZE], lap << 32 | slot);
+        return true;
+      }
+    }
+  }
+
+  /* Producer: take the next slot a reader pushed. Returns false if there is
+   * none, or if the reader that claimed it did not write it yet. */
+  static inline bool bebo_shmem_release_pop(
+      struct bebo_shmem_release_ring *ring, uint32_t *slot) {
+    uint64_t tail = ring->tail; /* we are the only writer */
+    uint64_t entry = bebo_atomic_load_u64(
+        &ring->entry[tail % BEBO_SHMEM_RELEASE_RING_SIZE]);
+    if ((uint32_t) (entry >> 32) !=
+        (uint32_t) (tail / BEBO_SHMEM_RELEASE_RING_SIZE + 1)) {
+      return false;
+    }
+    *slot = (uint32_t) entry;
+    bebo_atomic_store_release_u64(&ring->tail, tail + 1);
+    return true;
+  }
+
+  /* Producer: give up on the next entry if a reader claimed it but never
+   * wrote it (it died in between). Returns false if nothing was claimed. */
+  static inline bool bebo_shmem_release_skip(
+      struct bebo_shmem_release_ring *ring) {
+    uint64_t tail = ring->tail;
+    if (bebo_atomic_load_u64(&ring->head) == tail) {
+      return false;
+    }
+    bebo_atomic_store_release_u64(&ring->tail, tail + 1);
+    return true;
+  }
+
+  /* The cache line of reader if it attached with
+   * BEBO_SHMEM_FEATURE_READER_LINES, NULL if it uses the v1 reader table. */
+  static inline struct bebo_shmem_reader_line *bebo_shmem_reader_line(
+      struct shmem *shmem, int reader) {
+    struct bebo_shmem_v2 *v2 = bebo_shmem_v2(shmem);
+    if (v2 == NULL || !(bebo_atomic_load_u64(&v2->reader[reader].features) &
+        BEBO_SHMEM_FEATURE_READER_LINES)) {
+      return NULL;
+    }
+    return &v2->reader[reader];
+  }
+
+  static inline uint64_t *bebo_shmem_read_ptr_field(struct shmem *shmem, int reader) {
+    struct bebo_shmem_reader_line *line = bebo_shmem_reader_line(shmem, reader);
+    return line ? &line->read_ptr : &shmem->reader[reader].read_ptr;
+  }
+
+  static inline uint64_t *bebo_shmem_heartbeat_field(struct shmem *shmem, int reader) {
+    struct bebo_shmem_reader_line *line = bebo_shmem_reader_line(shmem, reader);
+    return line ? &line->heartbeat : &shmem->reader[reader].heartbeat;
+  }
+
+  static inline uint64_t *bebo_shmem_wake_at_field(struct shmem *shmem, int reader) {
+    struct bebo_shmem_reader_line *line = bebo_shmem_reader_line(shmem, reader);
+    return line ? &line->wake_at : &shmem->reader[reader].wake_at;
+  }
+
+  /* name of object base (BEBO_SHMEM_NAME, ...) of channel, NULL or "" is
+   * the default channel with the names from before there were channels.
+   * out holds BEBO_SHMEM_MAX_NAME. */
+  static inline void bebo_shmem_object_name(char *out, const char *base,
+      const char *channel) {
+    if (channel == NULL || channel[0] == '\0') {
+      snprintf(out, BEBO_SHMEM_MAX_NAME, "%s", base);
+    } else {
+      snprintf(out, BEBO_SHMEM_MAX_NAME, "%s@%s", base, channel);
+    }
+  }
+
+  /* name of the "new data" semaphore of reader, out holds BEBO_SHMEM_MAX_NAME */
+  static inline void bebo_shmem_data_sem_name(char *out, const char *channel,
+      int reader) {
+    if (channel == NULL || channel[0] == '\0') {
+      snprintf(out, BEBO_SHMEM_MAX_NAME, "%s_%d", BEBO_SHMEM_DATA_SEM, reader);
+    } else {
+      snprintf(out, BEBO_SHMEM_MAX_NAME, "%s@%s_%d", BEBO_SHMEM_DATA_SEM,
+          channel, reader);
+    }
+  }
+
+  /* Producer: claim a slot for writing. Fails if a reader holds a pin on it,
+   * or if a reader did not consume it yet and take_unread is false. In that
+   * case the slot is left untouched. */
+  static inline bool bebo_shmem_slot_begin_write(struct frame *frame,
+      bool take_unread) {
+    uint64_t seq = frame->seq; /* we are the only writer */
+    uint32_t mask;
+
+    bebo_atomic_store_u64(&frame->seq, seq | 1);
+    mask = bebo_atomic_load_u32(&frame->reader_mask);
+    if ((mask & BEBO_SHMEM_REF_PINS) ||
+        (!take_unread && (mask & BEBO_SHMEM_REF_UNREAD))) {
+      bebo_atomic_store_release_u64(&frame->seq, seq & ~(uint64_t) 1);
+      return false;
+    }
+
+    /* readers can't pin or consume while seq is odd */
+    if (mask & BEBO_SHMEM_REF_UNREAD) {
+      bebo_atomic_and_u32(&frame->reader_mask, BEBO_SHMEM_REF_PINS);
+    }
+    return true;
+  }
+
+  /* Producer: make the slot visible again, unread by the readers in mask
+   * (usually bebo_shmem_readers()). */
+  static inline void bebo_shmem_slot_end_write(struct frame *frame,
+      uint32_t readers) {
+    if (readers) {
+      bebo_atomic_or_u32(&frame->reader_mask, readers << 16);
+    }
+    bebo_atomic_store_release_u64(&frame->seq, (frame->seq | 1) + 1);
+  }
+
+  /* Producer: publish frame nr, its slot must have been written already.
+   * Sequentially consistent, the reader.wake_at loads that follow must not
+   * be moved before it, see bebo_shmem_reader_take_wakeup(). */
+  static inline void bebo_shmem_publish(struct shmem *shmem, uint64_t nr) {
+    bebo_atomic_store_u64(&shmem->write_ptr, nr);
+  }
+
+  /* Reader: ask to be signalled once frame nr is published, 0 to withdraw
+   * the request. Check write_ptr again afterwards before waiting, the frame
+   * may have come in between. */
+  static inline void bebo_shmem_reader_wake_at(struct shmem *shmem, int reader,
+      uint64_t nr) {
+    bebo_atomic_store_u64(bebo_shmem_wake_at_field(shmem, reader), nr);
+  }
+
+  /* Producer: after publishing frame nr, whether reader asked to be woken
+   * by now. Takes the request, a waiting reader is signalled only once. */
+  static inline bool bebo_shmem_reader_take_wakeup(struct shmem *shmem,
+      int reader, uint64_t nr) {
+    uint64_t *wake_at = bebo_shmem_wake_at_field(shmem, reader);
+    uint64_t at = bebo_atomic_load_u64(wake_at);
+    return at != 0 && at <= nr && bebo_atomic_cas_u64(wake_at, at, 0);
+  }
+
+  /* Reader: pin the slot if it still holds frame nr. While pinned the
+   * producer will not rewrite it. */
+  static inline bool bebo_shmem_slot_pin(struct frame *frame, uint64_t nr,
+      int reader) {
+    uint64_t seq = bebo_atomic_load_u64(&frame->seq);
+    if (seq & 1) {
+      return false;
+    }
+
+    bebo_atomic_or_u32(&frame->reader_mask, BEBO_SHMEM_REF_PIN(reader));
+    if (bebo_atomic_load_u64(&frame->seq) != seq || frame->nr != nr) {
+      bebo_atomic_and_u32(&frame->reader_mask, ~BEBO_SHMEM_REF_PIN(reader));
+      return false;
+    }
+    return true;
+  }
+
+  /* Reader: take our unread mark off a pinned slot. */
+  static inline void bebo_shmem_slot_consume(struct frame *frame, int reader) {
+    bebo_atomic_and_u32(&frame->reader_mask, ~BEBO_SHMEM_REF_UNREAD_BY(reader));
+  }
+
+  /* Reader: returns true if that was the last pin or unread mark on the
+   * slot, the producer may take it now. */
+  static inline bool bebo_shmem_slot_unpin(struct frame *frame, int reader) {
+    return bebo_atomic_and_u32(&frame->reader_mask,
+        ~BEBO_SHMEM_REF_PIN(reader)) == 0;
+  }
+
+  /* Reader: consume a frame older than before without looking at it, so
+   * the producer may reuse the slot. Returns true like
+   * bebo_shmem_slot_unpin(). */
+  static inline bool bebo_shmem_slot_skip(struct frame *frame, uint64_t before,
+      int reader) {
+    uint64_t nr = frame->nr;
+    if (nr == 0 || nr >= before || !bebo_shmem_slot_pin(frame, nr, reader)) {
+      return false;
+    }
+    bebo_shmem_slot_consume(frame, reader);
+    return bebo_shmem_slot_unpin(frame, reader);
+  }
+
+  /* Reader: copy a slot without pinning it. Returns false if the producer
+   * touched the slot while copying, the copy must be discarded then. */
+  static inline bool bebo_shmem_slot_read(struct frame *frame, struct frame *out) {
+    uint64_t seq = bebo_atomic_load_u64(&frame->seq);
+    if (seq & 1) {
+      return false;
+    }
+
+    memcpy(out, frame, sizeof(struct frame));
+    bebo_atomic_fence_acquire();
+    return bebo_atomic_load_u64(&frame->seq) == seq;
+  }
+
+  static inline uint32_t bebo_shmem_reader_generation(struct shmem *shmem,
+      int reader) {
+    return bebo_atomic_load_u32(&shmem->reader[reader].generation) &
+        ~BEBO_SHMEM_GENERATION_RELEASING;
+  }
+
+  /* Producer: next generation of reader, caller holds BEBO_SHMEM_MUTEX.
+   * Returns false if the reader is releasing right now. */
+  static inline bool bebo_shmem_reader_bump_generation(struct shmem *shmem,
+      int reader) {
+    uint32_t *generation = &shmem->reader[reader].generation;
+    uint32_t current = bebo_atomic_load_u32(generation);
+    return !(current & BEBO_SHMEM_GENERATION_RELEASING) &&
+        bebo_atomic_cas_u32(generation, current,
+            (current + 1) & ~BEBO_SHMEM_GENERATION_RELEASING);
+  }
+
+  /* Reader: before taking pins off, so they can't be the ones of a reader
+   * that got our entry after we were evicted. Returns false if generation
+   * is not ours anymore, leave the slots alone then. Keep it short, the
+   * producer can't evict us until bebo_shmem_reader_end_release(). */
+  static inline bool bebo_shmem_reader_begin_release(struct shmem *shmem,
+      int reader, uint32_t generation) {
+    return bebo_atomic_cas_u32(&shmem->reader[reader].generation, generation,
+        generation | BEBO_SHMEM_GENERATION_RELEASING);
+  }
+
+  static inline void bebo_shmem_reader_end_release(struct shmem *shmem,
+      int reader) {
+    bebo_atomic_and_u32(&shmem->reader[reader].generation,
+        ~BEBO_SHMEM_GENERATION_RELEASING);
+  }
+
+  /* Reader: take a free slot of the reader table, caller holds
+   * BEBO_SHMEM_MUTEX. features are the BEBO_SHMEM_FEATURE_* we use, only
+   * the ones the producer offers are taken. Returns the reader index or -1
+   * if the table is full. */
+  static inline int bebo_shmem_reader_attach(struct shmem *shmem,
+      uint64_t features) {
+    struct bebo_shmem_v2 *v2 = bebo_shmem_v2(shmem);
+    uint32_t readers = bebo_shmem_readers(shmem);
+    for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+      if (readers & (1u << i)) {
+        continue;
+      }
+
+      /* a reader that went away before may have left bits behind */
+      for (uint64_t j = 0; j < shmem->count; j++) {
+        bebo_atomic_and_u32(&bebo_shmem_frame(shmem, j)->reader_mask,
+            ~(BEBO_SHMEM_REF_PIN(i) | BEBO_SHMEM_REF_UNREAD_BY(i)));
+      }
+      /* before anything else, it says where the fields below live */
+      if (v2) {
+        bebo_atomic_store_release_u64(&v2->reader[i].features,
+            features & v2->features);
+      }
+      bebo_atomic_store_release_u64(bebo_shmem_read_ptr_field(shmem, i), 0);
+      bebo_atomic_store_release_u64(bebo_shmem_wake_at_field(shmem, i), 0);
+      bebo_atomic_store_release_u64(bebo_shmem_heartbeat_field(shmem, i),
+          bebo_shmem_now_ns());
+      shmem->reader[i].pid = bebo_shmem_pid();
+      /* nobody releases on a free entry, whoever had it was evicted or
+       * detached, so this takes one round */
+      while (!bebo_shmem_reader_bump_generation(shmem, i)) {
+        bebo_shmem_reader_end_release(shmem, i);
+      }
+      bebo_atomic_or_u32(&shmem->readers, 1u << i);
+      return i;
+    }
+    return -1;
+  }
+
+  /* Reader: leave the reader table and release everything we still hold,
+   * caller holds BEBO_SHMEM_MUTEX. */
+  static inline void bebo_shmem_reader_detach(struct shmem *shmem, int reader) {
+    struct bebo_shmem_v2 *v2 = bebo_shmem_v2(shmem);
+    bebo_atomic_and_u32(&shmem->readers, ~(1u << reader));
+    for (uint64_t j = 0; j < shmem->count; j++) {
+      bebo_atomic_and_u32(&bebo_shmem_frame(shmem, j)->reader_mask,
+          ~(BEBO_SHMEM_REF_PIN(reader) | BEBO_SHMEM_REF_UNREAD_BY(reader)));
+    }
+    /* a v1 reader taking the slot next does not know about the line */
+    if (v2) {
+      bebo_atomic_store_release_u64(&v2->reader[reader].features, 0);
+    }
+  }
+
+  /* Producer: throw out a reader that stopped reading, caller holds
+   * BEBO_SHMEM_MUTEX. Returns false if it is releasing a frame right now,
+   * try again later. */
+  static inline bool bebo_shmem_reader_evict(struct shmem *shmem, int reader) {
+    /* it died halfway through a release */
+    if (!bebo_shmem_process_alive(shmem->reader[reader].pid)) {
+      bebo_shmem_reader_end_release(shmem, reader);
+    }
+    if (!bebo_shmem_reader_bump_generation(shmem, reader)) {
+      return false;
+    }
+    bebo_shmem_reader_detach(shmem, reader);
+    return true;
+  }
+
+  static inline void bebo_shmem_reader_heartbeat(struct shmem *shmem, int reader) {
+    bebo_atomic_store_release_u64(bebo_shmem_heartbeat_field(shmem, reader),
+        bebo_shmem_now_ns());
+  }
+
+  static inline struct bebo_shmem_audio_chunk *bebo_shmem_audio_chunk(
+      struct shmem *shmem, uint64_t i) {
+    return (struct bebo_shmem_audio_chunk *) (((unsigned char *) shmem) +
+        shmem->audio_offset + i * sizeof(struct bebo_shmem_audio_chunk));
+  }
+
+  static inline uint8_t *bebo_shmem_audio_data(struct shmem *shmem, uint64_t i) {
+    return ((uint8_t *) shmem) + shmem->audio_data_offset +
+        i * shmem->audio_chunk_size;
+  }
+
+  /* Producer, while the slot is claimed: append a size byte record of type
+   * to frame.meta. Returns where its value goes, NULL if it does not fit. */
+  static inline void *bebo_shmem_meta_add(struct frame *frame, uint16_t type,
+      size_t size) {
+    size_t offset = (frame->meta_size + 7) & ~(size_t) 7;
+    size_t end = offset + sizeof(struct bebo_shmem_meta) + size;
+    if (size > UINT16_MAX || end > BEBO_SHMEM_FRAME_META_SIZE) {
+      return NULL;
+    }
+    struct bebo_shmem_meta *meta = (struct bebo_shmem_meta *) (frame->meta + offset);
+    meta->type = type;
+    meta->size = (uint16_t) size;
+    frame->meta_size = (uint32_t) end;
+    return meta + 1;
+  }
+
+  /* Reader: walk the records of a pinned frame, *offset starts at 0.
+   * Returns the value of the next record and its header in *meta, NULL at
+   * the end or if the area is garbled. */
+  static inline const void *bebo_shmem_meta_next(const struct frame *frame,
+      size_t *offset, struct bebo_shmem_meta *meta) {
+    size_t used = frame->meta_size;
+    size_t at = (*offset + 7) & ~(size_t) 7;
+    if (used > BEBO_SHMEM_FRAME_META_SIZE ||
+        at + sizeof(struct bebo_shmem_meta) > used) {
+      return NULL;
+    }
+    memcpy(meta, frame->meta + at, sizeof(*meta));
+    at += sizeof(struct bebo_shmem_meta);
+    if (at + meta->size > used) {
+      return NULL;
+    }
+    *offset = at + meta->size;
+    return frame->meta + at;
+  }
+
+  /* Producer: take the slot of audio chunk nr, whatever it held is gone. */
+  static inline struct bebo_shmem_audio_chunk *bebo_shmem_audio_begin_write(
+      struct shmem *shmem, uint64_t nr) {
+    struct bebo_shmem_audio_chunk *chunk =
+        bebo_shmem_audio_chunk(shmem, nr % shmem->audio_count);
+    bebo_atomic_store_u64(&chunk->seq, chunk->seq | 1);
+    bebo_atomic_fence_release();
+    return chunk;
+  }
+
+  /* Producer: the chunk is consistent again, publish it. */
+  static inline void bebo_shmem_audio_end_write(struct shmem *shmem,
+      struct bebo_shmem_audio_chunk *chunk) {
+    uint64_t nr = chunk->nr;
+    bebo_atomic_store_release_u64(&chunk->seq, (chunk->seq | 1) + 1);
+    bebo_atomic_store_release_u64(&shmem->audio_write_ptr, nr);
+  }
+
+  /* Reader: copy audio chunk nr and up to max bytes of its PCM. Returns
+   * false if the slot holds another chunk or was rewritten meanwhile. */
+  static inline bool bebo_shmem_audio_read(struct shmem *shmem, uint64_t nr,
+      struct bebo_shmem_audio_chunk *out, uint8_t *data, size_t max) {
+    uint64_t i = nr % shmem->audio_count;
+    struct bebo_shmem_audio_chunk *chunk = bebo_shmem_audio_chunk(shmem, i);
+    uint64_t seq = bebo_atomic_load_u64(&chunk->seq);
+    if (seq & 1) {
+      return false;
+    }
+
+    memcpy(out, chunk, sizeof(*out));
+    if (out->nr != nr || out->size > shmem->audio_chunk_size) {
+      return false;
+    }
+    if (out->size > max) {
+      out->size = (uint32_t) max;
+    }
+    memcpy(data, bebo_shmem_audio_data(shmem, i), out->size);
+    bebo_atomic_fence_acquire();
+    return bebo_atomic_load_u64(&chunk->seq) == seq;
+  }
+
+  /* Producer: replace the published clock sample (seqlock, like frame.seq). */
+  static inline void bebo_shmem_clock_publish(struct shmem *shmem,
+      const struct bebo_shmem_clock *sample) {
+    struct bebo_shmem_clock *clock = &shmem->clock;
+    uint64_t seq = clock->seq; /* we are the only writer */
+
+    bebo_atomic_store_u64(&clock->seq, seq | 1);
+    bebo_atomic_fence_release();
+    clock->base_time = sample->base_time;
+    clock->latency = sample->latency;
+    clock->internal = sample->internal;
+    clock->external = sample->external;
+    clock->rate_num = sample->rate_num;
+    clock->rate_denom = sample->rate_denom;
+    bebo_atomic_store_release_u64(&clock->seq, (seq | 1) + 1);
+  }
+
+  /* Reader: copy the published clock. Returns false if the producer has no
+   * clock yet or kept rewriting it while we looked. */
+  static inline bool bebo_shmem_clock_read(struct shmem *shmem,
+      struct bebo_shmem_clock *out) {
+    struct bebo_shmem_clock *clock = &shmem->clock;
+
+    for (int attempt = 0; attempt < BEBO_SHMEM_CLOCK_READ_ATTEMPTS; attempt++) {
+      uint64_t seq = bebo_atomic_load_u64(&clock->seq);
+      if (seq & 1) {
+        continue;
+      }
+      memcpy(out, clock, sizeof(*out));
+      bebo_atomic_fence_acquire();
+      if (bebo_atomic_load_u64(&clock->seq) == seq) {
+        return out->rate_denom != 0;
+      }
+    }
+    return false;
+  }
+
+  /* Producer clock time at now (a bebo_shmem_now_ns() value), extrapolated
+   * from the sample in clock. */
+  static inline uint64_t bebo_shmem_clock_time(
+      const struct bebo_shmem_clock *clock, uint64_t now) {
+    int64_t delta = (int64_t) (now - clock->internal);
+    int64_t skew = (int64_t) clock->rate_num - (int64_t) clock->rate_denom;
+    return clock->external + delta + delta * skew / (int64_t) clock->rate_denom;
+  }
+
+  /* Producer clock time at which frame is due. */
+  static inline uint64_t bebo_shmem_clock_frame_time(
+      const struct bebo_shmem_clock *clock, const struct frame *frame) {
+    return clock->base_time + frame->pts + clock->latency;
+  }
+
+#ifdef __cplusplus
+    }
+#endif
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * bebo_gate_bench [--channels 1,2,8] [--rate 48000] [--seconds 60]
+ *
+ * Checks and benchmarks the noise gate kernels (gst/noisegate). For every
+ * channel count, every kernel set this CPU runs first has to produce the
+ * same bytes as the scalar one, on blocks of the element's size and on
+ * odd sizes for the leftover frames. Then each one processes seconds of
+ * audio at rate in blocks like the element does and prints one JSON
+ * object per line:
+ *
+ *   {"kernels":"avx2","channels":2,"rate":48000,"frames":2880000,
+ *    "peak_ns_per_frame":..,"apply_ns_per_frame":..,"realtime":..}
+ *
+ * realtime is how many times faster than the audio plays peak and apply
+ * together ran. Exits with 1 if any output differed.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "gstnoisegatekernels.h"
+
+#define MAX_KERNELS 4
+#define MAX_CHANNELS 64
+#define MAX_SWEEP 16
+/* like the element */
+#define GATE_BLOCK 256
+#define MAKEUP 1.5f
+
+struct sweep {
+  int values[MAX_SWEEP];
+  int n;
+};
+
+static bool
+parse_sweep(const char *arg, struct sweep *sweep)
+{
+  char *end;
+
+  sweep->n = 0;
+  do {
+    if (sweep->n == MAX_SWEEP) {
+      return false;
+    }
+    sweep->values[sweep->n++] = (int) strtol(arg, &end, 10);
+    if (end == arg) {
+      return false;
+    }
+    arg = end + 1;
+  } while (*end == ',');
+  return *end == '\0';
+}
+
+static uint64_t
+now_ns(void)
+{
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0) {
+    QueryPerformanceFrequency(&freq);
+  }
+  QueryPerformanceCounter(&now);
+  return (uint64_t) (now.QuadPart / freq.QuadPart) * 1000000000ull +
+      (uint64_t) (now.QuadPart % freq.QuadPart) * 1000000000ull / freq.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static uint32_t
+next_random(uint32_t *state)
+{
+  // xorshift, the same samples every run
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static void
+fill(float *samples, float *gain, int frames, int channels, bool denormals)
+{
+  uint32_t state = 0x9e3779b9;
+
+  for (int i = 0; i < frames * channels; i++) {
+    uint32_t r = next_random(&state);
+    // some quiet stretches, exact zeros and denormals among the noise,
+    // denormals only for the checks, they are slow everywhere
+    if (r % 97 == 0) {
+      samples[i] = 0.0f;
+    } else if (denormals && r % 89 == 0) {
+      samples[i] = (r & 1 ? -1e-39f : 1e-39f);
+    } else {
+      samples[i] = ((float) (r >> 8) / (1 << 24) * 2.0f - 1.0f) *
+          ((r >> 4) % 8 == 0 ? 0.001f : 1.0f);
+    }
+  }
+  for (int n = 0; n < frames; n++) {
+    gain[n] = (float) (next_random(&state) >> 8) / (1 << 24);
+  }
+}
+
+static bool
+check(const struct gst_noise_gate_kernels *reference,
+    const struct gst_noise_gate_kernels *kernels,
+    const float *src, const float *gain, int frames, int channels)
+{
+  static const int sizes[] = { GATE_BLOCK, 1, 3, 7, 17, 255, 1000 };
+  size_t samples = (size_t) frames * channels;
+  float *peak[2], *dst[2];
+  bool same = true;
+
+  for (int k = 0; k < 2; k++) {
+    peak[k] = malloc(frames * sizeof(float));
+    dst[k] = malloc(samples * sizeof(float));
+  }
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    const struct gst_noise_gate_kernels *both[2] = { reference, kernels };
+    for (int k = 0; k < 2; k++) {
+      memset(peak[k], 0, frames * sizeof(float));
+      memset(dst[k], 0, samples * sizeof(float));
+      for (int n = 0; n < frames; n += sizes[s]) {
+        int block = frames - n < sizes[s] ? frames - n : sizes[s];
+        size_t at = (size_t) n * channels;
+        both[k]->peak(src + at, peak[k] + n, block, channels);
+        both[k]->apply(src + at, dst[k] + at, gain + n, MAKEUP, block, channels);
+      }
+    }
+    if (memcmp(peak[0], peak[1], frames * sizeof(float))) {
+      fprintf(stderr, "%s: peak differs from %s, %d channels, blocks of %d\n",
+          kernels->name, reference->name, channels, sizes[s]);
+      same = false;
+    }
+    if (memcmp(dst[0], dst[1], samples * sizeof(float))) {
+      fprintf(stderr, "%s: apply differs from %s, %d channels, blocks of %d\n",
+          kernels->name, reference->name, channels, sizes[s]);
+      same = false;
+    }
+  }
+
+  // in place, like the element's in place path would
+  memcpy(dst[0], src, samples * sizeof(float));
+  memcpy(dst[1], src, samples * sizeof(float));
+  reference->apply(dst[0], dst[0], gain, MAKEUP, frames, channels);
+  kernels->apply(dst[1], dst[1], gain, MAKEUP, frames, channels);
+  if (memcmp(dst[0], dst[1], samples * sizeof(float))) {
+    fprintf(stderr, "%s: in place apply differs from %s, %d channels\n",
+        kernels->name, reference->name, channels);
+    same = false;
+  }
+
+  for (int k = 0; k < 2; k++) {
+    free(peak[k]);
+    free(dst[k]);
+  }
+  return same;
+}
+
+static void
+bench(const struct gst_noise_gate_kernels *kernels, const float *src,
+    const float *gain, int frames, int channels, int rate, int seconds)
+{
+  size_t samples = (size_t) frames * channels;
+  float *peak = malloc(frames * sizeof(float));
+  float *dst = malloc(samples * sizeof(float));
+  uint64_t total = (uint64_t) rate * seconds;
+  uint64_t peak_ns = 0, apply_ns = 0;
+
+  // the buffer again and again until seconds of audio went through
+  for (uint64_t done = 0; done < total; ) {
+    int count = total - done < (uint64_t) frames ? (int) (total - done) : frames;
+
+    uint64_t start = now_ns();
+    for (int n = 0; n < count; n += GATE_BLOCK) {
+      int block = count - n < GATE_BLOCK ? count - n : GATE_BLOCK;
+      kernels->peak(src + (size_t) n * channels, peak + n, block, channels);
+    }
+    uint64_t middle = now_ns();
+    for (int n = 0; n < count; n += GATE_BLOCK) {
+      int block = count - n < GATE_BLOCK ? count - n : GATE_BLOCK;
+      size_t at = (size_t) n * channels;
+      kernels->apply(src + at, dst + at, gain + n, MAKEUP, block, channels);
+    }
+    uint64_t end = now_ns();
+
+    peak_ns += middle - start;
+    apply_ns += end - middle;
+    done += count;
+  }
+
+  uint64_t elapsed = peak_ns + apply_ns;
+  printf("{\"kernels\":\"%s\",\"channels\":%d,\"rate\":%d,\"frames\":%llu,"
+      "\"peak_ns_per_frame\":%.3f,\"apply_ns_per_frame\":%.3f,"
+      "\"realtime\":%.1f}\n",
+      kernels->name, channels, rate, (unsigned long long) total,
+      total ? (double) peak_ns / total : 0.0,
+      total ? (double) apply_ns / total : 0.0,
+      elapsed ? seconds * 1e9 / elapsed : 0.0);
+  fflush(stdout);
+
+  free(peak);
+  free(dst);
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: bebo_gate_bench [--channels 1,2,8] [--rate 48000] "
+      "[--seconds 60]\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct sweep channels = { { 1, 2, 8 }, 3 };
+  int rate = 48000;
+  int seconds = 60;
+
+  for (int i = 1; i < argc; i++) {
+    bool ok = i + 1 < argc;
+    if (ok && !strcmp(argv[i], "--channels")) {
+      ok = parse_sweep(argv[++i], &channels);
+    } else if (ok && !strcmp(argv[i], "--rate")) {
+      rate = atoi(argv[++i]);
+      ok = rate > 0;
+    } else if (ok && !strcmp(argv[i], "--seconds")) {
+      seconds = atoi(argv[++i]);
+      ok = seconds > 0;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      usage();
+      return 2;
+    }
+  }
+
+  const struct gst_noise_gate_kernels *kernels[MAX_KERNELS];
+  int count = gst_noise_gate_kernels_available(kernels, MAX_KERNELS);
+  if (count > MAX_KERNELS) {
+    count = MAX_KERNELS;
+  }
+
+  bool ok = true;
+  for (int c = 0; c < channels.n; c++) {
+    int chans = channels.values[c];
+    if (chans < 1 || chans > MAX_CHANNELS) {
+      continue;
+    }
+
+    // a second of audio, big enough to leave the caches
+    float *src = malloc((size_t) rate * chans * sizeof(float));
+    float *gain = malloc(rate * sizeof(float));
+    fill(src, gain, rate, chans, true);
+    for (int k = 1; k < count; k++) {
+      ok &= check(kernels[0], kernels[k], src, gain, rate, chans);
+    }
+
+    fill(src, gain, rate, chans, false);
+    for (int k = 0; k < count; k++) {
+      bench(kernels[k], src, gain, rate, chans, rate, seconds);
+    }
+
+    free(src);
+    free(gain);
+  }
+  return ok ? 0 : 1;
+}
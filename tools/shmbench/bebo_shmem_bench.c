@@ -0,0 +1,698 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * bebo_shmem_bench [--slots 4,8,16] [--payload 0,1048576,8294400]
+ *                  [--readers 1,2,4] [--frames 2000] [--pool]
+ *                  [--handover lockfree,mutex] [--verify] [--huge-pages 0,1]
+ *
+ * Benchmarks the shmem frame ring. For every combination of slot count,
+ * payload size and reader count it starts a producer and the readers as
+ * separate processes (this executable again, with --producer / --consumer)
+ * and prints one JSON object per line:
+ *
+ *   {"slots":8,"payload":1048576,"readers":2,"frames":2000,"pool":false,
+ *    "handover":"lockfree","verify":false,"consumers":[{"frames":2000,
+ *    "skipped":0,"torn":0,
+ *    "latency_us":{"p50":..,"p90":..,"p99":..,"p999":..,"max":..},
+ *    "lag":[n0,n1,..]}, ..],"huge_pages":1,"huge_pages_mapped":true,
+ *    "fps":9876.5}
+ *
+ * fps is what the producer managed at saturation: it publishes as fast as
+ * the readers release slots, like the sink's block policy, copying payload
+ * bytes into the block like the sink does for buffers that are not from
+ * its pool (0 is DXGI mode, only the slot travels). latency_us is publish
+ * to acquire returning, wakeup included. lag[n] counts the frames that were
+ * read while n newer frames were already published.
+ *
+ * With --pool (Linux) the blocks are memfds handed to the readers over the
+ * pool socket instead of living in the region, see bebo_shmem_pool.h.
+ *
+ * --huge-pages 0,1 creates the region with and without
+ * BEBO_SHMEM_REGION_HUGE_PAGES, like the sink's huge-pages property.
+ * huge_pages_mapped says whether the system actually gave us huge pages,
+ * the region falls back to normal ones when it does not. Without --pool
+ * the payload blocks live in the region and are backed by them too.
+ *
+ * --handover mutex runs the same traffic the way the ring worked before it
+ * was lock free: the producer holds BEBO_SHMEM_MUTEX while it writes and
+ * publishes a slot, readers hold it to acquire and release one. Sweep both
+ * to compare their latency.
+ *
+ * --verify is the torn read check. The producer fills every frame's block
+ * with its nr and writes fields that depend on it, readers check the
+ * frames they acquire and also copy the slot the producer is about to write
+ * with bebo_shmem_slot_read(). Every copy that passes the seq check but
+ * does not match is counted as "torn" by the consumer, which then exits
+ * with an error.
+ *
+ * The producer follows the sink's render path on the ring (claim, fill,
+ * end_write, publish, wake), the readers are bebo_shmem_client like
+ * beboshmsrc and the preview.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bebo_shmem.h"
+#include "bebo_shmem_ring.h"
+#include "bebo_shmem_client.h"
+#include "bebo_shmem_pool.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+#define ALIGN(n) BEBO_SHMEM_ALIGN(n)
+
+#define MAX_SWEEP 16
+
+enum handover {
+  HANDOVER_LOCKFREE,
+  HANDOVER_MUTEX,
+};
+
+static const char *handover_names[] = { "lockfree", "mutex" };
+#define ATTACH_TIMEOUT_MS 10000
+#define ACQUIRE_TIMEOUT_MS 1000
+
+struct sweep {
+  uint64_t values[MAX_SWEEP];
+  int n;
+};
+
+static uint32_t
+popcount(uint32_t v)
+{
+  uint32_t n = 0;
+  for (; v; v &= v - 1) {
+    n++;
+  }
+  return n;
+}
+
+static bool
+parse_sweep(const char *arg, struct sweep *sweep)
+{
+  char *end;
+
+  sweep->n = 0;
+  do {
+    if (sweep->n == MAX_SWEEP) {
+      return false;
+    }
+    sweep->values[sweep->n++] = strtoull(arg, &end, 10);
+    if (end == arg) {
+      return false;
+    }
+    arg = end + 1;
+  } while (*end == ',');
+  return *end == '\0';
+}
+
+/* lockfree,mutex into the handover values */
+static bool
+parse_handover(const char *arg, struct sweep *sweep)
+{
+  sweep->n = 0;
+  while (*arg) {
+    size_t len = strcspn(arg, ",");
+    int h;
+    for (h = 0; h < 2; h++) {
+      if (strlen(handover_names[h]) == len && !strncmp(arg, handover_names[h], len)) {
+        break;
+      }
+    }
+    if (h == 2 || sweep->n == MAX_SWEEP) {
+      return false;
+    }
+    sweep->values[sweep->n++] = h;
+    arg += len;
+    if (*arg == ',') {
+      arg++;
+    }
+  }
+  return sweep->n > 0;
+}
+
+/*
+ * producer
+ */
+
+/* The fields --verify checks, derived from nr. */
+static void
+stamp_frame(struct frame *frame, uint64_t nr)
+{
+  frame->pts = nr;
+  frame->dts = nr * 2;
+  frame->duration = ~nr;
+}
+
+static bool
+stamped(const struct frame *frame)
+{
+  return frame->pts == frame->nr && frame->dts == frame->nr * 2 &&
+      frame->duration == ~frame->nr;
+}
+
+static int
+run_producer(uint64_t slots, uint64_t payload, uint32_t readers, uint64_t frames,
+    bool pool, enum handover handover, bool verify, bool huge_pages)
+{
+  struct bebo_shmem_mutex mutex;
+  struct bebo_shmem_region region;
+  struct bebo_shmem_semaphore new_data[BEBO_SHMEM_MAX_READERS];
+  struct bebo_shmem_layout layout;
+  bebo_shmem_layout_headers(&layout);
+  uint64_t header_size = layout.frame_offset;
+  uint64_t frame_size = layout.frame_size;
+  uint64_t block_size = ALIGN(payload);
+  uint64_t payload_offset = header_size + frame_size * slots;
+  uint64_t size = payload_offset + (pool ? 0 : block_size * slots);
+  uint64_t slot_offset = size;
+  uint8_t **blocks = calloc((size_t) slots, sizeof(uint8_t *));
+#ifndef _WIN32
+  struct bebo_shmem_pool_server server;
+
+  if (pool) {
+    size += ALIGN(sizeof(struct bebo_shmem_slot) * slots);
+    if (slots > BEBO_SHMEM_POOL_SIZE || !bebo_shmem_pool_server_open(&server, NULL)) {
+      fprintf(stderr, "producer: could not open the pool %d\n", bebo_shmem_last_error());
+      free(blocks);
+      return 1;
+    }
+    for (uint64_t i = 0; i < slots; i++) {
+      blocks[i] = bebo_shmem_pool_server_alloc(&server, (uint32_t) i, block_size);
+      if (blocks[i] == NULL) {
+        fprintf(stderr, "producer: could not allocate pool buffer %d\n",
+            bebo_shmem_last_error());
+        bebo_shmem_pool_server_close(&server);
+        free(blocks);
+        return 1;
+      }
+    }
+  }
+#else
+  if (pool) {
+    fprintf(stderr, "producer: no fd pool on Windows\n");
+    free(blocks);
+    return 1;
+  }
+#endif
+
+  // like the sink, before the region: readers open them once they see it
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    char name[BEBO_SHMEM_MAX_NAME];
+    bebo_shmem_data_sem_name(name, NULL, i);
+    bebo_shmem_semaphore_create(&new_data[i], name);
+  }
+
+  if (!bebo_shmem_mutex_create(&mutex, BEBO_SHMEM_MUTEX, true) ||
+      !bebo_shmem_region_create(&region, BEBO_SHMEM_NAME, (size_t) size,
+          huge_pages ? BEBO_SHMEM_REGION_HUGE_PAGES : 0)) {
+    fprintf(stderr, "producer: could not create shmem %d\n", bebo_shmem_last_error());
+    for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+      bebo_shmem_semaphore_close(&new_data[i]);
+    }
+#ifndef _WIN32
+    if (pool) {
+      bebo_shmem_pool_server_close(&server);
+    }
+#endif
+    free(blocks);
+    return 1;
+  }
+
+  struct shmem *shmem = region.data;
+  memset(shmem, 0, (size_t) size);
+  shmem->version = SHM_INTERFACE_VERSION;
+  shmem->owner_pid = bebo_shmem_pid();
+  shmem->owner_heartbeat = bebo_shmem_now_ns();
+  shmem->info_generation = 1;
+  shmem->frame_offset = header_size;
+  if (pool) {
+    // the pixels are nowhere else, readers without the pool can't use them
+    bebo_shmem_v2_init(shmem, layout.v2_offset, BEBO_SHMEM_FEATURE_READER_LINES |
+        BEBO_SHMEM_FEATURE_RELEASE_RING | BEBO_SHMEM_FEATURE_FD_POOL,
+        BEBO_SHMEM_FEATURE_FD_POOL);
+    bebo_shmem_v2(shmem)->slot_offset = slot_offset;
+  } else {
+    bebo_shmem_v2_init(shmem, layout.v2_offset, BEBO_SHMEM_FEATURE_READER_LINES |
+        BEBO_SHMEM_FEATURE_RELEASE_RING, 0);
+  }
+  bebo_shmem_release_ring_init(shmem, layout.release_offset);
+  struct bebo_shmem_release_ring *release = bebo_shmem_release_ring(shmem);
+  shmem->frame_size = frame_size;
+  shmem->count = slots;
+  shmem->shmem_size = size;
+  shmem->payload_offset = payload && !pool ? payload_offset : 0;
+  shmem->payload_size = block_size;
+  for (uint64_t i = 0; pool && i < slots; i++) {
+    bebo_shmem_pool_slot(shmem, i)->pool_index = BEBO_SHMEM_POOL_NONE;
+  }
+  for (uint64_t i = 0; !pool && i < slots; i++) {
+    blocks[i] = (uint8_t *) shmem + payload_offset + i * block_size;
+  }
+  bebo_shmem_mutex_unlock(&mutex);
+
+  // what upstream hands us, copied into the block like a foreign buffer
+  uint8_t *source = payload ? malloc((size_t) payload) : NULL;
+  if (source) {
+    memset(source, 0x5a, (size_t) payload);
+  }
+
+  bool ok = true;
+  uint64_t deadline = bebo_shmem_now_ns() + (uint64_t) ATTACH_TIMEOUT_MS * 1000000;
+  while (popcount(bebo_shmem_readers(shmem)) < readers) {
+    if (bebo_shmem_now_ns() > deadline) {
+      fprintf(stderr, "producer: only %u of %u readers attached\n",
+          popcount(bebo_shmem_readers(shmem)), readers);
+      ok = false;
+      break;
+    }
+    bebo_shmem_sleep_ms(1);
+  }
+
+  uint64_t start = bebo_shmem_now_ns();
+  for (uint64_t nr = 1; ok && nr <= frames; nr++) {
+    uint64_t index = nr % slots;
+    struct frame *frame = bebo_shmem_frame(shmem, index);
+
+    bebo_atomic_store_release_u64(&shmem->owner_heartbeat, bebo_shmem_now_ns());
+#ifndef _WIN32
+    if (pool) {
+      bebo_shmem_pool_server_poll(&server);
+    }
+#endif
+    // the sink unrefs these, we have nothing to unref but readers should
+    // pay for pushing like they do with the sink
+    uint32_t released;
+    while (bebo_shmem_release_pop(release, &released)) {
+    }
+    // block policy: every reader gets every frame. Only try to claim once
+    // the slot looks free, a claim attempt keeps readers from pinning it.
+    for (;;) {
+      if (bebo_shmem_readers(shmem) == 0) {
+        fprintf(stderr, "producer: readers went away at frame %llu\n",
+            (unsigned long long) nr);
+        ok = false;
+        break;
+      }
+      if (bebo_atomic_load_u32(&frame->reader_mask) != 0) {
+        continue;
+      }
+      if (handover == HANDOVER_MUTEX &&
+          bebo_shmem_mutex_lock(&mutex, BEBO_SHMEM_INFINITE) != BEBO_SHMEM_WAIT_OK) {
+        fprintf(stderr, "producer: could not lock the mutex %d\n",
+            bebo_shmem_last_error());
+        ok = false;
+        break;
+      }
+      if (bebo_shmem_slot_begin_write(frame, false)) {
+        break;
+      }
+      if (handover == HANDOVER_MUTEX) {
+        bebo_shmem_mutex_unlock(&mutex);
+      }
+    }
+    if (!ok) {
+      break;
+    }
+
+    if (payload && verify) {
+      memset(blocks[index], (int) (nr & 0xff), (size_t) payload);
+    } else if (payload) {
+      memcpy(blocks[index], source, (size_t) payload);
+    }
+#ifndef _WIN32
+    if (pool) {
+      struct bebo_shmem_slot *slot = bebo_shmem_pool_slot(shmem, index);
+      slot->pool_index = (uint32_t) index;
+      slot->pool_generation = server.buffer[index].generation;
+      slot->pool_offset = 0;
+    }
+#endif
+    if (payload && !pool) {
+      frame->payload_offset = payload_offset + index * block_size;
+    }
+    stamp_frame(frame, nr);
+    frame->size = payload;
+    frame->info_generation = 1;
+    frame->nr = nr;
+    frame->publish_ns = bebo_shmem_now_ns();
+
+    uint32_t mask = bebo_shmem_readers(shmem);
+    bebo_shmem_slot_end_write(frame, mask);
+    bebo_shmem_publish(shmem, nr);
+    if (handover == HANDOVER_MUTEX) {
+      bebo_shmem_mutex_unlock(&mutex);
+    }
+    for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+      if ((mask & (1u << i)) && bebo_shmem_reader_take_wakeup(shmem, i, nr)) {
+        bebo_shmem_semaphore_signal(&new_data[i]);
+      }
+    }
+  }
+  uint64_t elapsed = bebo_shmem_now_ns() - start;
+
+  // keep the ring around until everybody is done with it
+  deadline = bebo_shmem_now_ns() + (uint64_t) ATTACH_TIMEOUT_MS * 1000000;
+  while (ok && bebo_shmem_readers(shmem) != 0 && bebo_shmem_now_ns() < deadline) {
+    bebo_shmem_sleep_ms(1);
+  }
+
+  if (ok) {
+    printf("%.1f %d\n", elapsed ? frames * 1e9 / elapsed : 0.0,
+        region.huge_pages);
+  }
+
+  free(source);
+  free(blocks);
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    bebo_shmem_semaphore_close(&new_data[i]);
+  }
+  bebo_shmem_region_close(&region);
+  bebo_shmem_mutex_close(&mutex);
+#ifndef _WIN32
+  if (pool) {
+    bebo_shmem_pool_server_close(&server);
+  }
+#endif
+  return ok ? 0 : 1;
+}
+
+/*
+ * consumer
+ */
+
+static int
+compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us(const uint64_t *sorted, uint64_t n, double p)
+{
+  if (n == 0) {
+    return 0;
+  }
+  uint64_t i = (uint64_t) (p * (n - 1));
+  return sorted[i] / 1000.0;
+}
+
+static void
+consumer_log(void *user_data, enum bebo_shmem_log_level level,
+    const char *message)
+{
+  (void) user_data;
+  if (level == BEBO_SHMEM_LOG_ERROR) {
+    fprintf(stderr, "consumer: %s\n", message);
+  }
+}
+
+/* One load per cache line, and the last byte, like the rest of a torn copy
+ * would show. */
+static bool
+check_block(const uint8_t *data, uint64_t size, uint64_t nr)
+{
+  for (uint64_t i = 0; i < size; i += 64) {
+    if (data[i] != (uint8_t) nr) {
+      return false;
+    }
+  }
+  return size == 0 || data[size - 1] == (uint8_t) nr;
+}
+
+/* Copy the slot the producer is about to write without pinning it, true
+ * unless the copy passed the seq check and is torn anyway. */
+static bool
+check_optimistic(struct bebo_shmem_client *client, uint64_t nr)
+{
+  struct frame *frame = bebo_shmem_frame(client->shmem, nr % client->shmem->count);
+  struct frame copy;
+
+  if (!bebo_shmem_slot_read(frame, &copy) || copy.nr == 0) {
+    return true;
+  }
+  return stamped(&copy);
+}
+
+static int
+run_consumer(uint64_t frames, enum handover handover, bool verify)
+{
+  struct bebo_shmem_client client;
+  enum bebo_shmem_open_result opened;
+
+  bebo_shmem_client_init(&client, consumer_log, NULL);
+  uint64_t deadline = bebo_shmem_now_ns() + (uint64_t) ATTACH_TIMEOUT_MS * 1000000;
+  while ((opened = bebo_shmem_client_open(&client)) != BEBO_SHMEM_OPEN_OK) {
+    if (opened != BEBO_SHMEM_OPEN_NOT_FOUND || bebo_shmem_now_ns() > deadline) {
+      fprintf(stderr, "consumer: could not open the ring: %d\n", opened);
+      return 1;
+    }
+    bebo_shmem_sleep_ms(1);
+  }
+
+  uint64_t slots = client.shmem->count;
+  uint64_t *latency = malloc(sizeof(uint64_t) * frames);
+  uint64_t *lag = calloc((size_t) slots + 1, sizeof(uint64_t));
+  uint64_t n = 0;
+  uint64_t skipped = 0;
+  uint64_t torn = 0;
+  uint64_t last_nr = 0;
+  volatile uint8_t sink = 0;
+
+  while (last_nr < frames) {
+    struct frame *frame;
+    uint64_t ticket;
+    enum bebo_shmem_wait_result res;
+    if (handover == HANDOVER_MUTEX) {
+      // sleep without the mutex, the producer could not publish otherwise
+      res = bebo_shmem_client_wait(&client, 1, ACQUIRE_TIMEOUT_MS, NULL);
+      if (res == BEBO_SHMEM_WAIT_OK) {
+        res = bebo_shmem_mutex_lock(&client.mutex, BEBO_SHMEM_INFINITE);
+      }
+      if (res == BEBO_SHMEM_WAIT_OK) {
+        res = bebo_shmem_client_acquire(&client, 0, &frame, &ticket);
+        bebo_shmem_mutex_unlock(&client.mutex);
+      }
+    } else {
+      res = bebo_shmem_client_acquire(&client, ACQUIRE_TIMEOUT_MS, &frame,
+          &ticket);
+    }
+    if (res != BEBO_SHMEM_WAIT_OK) {
+      fprintf(stderr, "consumer: gave up after frame %llu: %d\n",
+          (unsigned long long) last_nr, res);
+      break;
+    }
+
+    uint64_t now = bebo_shmem_now_ns();
+    uint64_t behind = bebo_shmem_write_ptr(client.shmem) - frame->nr;
+    lag[behind < slots ? behind : slots]++;
+    if (n < frames) {
+      latency[n++] = now - frame->publish_ns;
+    }
+    if (frame->nr > last_nr + 1) {
+      skipped += frame->nr - last_nr - 1;
+    }
+    last_nr = frame->nr;
+
+    // read the frame like a consumer would, one load per cache line
+    uint8_t *data = bebo_shmem_client_payload(&client, frame);
+    if (verify) {
+      // pinned, nothing may have changed under us
+      if (!stamped(frame) || (data && !check_block(data, frame->size, frame->nr))) {
+        torn++;
+      }
+      if (!check_optimistic(&client, frame->nr + 1)) {
+        torn++;
+      }
+    } else if (data) {
+      uint8_t sum = 0;
+      for (uint64_t i = 0; i < frame->size; i += 64) {
+        sum += data[i];
+      }
+      sink += sum;
+    }
+    if (handover == HANDOVER_MUTEX &&
+        bebo_shmem_mutex_lock(&client.mutex, BEBO_SHMEM_INFINITE) == BEBO_SHMEM_WAIT_OK) {
+      bebo_shmem_client_release(&client, ticket);
+      bebo_shmem_mutex_unlock(&client.mutex);
+    } else if (handover != HANDOVER_MUTEX) {
+      bebo_shmem_client_release(&client, ticket);
+    }
+  }
+  bebo_shmem_client_close(&client);
+
+  qsort(latency, (size_t) n, sizeof(uint64_t), compare_u64);
+  printf("{\"frames\":%llu,\"skipped\":%llu,\"torn\":%llu,\"latency_us\":{\"p50\":%.1f,"
+      "\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},\"lag\":[",
+      (unsigned long long) n, (unsigned long long) skipped,
+      (unsigned long long) torn, percentile_us(latency, n, 0.5), percentile_us(latency, n, 0.9),
+      percentile_us(latency, n, 0.99), percentile_us(latency, n, 0.999),
+      percentile_us(latency, n, 1.0));
+  for (uint64_t i = 0; i <= slots; i++) {
+    printf(i ? ",%llu" : "%llu", (unsigned long long) lag[i]);
+  }
+  printf("]}\n");
+
+  free(lag);
+  free(latency);
+  return torn == 0 ? 0 : 1;
+}
+
+/*
+ * driver
+ */
+
+static bool
+read_line(FILE *pipe, char *line, size_t size)
+{
+  if (pipe == NULL || fgets(line, (int) size, pipe) == NULL) {
+    return false;
+  }
+  line[strcspn(line, "\r\n")] = '\0';
+  return true;
+}
+
+static bool
+run_one(const char *self, uint64_t slots, uint64_t payload, uint32_t readers,
+    uint64_t frames, bool pool, enum handover handover, bool verify,
+    bool huge_pages)
+{
+  char command[1024];
+  char line[4096];
+  char fps[64];
+  int mapped = 0;
+  FILE *consumers[BEBO_SHMEM_MAX_READERS];
+  bool ok = true;
+
+  snprintf(command, sizeof(command), "\"%s\" --producer %llu %llu %u %llu %d %d %d %d",
+      self, (unsigned long long) slots, (unsigned long long) payload, readers,
+      (unsigned long long) frames, pool, handover, verify, huge_pages);
+  FILE *producer = popen(command, "r");
+
+  snprintf(command, sizeof(command), "\"%s\" --consumer %llu %d %d", self,
+      (unsigned long long) frames, handover, verify);
+  for (uint32_t i = 0; i < readers; i++) {
+    consumers[i] = popen(command, "r");
+  }
+
+  printf("{\"slots\":%llu,\"payload\":%llu,\"readers\":%u,\"frames\":%llu,"
+      "\"pool\":%s,\"handover\":\"%s\",\"verify\":%s,",
+      (unsigned long long) slots, (unsigned long long) payload,
+      readers, (unsigned long long) frames, pool ? "true" : "false",
+      handover_names[handover], verify ? "true" : "false");
+  printf("\"consumers\":[");
+  for (uint32_t i = 0; i < readers; i++) {
+    if (!read_line(consumers[i], line, sizeof(line))) {
+      strcpy(line, "null");
+      ok = false;
+    }
+    printf(i ? ",%s" : "%s", line);
+    // torn frames with --verify
+    if (consumers[i] && pclose(consumers[i]) != 0) {
+      ok = false;
+    }
+  }
+  // "fps mapped"
+  if (!read_line(producer, line, sizeof(line)) ||
+      sscanf(line, "%63s %d", fps, &mapped) != 2) {
+    strcpy(fps, "null");
+    ok = false;
+  }
+  printf("],\"huge_pages\":%d,\"huge_pages_mapped\":%s,\"fps\":%s}\n",
+      huge_pages, mapped ? "true" : "false", fps);
+  fflush(stdout);
+  if (producer) {
+    pclose(producer);
+  }
+  return ok;
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: bebo_shmem_bench [--slots 4,8,16] "
+      "[--payload 0,1048576,8294400] [--readers 1,2,4] [--frames 2000] "
+      "[--pool] [--handover lockfree,mutex] [--verify] [--huge-pages 0,1]\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct sweep slots = { { 4, 8, 16 }, 3 };
+  struct sweep payload = { { 0, 1048576, 8294400 }, 3 };
+  struct sweep readers = { { 1, 2, 4 }, 3 };
+  struct sweep handover = { { HANDOVER_LOCKFREE }, 1 };
+  struct sweep huge_pages = { { 0 }, 1 };
+  uint64_t frames = 2000;
+  bool pool = false;
+  bool verify = false;
+
+  if (argc == 10 && !strcmp(argv[1], "--producer")) {
+    return run_producer(strtoull(argv[2], NULL, 10), strtoull(argv[3], NULL, 10),
+        (uint32_t) strtoul(argv[4], NULL, 10), strtoull(argv[5], NULL, 10),
+        atoi(argv[6]) != 0, (enum handover) atoi(argv[7]), atoi(argv[8]) != 0,
+        atoi(argv[9]) != 0);
+  }
+  if (argc == 5 && !strcmp(argv[1], "--consumer")) {
+    return run_consumer(strtoull(argv[2], NULL, 10),
+        (enum handover) atoi(argv[3]), atoi(argv[4]) != 0);
+  }
+
+  for (int i = 1; i < argc; i++) {
+    bool ok = i + 1 < argc;
+    if (ok && !strcmp(argv[i], "--slots")) {
+      ok = parse_sweep(argv[++i], &slots);
+    } else if (ok && !strcmp(argv[i], "--payload")) {
+      ok = parse_sweep(argv[++i], &payload);
+    } else if (ok && !strcmp(argv[i], "--readers")) {
+      ok = parse_sweep(argv[++i], &readers);
+    } else if (ok && !strcmp(argv[i], "--frames")) {
+      frames = strtoull(argv[++i], NULL, 10);
+    } else if (ok && !strcmp(argv[i], "--handover")) {
+      ok = parse_handover(argv[++i], &handover);
+    } else if (ok && !strcmp(argv[i], "--huge-pages")) {
+      ok = parse_sweep(argv[++i], &huge_pages);
+    } else if (!strcmp(argv[i], "--pool")) {
+      pool = true;
+      ok = true;
+    } else if (!strcmp(argv[i], "--verify")) {
+      verify = true;
+      ok = true;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      usage();
+      return 2;
+    }
+  }
+
+  bool ok = true;
+  for (int g = 0; g < huge_pages.n; g++) {
+    for (int h = 0; h < handover.n; h++) {
+      for (int s = 0; s < slots.n; s++) {
+        for (int p = 0; p < payload.n; p++) {
+          for (int r = 0; r < readers.n; r++) {
+            if (slots.values[s] < 2 || readers.values[r] == 0 ||
+                readers.values[r] > BEBO_SHMEM_MAX_READERS) {
+              continue;
+            }
+            ok &= run_one(argv[0], slots.values[s], payload.values[p],
+                (uint32_t) readers.values[r], frames,
+                pool && payload.values[p] != 0,
+                (enum handover) handover.values[h], verify,
+                huge_pages.values[g] != 0);
+          }
+        }
+      }
+    }
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * Mapping of capture files, see bebo_shmem_capture.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "bebo_shmem_capture.h"
+
+static bool
+check_header(struct bebo_shmem_capture *capture)
+{
+  struct bebo_shmem_capture_header *header =
+      (struct bebo_shmem_capture_header *) capture->data;
+
+  if (capture->size < sizeof(*header) ||
+      memcmp(header->magic, "BEBOCAP", 7) != 0) {
+    fprintf(stderr, "not a capture file\n");
+    return false;
+  }
+  if (memcmp(header->magic, BEBO_SHMEM_CAPTURE_MAGIC, sizeof(header->magic)) != 0) {
+    fprintf(stderr, "capture was made by an older recorder, record it again\n");
+    return false;
+  }
+  if (header->version != SHM_INTERFACE_VERSION) {
+    fprintf(stderr, "capture was made with SHM_INTERFACE_VERSION %llu, we are %llu\n",
+        (unsigned long long) header->version,
+        (unsigned long long) SHM_INTERFACE_VERSION);
+    return false;
+  }
+  if (header->records == 0 || header->end > capture->size) {
+    fprintf(stderr, "capture is empty or was not finished\n");
+    return false;
+  }
+
+  capture->header = header;
+  return true;
+}
+
+#ifdef _WIN32
+
+bool
+bebo_shmem_capture_map(struct bebo_shmem_capture *capture, const char *path)
+{
+  LARGE_INTEGER size;
+
+  memset(capture, 0, sizeof(*capture));
+  capture->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (capture->file == INVALID_HANDLE_VALUE) {
+    capture->file = NULL;
+    fprintf(stderr, "could not open %s: %lu\n", path, GetLastError());
+    return false;
+  }
+  if (!GetFileSizeEx(capture->file, &size) || size.QuadPart == 0) {
+    bebo_shmem_capture_unmap(capture);
+    return false;
+  }
+
+  capture->mapping = CreateFileMappingW(capture->file, NULL, PAGE_READONLY, 0,
+      0, NULL);
+  if (capture->mapping) {
+    capture->data = MapViewOfFile(capture->mapping, FILE_MAP_READ, 0, 0, 0);
+  }
+  if (!capture->data) {
+    fprintf(stderr, "could not map %s: %lu\n", path, GetLastError());
+    bebo_shmem_capture_unmap(capture);
+    return false;
+  }
+  capture->size = (size_t) size.QuadPart;
+
+  if (!check_header(capture)) {
+    bebo_shmem_capture_unmap(capture);
+    return false;
+  }
+  return true;
+}
+
+void
+bebo_shmem_capture_unmap(struct bebo_shmem_capture *capture)
+{
+  if (capture->data) {
+    UnmapViewOfFile(capture->data);
+  }
+  if (capture->mapping) {
+    CloseHandle(capture->mapping);
+  }
+  if (capture->file) {
+    CloseHandle(capture->file);
+  }
+  memset(capture, 0, sizeof(*capture));
+}
+
+#else
+
+bool
+bebo_shmem_capture_map(struct bebo_shmem_capture *capture, const char *path)
+{
+  struct stat st;
+
+  memset(capture, 0, sizeof(*capture));
+  capture->fd = open(path, O_RDONLY);
+  if (capture->fd < 0) {
+    perror(path);
+    return false;
+  }
+  if (fstat(capture->fd, &st) != 0 || st.st_size == 0) {
+    bebo_shmem_capture_unmap(capture);
+    return false;
+  }
+
+  capture->data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED,
+      capture->fd, 0);
+  if (capture->data == MAP_FAILED) {
+    capture->data = NULL;
+    perror(path);
+    bebo_shmem_capture_unmap(capture);
+    return false;
+  }
+  capture->size = (size_t) st.st_size;
+  // records are read front to back
+  madvise(capture->data, capture->size, MADV_SEQUENTIAL);
+
+  if (!check_header(capture)) {
+    bebo_shmem_capture_unmap(capture);
+    return false;
+  }
+  return true;
+}
+
+void
+bebo_shmem_capture_unmap(struct bebo_shmem_capture *capture)
+{
+  if (capture->data) {
+    munmap(capture->data, capture->size);
+  }
+  if (capture->fd > 0) {
+    close(capture->fd);
+  }
+  memset(capture, 0, sizeof(*capture));
+}
+
+#endif
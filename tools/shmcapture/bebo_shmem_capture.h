@@ -0,0 +1,96 @@
+#pragma once
+
+/*
+ * Capture file of the shmem frame ring, written by bebo_shmem_record and
+ * played back by bebo_shmem_replay.
+ *
+ * The file is meant to be mapped: a struct bebo_shmem_capture_header, then
+ * records starting BEBO_SHMEM_CAPTURE_ALIGN aligned. A record is the slot
+ * as the producer published it, followed by payload_size bytes of pixels
+ * or access unit (also aligned), next says where the following record
+ * starts. Frames of a ring without payload (DXGI handles) are recorded
+ * without pixels.
+ *
+ * record.time_ns is the producer's publish time relative to the first
+ * record, so a replay reproduces the original inter-frame timing.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bebo_shmem.h"
+
+#ifdef __cplusplus
+  extern "C" {
+#endif
+
+// 2: struct shmem grew v2_offset
+#define BEBO_SHMEM_CAPTURE_MAGIC "BEBOCAP2"
+#define BEBO_SHMEM_CAPTURE_ALIGN 64
+#define BEBO_SHMEM_CAPTURE_ALIGN_UP(n) \
+  (((n) + BEBO_SHMEM_CAPTURE_ALIGN - 1) & ~(uint64_t) (BEBO_SHMEM_CAPTURE_ALIGN - 1))
+
+  struct bebo_shmem_capture_header {
+    char magic[8]; // BEBO_SHMEM_CAPTURE_MAGIC, not NUL terminated
+    uint64_t version; // SHM_INTERFACE_VERSION of the recorder
+    uint64_t records; // 0 if the recorder did not finish
+    uint64_t end; // file offset past the last record
+    uint64_t max_payload; // largest record payload_size
+    uint64_t missed; // frames the recorder could not copy in time
+    struct shmem shmem; // ring header when the recording started
+  };
+
+  struct bebo_shmem_capture_record {
+    uint64_t next; // offset of the next record from this one
+    uint64_t time_ns; // frame.publish_ns relative to the first record
+    uint64_t payload_size;
+    struct frame frame; // as published, payload_offset points into the producer's ring
+  };
+
+  struct bebo_shmem_capture {
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+    uint8_t *data;
+    size_t size;
+    struct bebo_shmem_capture_header *header;
+  };
+
+  /* Map a finished capture read only and check it was made by this
+   * version of the ring. */
+  bool bebo_shmem_capture_map(struct bebo_shmem_capture *capture,
+      const char *path);
+  void bebo_shmem_capture_unmap(struct bebo_shmem_capture *capture);
+
+  static inline uint64_t bebo_shmem_capture_first_offset(void) {
+    return BEBO_SHMEM_CAPTURE_ALIGN_UP(sizeof(struct bebo_shmem_capture_header));
+  }
+
+  static inline uint64_t bebo_shmem_capture_payload_offset(void) {
+    return BEBO_SHMEM_CAPTURE_ALIGN_UP(sizeof(struct bebo_shmem_capture_record));
+  }
+
+  /* Walk the records, pass NULL to get the first one. NULL at the end. */
+  static inline const struct bebo_shmem_capture_record *bebo_shmem_capture_next(
+      const struct bebo_shmem_capture *capture,
+      const struct bebo_shmem_capture_record *record) {
+    uint64_t offset = record == NULL ? bebo_shmem_capture_first_offset() :
+        (uint64_t) ((const uint8_t *) record - capture->data) + record->next;
+    if (offset + sizeof(struct bebo_shmem_capture_record) > capture->header->end) {
+      return NULL;
+    }
+    return (const struct bebo_shmem_capture_record *) (capture->data + offset);
+  }
+
+  static inline const uint8_t *bebo_shmem_capture_payload(
+      const struct bebo_shmem_capture_record *record) {
+    return (const uint8_t *) record + bebo_shmem_capture_payload_offset();
+  }
+
+#ifdef __cplusplus
+    }
+#endif
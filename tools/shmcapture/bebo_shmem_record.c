@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * bebo_shmem_record [-n frames] [-t seconds] [--channel name] capture-file
+ *
+ * Records the frames the producer of channel (the default one without
+ * --channel) publishes into a capture file, see bebo_shmem_capture.h. Stops after n frames, t seconds, on Ctrl-C or when
+ * the producer goes away.
+ *
+ * The recorder never writes to the ring. It takes no reader slot, so it
+ * pins nothing and the producer does not wait for it: slots are copied
+ * under frame.seq like bebo_shmem_slot_read() and frames that were
+ * overwritten before we got to them are counted as missed. Audio is not
+ * recorded.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bebo_shmem.h"
+#include "bebo_shmem_ring.h"
+#include "bebo_shmem_channel.h"
+#include "bebo_shmem_capture.h"
+
+// how often to look for new frames, we have no semaphore to wait on
+#define POLL_INTERVAL_MS 1
+#define COPY_ATTEMPTS 4
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int sig)
+{
+  (void) sig;
+  stop = 1;
+}
+
+static bool
+write_padded(FILE *file, const void *data, uint64_t size, uint64_t *offset)
+{
+  static const uint8_t zeros[BEBO_SHMEM_CAPTURE_ALIGN];
+  uint64_t padding = BEBO_SHMEM_CAPTURE_ALIGN_UP(size) - size;
+
+  if (size && fwrite(data, 1, (size_t) size, file) != size) {
+    return false;
+  }
+  if (padding && fwrite(zeros, 1, (size_t) padding, file) != padding) {
+    return false;
+  }
+  *offset += size + padding;
+  return true;
+}
+
+/* Copy frame nr and its payload out of the ring. Returns false if the
+ * producer reused the slot before we were done. */
+static bool
+copy_frame(struct shmem *shmem, uint64_t nr, struct bebo_shmem_capture_record *record,
+    uint8_t *payload, uint64_t max_payload)
+{
+  struct frame *frame = bebo_shmem_frame(shmem, nr % shmem->count);
+
+  for (int attempt = 0; attempt < COPY_ATTEMPTS; attempt++) {
+    if (!bebo_shmem_slot_read(frame, &record->frame)) {
+      continue;
+    }
+    if (record->frame.nr != nr) {
+      return false;
+    }
+
+    uint64_t size = 0;
+    if (record->frame.payload_offset != 0) {
+      size = record->frame.size;
+      // raw frames never exceed their block
+      if (shmem->codec == BEBO_SHMEM_CODEC_RAW && size > shmem->payload_size) {
+        size = shmem->payload_size;
+      }
+      if (size > max_payload ||
+          record->frame.payload_offset + size > shmem->shmem_size) {
+        return false;
+      }
+      memcpy(payload, (uint8_t *) shmem + record->frame.payload_offset, size);
+    }
+
+    // blocks and arena bytes are only reused after the slot is rewritten
+    bebo_atomic_fence_acquire();
+    if (bebo_atomic_load_u64(&frame->seq) == record->frame.seq) {
+      record->payload_size = size;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: bebo_shmem_record [-n frames] [-t seconds] "
+      "[--channel name] capture-file\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  uint64_t max_frames = 0;
+  uint64_t max_ns = 0;
+  const char *channel = NULL;
+  const char *path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      max_frames = strtoull(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      max_ns = (uint64_t) (atof(argv[++i]) * 1e9);
+    } else if (!strcmp(argv[i], "--channel") && i + 1 < argc &&
+        bebo_shmem_channel_name_valid(argv[i + 1])) {
+      channel = argv[++i];
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  if (path == NULL) {
+    usage();
+    return 2;
+  }
+
+  char name[BEBO_SHMEM_MAX_NAME];
+  bebo_shmem_object_name(name, BEBO_SHMEM_NAME, channel);
+  struct bebo_shmem_region region;
+  if (!bebo_shmem_region_open(&region, name, 0)) {
+    fprintf(stderr, "no producer, could not open shmem: %d\n", bebo_shmem_last_error());
+    return 1;
+  }
+  struct shmem *shmem = region.data;
+  if (shmem->version != SHM_INTERFACE_VERSION) {
+    fprintf(stderr, "SHM_INTERFACE_VERSION mismatch %llu != %llu\n",
+        (unsigned long long) shmem->version,
+        (unsigned long long) SHM_INTERFACE_VERSION);
+    bebo_shmem_region_close(&region);
+    return 1;
+  }
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    perror(path);
+    bebo_shmem_region_close(&region);
+    return 1;
+  }
+
+  // the largest payload a frame of this ring can have
+  uint64_t max_payload = shmem->codec != BEBO_SHMEM_CODEC_RAW ?
+      shmem->arena_size : shmem->payload_size;
+  uint8_t *payload = max_payload ? malloc((size_t) max_payload) : NULL;
+  struct bebo_shmem_capture_record *record = calloc(1, sizeof(*record));
+
+  struct bebo_shmem_capture_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BEBO_SHMEM_CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = SHM_INTERFACE_VERSION;
+  memcpy(&header.shmem, shmem, sizeof(header.shmem));
+
+  uint64_t offset = 0;
+  bool ok = write_padded(file, &header, sizeof(header), &offset);
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  uint64_t start = bebo_shmem_now_ns();
+  uint64_t first_publish_ns = 0;
+  uint64_t next_nr = bebo_shmem_write_ptr(shmem) + 1;
+  fprintf(stderr, "recording %ux%u, %llu slots, from frame %llu\n",
+      (unsigned) shmem->video_info.width, (unsigned) shmem->video_info.height,
+      (unsigned long long) shmem->count, (unsigned long long) next_nr);
+
+  while (ok && !stop && (max_frames == 0 || header.records < max_frames) &&
+      (max_ns == 0 || bebo_shmem_now_ns() - start < max_ns)) {
+    uint64_t write_ptr = bebo_shmem_write_ptr(shmem);
+    if (write_ptr < next_nr) {
+      if (!bebo_shmem_process_alive(shmem->owner_pid)) {
+        fprintf(stderr, "producer %u is gone\n", shmem->owner_pid);
+        break;
+      }
+      bebo_shmem_sleep_ms(POLL_INTERVAL_MS);
+      continue;
+    }
+
+    // anything older than a ring's worth is overwritten already
+    if (write_ptr - next_nr >= shmem->count) {
+      uint64_t oldest = write_ptr - shmem->count + 1;
+      header.missed += oldest - next_nr;
+      next_nr = oldest;
+    }
+
+    if (!copy_frame(shmem, next_nr, record, payload, max_payload)) {
+      header.missed++;
+      next_nr++;
+      continue;
+    }
+    next_nr++;
+
+    if (header.records == 0) {
+      first_publish_ns = record->frame.publish_ns;
+    }
+    record->time_ns = record->frame.publish_ns - first_publish_ns;
+    record->next = bebo_shmem_capture_payload_offset() +
+        BEBO_SHMEM_CAPTURE_ALIGN_UP(record->payload_size);
+    ok = write_padded(file, record, sizeof(*record), &offset) &&
+        write_padded(file, payload, record->payload_size, &offset);
+    if (record->payload_size > header.max_payload) {
+      header.max_payload = record->payload_size;
+    }
+    header.records++;
+  }
+
+  // the header says how far the file is valid
+  header.end = offset;
+  if (ok) {
+    ok = fseek(file, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, file) == 1;
+  }
+  if (fclose(file) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    perror(path);
+  }
+
+  fprintf(stderr, "recorded %llu frames, missed %llu, %llu bytes\n",
+      (unsigned long long) header.records, (unsigned long long) header.missed,
+      (unsigned long long) offset);
+
+  free(record);
+  free(payload);
+  bebo_shmem_region_close(&region);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * bebo_shmem_replay [--fast] [--loop] [--wait-for-reader] [--channel name]
+ *                   capture-file
+ *
+ * Plays a capture made by bebo_shmem_record back as the producer of the
+ * shmem frame ring of channel (the default one without --channel), no GPU
+ * or capture source needed. Consumers attach to it like they would to
+ * dshowfiltersink.
+ *
+ * By default frames are published with the inter-frame timing they were
+ * recorded with and, like the sink's drop-newest policy, dropped when the
+ * readers still hold the slot. With --fast they are published as fast as
+ * the readers take them, nothing is dropped, which makes for repeatable
+ * consumer benchmarks.
+ *
+ * Every slot gets its own payload block, so a slot can always be rewritten
+ * once no reader holds it. Records whose payload does not fit the block the
+ * header promised are skipped, the file is corrupt. Readers are not evicted and no clock or audio
+ * is published.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bebo_shmem.h"
+#include "bebo_shmem_ring.h"
+#include "bebo_shmem_channel.h"
+#include "bebo_shmem_capture.h"
+
+#define ALIGNMENT 64
+#define ALIGN(n) (((n) + ALIGNMENT - 1) & ~(uint64_t) (ALIGNMENT - 1))
+
+// sleep until this close to a frame's time, then spin
+#define SPIN_NS 1000000
+
+static volatile sig_atomic_t stop;
+
+struct replay {
+  struct bebo_shmem_region region;
+  struct bebo_shmem_mutex mutex;
+  struct bebo_shmem_semaphore new_data[BEBO_SHMEM_MAX_READERS];
+  struct bebo_shmem_channel_registration registration;
+  const char *channel;
+  struct shmem *shmem;
+  uint64_t block_size;
+
+  uint64_t published;
+  uint64_t dropped;
+  uint64_t skipped;
+};
+
+static void
+on_signal(int sig)
+{
+  (void) sig;
+  stop = 1;
+}
+
+static void
+wait_until(uint64_t due)
+{
+  for (;;) {
+    uint64_t now = bebo_shmem_now_ns();
+    if (now >= due || stop) {
+      return;
+    }
+    if (due - now > SPIN_NS) {
+      bebo_shmem_sleep_ms((uint32_t) ((due - now - SPIN_NS) / 1000000) + 1);
+    }
+  }
+}
+
+/* Lay the ring out like the sink does, with count slots and count payload
+ * blocks big enough for the largest recorded frame. */
+static bool
+create_ring(struct replay *replay, const struct bebo_shmem_capture_header *header)
+{
+  const struct shmem *recorded = &header->shmem;
+  uint64_t v2_offset = ALIGN(sizeof(struct shmem));
+  uint64_t header_size = v2_offset + ALIGN(sizeof(struct bebo_shmem_v2));
+  uint64_t frame_size = ALIGN(sizeof(struct frame));
+  uint64_t count = recorded->count;
+
+  replay->block_size = ALIGN(header->max_payload);
+  uint64_t payload_offset = header_size + frame_size * count;
+  uint64_t size = payload_offset + replay->block_size * count;
+  char name[BEBO_SHMEM_MAX_NAME];
+
+  if (bebo_shmem_channel_register(&replay->registration, replay->channel) ==
+      BEBO_SHMEM_CHANNEL_IN_USE) {
+    fprintf(stderr, "channel \"%s\" is taken by another producer\n",
+        replay->channel ? replay->channel : "");
+    return false;
+  }
+
+  // readers open the semaphores as soon as they find the region
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    bebo_shmem_data_sem_name(name, replay->channel, i);
+    if (!bebo_shmem_semaphore_create(&replay->new_data[i], name)) {
+      fprintf(stderr, "could not create semaphore %s %d\n", name,
+          bebo_shmem_last_error());
+      return false;
+    }
+  }
+
+  bebo_shmem_object_name(name, BEBO_SHMEM_MUTEX, replay->channel);
+  if (!bebo_shmem_mutex_create(&replay->mutex, name, true)) {
+    fprintf(stderr, "could not create shmem mutex %d\n", bebo_shmem_last_error());
+    return false;
+  }
+  bebo_shmem_object_name(name, BEBO_SHMEM_NAME, replay->channel);
+  if (!bebo_shmem_region_create(&replay->region, name, (size_t) size, 0)) {
+    fprintf(stderr, "could not create shmem %d\n", bebo_shmem_last_error());
+    bebo_shmem_mutex_unlock(&replay->mutex);
+    return false;
+  }
+
+  struct shmem *shmem = replay->shmem = replay->region.data;
+  memset(shmem, 0, (size_t) size);
+  shmem->video_info = recorded->video_info;
+  shmem->format = recorded->format;
+  shmem->info_generation = recorded->info_generation;
+  shmem->version = SHM_INTERFACE_VERSION;
+  shmem->owner_pid = bebo_shmem_pid();
+  shmem->owner_heartbeat = bebo_shmem_now_ns();
+  shmem->frame_offset = header_size;
+  bebo_shmem_v2_init(shmem, v2_offset, BEBO_SHMEM_FEATURE_READER_LINES, 0);
+  shmem->frame_size = frame_size;
+  shmem->count = count;
+  shmem->shmem_size = size;
+  shmem->codec = recorded->codec;
+  if (replay->block_size) {
+    shmem->payload_offset = payload_offset;
+    if (recorded->codec == BEBO_SHMEM_CODEC_RAW) {
+      shmem->payload_size = replay->block_size;
+    } else {
+      shmem->arena_size = replay->block_size * count;
+    }
+  }
+  bebo_shmem_mutex_unlock(&replay->mutex);
+  bebo_shmem_channel_describe(&replay->registration, shmem);
+  return true;
+}
+
+static void
+close_ring(struct replay *replay)
+{
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    bebo_shmem_semaphore_close(&replay->new_data[i]);
+  }
+  bebo_shmem_channel_unregister(&replay->registration);
+  bebo_shmem_region_close(&replay->region);
+  bebo_shmem_mutex_close(&replay->mutex);
+}
+
+static void
+publish(struct replay *replay, const struct bebo_shmem_capture_record *record,
+    bool block)
+{
+  struct shmem *shmem = replay->shmem;
+  uint64_t nr = shmem->write_ptr + 1;
+  uint64_t index = nr % shmem->count;
+  struct frame *frame = bebo_shmem_frame(shmem, index);
+
+  bebo_atomic_store_release_u64(&shmem->owner_heartbeat, bebo_shmem_now_ns());
+  if (record->payload_size > replay->block_size) {
+    replay->skipped++;
+    return;
+  }
+  for (;;) {
+    uint32_t readers = bebo_shmem_readers(shmem);
+    // with nobody attached, unread marks are left over from readers that left
+    if (bebo_shmem_slot_begin_write(frame, readers == 0)) {
+      break;
+    }
+    if (!block || stop) {
+      replay->dropped++;
+      return;
+    }
+    bebo_shmem_sleep_ms(1);
+  }
+
+  const struct frame *in = &record->frame;
+  frame->dts = in->dts;
+  frame->pts = in->pts;
+  frame->latency = in->latency;
+  frame->duration = in->duration;
+  frame->size = in->size;
+  frame->dxgi_handle = NULL;
+  frame->payload_offset = 0;
+  if (record->payload_size) {
+    uint64_t offset = shmem->payload_offset + index * replay->block_size;
+    memcpy((uint8_t *) shmem + offset, bebo_shmem_capture_payload(record),
+        (size_t) record->payload_size);
+    frame->payload_offset = offset;
+  }
+  frame->n_planes = in->n_planes;
+  memcpy(frame->plane_offset, in->plane_offset, sizeof(frame->plane_offset));
+  memcpy(frame->plane_stride, in->plane_stride, sizeof(frame->plane_stride));
+  frame->discontinuity = in->discontinuity;
+  frame->width = in->width;
+  frame->height = in->height;
+  frame->format = in->format;
+  frame->info_generation = in->info_generation;
+  memset(frame->read_ns, 0, sizeof(frame->read_ns));
+  frame->flags = in->flags;
+  frame->meta_size = in->meta_size <= BEBO_SHMEM_FRAME_META_SIZE ? in->meta_size : 0;
+  memcpy(frame->meta, in->meta, frame->meta_size);
+  frame->nr = nr;
+  frame->publish_ns = bebo_shmem_now_ns();
+
+  uint32_t readers = bebo_shmem_readers(shmem);
+  bebo_shmem_slot_end_write(frame, readers);
+  bebo_shmem_publish(shmem, nr);
+  replay->published++;
+
+  for (int i = 0; i < BEBO_SHMEM_MAX_READERS; i++) {
+    if ((readers & (1u << i)) && bebo_shmem_reader_take_wakeup(shmem, i, nr)) {
+      bebo_shmem_semaphore_signal(&replay->new_data[i]);
+    }
+  }
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: bebo_shmem_replay [--fast] [--loop] [--wait-for-reader] "
+      "[--channel name] capture-file\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  bool fast = false;
+  bool loop = false;
+  bool wait_for_reader = false;
+  const char *channel = NULL;
+  const char *path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--fast")) {
+      fast = true;
+    } else if (!strcmp(argv[i], "--loop")) {
+      loop = true;
+    } else if (!strcmp(argv[i], "--wait-for-reader")) {
+      wait_for_reader = true;
+    } else if (!strcmp(argv[i], "--channel") && i + 1 < argc &&
+        bebo_shmem_channel_name_valid(argv[i + 1])) {
+      channel = argv[++i];
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  if (path == NULL) {
+    usage();
+    return 2;
+  }
+
+  struct bebo_shmem_capture capture;
+  if (!bebo_shmem_capture_map(&capture, path)) {
+    return 1;
+  }
+
+  struct replay replay;
+  memset(&replay, 0, sizeof(replay));
+  replay.channel = channel;
+  if (!create_ring(&replay, capture.header)) {
+    close_ring(&replay);
+    bebo_shmem_capture_unmap(&capture);
+    return 1;
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  fprintf(stderr, "replaying %llu frames of %ux%u, %llu slots\n",
+      (unsigned long long) capture.header->records,
+      (unsigned) capture.header->shmem.video_info.width,
+      (unsigned) capture.header->shmem.video_info.height,
+      (unsigned long long) replay.shmem->count);
+
+  while (wait_for_reader && !stop && bebo_shmem_readers(replay.shmem) == 0) {
+    bebo_shmem_sleep_ms(10);
+  }
+
+  uint64_t start = bebo_shmem_now_ns();
+  do {
+    uint64_t loop_start = bebo_shmem_now_ns();
+    const struct bebo_shmem_capture_record *record = NULL;
+    while (!stop && (record = bebo_shmem_capture_next(&capture, record)) != NULL) {
+      if (!fast) {
+        wait_until(loop_start + record->time_ns);
+      }
+      publish(&replay, record, fast);
+    }
+  } while (loop && !stop);
+
+  double seconds = (bebo_shmem_now_ns() - start) / 1e9;
+  fprintf(stderr, "published %llu frames, dropped %llu, skipped %llu corrupt, "
+      "in %.3f s (%.1f fps)\n",
+      (unsigned long long) replay.published, (unsigned long long) replay.dropped,
+      (unsigned long long) replay.skipped, seconds,
+      seconds > 0 ? replay.published / seconds : 0.0);
+
+  close_ring(&replay);
+  bebo_shmem_capture_unmap(&capture);
+  return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2019 Pigs in Flight, Inc.
+ *
+ * bebo_thumb_bench [--width 1280,1920,3840] [--frames 200]
+ *
+ * Checks and benchmarks the thumbnail box filter kernels
+ * (gst/dshowfiltersink). For every width, every kernel set this CPU runs
+ * first has to produce the same sums as the scalar one, on whole RGBA rows
+ * and on odd lengths and offsets for the leftover bytes. Then each one sums
+ * up frames 16:9 RGBA frames of that width, like the thumbnail ring does
+ * for every frame it scales, and prints one JSON object per line:
+ *
+ *   {"kernels":"sse2","width":1920,"height":1080,"frames":200,
+ *    "ns_per_byte":..,"ms_per_frame":..}
+ *
+ * Exits with 1 if any sums differed.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "gstshmthumbnailkernels.h"
+
+#define MAX_KERNELS 2
+#define MAX_SWEEP 16
+#define MAX_WIDTH 8192
+/* RGBA */
+#define BPP 4
+
+struct sweep {
+  int values[MAX_SWEEP];
+  int n;
+};
+
+static bool
+parse_sweep(const char *arg, struct sweep *sweep)
+{
+  char *end;
+
+  sweep->n = 0;
+  do {
+    if (sweep->n == MAX_SWEEP) {
+      return false;
+    }
+    sweep->values[sweep->n++] = (int) strtol(arg, &end, 10);
+    if (end == arg) {
+      return false;
+    }
+    arg = end + 1;
+  } while (*end == ',');
+  return *end == '\0';
+}
+
+static uint64_t
+now_ns(void)
+{
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0) {
+    QueryPerformanceFrequency(&freq);
+  }
+  QueryPerformanceCounter(&now);
+  return (uint64_t) (now.QuadPart / freq.QuadPart) * 1000000000ull +
+      (uint64_t) (now.QuadPart % freq.QuadPart) * 1000000000ull / freq.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static uint32_t
+next_random(uint32_t *state)
+{
+  // xorshift, the same pixels every run
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static void
+fill(uint8_t *pixels, size_t size)
+{
+  uint32_t state = 0x9e3779b9;
+
+  for (size_t i = 0; i < size; i++) {
+    pixels[i] = (uint8_t) (next_random(&state) >> 24);
+  }
+}
+
+static bool
+check(const struct gst_shm_thumbnail_kernels *reference,
+    const struct gst_shm_thumbnail_kernels *kernels, const uint8_t *rows,
+    size_t row_bytes)
+{
+  // whole rows, odd lengths and unaligned starts for the scalar tails
+  static const size_t offsets[] = { 0, 1, 3, 7 };
+  static const size_t trims[] = { 0, 1, 5, 15, 17 };
+  uint32_t *sums[2];
+  bool same = true;
+
+  for (int k = 0; k < 2; k++) {
+    sums[k] = malloc(row_bytes * sizeof(uint32_t));
+  }
+
+  for (size_t o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++) {
+    for (size_t t = 0; t < sizeof(trims) / sizeof(trims[0]); t++) {
+      const struct gst_shm_thumbnail_kernels *both[2] = { reference, kernels };
+      if (offsets[o] + trims[t] > row_bytes) {
+        continue;
+      }
+      size_t n = row_bytes - offsets[o] - trims[t];
+      for (int k = 0; k < 2; k++) {
+        memset(sums[k], 0, row_bytes * sizeof(uint32_t));
+        // 300 rows, more than fit into 16 bits of a 255 sum
+        for (int r = 0; r < 300; r++) {
+          both[k]->accumulate(sums[k] + offsets[o],
+              rows + (size_t) (r % 8) * row_bytes + offsets[o], n);
+        }
+      }
+      if (memcmp(sums[0], sums[1], row_bytes * sizeof(uint32_t))) {
+        fprintf(stderr, "%s: sums differ from %s, %zu bytes at %zu\n",
+            kernels->name, reference->name, n, offsets[o]);
+        same = false;
+      }
+    }
+  }
+
+  for (int k = 0; k < 2; k++) {
+    free(sums[k]);
+  }
+  return same;
+}
+
+static void
+bench(const struct gst_shm_thumbnail_kernels *kernels, const uint8_t *frame,
+    int width, int height, int frames)
+{
+  size_t row_bytes = (size_t) width * BPP;
+  uint32_t *sums = calloc(row_bytes, sizeof(uint32_t));
+  volatile uint32_t sink = 0;
+
+  uint64_t start = now_ns();
+  for (int f = 0; f < frames; f++) {
+    // 16 source rows to a thumbnail row, a 1/16 thumbnail
+    for (int y = 0; y < height; y++) {
+      if (y % 16 == 0) {
+        sink += sums[f % row_bytes];
+        memset(sums, 0, row_bytes * sizeof(uint32_t));
+      }
+      kernels->accumulate(sums, frame + (size_t) y * row_bytes, row_bytes);
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  uint64_t bytes = (uint64_t) row_bytes * height * frames;
+  printf("{\"kernels\":\"%s\",\"width\":%d,\"height\":%d,\"frames\":%d,"
+      "\"ns_per_byte\":%.4f,\"ms_per_frame\":%.3f}\n",
+      kernels->name, width, height, frames,
+      bytes ? (double) elapsed / bytes : 0.0,
+      frames ? elapsed / 1e6 / frames : 0.0);
+  fflush(stdout);
+
+  free(sums);
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: bebo_thumb_bench [--width 1280,1920,3840] "
+      "[--frames 200]\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct sweep widths = { { 1280, 1920, 3840 }, 3 };
+  int frames = 200;
+
+  for (int i = 1; i < argc; i++) {
+    bool ok = i + 1 < argc;
+    if (ok && !strcmp(argv[i], "--width")) {
+      ok = parse_sweep(argv[++i], &widths);
+    } else if (ok && !strcmp(argv[i], "--frames")) {
+      frames = atoi(argv[++i]);
+      ok = frames > 0;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      usage();
+      return 2;
+    }
+  }
+
+  const struct gst_shm_thumbnail_kernels *kernels[MAX_KERNELS];
+  int count = gst_shm_thumbnail_kernels_available(kernels, MAX_KERNELS);
+  if (count > MAX_KERNELS) {
+    count = MAX_KERNELS;
+  }
+
+  bool ok = true;
+  for (int w = 0; w < widths.n; w++) {
+    int width = widths.values[w];
+    if (width < 1 || width > MAX_WIDTH) {
+      continue;
+    }
+    int height = width * 9 / 16 ? width * 9 / 16 : 1;
+
+    size_t row_bytes = (size_t) width * BPP;
+    uint8_t *frame = malloc(row_bytes * height);
+    fill(frame, row_bytes * height);
+    if (height >= 8) {
+      for (int k = 1; k < count; k++) {
+        ok &= check(kernels[0], kernels[k], frame, row_bytes);
+      }
+    }
+
+    for (int k = 0; k < count; k++) {
+      bench(kernels[k], frame, width, height, frames);
+    }
+
+    free(frame);
+  }
+  return ok ? 0 : 1;
+}